@@ -0,0 +1,40 @@
+#!/bin/sh
+set -e
+
+# Boots the kernel once per mkzinitrd compression level and prints how long the initrd took each time: the boot
+# profile's mount_initrd phase, the total from main() to starting init, and the initrd-image benchmark's read of the
+# whole image. Run it after build.sh, it leaves boot.img alone and works on a copy.
+#
+#   LEVELS     mkzinitrd -l levels to try, "raw" is the uncompressed archive (default "raw 1 3 6 9")
+#   BOOT_SECS  how long each boot gets before QEMU is stopped (default 60)
+
+export OVMFPATH=${OVMFPATH:-/home/gareth/edk2/Build/OvmfX64/DEBUG_GCC46/FV}
+LEVELS=${LEVELS:-"raw 1 3 6 9"}
+BOOT_SECS=${BOOT_SECS:-60}
+
+if [ ! -f initrd.img ] || [ ! -f boot.img ] || [ ! -x tools/mkzinitrd/mkzinitrd ]; then
+   echo Run build.sh first
+   exit 1
+fi
+
+for LEVEL in $LEVELS; do
+    echo Level $LEVEL
+    if [ "$LEVEL" = raw ]; then
+       cp initrd.img bench-initrd.img
+    else
+       tools/mkzinitrd/mkzinitrd -l $LEVEL initrd.img bench-initrd.img
+    fi
+    ls -l bench-initrd.img | awk '{print "  image is " $5 " bytes"}'
+
+    cp boot.img bench-boot.img
+    mcopy -o -i bench-boot.img bench-initrd.img ::/EFI/BOOT/initrd.img
+    printf 'fs0:\r\ncd fs0:\\EFI\\BOOT\r\nkernel.efi initrd=initrd.img bench=initrd-image\r\n' > bench-startup.nsh
+    mcopy -o -i bench-boot.img bench-startup.nsh ::/startup.nsh
+
+    rm -f bench-debug.log
+    timeout $BOOT_SECS qemu-system-x86_64 -bios ${OVMFPATH}/OVMF.fd -usb -usbdevice disk::bench-boot.img -m 4G -smp 4 \
+            -display none -debugcon file:bench-debug.log -global isa-debugcon.iobase=0x402 || true
+    grep -a -e "^mount_initrd " -e "^total since main()" -e "initrd-image" bench-debug.log | sed 's/^/  /' || \
+         echo "  nothing logged, try a longer BOOT_SECS"
+done
+rm -f bench-initrd.img bench-boot.img bench-startup.nsh bench-debug.log
@@ -23,6 +23,18 @@ cd ..
 bin2c/bin2c -o ../kernel/zoidberg_logo.h Logo.bmp
 popd
 
+pushd tools/mkzinitrd
+gcc -O2 -o mkzinitrd mkzinitrd.c
+popd
+
+pushd tools/ktracedump
+gcc -O2 -o ktracedump ktracedump.c
+popd
+
+pushd tools/profsym
+gcc -O2 -o profsym profsym.c
+popd
+
 pushd kernel
 ./gen_syscalls.sh
 popd
@@ -34,6 +46,7 @@ cp -Rv $WORKSPACE/build/* build/
 echo Building userland
 
 cp kernel/syscalls.inc userland/newlib/newlib/libc/sys/zoidberg
+cp kernel/zring.h userland/newlib/newlib/libc/include/sys/zring.h
 cp kernel/u_syscalls.asm userland/
 pushd userland
 make  -j all
@@ -53,30 +66,16 @@ mcopy -i boot.img build/zoidberg/DEBUG_GCC46/X64/SimpleThread.efi ::/EFI/BOOT
 mcopy -i boot.img startup.nsh ::/
 
 echo Building initrd
-dd if=/dev/zero of=initrd.img bs=2M count=1
-/sbin/mkfs.vfat initrd.img 
-mmd -i initrd.img ::/dev
-mmd -i initrd.img ::/boot
-mmd -i initrd.img ::/sbin
-mmd -i initrd.img ::/bin
-mcopy -i initrd.img userland/build/sbin/init ::/sbin
-mcopy -i initrd.img userland/build/bin/uname ::/bin
-mcopy -i initrd.img userland/build/bin/sh ::/bin
-
-echo Shrinking+rebuilding initrd.img
-BYTESTOTAL=`du -b initrd.img | awk {'print $1'}`
-BYTESFREE=`mdir -i initrd.img | grep free | sed 's/bytes free//' | sed 's/ //g'`
-BYTESFINAL=$((($BYTESTOTAL-$BYTESFREE)+65536  ))
-
-BYTESFINAL=$(($BYTESFINAL - ($BYTESFINAL % 65536)))
-
-cp initrd.img initrd.img.bak
-rm -f initrd.img
-dd if=/dev/zero of=initrd.img bs=65536 count=$(( ($BYTESFINAL / 65536) ))
-/sbin/mkfs.vfat initrd.img
-mkdir -p initrd/
-mcopy -i initrd.img.bak -spn ::/* initrd/
-mcopy -i initrd.img -sp initrd/* ::/
+rm -rf initrd/
+mkdir -p initrd/dev initrd/boot initrd/sbin initrd/bin
+cp userland/build/sbin/init initrd/sbin
+cp userland/build/bin/uname initrd/bin
+cp userland/build/bin/sh initrd/bin
+cp userland/build/bin/mallocbench initrd/bin
+tar --format=ustar --owner=0 --group=0 -cf initrd.img -C initrd .
+
+echo Compressing initrd.img
+tools/mkzinitrd/mkzinitrd -l 9 initrd.img initrd.img.z
 
 echo Copying initrd.img to boot partition
-mcopy -i boot.img initrd.img ::/EFI/BOOT
+mcopy -i boot.img initrd.img.z ::/EFI/BOOT/initrd.img
@@ -0,0 +1,23 @@
+#!/bin/sh
+set -e
+
+# Adds initrdlp.img to boot.img, a test image for tarfs and not part of a normal build - run it after build.sh
+# It's the same initrd plus a file whose ustar prefix (155) and name (100) fields are both full, boot it with
+# kernel.efi initrd=initrdlp.img to check tarfs handles the longest path a plain ustar header can hold
+
+if [ ! -d initrd ] || [ ! -f boot.img ]; then
+   echo Run build.sh first
+   exit 1
+fi
+
+echo Building initrd-longpath.img
+rm -rf initrd-longpath/
+cp -R initrd/ initrd-longpath/
+LONGPATH_DIR=`printf '%050d/%050d/%053d' 0 0 0 | tr 0 p`
+LONGPATH_NAME=`printf '%0100d' 0 | tr 0 n`
+mkdir -p initrd-longpath/$LONGPATH_DIR
+echo longpath > initrd-longpath/$LONGPATH_DIR/$LONGPATH_NAME
+tar --format=ustar --owner=0 --group=0 -cf initrd-longpath.img -C initrd-longpath sbin bin dev boot `echo $LONGPATH_DIR | cut -d/ -f1`
+
+echo Copying initrd-longpath.img to boot partition
+mcopy -o -i boot.img initrd-longpath.img ::/EFI/BOOT/initrdlp.img
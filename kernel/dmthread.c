@@ -15,20 +15,44 @@
 #include <Protocol/Cpu.h>
 #include <Protocol/SmmBase2.h>
 #include"dmthread.h" 
+#include "k_heap.h"
+#include "k_stack.h"
+#include "k_smp.h"
 
 #define free(x) (void) gBS->FreePool(x)
-void remove_thread();
 
 INT32 volatile  gThreads ;
 
-volatile unsigned int Inschedule= 0;
 EFI_EVENT myEvent=0;
 Scheduler sys={0};
 
+// each CPU has one FIFO per priority plus a bit per non-empty queue, so picking the next thread is a find-first-set
+// threads that are blocked or dead are never on a queue, the scheduler doesn't look at them at all
+// one lock covers every CPU's queues, the waiters and the sleepers
+dmt_cpu_t dmt_cpus[SMP_MAX_CPUS] = {{&dmt_cpus[0]}};
+static volatile UINT8 dmt_spin = 0;
+static dmt_waiter_t *  waiters = NULL;
+static dmt_sleeper_t *  sleepers = NULL;
+
+// the BSP's periodic tick is stopped while only idle threads can run, see update_tick()
+static UINT64 tick_us = DMT_TICK_DEFAULT_US;
+enum{TICK_PERIODIC=0, TICK_ONESHOT=1, TICK_OFF=2};
+static int tick_state = TICK_PERIODIC;
+static UINT64 tsc_per_us = 0;
+
+// TPL_NOTIFY on the BSP so a wait queue's event notify can't land halfway through a queue update, IF off on the APs
+static EFI_TPL dmt_lock()
+{
+    return smp_lock(&dmt_spin, TPL_NOTIFY);
+}
+
+static void dmt_unlock(EFI_TPL old_tpl)
+{
+    smp_unlock(&dmt_spin, old_tpl);
+}
+
 void* mMalloc(UINTN s) { 
-    void* m = 0; 
-    (void) gBS->AllocatePool( EfiLoaderData, (UINTN)s, &m); 
-    return m;
+    return kmalloc(s);
 }
 static thread_list* _new_thread(thread_func_t f, void *  arg)
 {
@@ -37,20 +61,200 @@ static thread_list* _new_thread(thread_func_t f, void *  arg)
     new_thread -> thread.arg  =  arg;
     new_thread -> thread.stack  =   0 ;
     new_thread -> thread.kernel=  f;
-    new_thread -> thread.status=  0;
-    new_thread -> thread.priority=  0;
+    new_thread -> thread.status=  STATUS_READY;
+    new_thread -> thread.priority=  DMT_PRIO_DEFAULT;
     new_thread -> thread.status_w = STATUS_IN_MAIN;
     new_thread -> next = new_thread;
     new_thread -> prev = new_thread;
+    new_thread -> rq_next = 0;
+    new_thread -> on_runq = 0;
+    new_thread -> waiter = 0;
+    new_thread -> cancel_block = 0;
+    new_thread -> block_obj = 0;
+    new_thread -> sleeper = 0;
+    new_thread -> rq_cpu = 0;
+    new_thread -> on_cpu = 0;
+    new_thread -> affinity = DMT_CPU_BSP;
+    new_thread -> bsp_depth = 0;
+    new_thread -> fw_frames = 0;
     return new_thread;
 }
 
-static thread_list* getNext(thread_list* cur)
+static void runq_push(dmt_cpu_t* cpu, thread_list* t)
+{
+    unsigned short p = t->thread.priority;
+    t->rq_next = 0;
+    if(cpu->runq_tail[p]) cpu->runq_tail[p]->rq_next = t; else cpu->runq_head[p] = t;
+    cpu->runq_tail[p] = t;
+    cpu->runq_bitmap |= (UINT32)1 << p;
+    cpu->nr_queued++;
+    t->on_runq = 1;
+    t->rq_cpu = cpu;
+}
+
+static thread_list* runq_pop(dmt_cpu_t* cpu)
+{
+    thread_list *  t;
+    unsigned short p;
+    if(cpu->runq_bitmap == 0) return 0;
+    p = (unsigned short)__builtin_ctz(cpu->runq_bitmap);
+    t = cpu->runq_head[p];
+    cpu->runq_head[p] = t->rq_next;
+    if(cpu->runq_head[p] == 0) {
+        cpu->runq_tail[p] = 0;
+        cpu->runq_bitmap &= ~((UINT32)1 << p);
+    }
+    cpu->nr_queued--;
+    t->rq_next = 0;
+    t->on_runq = 0;
+    return t;
+}
+
+static void runq_remove(thread_list* t)
+{
+    dmt_cpu_t *  cpu = t->rq_cpu;
+    unsigned short p = t->thread.priority;
+    thread_list *  prev = 0;
+    thread_list *  iter;
+    for(iter = cpu->runq_head[p]; iter; prev = iter, iter = iter->rq_next) {
+        if(iter != t) continue;
+        if(prev) prev->rq_next = t->rq_next; else cpu->runq_head[p] = t->rq_next;
+        if(cpu->runq_tail[p] == t) cpu->runq_tail[p] = prev;
+        if(cpu->runq_head[p] == 0) cpu->runq_bitmap &= ~((UINT32)1 << p);
+        cpu->nr_queued--;
+        break;
+    }
+    t->rq_next = 0;
+    t->on_runq = 0;
+}
+
+// where a thread goes when it's made runnable: the BSP if it has to be there, otherwise back to the AP it last ran on
+// so its cache is still warm, or the least loaded one if it's coming off the BSP
+static dmt_cpu_t* home_cpu(thread_list* t)
+{
+    dmt_cpu_t *  best = 0;
+    UINTN i;
+    if(t->affinity == DMT_CPU_BSP || t->bsp_depth || t->fw_frames) return &dmt_cpus[0];
+    if(t->rq_cpu && t->rq_cpu->id != 0) return t->rq_cpu;
+    for(i = 1; i < SMP_MAX_CPUS; i++) {
+        if(!dmt_cpus[i].online) continue;
+        if(best == 0 || dmt_cpus[i].nr_queued < best->nr_queued) best = &dmt_cpus[i];
+    }
+    return best ? best : &dmt_cpus[0];
+}
+
+static void enqueue(dmt_cpu_t* cpu, thread_list* t)
+{
+    runq_push(cpu, t);
+    if(cpu != dmt_this_cpu()) smp_kick(cpu->id);
+}
+
+static void waiter_unlink(dmt_waiter_t* w)
+{
+    if(w->prev) w->prev->next = w->next; else waiters = w->next;
+    if(w->next) w->next->prev = w->prev;
+    w->thread->waiter = 0;
+}
+
+static void _wake(thread_list* t)
+{
+    if(t->thread.status != STATUS_BLOCKED) return;
+    t->thread.status = STATUS_READY;
+    if(!t->on_runq && !t->on_cpu) enqueue(home_cpu(t), t);
+}
+
+// CheckEvent() for every thread blocked on an event - only waiters are visited, not every thread in the system
+static void poll_waiters()
+{
+    dmt_waiter_t *  w = waiters;
+    dmt_waiter_t *  next;
+    while(w) {
+        next = w->next;
+        if(gBS->CheckEvent(w->event) == EFI_SUCCESS) {
+            w->signalled = 1;
+            waiter_unlink(w);
+            _wake(w->thread);
+        }
+        w = next;
+    }
+}
+
+static void sleeper_unlink(thread_list* t)
+{
+    dmt_sleeper_t **  pp;
+    for(pp = &sleepers; *pp; pp = &(*pp)->next) {
+        if(*pp != t->sleeper) continue;
+        *pp = t->sleeper->next;
+        break;
+    }
+    t->sleeper = 0;
+}
+
+// the list is in deadline order so this stops at the first sleeper that isn't due
+static void wake_sleepers()
 {
-   if( cur -> next -> next -> thread.priority < cur -> next -> thread.priority )
-       return (thread_list*)cur->next->next;
-   else 
-       return (thread_list*)cur->next;
+    UINT64 now;
+    if(sleepers == 0) return;
+    now = thread_now_us();
+    while(sleepers && sleepers->deadline <= now) {
+        sleepers->thread->sleeper = 0;
+        _wake(sleepers->thread);
+        sleepers = sleepers->next;
+    }
+}
+
+static UINT64 rdtsc()
+{
+    UINT32 lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+}
+
+static void calibrate_tsc()
+{
+    UINT64 start = rdtsc();
+    gBS->Stall(5000);
+    tsc_per_us = (rdtsc() - start) / 5000;
+    if(tsc_per_us == 0) tsc_per_us = 1;
+}
+
+UINT64 thread_now_us()
+{
+    if(tsc_per_us == 0) return 0;
+    return rdtsc() / tsc_per_us;
+}
+
+UINT64 thread_tsc_per_us()
+{
+    return tsc_per_us;
+}
+
+// SetTimer() counts in 100ns units
+static void arm_periodic()
+{
+    gBS->SetTimer(myEvent, TimerPeriodic, tick_us*10);
+}
+
+// with nothing but idle threads runnable and no events to poll the tick has no work to do, so it's swapped for a
+// one shot at the next sleeper's deadline (or nothing at all), anything else going runnable puts it back
+// this is the BSP's tick, an AP waking something on the BSP kicks it out of hlt to come and look
+static void update_tick(thread_list* next)
+{
+    UINT64 now;
+    if(myEvent == 0) return;
+    if(next->thread.priority == DMT_PRIO_IDLE && dmt_cpus[0].runq_bitmap == 0 && waiters == 0) {
+        if(sleepers) {
+            now = thread_now_us();
+            gBS->SetTimer(myEvent, TimerRelative, (sleepers->deadline > now) ? (sleepers->deadline - now)*10 : 1);
+            tick_state = TICK_ONESHOT;
+        } else if(tick_state != TICK_OFF) {
+            gBS->SetTimer(myEvent, TimerCancel, 0);
+            tick_state = TICK_OFF;
+        }
+    } else if(tick_state != TICK_PERIODIC) {
+        arm_periodic();
+        tick_state = TICK_PERIODIC;
+    }
 }
 
 static void _insert_thread(thread_list* newt, thread_list* prev)
@@ -69,89 +273,150 @@ static thread_list* _remove_thread(thread_list* t)
     //assert (iter  &&  iter -> next   ==  t);
     iter -> next   =  t -> next ;
     t -> next -> prev = iter;
-    free(t);
+    kfree(t);
     return iter;
 }
 
 
-void free_dead_stack()
+static void free_dead_stack(dmt_cpu_t* cpu)
+{
+    if  (cpu->unfreed_stack){
+        kstack_free(cpu->unfreed_stack, STACK_SIZE);
+        cpu->unfreed_stack  =   0 ;
+    }
+}
+
+// drops a dead thread, its stack is freed straight away unless we're still running on it
+static void reap_thread(dmt_cpu_t* cpu, thread_list* t)
 {
-    if  (sys.unfreed_stack){
-        free(sys.unfreed_stack);
-        sys.unfreed_stack  =   0 ;
+    if(t->waiter) waiter_unlink(t->waiter);
+    if(t->sleeper) sleeper_unlink(t);
+    if(t->on_runq) runq_remove(t);
+    if(t == cpu->current) {
+        cpu->unfreed_stack = t->thread.stack;
+    } else if(t->thread.stack) {
+        kstack_free(t->thread.stack, STACK_SIZE);
     }
+    if(sys.threads == t) sys.threads = (t->next != t) ? (thread_list*)t->next : 0;
+    _remove_thread(t);
+    gThreads--;
 }
 
-void remove_thread()
+// an AP with nothing of its own takes the head of the busiest other AP's queue, the BSP's is never touched - it's
+// where threads with firmware calls on their stack are
+static thread_list* steal(dmt_cpu_t* cpu)
 {
-    free_dead_stack();
-    if  (sys.current  ==  sys.threads) {
-        sys.unfreed_stack  =  sys.current -> thread.stack;
-        sys.threads  =  getNext(sys.current);
-        thread_list *prev =_remove_thread(sys.current);
-        sys.current  =  sys.threads;
-        (void)prev;
-    } else  {
-        sys.unfreed_stack  =  sys.current -> thread.stack;
-        thread_list *prev =_remove_thread(sys.current);
-        sys.current = getNext(prev);
+    dmt_cpu_t *  victim = 0;
+    UINTN i;
+    for(i = 1; i < SMP_MAX_CPUS; i++) {
+        if(&dmt_cpus[i] == cpu || dmt_cpus[i].nr_queued == 0) continue;
+        if(victim == 0 || dmt_cpus[i].nr_queued > victim->nr_queued) victim = &dmt_cpus[i];
     }
+    return victim ? runq_pop(victim) : 0;
+}
 
-    if  (sys.current  ==   0 ) {
-        sys.current  =  sys.threads;
-        //assert(0);
+// highest priority runnable thread, reaping anything killed while it sat on the queue
+static thread_list* pick_next(dmt_cpu_t* cpu)
+{
+    thread_list *  t;
+    while((t = runq_pop(cpu)) != 0 || (cpu->id != 0 && (t = steal(cpu)) != 0)) {
+        if(t->thread.status != STATUS_DEAD) return t;
+        reap_thread(cpu, t);
     }
+    return 0;
 }
 
+// the scheduler lock is held from before the switch until whoever we switch to drops it in finish_switch(), so no
+// other CPU can pick up a thread while we're still on its stack
+static void switchto(dmt_cpu_t* cpu, thread_list* next)
+{
+    cpu->current = next;
+    next->on_cpu = 1;
+    next->rq_cpu = cpu;
+    if(cpu->id == 0) update_tick(next);
+    LongJump(& next->thread.sig_context, 1);
+}
 
-void switchto( )
+// first thing a thread does on the CPU it was switched to
+static void finish_switch(int preempted)
 {
-        LongJump(& sys.current->thread.sig_context, 1);
+    __sync_synchronize();
+    dmt_spin = 0;
+    if(smp_is_bsp())
+        gBS->RestoreTPL(TPL_APPLICATION);
+    else if(!preempted)
+        EnableInterrupts();   // a preempted thread gets IF back from the iret
 }
 
-void Skedule()
+// preempted means a tick got us here rather than the thread asking, and the tick's frames are under us on the
+// thread's stack - on the BSP those are the firmware's event dispatch, so a thread switched out there stays there
+static void schedule(int preempted)
 {
     UINTN i;
+    dmt_cpu_t *  cpu;
     thread_list *  oldThread;
-    BOOLEAN CouldSkedule ;
-    CouldSkedule =  __sync_bool_compare_and_swap (&Inschedule, 0, 1);
-    if(CouldSkedule == 0)
-        return;
+    thread_list *  next;
+    EFI_TPL old_tpl;
+    old_tpl = dmt_lock();
+    cpu = dmt_this_cpu();    // can't move while we hold the lock, and no tick can get in here either
     //pebp();
-    oldThread = sys.current;
+    free_dead_stack(cpu);
+    if(cpu->id == 0) poll_waiters();   // CheckEvent() is a boot service
+    wake_sleepers();
+
+    oldThread = cpu->current;
     if(oldThread->thread.status == STATUS_DEAD){
-        remove_thread();
-        __sync_bool_compare_and_swap (&Inschedule, 1, 0);
-        gThreads--;
-        return;
-        //switchto();
-//        LongJump(& sys.current->thread.sig_context, 1);
+        // never coming back here, so the stack goes on the unfreed list and we jump straight to whoever is next
+        next = pick_next(cpu);
+        reap_thread(cpu, oldThread);
+        if(next == 0) next = cpu->idle ? cpu->idle : sys.threads;
+        switchto(cpu, next);
     }
-    free_dead_stack();
 
-    sys.current = getNext(sys.current);
-    if(oldThread == sys.current)
+    // a thread that gave up the CPU itself can go wherever it belongs now, one that was preempted stays put
+    // (a CPU without an idle thread yet can't let its current thread go, there'd be nothing to switch to)
+    oldThread->fw_frames = preempted && cpu->id == 0;
+    if(oldThread->thread.status == STATUS_READY && !oldThread->on_runq && oldThread != cpu->idle)
+        enqueue((preempted || !cpu->idle) ? cpu : home_cpu(oldThread), oldThread);
+    next = pick_next(cpu);
+    if(next == 0)
+        next = cpu->idle ? cpu->idle : oldThread;   // everything is blocked, keep going until a waiter comes good
+    if(next == oldThread) {
+        if(cpu->id == 0) update_tick(next);
+        dmt_unlock(old_tpl);
         return;
+    }
+    oldThread->on_cpu = 0;
     i = SetJump(&oldThread->thread.sig_context);
     if( i  ==  0)
     {
-    //EnableInterrupt ();
-        gBS->RestoreTPL(TPL_APPLICATION);
-        LongJump(& sys.current->thread.sig_context, 1);
+        switchto(cpu, next);
     }
-    __sync_bool_compare_and_swap (&Inschedule, 1, 0);
+    finish_switch(preempted);
     //pebp();
     // Print(L"Haha, I am resuming\n");
     //while(1);
 }
 
+void Skedule()
+{
+    schedule(0);
+}
+
+void thread_preempt()
+{
+    dmt_this_cpu()->ticks++;
+    schedule(1);
+}
+
 VOID
 ThreadTimerHandler(
         IN EFI_EVENT                Event,
         IN VOID                     *Context
         )
 {
-    Skedule();
+    dmt_this_cpu()->ticks++;
+    schedule(1);
 }
 
 void start_thread(dmthread_t*  thread)
@@ -166,7 +431,7 @@ void start_thread(dmthread_t*  thread)
     __asm( "mov %%" sp_register ",%0":"=m"(gsp):);   
 
     gThreads++; 
-    gBS->AllocatePool(EfiBootServicesData, STACK_SIZE + 128, (void**)&thread->stack);
+    thread->stack = (char*)kstack_alloc(STACK_SIZE);   // recycled from the last thread to exit if there was one
 
     disp = (char*)gbp - (char*)gsp;
     stack_btm  =  ((char*)thread->stack)+  STACK_SIZE - (gbp - gsp + 4)*sizeof(ptr_size);
@@ -181,14 +446,13 @@ void start_thread(dmthread_t*  thread)
     i = SetJump(&thread->sig_context);
     if( i > 0)
     {
-        __sync_bool_compare_and_swap (&Inschedule, 1, 0);
+        finish_switch(0);
         (thread->kernel)(thread->arg); 
 
         if  (sys.threads -> next ){
-            sys.current->thread.status=STATUS_DEAD;
-            gThreads --;
-            // skedule
-            Skedule();
+            thread_self()->thread.status=STATUS_DEAD;
+            // skedule, reaps us and never returns
+            for(;;) Skedule();
         }else{
             *(int*)0 = 0;
         }
@@ -199,9 +463,11 @@ void start_thread(dmthread_t*  thread)
 
 void initTimer()
 {
-    gBS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, (EFI_EVENT_NOTIFY)Skedule, (VOID*)NULL, &myEvent);
-    gBS->SetTimer(myEvent,TimerPeriodic , 0);
-    
+    if(tsc_per_us == 0) calibrate_tsc();
+    gBS->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK, (EFI_EVENT_NOTIFY)ThreadTimerHandler, (VOID*)NULL, &myEvent);
+    arm_periodic();
+    tick_state = TICK_PERIODIC;
+
 }
 
 void closeTimer()
@@ -224,18 +490,29 @@ thread_list* create_thread(thread_func_t f, void *  arg)
 {
     // __asm enter // or __asm push ebp; mov esp, ebp
     thread_list *  new_thread;
+    thread_list *  creator;
+    dmt_cpu_t *  cpu;
+    EFI_TPL old_tpl;
     if(  myEvent == 0){
         initTimer();
     }
+    // a tick landing while cpu->current points at the half built thread would save the creator's context into it
+    old_tpl = dmt_lock();
+    cpu = dmt_this_cpu();
     new_thread = _new_thread(f, arg);
     if(sys.threads == 0){
         thread_list *  main_thread = _new_thread(0,0);
-        sys.threads = sys.current = main_thread;
+        main_thread->on_cpu = 1;
+        main_thread->rq_cpu = cpu;
+        sys.threads = cpu->current = main_thread;
     }
+    creator = cpu->current;
     _insert_thread(new_thread, sys.threads->prev);
-    sys.current = new_thread;
+    cpu->current = new_thread;
     start_thread(& new_thread->thread);
-    sys.current = sys.threads;
+    cpu->current = creator;
+    enqueue(home_cpu(new_thread), new_thread);
+    dmt_unlock(old_tpl);
 // Thanks there is leave here, then the esp is correct
 //     // __asm leave // or __asm mov ebp esp; pop ebp
     return new_thread;
@@ -243,7 +520,7 @@ thread_list* create_thread(thread_func_t f, void *  arg)
 
 void thread_join()
 {
-    while(sys.current->next && (sys.current->next != sys.current)){
+    while(thread_self()->next && (thread_self()->next != thread_self())){
         Skedule();
     }
     closeTimer();
@@ -253,3 +530,199 @@ void thread_yield()
 {
    Skedule();
 }
+
+void thread_block()
+{
+    thread_block_prepare();
+    thread_block_finish();
+}
+
+// a thread_wake() landing between the two halves just flips us back to ready, so the wakeup can't get lost
+void thread_block_prepare()
+{
+    EFI_TPL old_tpl = dmt_lock();
+    thread_self()->thread.status = STATUS_BLOCKED;
+    dmt_unlock(old_tpl);
+}
+
+void thread_block_finish()
+{
+    while(thread_self()->thread.status == STATUS_BLOCKED)
+        Skedule();
+}
+
+void thread_wake(thread_list* t)
+{
+    EFI_TPL old_tpl = dmt_lock();
+    _wake(t);
+    dmt_unlock(old_tpl);
+}
+
+void thread_kill(thread_list* t)
+{
+    EFI_TPL old_tpl;
+    // off whatever wait queue it's on before the stack goes, the queue's lock is always taken before ours
+    if(t->cancel_block) t->cancel_block(t);
+    old_tpl = dmt_lock();
+    t->thread.status = STATUS_DEAD;
+    if(t->waiter) waiter_unlink(t->waiter);
+    if(t->sleeper) sleeper_unlink(t);
+    if(!t->on_runq && !t->on_cpu) enqueue(home_cpu(t), t); // so pick_next() gets to reap it
+    dmt_unlock(old_tpl);
+}
+
+void thread_set_priority(thread_list* t, unsigned short priority)
+{
+    EFI_TPL old_tpl;
+    dmt_cpu_t *  cpu;
+    if(priority >= DMT_PRIORITIES) priority = DMT_PRIORITIES-1;
+    old_tpl = dmt_lock();
+    if(t->on_runq) {
+        cpu = t->rq_cpu;
+        runq_remove(t);
+        t->thread.priority = priority;
+        runq_push(cpu, t);
+    } else {
+        t->thread.priority = priority;
+    }
+    dmt_unlock(old_tpl);
+}
+
+void thread_set_affinity(thread_list* t, int affinity)
+{
+    EFI_TPL old_tpl = dmt_lock();
+    t->affinity = affinity;
+    if(t->on_runq && !t->fw_frames && t->rq_cpu != home_cpu(t)) {
+        runq_remove(t);
+        enqueue(home_cpu(t), t);
+    }
+    dmt_unlock(old_tpl);
+}
+
+// getting on to the BSP is giving up the CPU with bsp_depth set, home_cpu() does the rest - a tick in between just
+// means we're still on an AP when we try again
+void thread_enter_bsp()
+{
+    thread_list *  self = thread_self();
+    EFI_TPL old_tpl;
+    if(self == 0 || self->affinity == DMT_CPU_BSP) return;
+    old_tpl = dmt_lock();
+    self->bsp_depth++;
+    dmt_unlock(old_tpl);
+    while(!smp_is_bsp())
+        Skedule();
+}
+
+void thread_leave_bsp()
+{
+    thread_list *  self = thread_self();
+    EFI_TPL old_tpl;
+    int go;
+    if(self == 0 || self->affinity == DMT_CPU_BSP) return;
+    old_tpl = dmt_lock();
+    if(self->bsp_depth) self->bsp_depth--;
+    go = self->bsp_depth == 0 && smp_cpu_count() > 1;
+    dmt_unlock(old_tpl);
+    if(go) Skedule();
+}
+
+void thread_set_idle()
+{
+    EFI_TPL old_tpl = dmt_lock();
+    dmt_this_cpu()->idle = thread_self();
+    thread_self()->thread.priority = DMT_PRIO_IDLE;
+    dmt_unlock(old_tpl);
+}
+
+// IF is off while we look so a kick can't land between the check and the hlt, sti holds interrupts off for one
+// more instruction
+void thread_idle_wait()
+{
+    DisableInterrupts();
+    if(dmt_this_cpu()->runq_bitmap == 0) {
+        __asm__ volatile("sti; hlt");
+        dmt_this_cpu()->idle_wakeups++;
+    } else {
+        EnableInterrupts();
+    }
+}
+
+int thread_cpu_init(dmt_cpu_t* cpu)
+{
+    thread_list *  idle;
+    if(tsc_per_us == 0) calibrate_tsc();   // the APs time their local APIC timers with it
+    idle = _new_thread(0,0);
+    if(idle == 0) return -1;
+    idle->thread.priority = DMT_PRIO_IDLE;
+    idle->affinity = DMT_CPU_ANY;
+    idle->on_cpu = 1;
+    idle->rq_cpu = cpu;
+    cpu->idle = idle;
+    cpu->current = idle;
+    return 0;
+}
+
+// whatever the AP was doing when something got queued for it or its tick went off, it comes back here when there's
+// nothing left to run - stealing included, which the tick gives it a go at every time slice
+void thread_ap_main()
+{
+    dmt_cpu_t *  cpu = dmt_this_cpu();
+    cpu->online = 1;
+    for(;;) {
+        thread_idle_wait();
+        Skedule();
+    }
+}
+
+void thread_wait_event(EFI_EVENT e)
+{
+    dmt_waiter_t w;
+    EFI_TPL old_tpl;
+    w.event     = e;
+    w.signalled = 0;
+    w.thread    = thread_self();
+    w.prev      = 0;
+    old_tpl = dmt_lock();
+    w.next = waiters;
+    if(waiters) waiters->prev = &w;
+    waiters = &w;
+    w.thread->waiter = &w;
+    w.thread->thread.status = STATUS_BLOCKED;
+    dmt_unlock(old_tpl);
+    while(!w.signalled)
+        Skedule();
+}
+
+void thread_sleep(UINT64 us)
+{
+    dmt_sleeper_t s;
+    dmt_sleeper_t **  pp;
+    EFI_TPL old_tpl;
+    s.deadline = thread_now_us() + us;
+    s.thread   = thread_self();
+    old_tpl = dmt_lock();
+    for(pp = &sleepers; *pp && (*pp)->deadline <= s.deadline; pp = &(*pp)->next);
+    s.next = *pp;
+    *pp = &s;
+    s.thread->sleeper = &s;
+    s.thread->thread.status = STATUS_BLOCKED;
+    dmt_unlock(old_tpl);
+    while(s.thread->thread.status == STATUS_BLOCKED)
+        Skedule();
+    old_tpl = dmt_lock();
+    if(s.thread->sleeper) sleeper_unlink(s.thread); // woken early
+    dmt_unlock(old_tpl);
+}
+
+void thread_set_tick(UINT64 us)
+{
+    EFI_TPL old_tpl = dmt_lock();
+    tick_us = us;
+    if(myEvent && tick_state == TICK_PERIODIC) arm_periodic();
+    dmt_unlock(old_tpl);
+}
+
+UINT64 thread_get_tick()
+{
+    return tick_us;
+}
@@ -29,6 +29,17 @@
 #define STACK_SIZE  65536 
 #define RESERVED_STACK  4 
 
+#define DMT_TICK_DEFAULT_US  10000   // time slice, the tick= kernel option overrides it
+
+// run queue priorities, lower numbers run first
+#define DMT_PRIORITIES    32
+#define DMT_PRIO_DEFAULT  16
+#define DMT_PRIO_IDLE     (DMT_PRIORITIES-1)
+
+// where a thread may run - most of the kernel calls boot services, which only work on the BSP, so that's the default
+#define DMT_CPU_BSP  0
+#define DMT_CPU_ANY  1
+
 
 typedef void ( * thread_func_t)(void * );
 
@@ -36,7 +47,7 @@ typedef BASE_LIBRARY_JUMP_BUFFER dmtcontext;
 typedef unsigned long long ptr_size ;
 
 enum{FRAME_JMPBUF=1, FRAME_SIGCONTEXT=0, FRAME_TWO=2, FRAME_UCONTEXT=3};
-enum{STATUS_DEAD=1, STATUS_READY=2};
+enum{STATUS_DEAD=1, STATUS_READY=2, STATUS_BLOCKED=3};
 enum{STATUS_IN_MAIN=0, STATUS_CREATED=1, STATUS_IN_THREAD=2 };
 
 typedef struct dmthread_t
@@ -52,23 +63,86 @@ typedef struct dmthread_t
 } dmthread_t;
 
 
+struct dmt_waiter_t;
+struct dmt_cpu_t;
+
 typedef struct thread_list
 {
     dmthread_t thread;
     volatile struct thread_list *   next ;
     struct thread_list *   prev;
+    struct thread_list *   rq_next;     // next on the run queue for this priority
+    int on_runq;
+    struct dmt_waiter_t *  waiter;      // set while blocked in thread_wait_event()
+    void (* cancel_block)(struct thread_list * );   // set while blocked on a kernel wait queue, thread_kill() calls it
+    void *  block_obj;
+    struct dmt_sleeper_t *  sleeper;    // set while in thread_sleep()
+    struct dmt_cpu_t *  rq_cpu;         // whose run queue it's on, or where it last ran
+    int on_cpu;                         // some CPU's current thread
+    int affinity;                       // DMT_CPU_BSP or DMT_CPU_ANY
+    int bsp_depth;                      // thread_enter_bsp() calls not left yet
+    int fw_frames;                      // switched out by the BSP's timer event, can only carry on on the BSP
 } thread_list;
 
+// a blocked thread waiting for an EFI event, polled once per tick by the scheduler
+typedef struct dmt_waiter_t
+{
+    EFI_EVENT event;
+    volatile int signalled;
+    thread_list *  thread;
+    struct dmt_waiter_t *  next;
+    struct dmt_waiter_t *  prev;
+} dmt_waiter_t;
+
+// a thread in thread_sleep(), the list is kept in deadline order
+typedef struct dmt_sleeper_t
+{
+    UINT64 deadline;                    // thread_now_us() to wake at
+    thread_list *  thread;
+    struct dmt_sleeper_t *  next;
+} dmt_sleeper_t;
+
 typedef struct Scheduler
 {
-    thread_list *  threads;
-    thread_list *  current;
-    char  * unfreed_stack;
+    thread_list *  threads;             // every thread but the APs' idle ones, in creation order
     int  retaddr;
 } Scheduler;
 
+// per-CPU scheduler state, the GS base points at the running CPU's
+typedef struct dmt_cpu_t
+{
+    struct dmt_cpu_t *  self;           // %gs:0
+    thread_list *  current;
+    UINTN id;                           // 0 is the BSP
+    volatile int online;
+    thread_list *  idle;                // runs when there's nothing on the run queue, never on it itself
+    char  * unfreed_stack;              // a thread that exited here, freed once we're off it
+    thread_list *  runq_head[DMT_PRIORITIES];
+    thread_list *  runq_tail[DMT_PRIORITIES];
+    UINT32 runq_bitmap;
+    UINT32 nr_queued;
+    UINT64 ticks;                       // timer interrupts taken, only ever counts up
+    UINT64 idle_wakeups;                // times the idle thread came out of hlt
+} dmt_cpu_t;
+
 
 extern Scheduler sys;
+extern dmt_cpu_t dmt_cpus[];
+
+static inline dmt_cpu_t* dmt_this_cpu()
+{
+    dmt_cpu_t *  cpu;
+    __asm__ volatile("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+// one instruction, so it's right even if we're preempted and moved to another CPU halfway through
+static inline thread_list* thread_self()
+{
+    thread_list *  t;
+    __asm__ volatile("mov %%gs:%c1, %0" : "=r"(t) : "i"(OFFSET_OF(dmt_cpu_t, current)));
+    return t;
+}
 
 void stopTimer();
 void resumeTimer();
@@ -77,6 +151,28 @@ void thread_join();
 thread_list* clone_thread(thread_list* orig);
 void thread_yield();
 
+void thread_block();                          // stop running until someone calls thread_wake()
+void thread_block_prepare();                  // thread_block() in two halves: mark the current thread blocked while
+void thread_block_finish();                   // holding whatever protects your wait list, then drop it and finish
+void thread_wake(thread_list* t);             // make a blocked thread runnable again
+void thread_kill(thread_list* t);             // reaped the next time the scheduler comes across it
+void thread_set_priority(thread_list* t, unsigned short priority);
+void thread_wait_event(EFI_EVENT e);          // block until e is signalled, without sitting on the run queue
+void thread_sleep(UINT64 us);                 // block for at least us microseconds, thread_wake() cuts it short
+UINT64 thread_now_us();                       // TSC based, counts from whenever the CPU started its TSC
+UINT64 thread_tsc_per_us();                   // the calibration thread_now_us() uses, 0 until the scheduler's run
+void thread_set_tick(UINT64 us);              // time slice length, 0 leaves it up to the firmware
+UINT64 thread_get_tick();
+void thread_preempt();                        // from a timer interrupt, may switch threads before returning
+
+void thread_set_affinity(thread_list* t, int affinity); // takes effect the next time t gives up the CPU itself
+void thread_enter_bsp();                      // a DMT_CPU_ANY thread runs on the BSP from here, so it can call boot
+void thread_leave_bsp();                      // services, until it leaves again - these nest
+void thread_set_idle();                       // the calling thread is what this CPU runs when it has nothing else
+void thread_idle_wait();                      // hlt, unless something is already queued here
+int  thread_cpu_init(dmt_cpu_t* cpu);         // on the BSP, before the AP calls thread_ap_main()
+void thread_ap_main();                        // an AP's boot stack becomes its idle thread, never returns
+
 int setTimer ();
 #if 1
 #define myprintf(...) fprintf(stdout, __VA_ARGS__); fflush(stdout);
@@ -10,8 +10,16 @@ echo "static void *syscalls["`wc -l < syscalls.lst`"] = {" >>syscalls.inc
  cat syscalls.lst  | awk {'print "&sys_" tolower($2) ","'} >> syscalls.inc
 echo "};" >> syscalls.inc
 
-echo "section .text" > u_syscalls.asm
+# each stub uses SYSCALL if crt0 found the kernel supports it, and falls back to int 0x80 otherwise
+# SYSCALL overwrites rcx with the return address, so the first argument goes in r10 instead
+echo "default rel" > u_syscalls.asm
+echo "section .data" >> u_syscalls.asm
+echo "global z_fast_syscalls" >> u_syscalls.asm
+echo "z_fast_syscalls: db 0" >> u_syscalls.asm
+echo "section .text" >> u_syscalls.asm
+echo "global z_syscall_probe" >> u_syscalls.asm
 cat syscalls.lst | awk '{print "global sys_" tolower($2) }' >> u_syscalls.asm
 
-cat syscalls.lst  | awk '{print "sys_" tolower($2) ":\n   mov rax," $1 "\n   int 0x80\n   ret"}' >> u_syscalls.asm
+printf "z_syscall_probe:\n   mov rax,667\n   int 0x80\n   ret\n" >> u_syscalls.asm
+cat syscalls.lst  | awk '{print "sys_" tolower($2) ":\n   mov rax," $1 "\n   cmp byte [z_fast_syscalls],0\n   je .slow\n   mov r10,rcx\n   syscall\n   ret\n.slow:\n   int 0x80\n   ret"}' >> u_syscalls.asm
 
@@ -0,0 +1,1348 @@
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "kmsg.h"
+#include "k_dbgsink.h"
+#include "dmthread.h"
+#include "k_thread.h"
+#include "k_heap.h"
+#include "k_bootprof.h"
+#include "k_pmm.h"
+#include "k_stack.h"
+#include "k_imgcache.h"
+#include "k_initrd.h"
+#include "k_smp.h"
+#include "k_sync.h"
+#include "k_workq.h"
+#include "k_vfs.h"
+#include "k_vfs_trie.h"
+#include "k_fdtable.h"
+#include "k_syscalls.h"
+#include "k_bench.h"
+
+// In-kernel microbenchmarks
+//
+// Each entry in bench_tests runs a fixed workload against one subsystem and reports what it measured as result lines.
+// Writing "name [arg]" to /dev/bench runs that benchmark in the writing thread, and the lines are read back from
+// /dev/bench; bench=name[:arg],... on the kernel command line runs them once tasking is up, just before PID 1. Every
+// result line goes to the log as well, under BENCH.
+//
+// Time is taken from the TSC and converted with the scheduler's calibration, so nothing runs before scheduler_start().
+// Results are only comparable between runs on the same machine - under QEMU without KVM the TSC is emulated and every
+// number is out by some unknown factor.
+
+extern EFI_BOOT_SERVICES *BS;
+
+typedef struct bench_t {
+     char* name;
+     void  (*run)(UINTN arg);
+     UINTN def_arg;                   // used when no arg is given
+     char* help;
+} bench_t;
+
+static kmutex_t bench_lock     = KMUTEX_INIT;   // one benchmark at a time
+static kmutex_t bench_out_lock = KMUTEX_INIT;
+static char     bench_out[BENCH_OUT_SIZE];
+static UINTN    bench_out_len  = 0;
+static UINTN    bench_out_lost = 0;
+
+static volatile UINT64 bench_sink; // results go here so the compiler can't drop the work that made them
+
+static void bench_report(const char* fmt, ...) {
+     char line[BENCH_LINE_MAX];
+     va_list ap;
+     int len;
+     va_start(ap,fmt);
+     len = vsnprintf(line,BENCH_LINE_MAX-1,fmt,ap);
+     va_end(ap);
+     if(len < 0) return;
+     if(len > BENCH_LINE_MAX-2) len = BENCH_LINE_MAX-2;
+     klog("BENCH",1,"%s",line);
+     line[len++] = '\n';
+     kmutex_lock(&bench_out_lock);
+     if(bench_out_len + len <= BENCH_OUT_SIZE) {
+        memcpy(bench_out + bench_out_len,line,len);
+        bench_out_len += len;
+     } else {
+        bench_out_lost++;
+     }
+     kmutex_unlock(&bench_out_lock);
+}
+
+static UINT64 bench_ns(UINT64 cycles) {
+     return cycles * 1000 / thread_tsc_per_us();
+}
+
+// bytes per microsecond is MB/s
+static UINT64 bench_mbps(UINT64 bytes, UINT64 cycles) {
+     return cycles ? bytes * thread_tsc_per_us() / cycles : 0;
+}
+
+static UINT32 bench_rand(UINT32* seed) {
+     *seed = *seed * 1103515245 + 12345;
+     return *seed >> 16;
+}
+
+// per op, in nanoseconds with two decimals, for things far quicker than a microsecond
+#define BENCH_NS_FMT "%lld.%02lld"
+#define BENCH_NS_ARG(cycles,ops) (bench_ns((cycles)*100/(ops))/100), (bench_ns((cycles)*100/(ops))%100)
+
+// mount table lookups
+//
+// A private trie with n mountpoints, two levels deep under /mnt so no parent has more than 32 children, plus one at
+// /. The same paths are resolved through it and by a scan of the entries the way locate_prefix() used to, picking
+// the longest prefix that matches.
+
+#define BENCH_VFS_PATHS  64
+#define BENCH_VFS_ROUNDS 256
+
+static vfs_prefix_entry_t* bench_vfs_linear(vfs_prefix_entry_t* entries, UINTN n, char* path) {
+     vfs_prefix_entry_t* retval = NULL;
+     size_t max_len = 0;
+     UINTN i;
+     for(i=0; i < n; i++) {
+         if(strncmp(path,entries[i].prefix_str,strlen(entries[i].prefix_str))==0) {
+            if(strlen(entries[i].prefix_str) > max_len) {
+               retval  = &entries[i];
+               max_len = strlen(entries[i].prefix_str);
+            }
+         }
+     }
+     return retval;
+}
+
+static void bench_vfs_mounts_n(UINTN n) {
+     vfs_prefix_entry_t* entries = (vfs_prefix_entry_t*)kmalloc(sizeof(vfs_prefix_entry_t)*(n+1));
+     char* names = (char*)kmalloc(32*(n+1));
+     char* paths = (char*)kmalloc(64*BENCH_VFS_PATHS);
+     vfs_trie_node_t* root = vfs_trie_new();
+     UINT64 start, trie_cycles, linear_cycles;
+     UINTN i, r;
+     if(entries == NULL || names == NULL || paths == NULL || root == NULL) {
+        bench_report("vfs-mounts %lld: out of memory",n);
+        goto out;
+     }
+     memset(entries,0,sizeof(vfs_prefix_entry_t)*(n+1));
+     for(i=0; i <= n; i++) {
+         if(i == 0) {
+            strcpy(names,"/");
+         } else {
+            snprintf(names + 32*i,32,"/mnt/%lld/%lld/",(UINT64)(i-1)/32,(UINT64)(i-1)%32);
+         }
+         entries[i].prefix_str = names + 32*i;
+         entries[i].prefix_len = strlen(entries[i].prefix_str);
+         vfs_trie_insert_in(root,&entries[i]);
+     }
+     // 3 in 4 land in a mount, the rest fall through to /
+     for(i=0; i < BENCH_VFS_PATHS; i++) {
+         r = (i*7919) % n;
+         if(i % 4 == 3) {
+            snprintf(paths + 64*i,64,"/usr/lib/%lld/libc.a",(UINT64)i);
+         } else {
+            snprintf(paths + 64*i,64,"/mnt/%lld/%lld/bin/file%lld",(UINT64)r/32,(UINT64)r%32,(UINT64)i);
+         }
+         if(vfs_trie_lookup_in(root,paths + 64*i) != bench_vfs_linear(entries,n+1,paths + 64*i)) {
+            bench_report("vfs-mounts %lld: trie and scan disagree on %s",n,paths + 64*i);
+            goto out;
+         }
+     }
+
+     start = AsmReadTsc();
+     for(r=0; r < BENCH_VFS_ROUNDS; r++) {
+         for(i=0; i < BENCH_VFS_PATHS; i++) bench_sink += (UINT64)vfs_trie_lookup_in(root,paths + 64*i);
+     }
+     trie_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(r=0; r < BENCH_VFS_ROUNDS; r++) {
+         for(i=0; i < BENCH_VFS_PATHS; i++) bench_sink += (UINT64)bench_vfs_linear(entries,n+1,paths + 64*i);
+     }
+     linear_cycles = AsmReadTsc() - start;
+
+     bench_report("vfs-mounts %lld: trie " BENCH_NS_FMT " ns/lookup, linear scan " BENCH_NS_FMT " ns/lookup",n,
+                  BENCH_NS_ARG(trie_cycles,BENCH_VFS_ROUNDS*BENCH_VFS_PATHS),
+                  BENCH_NS_ARG(linear_cycles,BENCH_VFS_ROUNDS*BENCH_VFS_PATHS));
+out:
+     if(root != NULL) vfs_trie_free(root);
+     if(paths != NULL) kfree(paths);
+     if(names != NULL) kfree(names);
+     if(entries != NULL) kfree(entries);
+}
+
+static void bench_vfs_mounts(UINTN max) {
+     UINTN n;
+     for(n=1; n <= max; n *= 10) bench_vfs_mounts_n(n);
+}
+
+// initrd file reads
+//
+// The same file read start to end in 64KiB pieces through the VFS, which is initrdfs or tarfs straight over the image
+// in memory, and through StdLib from initrd:, which is the firmware's FAT driver on top of InitRDReadBlocks(). Only a
+// FAT image has an initrd: volume, and StdLib has to be called on the BSP.
+
+#define BENCH_INITRD_FILE "/sbin/init"
+#define BENCH_READ_BUF    65536
+
+static void bench_initrd_read(UINTN rounds) {
+     UINT8* buf = (UINT8*)kmalloc(BENCH_READ_BUF);
+     vfs_fd_t* fd;
+     FILE* fp;
+     UINT64 start, cycles, bytes;
+     ssize_t n;
+     UINTN r;
+     if(buf == NULL) {
+        bench_report("initrd-read: out of memory");
+        return;
+     }
+
+     bytes = 0;
+     start = AsmReadTsc();
+     for(r=0; r < rounds; r++) {
+         fd = vfs_fopen(BENCH_INITRD_FILE,"r");
+         if(fd == NULL) break;
+         while((n = vfs_fread(fd,buf,BENCH_READ_BUF)) > 0) bytes += n;
+         vfs_fclose(fd);
+     }
+     cycles = AsmReadTsc() - start;
+     if(r < rounds) {
+        bench_report("initrd-read: can't open %s",BENCH_INITRD_FILE);
+     } else {
+        bench_report("initrd-read vfs: %lld bytes in %lld us, %lld MB/s",bytes,bench_ns(cycles)/1000,
+                     bench_mbps(bytes,cycles));
+     }
+
+     bytes = 0;
+     thread_enter_bsp();
+     start = AsmReadTsc();
+     for(r=0; r < rounds; r++) {
+         fp = fopen("initrd:" BENCH_INITRD_FILE,"rb");
+         if(fp == NULL) break;
+         while((n = fread(buf,1,BENCH_READ_BUF,fp)) > 0) bytes += n;
+         fclose(fp);
+     }
+     cycles = AsmReadTsc() - start;
+     thread_leave_bsp();
+     if(r < rounds) {
+        bench_report("initrd-read blockio: no initrd: volume, the image isn't FAT");
+     } else {
+        bench_report("initrd-read blockio: %lld bytes in %lld us, %lld MB/s",bytes,bench_ns(cycles)/1000,
+                     bench_mbps(bytes,cycles));
+     }
+     kfree(buf);
+}
+
+// write syscalls
+//
+// sys_write() to /dev/null, called directly so it's the fd table lookup and the handler dispatch without the trap.
+// From a task /dev/null goes in a free slot of its table for the run; the bench= kernel task has no table, so it
+// gets one of its own and does what sys_write() does after finding the task.
+
+#define BENCH_WRITE_BIG 65536
+
+static ssize_t bench_write_fd(fd_table_t* fds, int fd, void* buf, size_t count) {
+     vfs_fd_t* f;
+     if(fds == NULL) return sys_write(fd,buf,count);
+     f = fd_lookup(fds,fd);
+     if(f == NULL || f->fs_handler->write == NULL) return -1;
+     return f->fs_handler->write(f->fs_handler,f->handler_fd,buf,count);
+}
+
+static void bench_syscall_write(UINTN iters) {
+     task_def_t* t = get_task(get_cur_task());
+     fd_table_t  own;
+     fd_table_t* fds = (t != NULL) ? &(t->fds) : &own;
+     UINT8* buf;
+     UINT64 start, small_cycles, big_cycles;
+     UINTN i;
+     int fd;
+     if(t == NULL) fd_table_init(&own);
+     buf = (UINT8*)kmalloc(BENCH_WRITE_BIG);
+     fd  = fd_table_alloc(fds,vfs_fopen("/dev/null","w"));
+     if(buf == NULL || fd < 0) {
+        bench_report("syscall-write: can't set up a buffer and /dev/null");
+        goto out;
+     }
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) bench_sink += bench_write_fd(t ? NULL : fds,fd,buf,1);
+     small_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) bench_sink += bench_write_fd(t ? NULL : fds,fd,buf,BENCH_WRITE_BIG);
+     big_cycles = AsmReadTsc() - start;
+
+     bench_report("syscall-write 1 byte: " BENCH_NS_FMT " ns/call%s",BENCH_NS_ARG(small_cycles,iters),
+                  t ? "" : " (no task, own fd table)");
+     bench_report("syscall-write %d bytes: " BENCH_NS_FMT " ns/call%s",BENCH_WRITE_BIG,BENCH_NS_ARG(big_cycles,iters),
+                  t ? "" : " (no task, own fd table)");
+out:
+     if(fd >= 0) fd_table_close(fds,fd);
+     if(t == NULL) fd_table_free(&own);
+     if(buf != NULL) kfree(buf);
+}
+
+// null syscall latency
+//
+// getpid through int 0x80, which goes through the firmware's interrupt dispatch and a full context save, and through
+// SYSCALL, the same way the userland stubs in u_syscalls.asm do it. Everything runs in ring 0 so the kernel can make
+// the calls itself; only the BSP has the MSRs and the handler set up, which is where tasks run anyway.
+
+static UINT64 bench_int80(UINT64 num) {
+     UINT64 a;
+     __asm__ volatile("int $0x80" : "=a"(a) : "a"(num) : "memory");
+     return a;
+}
+
+static UINT64 bench_syscall(UINT64 num) {
+     UINT64 a;
+     __asm__ volatile("syscall"
+                      : "=a"(a)
+                      : "a"(num)
+                      : "rcx","rdx","r8","r9","r10","r11","xmm0","xmm1","xmm2","xmm3","xmm4","xmm5","memory","cc");
+     return a;
+}
+
+static void bench_syscall_null(UINTN iters) {
+     UINT64 start, slow_cycles, fast_cycles = 0;
+     UINTN i;
+     thread_enter_bsp();
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) bench_sink += bench_int80(ZSYSCALL_GETPID);
+     slow_cycles = AsmReadTsc() - start;
+     if(z_fast_syscalls) {
+        start = AsmReadTsc();
+        for(i=0; i < iters; i++) bench_sink += bench_syscall(ZSYSCALL_GETPID);
+        fast_cycles = AsmReadTsc() - start;
+     }
+     thread_leave_bsp();
+     bench_report("syscall-null int 0x80: " BENCH_NS_FMT " ns/call, %lld cycles",BENCH_NS_ARG(slow_cycles,iters),
+                  slow_cycles/iters);
+     if(z_fast_syscalls) {
+        bench_report("syscall-null SYSCALL: " BENCH_NS_FMT " ns/call, %lld cycles",BENCH_NS_ARG(fast_cycles,iters),
+                     fast_cycles/iters);
+     } else {
+        bench_report("syscall-null SYSCALL: not enabled on this CPU");
+     }
+}
+
+// userland heap
+//
+// /bin/mallocbench times itself, on the userland heap and then on the kernel heap through sys_malloc(), and prints
+// its results to the console. The shell can't start programs yet, so this is how it gets run.
+
+static void bench_user_malloc(UINTN arg) {
+     sys_spawn("initrd:/bin/mallocbench",NULL,NULL);
+     bench_report("user-malloc: spawned /bin/mallocbench, it prints its results to the console");
+}
+
+// page pool and kernel heap against the firmware
+//
+// Latency is an allocate and free pair done over and over, for a small heap object and for a 4 page block, through
+// kmalloc()/pmm_alloc_pages() and through AllocatePool()/AllocatePages() on the BSP. Fragmentation churns up to
+// BENCH_PMM_LIVE blocks of 1 to 64 pages held at once, allocated and freed in a seeded random order, then reports the
+// largest block that can still be had while they're all held: from the pool by asking for it, from the firmware by
+// the largest stretch of conventional memory in its memory map.
+
+#define BENCH_PMM_LIVE  512
+#define BENCH_PMM_SMALL 64
+#define BENCH_PMM_PAGES 4
+
+static UINTN bench_pmm_largest() {
+     UINTN pages;
+     void* p;
+     for(pages = (UINTN)1 << PMM_MAX_ORDER; pages > 0; pages >>= 1) {
+         p = pmm_alloc_pages(pages,1);
+         if(p != NULL) {
+            pmm_free_pages(p,pages);
+            return pages;
+         }
+     }
+     return 0;
+}
+
+// caller is on the BSP
+static UINTN bench_fw_largest() {
+     EFI_MEMORY_DESCRIPTOR* map = NULL;
+     EFI_MEMORY_DESCRIPTOR* d;
+     UINTN map_size = 0, map_key, desc_size, i;
+     UINT32 desc_ver;
+     UINTN retval = 0;
+     BS->GetMemoryMap(&map_size,NULL,&map_key,&desc_size,&desc_ver);
+     map_size += 8*desc_size;
+     map = (EFI_MEMORY_DESCRIPTOR*)kmalloc(map_size);
+     if(map == NULL || EFI_ERROR(BS->GetMemoryMap(&map_size,map,&map_key,&desc_size,&desc_ver))) {
+        if(map != NULL) kfree(map);
+        return 0;
+     }
+     for(i=0; i < map_size/desc_size; i++) {
+         d = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)map + i*desc_size);
+         if(d->Type == EfiConventionalMemory && d->NumberOfPages > retval) retval = d->NumberOfPages;
+     }
+     kfree(map);
+     return retval;
+}
+
+// firmware is 1 to churn with AllocatePages(), caller is on the BSP then
+static void bench_pmm_churn(UINTN rounds, int firmware) {
+     void*  live[BENCH_PMM_LIVE];
+     UINTN  pages[BENCH_PMM_LIVE];
+     UINT32 seed = 1;
+     UINTN  i, slot, held = 0, failed = 0, largest;
+     EFI_PHYSICAL_ADDRESS addr;
+     memset(live,0,sizeof(live));
+     for(i=0; i < rounds; i++) {
+         slot = bench_rand(&seed) % BENCH_PMM_LIVE;
+         if(live[slot] != NULL) {
+            if(firmware) BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)live[slot],pages[slot]);
+            else         pmm_free_pages(live[slot],pages[slot]);
+            live[slot] = NULL;
+            held--;
+            continue;
+         }
+         pages[slot] = 1 + bench_rand(&seed) % 64;
+         if(firmware) {
+            live[slot] = EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiLoaderData,pages[slot],&addr)) ?
+                         NULL : (void*)(UINTN)addr;
+         } else {
+            live[slot] = pmm_alloc_pages(pages[slot],1);
+         }
+         if(live[slot] == NULL) failed++; else held++;
+     }
+     largest = firmware ? bench_fw_largest() : bench_pmm_largest();
+     for(i=0; i < BENCH_PMM_LIVE; i++) {
+         if(live[i] == NULL) continue;
+         if(firmware) BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)live[i],pages[i]);
+         else         pmm_free_pages(live[i],pages[i]);
+     }
+     bench_report("pmm-alloc %s churn: %lld blocks held, %lld failed, largest free block %lld pages",
+                  firmware ? "firmware" : "pool",(UINT64)held,(UINT64)failed,(UINT64)largest);
+}
+
+static void bench_pmm_alloc(UINTN iters) {
+     UINT64 start, heap_cycles, pool_cycles, pages_cycles, fwpages_cycles;
+     UINTN pool_before, i;
+     EFI_PHYSICAL_ADDRESS addr;
+     void* p;
+     if(pmm_total_pages() == 0) {
+        bench_report("pmm-alloc: the page pool isn't in use");
+        return;
+     }
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) {
+         p = kmalloc(BENCH_PMM_SMALL);
+         kfree(p);
+     }
+     heap_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) {
+         p = pmm_alloc_pages(BENCH_PMM_PAGES,1);
+         if(p != NULL) pmm_free_pages(p,BENCH_PMM_PAGES);
+     }
+     pages_cycles = AsmReadTsc() - start;
+
+     thread_enter_bsp();
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) {
+         if(!EFI_ERROR(BS->AllocatePool(EfiLoaderData,BENCH_PMM_SMALL,&p))) BS->FreePool(p);
+     }
+     pool_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) {
+         if(!EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiLoaderData,BENCH_PMM_PAGES,&addr))) {
+            BS->FreePages(addr,BENCH_PMM_PAGES);
+         }
+     }
+     fwpages_cycles = AsmReadTsc() - start;
+     thread_leave_bsp();
+
+     bench_report("pmm-alloc %d bytes: kmalloc " BENCH_NS_FMT " ns, AllocatePool " BENCH_NS_FMT " ns",BENCH_PMM_SMALL,
+                  BENCH_NS_ARG(heap_cycles,iters),BENCH_NS_ARG(pool_cycles,iters));
+     bench_report("pmm-alloc %d pages: pmm_alloc_pages " BENCH_NS_FMT " ns, AllocatePages " BENCH_NS_FMT " ns",
+                  BENCH_PMM_PAGES,BENCH_NS_ARG(pages_cycles,iters),BENCH_NS_ARG(fwpages_cycles,iters));
+
+     pool_before = pmm_free_count();
+     bench_pmm_churn(iters,0);
+     if(pmm_free_count() != pool_before) {
+        bench_report("pmm-alloc: pool has %lld free pages after the churn, %lld before",
+                     (UINT64)pmm_free_count(),(UINT64)pool_before);
+     }
+     thread_enter_bsp();
+     bench_pmm_churn(iters,1);
+     thread_leave_bsp();
+}
+
+// context switch rate
+//
+// n threads yield to each other as fast as they can for BENCH_CSW_US while another m sit blocked on a wait queue, for
+// a few m. Sleepers off the run queue cost nothing, so the rate should hold as m grows.
+
+#define BENCH_CSW_US 200000
+
+static volatile UINT64 bench_csw_stop;
+static kwaitq_t        bench_csw_waitq = KWAITQ_INIT;
+static ksem_t          bench_csw_done  = KSEM_INIT(0);
+
+static void bench_csw_runner(void* arg) {
+     volatile UINT64* count = (volatile UINT64*)arg;
+     while(!bench_csw_stop) {
+        thread_yield();
+        (*count)++;
+     }
+     ksem_post(&bench_csw_done);
+}
+
+static void bench_csw_sleeper(void* arg) {
+     while(!bench_csw_stop) {
+        if(!kwaitq_wait_on(&bench_csw_waitq,&bench_csw_stop,0)) thread_yield();
+     }
+     ksem_post(&bench_csw_done);
+}
+
+static void bench_context_switch_nm(UINTN n, UINTN m) {
+     UINT64* counts = (UINT64*)kmalloc(sizeof(UINT64)*n);
+     UINT64 start, cycles, total = 0;
+     UINTN i, started = 0;
+     if(counts == NULL) {
+        bench_report("context-switch: out of memory");
+        return;
+     }
+     memset(counts,0,sizeof(UINT64)*n);
+     bench_csw_stop = 0;
+     for(i=0; i < m; i++) {
+         if(create_thread(&bench_csw_sleeper,NULL) == NULL) break;
+         started++;
+     }
+     // give the sleepers a chance to get onto the wait queue before timing starts
+     thread_sleep(10000);
+     for(i=0; i < n; i++) {
+         if(create_thread(&bench_csw_runner,&counts[i]) == NULL) break;
+         started++;
+     }
+     start = AsmReadTsc();
+     thread_sleep(BENCH_CSW_US);
+     bench_csw_stop = 1;
+     cycles = AsmReadTsc() - start;
+     kwaitq_wake_all(&bench_csw_waitq);
+     for(i=0; i < started; i++) ksem_wait(&bench_csw_done);
+     for(i=0; i < n; i++) total += counts[i];
+     kfree(counts);
+     bench_report("context-switch %lld runnable, %lld blocked: %lld yields/s, " BENCH_NS_FMT " ns each",
+                  (UINT64)n,(UINT64)m,total * 1000000000 / bench_ns(cycles),
+                  BENCH_NS_ARG(cycles,total ? total : 1));
+}
+
+static void bench_context_switch(UINTN n) {
+     UINTN m;
+     if(n == 0) n = 1;
+     for(m=0; m <= 1000; m = m ? m*10 : 10) bench_context_switch_nm(n,m);
+}
+
+// scheduler tick rates
+//
+// At each tick length, a fixed amount of work on the BSP with nothing else queued there, so every tick is overhead:
+// the extra cycles over the longest tick, split over the extra ticks taken, is what a tick costs. Then the bench
+// thread sleeps for BENCH_TICK_US and counts how often the BSP came out of hlt, which a tickless idle keeps down to
+// the wakeups something actually asked for. The tick length is put back afterwards.
+
+#define BENCH_TICK_US    500000
+#define BENCH_TICK_WORK  (1 << 20)
+
+static UINT64 bench_tick_rates[] = {20000, 10000, 4000, 1000, 250};
+
+static void bench_tick_work() {
+     UINT64 x = 1;
+     UINTN i;
+     for(i=0; i < BENCH_TICK_WORK; i++) x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+     bench_sink += x;
+}
+
+static void bench_tick(UINTN rounds) {
+     UINTN nrates = sizeof(bench_tick_rates)/sizeof(bench_tick_rates[0]);
+     UINT64 old_tick = thread_get_tick();
+     UINT64 cycles[sizeof(bench_tick_rates)/sizeof(bench_tick_rates[0])];
+     UINT64 ticks[sizeof(bench_tick_rates)/sizeof(bench_tick_rates[0])];
+     UINT64 start, tick_start, wakeups, per_tick;
+     UINTN i, r;
+     if(rounds == 0) rounds = 1;
+
+     thread_enter_bsp();
+     for(i=0; i < nrates; i++) {
+         thread_set_tick(bench_tick_rates[i]);
+         tick_start = dmt_cpus[0].ticks;
+         start = AsmReadTsc();
+         for(r=0; r < rounds; r++) bench_tick_work();
+         cycles[i] = AsmReadTsc() - start;
+         ticks[i]  = dmt_cpus[0].ticks - tick_start;
+
+         wakeups = dmt_cpus[0].idle_wakeups;
+         tick_start = dmt_cpus[0].ticks;
+         thread_sleep(BENCH_TICK_US);
+         wakeups = dmt_cpus[0].idle_wakeups - wakeups;
+         per_tick = (i > 0 && ticks[i] > ticks[0] && cycles[i] > cycles[0]) ?
+                    bench_ns(cycles[i] - cycles[0]) / (ticks[i] - ticks[0]) : 0;
+         bench_report("tick %lld us: work %lld us with %lld ticks, %lld ns/tick over %lld us, "
+                      "idle %lld wakeups/s %lld ticks/s",bench_tick_rates[i],bench_ns(cycles[i])/1000,ticks[i],
+                      per_tick,bench_tick_rates[0],wakeups * 1000000 / BENCH_TICK_US,
+                      (dmt_cpus[0].ticks - tick_start) * 1000000 / BENCH_TICK_US);
+     }
+     thread_set_tick(old_tick);
+     thread_leave_bsp();
+}
+
+// thread create and exit
+//
+// Threads that do nothing but post a semaphore and return, created one at a time and waited for, which recycles the
+// same stack every time, then created all at once, which takes more stacks than the pool keeps. Then a stack on its
+// own from the pool against the AllocatePool() every thread used to make.
+
+static ksem_t bench_thread_done = KSEM_INIT(0);
+
+static void bench_thread_exit(void* arg) {
+     ksem_post(&bench_thread_done);
+}
+
+static void bench_thread_create(UINTN n) {
+     UINT64 start, one_cycles, burst_cycles, pool_cycles, fw_cycles;
+     UINTN i, started = 0;
+     void* p;
+     if(n == 0) n = 1;
+
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         if(create_thread(&bench_thread_exit,NULL) == NULL) break;
+         ksem_wait(&bench_thread_done);
+     }
+     one_cycles = AsmReadTsc() - start;
+     if(i < n) {
+        bench_report("thread-create: create_thread() failed after %lld threads",(UINT64)i);
+        return;
+     }
+
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         if(create_thread(&bench_thread_exit,NULL) == NULL) break;
+         started++;
+     }
+     for(i=0; i < started; i++) ksem_wait(&bench_thread_done);
+     burst_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         p = kstack_alloc(STACK_SIZE);
+         if(p != NULL) kstack_free(p,STACK_SIZE);
+     }
+     pool_cycles = AsmReadTsc() - start;
+
+     thread_enter_bsp();
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         if(!EFI_ERROR(BS->AllocatePool(EfiLoaderData,STACK_SIZE,&p))) BS->FreePool(p);
+     }
+     fw_cycles = AsmReadTsc() - start;
+     thread_leave_bsp();
+
+     bench_report("thread-create %lld: one at a time %lld threads/s, %lld at once %lld threads/s",(UINT64)n,
+                  n * 1000000000 / bench_ns(one_cycles),(UINT64)started,started * 1000000000 / bench_ns(burst_cycles));
+     bench_report("thread-create %d byte stack: kstack_alloc " BENCH_NS_FMT " ns, AllocatePool " BENCH_NS_FMT " ns",
+                  STACK_SIZE,BENCH_NS_ARG(pool_cycles,n),BENCH_NS_ARG(fw_cycles,n));
+}
+
+// task table
+//
+// n tasks requested the way anything else starts one and kept alive together, timed from the first req_task() to the
+// last of them running, with the memory the task table takes for them. The fixed table this replaced was 4096 tasks
+// with 512 fd slots each, zeroed by scheduler_start() - its own time is the scheduler_start phase in the boot profile.
+
+#define BENCH_OLD_TASKS 4096
+
+static volatile UINT64 bench_task_stop;
+static kwaitq_t        bench_task_waitq = KWAITQ_INIT;
+static ksem_t          bench_task_live  = KSEM_INIT(0);
+
+static void bench_task_proc(void* arg) {
+     ksem_post(&bench_task_live);
+     while(!bench_task_stop) {
+        if(!kwaitq_wait_on(&bench_task_waitq,&bench_task_stop,0)) thread_yield();
+     }
+}
+
+static void bench_task_table(UINTN n) {
+     UINT64 start, cycles, bytes_before, bytes_live, tasks_before;
+     UINTN i;
+     bench_task_stop = 0;
+     tasks_before = get_task_count();
+     bytes_before = get_task_table_bytes();
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) req_task(&bench_task_proc,NULL);
+     for(i=0; i < n; i++) ksem_wait(&bench_task_live);
+     cycles = AsmReadTsc() - start;
+     bytes_live = get_task_table_bytes();
+     bench_task_stop = 1;
+     kwaitq_wake_all(&bench_task_waitq);
+     // they take themselves out of the table on the way out
+     while(get_task_count() > tasks_before) thread_sleep(1000);
+
+     bench_report("task-table %lld tasks: %lld us to all running, %lld bytes of table (%lld before, %lld after)",
+                  (UINT64)n,bench_ns(cycles)/1000,bytes_live,bytes_before,get_task_table_bytes());
+     bench_report("task-table: the old fixed table was %lld bytes",
+                  (UINT64)BENCH_OLD_TASKS * (sizeof(task_def_t) + FD_TABLE_MAX*sizeof(vfs_fd_t)));
+}
+
+// spawn storm
+//
+// BENCH_SPAWN_PRODUCERS threads push n task requests between them as fast as they can, timed to the last push and then
+// to the last of the tasks exiting: first through req_task() with a task that returns straight away, then through
+// sys_spawn() of a path that isn't there, which is every step of a spawn up to opening the image. Each of those logs
+// that it couldn't open it.
+
+#define BENCH_SPAWN_PRODUCERS 4
+#define BENCH_SPAWN_PATH      "initrd:/bench/none"
+
+typedef struct bench_spawn_t {
+     UINTN count;
+     int   use_spawn;
+} bench_spawn_t;
+
+static ksem_t bench_spawn_pushed = KSEM_INIT(0);
+static ksem_t bench_spawn_last   = KSEM_INIT(0);
+
+static void bench_spawn_nop(void* arg) {
+}
+
+// main starts requests in order, so once this one runs every task before it has been started
+static void bench_spawn_marker(void* arg) {
+     ksem_post(&bench_spawn_last);
+}
+
+static void bench_spawn_producer(void* arg) {
+     bench_spawn_t* s = (bench_spawn_t*)arg;
+     UINTN i;
+     for(i=0; i < s->count; i++) {
+         if(s->use_spawn) sys_spawn(BENCH_SPAWN_PATH,NULL,NULL);
+         else             req_task(&bench_spawn_nop,NULL);
+     }
+     ksem_post(&bench_spawn_pushed);
+}
+
+static void bench_spawn_storm_one(UINTN n, int use_spawn) {
+     bench_spawn_t s;
+     UINT64 start, push_cycles, all_cycles, tasks_before;
+     UINTN i;
+     s.count     = n / BENCH_SPAWN_PRODUCERS;
+     s.use_spawn = use_spawn;
+     tasks_before = get_task_count();
+     start = AsmReadTsc();
+     for(i=0; i < BENCH_SPAWN_PRODUCERS; i++) create_thread(&bench_spawn_producer,&s);
+     for(i=0; i < BENCH_SPAWN_PRODUCERS; i++) ksem_wait(&bench_spawn_pushed);
+     push_cycles = AsmReadTsc() - start;
+     req_task(&bench_spawn_marker,NULL);
+     ksem_wait(&bench_spawn_last);
+     while(get_task_count() > tasks_before) thread_sleep(1000);
+     all_cycles = AsmReadTsc() - start;
+     n = s.count * BENCH_SPAWN_PRODUCERS;
+     bench_report("spawn-storm %s x%lld: " BENCH_NS_FMT " ns/push, %lld tasks/s started and gone",
+                  use_spawn ? "sys_spawn" : "req_task",(UINT64)n,BENCH_NS_ARG(push_cycles,n ? n : 1),
+                  n * 1000000000 / bench_ns(all_cycles));
+}
+
+static void bench_spawn_storm(UINTN n) {
+     bench_spawn_storm_one(n,0);
+     bench_spawn_storm_one(n,1);
+}
+
+// work queue
+//
+// Latency is one job at a time, from just before kwork_submit() to the job starting on a worker, with the submitter
+// waiting for each before the next. Throughput is n jobs submitted back to back and waited for together, allocated by
+// kwork_submit() and then embedded through kwork_queue().
+
+static volatile UINT64 bench_work_ran;
+static ksem_t          bench_work_done = KSEM_INIT(0);
+
+static void bench_work_stamp(void* arg) {
+     bench_work_ran = AsmReadTsc();
+     ksem_post(&bench_work_done);
+}
+
+static void bench_work_nop(void* arg) {
+     ksem_post(&bench_work_done);
+}
+
+static void bench_workq(UINTN n) {
+     kwork_t* works = (kwork_t*)kmalloc(sizeof(kwork_t)*n);
+     UINT64 start, lat, lat_total = 0, lat_max = 0, submit_cycles, queue_cycles;
+     UINTN i, queued = 0;
+     if(works == NULL || n == 0) {
+        bench_report("workq: out of memory");
+        if(works != NULL) kfree(works);
+        return;
+     }
+
+     for(i=0; i < n; i++) {
+         start = AsmReadTsc();
+         if(kwork_submit(&bench_work_stamp,NULL) != 0) break;
+         ksem_wait(&bench_work_done);
+         lat = bench_work_ran - start;
+         lat_total += lat;
+         if(lat > lat_max) lat_max = lat;
+     }
+     if(i < n) {
+        bench_report("workq: kwork_submit() failed after %lld jobs",(UINT64)i);
+        kfree(works);
+        return;
+     }
+
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         if(kwork_submit(&bench_work_nop,NULL) == 0) queued++;
+     }
+     for(i=0; i < queued; i++) ksem_wait(&bench_work_done);
+     submit_cycles = AsmReadTsc() - start;
+
+     start = AsmReadTsc();
+     for(i=0; i < n; i++) {
+         kwork_init(&works[i],&bench_work_nop,NULL);
+         kwork_queue(&works[i]);
+     }
+     for(i=0; i < n; i++) ksem_wait(&bench_work_done);
+     queue_cycles = AsmReadTsc() - start;
+     kfree(works);
+
+     bench_report("workq latency x%lld: " BENCH_NS_FMT " ns average, %lld ns worst",(UINT64)n,
+                  BENCH_NS_ARG(lat_total,n),bench_ns(lat_max));
+     bench_report("workq throughput x%lld: kwork_submit %lld jobs/s, kwork_queue %lld jobs/s",(UINT64)n,
+                  queued * 1000000000 / bench_ns(submit_cycles),n * 1000000000 / bench_ns(queue_cycles));
+}
+
+// image cache
+//
+// The part of a spawn that comes before the program runs, for BENCH_INITRD_FILE: getting the image into memory and
+// LoadImage() on it. Cold reads the file into a fresh cache entry, forced by asking for a modification time the entry
+// doesn't have yet; warm asks for the same one again and gets it from memory. The entry left behind has a made up
+// time, so the next real spawn of the file just reads it again.
+
+static int bench_read_image(void* ctx, void* buf, UINT64 size) {
+     vfs_fd_t* fd = (vfs_fd_t*)ctx;
+     vfs_lseek(fd,0,SEEK_SET);
+     return (vfs_fread(fd,buf,size) == size) ? 0 : 1;
+}
+
+// cycles to get the image and load it, 0 if either failed
+static UINT64 bench_image_load(vfs_fd_t* fd, UINT64 size, UINT64 mtime, int* hit) {
+     imgcache_ent_t* img;
+     EFI_HANDLE child_h;
+     EFI_STATUS s;
+     UINT64 start = AsmReadTsc();
+     img = imgcache_get(BENCH_INITRD_FILE,sizeof(BENCH_INITRD_FILE),size,mtime,bench_read_image,fd,hit);
+     if(img == NULL) return 0;
+     thread_enter_bsp();
+     s = BS->LoadImage(FALSE,gImageHandle,NULL,img->data,img->size,&child_h);
+     thread_leave_bsp();
+     imgcache_release(img);
+     if(EFI_ERROR(s)) return 0;
+     start = AsmReadTsc() - start;
+     thread_enter_bsp();
+     BS->UnloadImage(child_h);
+     thread_leave_bsp();
+     return start;
+}
+
+static void bench_spawn_cache(UINTN rounds) {
+     vfs_fd_t* fd = vfs_fopen(BENCH_INITRD_FILE,"r");
+     struct stat st;
+     UINT64 cold = 0, warm = 0, c, w;
+     UINTN r;
+     int cold_hit, warm_hit;
+     if(fd == NULL || vfs_fstat(fd,&st) != 0) {
+        bench_report("spawn-cache: can't open " BENCH_INITRD_FILE);
+        if(fd != NULL) vfs_fclose(fd);
+        return;
+     }
+     for(r=0; r < rounds; r++) {
+         c = bench_image_load(fd,st.st_size,st.st_mtime + r + 1,&cold_hit);
+         w = bench_image_load(fd,st.st_size,st.st_mtime + r + 1,&warm_hit);
+         if(c == 0 || w == 0 || cold_hit || !warm_hit) {
+            bench_report("spawn-cache: round %lld didn't load as expected",(UINT64)r);
+            break;
+         }
+         cold += c;
+         warm += w;
+     }
+     vfs_fclose(fd);
+     if(r == 0) return;
+     bench_report("spawn-cache " BENCH_INITRD_FILE " %lld bytes: cold %lld us, warm %lld us to loaded",
+                  (UINT64)st.st_size,bench_ns(cold/r)/1000,bench_ns(warm/r)/1000);
+}
+
+// concurrent logging
+//
+// n lines through klog() split between 1, 2, 4, 8 and 16 threads at once. Time per line is what a caller waits,
+// which with the drain writing out behind them shouldn't grow with the thread count; the drain is then timed to
+// catch up. Lines that found a ring full are counted rather than waited for.
+
+#define BENCH_KLOG_MAX_THREADS 16
+
+typedef struct bench_klog_t {
+     UINTN  count;
+     UINTN  id;
+     UINT64 cycles;
+} bench_klog_t;
+
+static ksem_t bench_klog_done = KSEM_INIT(0);
+
+static void bench_klog_writer(void* arg) {
+     bench_klog_t* w = (bench_klog_t*)arg;
+     UINT64 start = AsmReadTsc();
+     UINTN i;
+     for(i=0; i < w->count; i++) klog("BENCH",1,"klog-threads writer %lld line %lld",(UINT64)w->id,(UINT64)i);
+     w->cycles = AsmReadTsc() - start;
+     ksem_post(&bench_klog_done);
+}
+
+static void bench_klog_threads(UINTN n) {
+     bench_klog_t writers[BENCH_KLOG_MAX_THREADS];
+     UINT64 start, cycles, drain, dropped, caller;
+     UINTN t, i, lines;
+     for(t=1; t <= BENCH_KLOG_MAX_THREADS; t *= 2) {
+         lines   = (n / t) * t;
+         dropped = kmsg_dropped();
+         start   = AsmReadTsc();
+         for(i=0; i < t; i++) {
+             writers[i].count = n / t;
+             writers[i].id    = i;
+             create_thread(&bench_klog_writer,&writers[i]);
+         }
+         for(i=0; i < t; i++) ksem_wait(&bench_klog_done);
+         cycles = AsmReadTsc() - start;
+         while(kmsg_pending()) thread_sleep(1000);
+         drain = AsmReadTsc() - start - cycles;
+         for(caller=0, i=0; i < t; i++) caller += writers[i].cycles;
+         bench_report("klog-threads %lld threads: %lld lines/s, " BENCH_NS_FMT " ns/line in klog(), "
+                      "%lld us more to drain, %lld dropped",(UINT64)t,lines * 1000000000 / bench_ns(cycles),
+                      BENCH_NS_ARG(caller,lines ? lines : 1),bench_ns(drain)/1000,kmsg_dropped() - dropped);
+     }
+}
+
+// debug sinks
+//
+// n lines through klog() with each debug sink on by itself, then with none and with the default set, timed from the
+// first line to the drain having written out the last. With none the drain still takes every line off the rings, so
+// the difference is what that sink costs. The sinks in use are put back afterwards; boot time with logging on and off
+// is the boot profile's total with debug= and with debug=debugcon,console.
+
+typedef struct bench_sink_t {
+     char*  name;
+     UINT32 sinks;
+} bench_sink_t;
+
+static bench_sink_t bench_sinks[] = {
+     {"none",     0},
+     {"debugcon", DBGSINK_DEBUGCON},
+     {"com1",     DBGSINK_COM1},
+     {"console",  DBGSINK_CONSOLE},
+     {"mem",      DBGSINK_MEM},
+     {"default",  DBGSINK_DEFAULT},
+     {NULL,       0}
+};
+
+static void bench_klog_sinks(UINTN n) {
+     UINT32 old_sinks = dbgsink_enabled();
+     UINT64 start, cycles[sizeof(bench_sinks)/sizeof(bench_sinks[0])];
+     UINTN s, i;
+     // settle what's already logged first, so it isn't timed under the first sink
+     while(kmsg_pending()) thread_sleep(1000);
+     for(s=0; bench_sinks[s].name != NULL; s++) {
+         cycles[s] = 0;
+         if(dbgsink_enable(bench_sinks[s].sinks) != 0) continue;
+         start = AsmReadTsc();
+         for(i=0; i < n; i++) klog("BENCH",1,"klog-sinks %s line %lld",bench_sinks[s].name,(UINT64)i);
+         while(kmsg_pending()) thread_sleep(100);
+         cycles[s] = AsmReadTsc() - start;
+     }
+     dbgsink_enable(old_sinks);
+     for(s=0; bench_sinks[s].name != NULL; s++) {
+         if(cycles[s] == 0) {
+            bench_report("klog-sinks %s: not there",bench_sinks[s].name);
+            continue;
+         }
+         bench_report("klog-sinks %s: %lld lines in %lld us, " BENCH_NS_FMT " ns/line",bench_sinks[s].name,(UINT64)n,
+                      bench_ns(cycles[s])/1000,BENCH_NS_ARG(cycles[s],n ? n : 1));
+     }
+}
+
+// boot profiler overhead
+//
+// What a begin/end pair cost while boot was being recorded, times the spans boot recorded, is what the profiler added
+// to boot. Past bootprof_finish() a pair returns straight away, which is the cost left in code that keeps its spans,
+// and BOOTPROF_FW() around a firmware call is timed against the bare call.
+
+static void bench_bootprof(UINTN iters) {
+     UINT64 start, pair, idle_cycles, fw_cycles, bare_cycles, count;
+     UINTN i;
+     if(iters == 0) iters = 1;
+     pair = bootprof_pair_cycles(iters);
+
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) bootprof_end(bootprof_begin("bench","bench"));
+     idle_cycles = AsmReadTsc() - start;
+
+     thread_enter_bsp();
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) BS->GetNextMonotonicCount(&count);
+     bare_cycles = AsmReadTsc() - start;
+     start = AsmReadTsc();
+     for(i=0; i < iters; i++) BOOTPROF_FW("GetNextMonotonicCount",BS->GetNextMonotonicCount(&count));
+     fw_cycles = AsmReadTsc() - start;
+     thread_leave_bsp();
+
+     bench_report("bootprof recording: " BENCH_NS_FMT " ns a pair, %lld spans at boot, %lld us of boot in all",
+                  BENCH_NS_ARG(pair,1),(UINT64)bootprof_recorded(),bench_ns(pair * bootprof_recorded())/1000);
+     bench_report("bootprof after boot: " BENCH_NS_FMT " ns a pair, GetNextMonotonicCount " BENCH_NS_FMT
+                  " ns bare, " BENCH_NS_FMT " ns through BOOTPROF_FW",BENCH_NS_ARG(idle_cycles,iters),
+                  BENCH_NS_ARG(bare_cycles,iters),BENCH_NS_ARG(fw_cycles,iters));
+}
+
+// gate for benchmarks that time threads on every CPU
+//
+// bench_gate_thread() starts a DMT_CPU_ANY thread, which gets off the BSP and waits at the gate. bench_gate_open()
+// waits for n of them to be there, lets them all go at once and returns the cycles until n have called
+// bench_gate_done(), so thread creation and migration aren't in what's timed.
+
+static volatile UINT64 bench_gate_go;
+static kwaitq_t        bench_gate_waitq = KWAITQ_INIT;
+static ksem_t          bench_gate_ready = KSEM_INIT(0);
+static ksem_t          bench_gate_end   = KSEM_INIT(0);
+
+static int bench_gate_thread(void (*func)(void* arg), void* arg) {
+     thread_list* t = create_thread(func,arg);
+     if(t == NULL) return -1;
+     thread_set_affinity(t,DMT_CPU_ANY);
+     return 0;
+}
+
+static void bench_gate_wait() {
+     thread_yield(); // the affinity only takes effect once we give up the CPU
+     ksem_post(&bench_gate_ready);
+     while(!bench_gate_go) {
+        if(!kwaitq_wait_on(&bench_gate_waitq,&bench_gate_go,0)) thread_yield();
+     }
+}
+
+static void bench_gate_done() {
+     ksem_post(&bench_gate_end);
+}
+
+static UINT64 bench_gate_open(UINTN n) {
+     UINT64 start;
+     UINTN i;
+     for(i=0; i < n; i++) ksem_wait(&bench_gate_ready);
+     start = AsmReadTsc();
+     bench_gate_go = 1;
+     kwaitq_wake_all(&bench_gate_waitq);
+     for(i=0; i < n; i++) ksem_wait(&bench_gate_end);
+     start = AsmReadTsc() - start;
+     bench_gate_go = 0;
+     return start;
+}
+
+// lock contention
+//
+// 1 to twice as many threads as CPUs (at most 16) taking one kmutex arg times between them around a counter bump,
+// then a bounded buffer of BENCH_SEMQ_SLOTS items passed from half of them to the other half, counted by two ksem_t
+// with the kmutex around the buffer itself. A count or sum that comes out wrong means the lock let two in at once.
+
+#define BENCH_LOCK_MAX_THREADS 16
+#define BENCH_SEMQ_SLOTS       16
+
+static kmutex_t        bench_lk_mutex = KMUTEX_INIT;
+static volatile UINT64 bench_lk_count;
+static UINTN           bench_lk_per;   // each thread's share, read once the gate opens
+static ksem_t          bench_semq_free;
+static ksem_t          bench_semq_full;
+static UINT64          bench_semq_buf[BENCH_SEMQ_SLOTS];
+static UINTN           bench_semq_head;
+static UINTN           bench_semq_tail;
+static volatile UINT64 bench_semq_sum;
+
+static void bench_lock_worker(void* arg) {
+     UINTN i;
+     bench_gate_wait();
+     for(i=0; i < bench_lk_per; i++) {
+         kmutex_lock(&bench_lk_mutex);
+         bench_lk_count++;
+         kmutex_unlock(&bench_lk_mutex);
+     }
+     bench_gate_done();
+}
+
+static void bench_semq_producer(void* arg) {
+     UINTN i;
+     bench_gate_wait();
+     for(i=0; i < bench_lk_per; i++) {
+         ksem_wait(&bench_semq_free);
+         kmutex_lock(&bench_lk_mutex);
+         bench_semq_buf[bench_semq_head++ % BENCH_SEMQ_SLOTS] = i+1;
+         kmutex_unlock(&bench_lk_mutex);
+         ksem_post(&bench_semq_full);
+     }
+     bench_gate_done();
+}
+
+static void bench_semq_consumer(void* arg) {
+     UINTN i;
+     bench_gate_wait();
+     for(i=0; i < bench_lk_per; i++) {
+         ksem_wait(&bench_semq_full);
+         kmutex_lock(&bench_lk_mutex);
+         bench_semq_sum += bench_semq_buf[bench_semq_tail++ % BENCH_SEMQ_SLOTS];
+         kmutex_unlock(&bench_lk_mutex);
+         ksem_post(&bench_semq_free);
+     }
+     bench_gate_done();
+}
+
+// starts t threads, alternately running func and func2, or if it can't, lets the ones it did start go with nothing to do
+static int bench_lock_start(void (*func)(void* arg), void (*func2)(void* arg), UINTN t) {
+     UINTN started = 0;
+     while(started < t && bench_gate_thread((started & 1) ? func2 : func,NULL) == 0) started++;
+     if(started == t) return 0;
+     bench_lk_per = 0;
+     bench_gate_open(started);
+     bench_report("lock-contention: create_thread() failed after %lld threads",(UINT64)started);
+     return -1;
+}
+
+static void bench_lock_contention(UINTN n) {
+     UINTN max = smp_cpu_count()*2;
+     UINTN t, ops;
+     UINT64 cycles;
+     if(max > BENCH_LOCK_MAX_THREADS) max = BENCH_LOCK_MAX_THREADS;
+
+     for(t=1; t <= max; t *= 2) {
+         bench_lk_per   = n / t;
+         bench_lk_count = 0;
+         if(bench_lock_start(&bench_lock_worker,&bench_lock_worker,t) != 0) return;
+         cycles = bench_gate_open(t);
+         ops    = bench_lk_per * t;
+         bench_report("lock-contention kmutex %lld threads: %lld ops/s, " BENCH_NS_FMT " ns/op%s",(UINT64)t,
+                      ops * 1000000000 / bench_ns(cycles),BENCH_NS_ARG(cycles,ops ? ops : 1),
+                      bench_lk_count == ops ? "" : ", LOST UPDATES");
+     }
+
+     // producers and consumers alternate, every producer has a consumer for its items
+     for(t=2; t <= max; t *= 2) {
+         bench_lk_per    = n / (t/2);
+         bench_semq_head = 0;
+         bench_semq_tail = 0;
+         bench_semq_sum  = 0;
+         ksem_init(&bench_semq_free,BENCH_SEMQ_SLOTS);
+         ksem_init(&bench_semq_full,0);
+         if(bench_lock_start(&bench_semq_producer,&bench_semq_consumer,t) != 0) return;
+         cycles = bench_gate_open(t);
+         ops    = bench_lk_per * (t/2);
+         bench_report("lock-contention ksem queue %lld+%lld threads: %lld items/s, " BENCH_NS_FMT " ns/item%s",
+                      (UINT64)t/2,(UINT64)t/2,ops * 1000000000 / bench_ns(cycles),BENCH_NS_ARG(cycles,ops ? ops : 1),
+                      bench_semq_sum == (UINT64)(t/2) * bench_lk_per * (bench_lk_per+1) / 2 ? "" : ", WRONG SUM");
+     }
+}
+
+// SMP scaling
+//
+// arg rounds of bench_tick_work() split evenly between 1, 2, ... smp_cpu_count() DMT_CPU_ANY threads, each run timed
+// from the gate opening to the last thread done. Speedup is against the single thread per round of work, so with
+// the rounds spread well it should come close to the thread count; efficiency is speedup over threads.
+
+static UINTN bench_smp_per;
+
+static void bench_smp_worker(void* arg) {
+     UINTN i;
+     bench_gate_wait();
+     for(i=0; i < bench_smp_per; i++) bench_tick_work();
+     bench_gate_done();
+}
+
+static void bench_smp_scaling(UINTN n) {
+     UINTN cpus = smp_cpu_count();
+     UINTN t, started, rounds;
+     UINT64 cycles, one = 0, speedup;
+     if(n == 0) n = 1;
+     for(t=1; t <= cpus; t++) {
+         bench_smp_per = n / t;
+         if(bench_smp_per == 0) break;
+         for(started=0; started < t && bench_gate_thread(&bench_smp_worker,NULL) == 0; started++);
+         if(started < t) {
+            bench_smp_per = 0;
+            bench_gate_open(started);
+            bench_report("smp-scaling: create_thread() failed after %lld threads",(UINT64)started);
+            return;
+         }
+         cycles = bench_gate_open(t);
+         rounds = bench_smp_per * t;
+         if(t == 1) one = cycles;
+         // cycles per round on one thread over cycles per round on t, in hundredths
+         speedup = (one * rounds * 100) / (n * (cycles ? cycles : 1));
+         bench_report("smp-scaling %lld threads: %lld rounds in %lld us, speedup %lld.%02lld, efficiency %lld%%",
+                      (UINT64)t,(UINT64)rounds,bench_ns(cycles)/1000,speedup/100,speedup%100,speedup/t);
+     }
+}
+
+// whole initrd image
+//
+// The filesystem image read start to end through initrd_read() arg times. The first pass waits on the stream if it
+// hasn't finished and decompresses every chunk, later passes get what the chunk cache still holds. To compare
+// compression levels, bench_initrd_levels.sh boots an image packed at each mkzinitrd -l level with this on the
+// command line and collects it with the boot profile's mount_initrd phase and time to init.
+
+static void bench_initrd_image(UINTN rounds) {
+     UINT8* buf = (UINT8*)kmalloc(BENCH_READ_BUF);
+     UINT64 size = initrd_size();
+     UINT64 start, offset, len, first = 0, rest = 0;
+     UINTN r;
+     if(buf == NULL) {
+        bench_report("initrd-image: out of memory");
+        return;
+     }
+     if(size == 0) {
+        bench_report("initrd-image: no initrd");
+        kfree(buf);
+        return;
+     }
+     if(rounds == 0) rounds = 1;
+     for(r=0; r < rounds; r++) {
+         start = AsmReadTsc();
+         for(offset=0; offset < size; offset += len) {
+             len = size - offset;
+             if(len > BENCH_READ_BUF) len = BENCH_READ_BUF;
+             if(initrd_read(offset,buf,len) != 0) break;
+         }
+         if(offset < size) {
+            bench_report("initrd-image: read failed at offset %lld",offset);
+            kfree(buf);
+            return;
+         }
+         if(r == 0) first = AsmReadTsc() - start; else rest += AsmReadTsc() - start;
+     }
+     bench_report("initrd-image %s, %lld bytes: first pass %lld us, %lld MB/s",
+                  initrd_map(0,1) == NULL ? "compressed" : "uncompressed",size,bench_ns(first)/1000,
+                  bench_mbps(size,first));
+     if(rounds > 1) {
+        bench_report("initrd-image later passes: %lld us each, %lld MB/s",bench_ns(rest/(rounds-1))/1000,
+                     bench_mbps(size*(rounds-1),rest));
+     }
+     kfree(buf);
+}
+
+static bench_t bench_tests[] = {
+     {"vfs-mounts",      &bench_vfs_mounts,      1000,   "path lookups, trie vs linear scan, 1 to arg mounts in powers of 10"},
+     {"initrd-read",     &bench_initrd_read,     20,     "read " BENCH_INITRD_FILE " arg times, via the VFS and via initrd:"},
+     {"syscall-write",   &bench_syscall_write,   100000, "arg sys_write()s of 1 byte then 64KiB to /dev/null, no trap"},
+     {"syscall-null",    &bench_syscall_null,    100000, "arg getpid calls through int 0x80, then through SYSCALL"},
+     {"user-malloc",     &bench_user_malloc,     0,      "spawn /bin/mallocbench, shell-style string building in userland"},
+     {"pmm-alloc",       &bench_pmm_alloc,       20000,  "arg alloc/free pairs, pool and heap vs firmware, then a churn"},
+     {"context-switch",  &bench_context_switch,  8,      "arg threads yielding to each other, with 0/10/100/1000 more blocked"},
+     {"tick",            &bench_tick,            64,     "arg rounds of work on the BSP at several tick lengths, then idle wakeups"},
+     {"thread-create",   &bench_thread_create,   1000,   "arg threads created and exited, one at a time then all at once"},
+     {"task-table",      &bench_task_table,      1000,   "arg tasks started and kept alive together, time and table memory"},
+     {"spawn-storm",     &bench_spawn_storm,     4000,   "arg task requests from 4 threads at once, via req_task then sys_spawn"},
+     {"workq",           &bench_workq,           10000,  "arg jobs one at a time for latency, then all at once for throughput"},
+     {"spawn-cache",     &bench_spawn_cache,     20,     "arg cold then warm image cache loads up to LoadImage()"},
+     {"klog-threads",    &bench_klog_threads,    16000,  "arg log lines split between 1 to 16 threads logging at once"},
+     {"klog-sinks",      &bench_klog_sinks,      2000,   "arg log lines written out through each debug sink on its own"},
+     {"bootprof",        &bench_bootprof,        100000, "arg boot profiler span pairs, recording and after boot, and BOOTPROF_FW"},
+     {"lock-contention", &bench_lock_contention, 100000, "arg kmutex ops, then ksem queue items, split between 1 to 16 threads"},
+     {"smp-scaling",     &bench_smp_scaling,     256,    "arg rounds of CPU-bound work split between 1 to smp_cpu_count() threads"},
+     {"initrd-image",    &bench_initrd_image,    3,      "read the whole initrd image arg times through initrd_read(), first pass cold"},
+     {NULL,              NULL,                   0,      NULL}
+};
+
+static int bench_run(char* name, char* arg) {
+     UINTN i;
+     if(strcmp(name,"list")==0) {
+        for(i=0; bench_tests[i].name != NULL; i++) {
+            bench_report("%s [%lld]: %s",bench_tests[i].name,(UINT64)bench_tests[i].def_arg,bench_tests[i].help);
+        }
+        return 0;
+     }
+     for(i=0; bench_tests[i].name != NULL; i++) {
+         if(strcmp(bench_tests[i].name,name)==0) break;
+     }
+     if(bench_tests[i].name == NULL) {
+        klog("BENCH",0,"No benchmark called %s",name);
+        return -1;
+     }
+     if(thread_tsc_per_us() == 0) {
+        klog("BENCH",0,"TSC isn't calibrated, can't run %s before the scheduler",name);
+        return -1;
+     }
+     kmutex_lock(&bench_lock);
+     bench_tests[i].run((arg != NULL && *arg != 0) ? strtoull(arg,NULL,10) : bench_tests[i].def_arg);
+     kmutex_unlock(&bench_lock);
+     return 0;
+}
+
+static char* bench_boot_list = NULL;
+static void  (*bench_boot_then)(void* arg) = NULL;
+
+static void bench_boot_task(void* _t) {
+     char buf[BENCH_LINE_MAX];
+     char* name = buf;
+     char* end;
+     char* arg;
+     strncpy(buf,bench_boot_list,BENCH_LINE_MAX-1);
+     buf[BENCH_LINE_MAX-1] = 0;
+     while(*name != 0) {
+        end = strchr(name,',');
+        if(end != NULL) *end = 0;
+        arg = strchr(name,':');
+        if(arg != NULL) *arg++ = 0;
+        if(*name != 0) bench_run(name,arg);
+        if(end == NULL) break;
+        name = end+1;
+     }
+     if(bench_boot_then != NULL) req_task(bench_boot_then,NULL);
+}
+
+void bench_boot(char* list, void (*then)(void* arg)) {
+     bench_boot_list = list;
+     bench_boot_then = then;
+     init_kernel_task(&bench_boot_task,NULL);
+}
+
+ssize_t bench_read(void* buf, size_t count) {
+     char lost[64];
+     int n = 0;
+     kmutex_lock(&bench_out_lock);
+     if(bench_out_lost != 0 && count >= sizeof(lost)) {
+        n = snprintf(lost,sizeof(lost),"# %lld lines dropped, read more often\n",(UINT64)bench_out_lost);
+        memcpy(buf,lost,n);
+        bench_out_lost = 0;
+     } else {
+        n = (bench_out_len < count) ? bench_out_len : count;
+        memcpy(buf,bench_out,n);
+        memmove(bench_out,bench_out + n,bench_out_len - n);
+        bench_out_len -= n;
+     }
+     kmutex_unlock(&bench_out_lock);
+     return n;
+}
+
+ssize_t bench_write(void* buf, size_t count) {
+     char cmd[BENCH_LINE_MAX];
+     char* arg;
+     if(count == 0 || count >= BENCH_LINE_MAX) return -1;
+     memcpy(cmd,buf,count);
+     cmd[count] = 0;
+     cmd[strcspn(cmd,"\r\n")] = 0;
+     arg = strchr(cmd,' ');
+     if(arg != NULL) *arg++ = 0;
+     if(bench_run(cmd,arg) != 0) return -1;
+     return count;
+}
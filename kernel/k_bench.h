@@ -0,0 +1,19 @@
+#ifndef K_BENCH_H
+#define K_BENCH_H
+
+#include <Uefi.h>
+#include <sys/types.h>
+
+// in-kernel microbenchmarks, see k_bench.c
+
+#define BENCH_OUT_SIZE 16384          // result text kept between reads of /dev/bench, later lines are dropped
+#define BENCH_LINE_MAX 256
+
+// bench=name[:arg],... from the command line, run by a kernel task once tasking is up - then is requested as a task
+// after the last one, so PID 1 can wait for them
+void    bench_boot(char* list, void (*then)(void* arg));
+
+ssize_t bench_read(void* buf, size_t count);       // /dev/bench: result lines of everything run since the last read
+ssize_t bench_write(void* buf, size_t count);      // /dev/bench: "name [arg]" runs one in the writer, "list" lists them
+
+#endif
@@ -0,0 +1,191 @@
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseLib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "kmsg.h"
+#include "dmthread.h"
+#include "k_smp.h"
+#include "k_vfs.h"
+#include "k_bootprof.h"
+
+// Boot profiler
+//
+// Phases are the steps main() goes through, each one ends where the next starts. Spans are whatever a subsystem
+// wants timed inside them, firmware calls in particular since those are where most of boot goes and there's no other
+// way to see into them. Everything is TSC stamps in a fixed table, so recording one is a few instructions and works
+// before there's a heap or a calibrated clock. bootprof_finish() turns them into a table on the log and a Chrome
+// trace (chrome://tracing or Perfetto) on the boot volume, so boots can be compared.
+
+#define BOOTPROF_TRACE_NAME  "boottrace.json"
+#define BOOTPROF_PHASE_CAT   "phase"
+
+typedef struct bootprof_span_t {
+     char*  name;
+     char*  cat;
+     UINT64 start;                    // TSC
+     UINT64 end;                      // 0 while it's still going
+     UINTN  cpu;
+     int    phase;
+} bootprof_span_t;
+
+static bootprof_span_t bootprof_spans[BOOTPROF_MAX_SPANS];
+static volatile UINTN  bootprof_count   = 0;
+static volatile UINTN  bootprof_dropped = 0;
+static UINTN           bootprof_cur     = BOOTPROF_NONE;   // the phase running now
+static UINT64          bootprof_t0      = 0;
+static int             bootprof_done    = 0;
+
+void bootprof_start() {
+     bootprof_t0 = AsmReadTsc();
+}
+
+static inline void bootprof_fill(bootprof_span_t* s, char* name, char* cat) {
+     s->name  = name;
+     s->cat   = cat;
+     s->end   = 0;
+     s->cpu   = smp_cpu_id();
+     s->phase = 0;
+     s->start = AsmReadTsc();
+}
+
+UINTN bootprof_begin(char* name, char* cat) {
+     UINTN i;
+     if(bootprof_done) return BOOTPROF_NONE;
+     i = __sync_fetch_and_add(&bootprof_count,1);
+     if(i >= BOOTPROF_MAX_SPANS) {
+        __sync_fetch_and_add(&bootprof_dropped,1);
+        return BOOTPROF_NONE;
+     }
+     bootprof_fill(&bootprof_spans[i],name,cat);
+     return i;
+}
+
+void bootprof_end(UINTN span) {
+     if(span == BOOTPROF_NONE) return;
+     bootprof_spans[span].end = AsmReadTsc();
+}
+
+void bootprof_phase(char* name) {
+     bootprof_end(bootprof_cur);
+     bootprof_cur = bootprof_begin(name,BOOTPROF_PHASE_CAT);
+     if(bootprof_cur != BOOTPROF_NONE) bootprof_spans[bootprof_cur].phase = 1;
+}
+
+static UINT64 bootprof_us(UINT64 tsc, UINT64 tsc_per_us) {
+     return tsc / tsc_per_us;
+}
+
+// one line per phase, then every other kind of span added up by name
+static void bootprof_table(UINTN n, UINT64 end, UINT64 tsc_per_us) {
+     bootprof_span_t* s;
+     UINT64 total = end - bootprof_t0;
+     UINT64 sum, max, len;
+     UINTN i, j, count;
+     kprintf("\n%-24s %-10s %12s %6s\n","Boot phase","","ms","%");
+     for(i=0; i < n; i++) {
+         s = &bootprof_spans[i];
+         if(!s->phase || s->end == 0) continue;
+         len = s->end - s->start;
+         kprintf("%-24s %-10s %8lld.%03lld %5lld%%\n",s->name,"",bootprof_us(len,tsc_per_us)/1000,
+                 bootprof_us(len,tsc_per_us)%1000,total ? len*100/total : 0);
+     }
+     kprintf("%-24s %-10s %8lld.%03lld\n","total since main()","",bootprof_us(total,tsc_per_us)/1000,
+             bootprof_us(total,tsc_per_us)%1000);
+
+     kprintf("\n%-24s %-10s %6s %12s %12s\n","Span","category","calls","total ms","max ms");
+     for(i=0; i < n; i++) {
+         s = &bootprof_spans[i];
+         if(s->phase || s->end == 0) continue;
+         // only the first span of each name prints, with every later one of that name added in
+         for(j=0; j < i; j++) {
+             if(!bootprof_spans[j].phase && bootprof_spans[j].end != 0 &&
+                strcmp(bootprof_spans[j].name,s->name) == 0 && strcmp(bootprof_spans[j].cat,s->cat) == 0) break;
+         }
+         if(j < i) continue;
+         sum = max = 0;
+         count = 0;
+         for(j=i; j < n; j++) {
+             if(bootprof_spans[j].phase || bootprof_spans[j].end == 0 || strcmp(bootprof_spans[j].name,s->name) != 0 ||
+                strcmp(bootprof_spans[j].cat,s->cat) != 0) continue;
+             len  = bootprof_spans[j].end - bootprof_spans[j].start;
+             sum += len;
+             if(len > max) max = len;
+             count++;
+         }
+         kprintf("%-24s %-10s %6lld %8lld.%03lld %8lld.%03lld\n",s->name,s->cat,count,
+                 bootprof_us(sum,tsc_per_us)/1000,bootprof_us(sum,tsc_per_us)%1000,
+                 bootprof_us(max,tsc_per_us)/1000,bootprof_us(max,tsc_per_us)%1000);
+     }
+     kprintf("\n");
+}
+
+// complete ("X") events in microseconds from main(), one thread per CPU so spans nest under their phase
+static int bootprof_write_trace(char* path, UINTN n, UINT64 tsc_per_us) {
+     bootprof_span_t* s;
+     FILE* fp;
+     UINTN i;
+     fp = fopen(path,"w");
+     if(fp == NULL) return -1;
+     fprintf(fp,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+     fprintf(fp,"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"zoidberg boot\"}}");
+     for(i=0; i < n; i++) {
+         s = &bootprof_spans[i];
+         if(s->end == 0) continue;
+         fprintf(fp,",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%lld,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld}",
+                 s->name,s->cat,(UINT64)s->cpu,
+                 bootprof_us((s->start - bootprof_t0)*1000,tsc_per_us)/1000,bootprof_us((s->start - bootprof_t0)*1000,tsc_per_us)%1000,
+                 bootprof_us((s->end - s->start)*1000,tsc_per_us)/1000,bootprof_us((s->end - s->start)*1000,tsc_per_us)%1000);
+     }
+     fprintf(fp,"\n]}\n");
+     fclose(fp);
+     return 0;
+}
+
+UINTN bootprof_recorded() {
+     return bootprof_count;
+}
+
+// the same steps as a begin/end pair during boot, into a span of its own so the table is left alone
+UINT64 bootprof_pair_cycles(UINTN pairs) {
+     bootprof_span_t scratch;
+     volatile UINTN count = 0;
+     UINT64 start;
+     UINTN i;
+     if(pairs == 0) return 0;
+     start = AsmReadTsc();
+     for(i=0; i < pairs; i++) {
+         __sync_fetch_and_add(&count,1);
+         bootprof_fill(&scratch,"bench","bench");
+         scratch.end = AsmReadTsc();
+     }
+     return (AsmReadTsc() - start) / pairs;
+}
+
+void bootprof_finish() {
+     char path[PATH_MAX];
+     UINT64 end = AsmReadTsc();
+     UINT64 tsc_per_us;
+     UINTN n;
+     bootprof_end(bootprof_cur);
+     bootprof_cur  = BOOTPROF_NONE;
+     bootprof_done = 1;
+     n = (bootprof_count < BOOTPROF_MAX_SPANS) ? bootprof_count : BOOTPROF_MAX_SPANS;
+     tsc_per_us = thread_tsc_per_us(); // the scheduler's calibrated the TSC by now
+     if(tsc_per_us == 0) {
+        klog("BOOTPROF",0,"TSC isn't calibrated, no boot profile");
+        return;
+     }
+
+     bootprof_table(n,end,tsc_per_us);
+     if(bootprof_dropped != 0) klog("BOOTPROF",0,"%lld spans past the first %d weren't recorded",(UINT64)bootprof_dropped,BOOTPROF_MAX_SPANS);
+
+     vfs_boot_file(path,PATH_MAX,BOOTPROF_TRACE_NAME);
+     if(bootprof_write_trace(path,n,tsc_per_us) != 0) {
+        klog("BOOTPROF",0,"Could not write %s",path);
+     } else {
+        klog("BOOTPROF",1,"Wrote boot trace to %s",path);
+     }
+}
@@ -0,0 +1,31 @@
+#ifndef K_BOOTPROF_H
+#define K_BOOTPROF_H
+
+#include <Uefi.h>
+
+// where boot time goes between main() and /sbin/init, see k_bootprof.c
+
+#define BOOTPROF_MAX_SPANS 4096       // later spans are counted as dropped
+#define BOOTPROF_NONE      ((UINTN)-1)
+
+void  bootprof_start();               // first thing in main()
+void  bootprof_phase(char* name);     // ends the boot phase running now and starts the next one
+
+// a span of something a subsystem does, cat groups them in the report ("firmware" for firmware calls)
+UINTN bootprof_begin(char* name, char* cat);
+void  bootprof_end(UINTN span);
+
+// a firmware call timed as a span, the call's own value is what this evaluates to
+#define BOOTPROF_FW(name, call) ({ UINTN _bp_span = bootprof_begin(name,"firmware"); \
+                                   __typeof__(call) _bp_ret = (call);              \
+                                   bootprof_end(_bp_span);                         \
+                                   _bp_ret; })
+
+// closes the last phase, logs the table and writes boottrace.json (Chrome trace events) to /boot - spans after this
+// aren't recorded
+void  bootprof_finish();
+
+UINTN  bootprof_recorded();             // spans begun during boot, dropped ones included
+UINT64 bootprof_pair_cycles(UINTN pairs); // what one begin/end pair cost while boot was recording, averaged over pairs
+
+#endif
@@ -0,0 +1,177 @@
+#include <Library/UefiBootServicesTableLib.h>
+
+#include <string.h>
+
+#include "kmsg.h"
+#include "k_console.h"
+#include "k_smp.h"
+#include "k_dbgsink.h"
+
+// Debug sinks
+//
+// The kmsg drain hands every string it writes out to here, whole, so the port I/O is batched instead of one outb per
+// character: debugcon takes a string in one rep outsb, and the 16550 is filled a FIFO at a time each time its
+// transmitter empties. The memory sink keeps the last DBGSINK_MEM_SIZE bytes for /dev/kmsg to read, so a log survives
+// without a serial cable or a screen. Only the drain writes, so only the memory ring (which readers share) locks.
+//
+// debug= at boot says which sinks are on, without it it's debugcon and the console as before. debug= with nothing
+// after it turns them all off.
+
+extern EFI_SYSTEM_TABLE *ST;
+
+#define DEBUGCON_PORT     0x402
+#define COM1_PORT         0x3F8
+#define UART_FIFO         16
+#define UART_TIMEOUT      1000000     // polls of the line status before the UART is given up on
+#define DBGSINK_MEM_SIZE  65536       // a power of 2
+
+static UINT32          dbgsink_mask     = DBGSINK_DEFAULT;
+static char            dbgsink_mem[DBGSINK_MEM_SIZE];
+static UINT64          dbgsink_mem_head = 0;   // bytes ever written
+static UINT64          dbgsink_mem_tail = 0;   // bytes ever read from /dev/kmsg
+static volatile UINT8  dbgsink_mem_lock = 0;
+
+static inline void port_out8(UINT16 port, UINT8 v) {
+     __asm__ volatile("outb %0, %1" : : "a"(v), "Nd"(port));
+}
+
+static inline UINT8 port_in8(UINT16 port) {
+     UINT8 v;
+     __asm__ volatile("inb %1, %0" : "=a"(v) : "Nd"(port));
+     return v;
+}
+
+static inline void port_out_string(UINT16 port, char* s, UINTN len) {
+     __asm__ volatile("rep outsb" : "+S"(s), "+c"(len) : "d"(port) : "memory");
+}
+
+static void debugcon_write(char* s, UINTN len) {
+     port_out_string(DEBUGCON_PORT,s,len);
+}
+
+static int com1_init() {
+     port_out8(COM1_PORT+7,0xA5);        // nothing there if the scratch register doesn't hold it
+     if(port_in8(COM1_PORT+7) != 0xA5) return -1;
+     port_out8(COM1_PORT+1,0x00);        // no interrupts, we poll
+     port_out8(COM1_PORT+3,0x80);        // divisor latch
+     port_out8(COM1_PORT+0,0x01);        // 115200
+     port_out8(COM1_PORT+1,0x00);
+     port_out8(COM1_PORT+3,0x03);        // 8N1
+     port_out8(COM1_PORT+2,0xC7);        // FIFOs on and cleared
+     port_out8(COM1_PORT+4,0x03);        // DTR, RTS
+     return 0;
+}
+
+static void com1_write(char* s, UINTN len) {
+     UINTN n, polls;
+     while(len > 0) {
+        // transmitter holding register empty means the whole FIFO is free
+        for(polls=0; !(port_in8(COM1_PORT+5) & 0x20); polls++) {
+            if(polls == UART_TIMEOUT) {
+               dbgsink_mask &= ~DBGSINK_COM1;
+               return;
+            }
+            __asm__ volatile("pause");
+        }
+        n = (len < UART_FIFO) ? len : UART_FIFO;
+        port_out_string(COM1_PORT,s,n);
+        s   += n;
+        len -= n;
+     }
+}
+
+static void console_sink_write(char* s, UINTN len, UINTN attr) {
+     CHAR16 w[64];
+     UINTN i;
+     if(attr == 0) {
+        console_write_chars(s,len);
+        return;
+     }
+     for(i=0; i < len && i < 63; i++) w[i] = (CHAR16)s[i];
+     w[i] = 0;
+     ST->ConOut->SetAttribute(ST->ConOut,attr);
+     ST->ConOut->OutputString(ST->ConOut,w);
+     ST->ConOut->SetAttribute(ST->ConOut,EFI_TEXT_ATTR(EFI_LIGHTGRAY,EFI_BACKGROUND_BLACK));
+}
+
+static void mem_write(char* s, UINTN len) {
+     EFI_TPL old;
+     UINTN off, n;
+     if(len > DBGSINK_MEM_SIZE) {
+        s   += len - DBGSINK_MEM_SIZE;
+        len  = DBGSINK_MEM_SIZE;
+     }
+     old = smp_lock(&dbgsink_mem_lock,TPL_HIGH_LEVEL);
+     off = dbgsink_mem_head & (DBGSINK_MEM_SIZE-1);
+     n   = (len < DBGSINK_MEM_SIZE - off) ? len : DBGSINK_MEM_SIZE - off;
+     memcpy(dbgsink_mem + off,s,n);
+     memcpy(dbgsink_mem,s + n,len - n);
+     dbgsink_mem_head += len;
+     smp_unlock(&dbgsink_mem_lock,old);
+}
+
+ssize_t dbgsink_mem_read(void* buf, size_t count) {
+     EFI_TPL old;
+     UINTN off, n, first;
+     old = smp_lock(&dbgsink_mem_lock,TPL_HIGH_LEVEL);
+     if(dbgsink_mem_head - dbgsink_mem_tail > DBGSINK_MEM_SIZE) dbgsink_mem_tail = dbgsink_mem_head - DBGSINK_MEM_SIZE;
+     n     = (count < dbgsink_mem_head - dbgsink_mem_tail) ? count : dbgsink_mem_head - dbgsink_mem_tail;
+     off   = dbgsink_mem_tail & (DBGSINK_MEM_SIZE-1);
+     first = (n < DBGSINK_MEM_SIZE - off) ? n : DBGSINK_MEM_SIZE - off;
+     memcpy(buf,dbgsink_mem + off,first);
+     memcpy((char*)buf + first,dbgsink_mem,n - first);
+     dbgsink_mem_tail += n;
+     smp_unlock(&dbgsink_mem_lock,old);
+     return n;
+}
+
+void dbgsink_write(UINT32 sinks, char* s, UINTN len, UINTN attr) {
+     sinks &= dbgsink_mask;
+     if(sinks & DBGSINK_DEBUGCON) debugcon_write(s,len);
+     if(sinks & DBGSINK_COM1)     com1_write(s,len);
+     if(sinks & DBGSINK_CONSOLE)  console_sink_write(s,len,attr);
+     if(sinks & DBGSINK_MEM)      mem_write(s,len);
+}
+
+void dbgsink_select(char* names) {
+     char* name = names;
+     char* end;
+     UINTN len;
+     UINT32 mask = 0;
+     while(*name != 0) {
+        end = strchr(name,',');
+        len = (end != NULL) ? (UINTN)(end - name) : strlen(name);
+        if(len == 8 && strncmp(name,"debugcon",8) == 0) {
+           mask |= DBGSINK_DEBUGCON;
+        } else if(len == 4 && strncmp(name,"com1",4) == 0) {
+           mask |= DBGSINK_COM1;
+        } else if(len == 7 && strncmp(name,"console",7) == 0) {
+           mask |= DBGSINK_CONSOLE;
+        } else if(len == 3 && strncmp(name,"mem",3) == 0) {
+           mask |= DBGSINK_MEM;
+        } else if(len != 0) {
+           klog("DEBUG",0,"Unknown debug sink %.*s",(int)len,name);
+        }
+        if(end == NULL) break;
+        name = end+1;
+     }
+     if((mask & DBGSINK_COM1) && com1_init() != 0) {
+        mask &= ~DBGSINK_COM1;
+        klog("DEBUG",0,"No UART at COM1");
+     }
+     dbgsink_mask = mask; // complaints above went to the default sinks, this is parsed before there's a drain thread
+}
+
+UINT32 dbgsink_enabled() {
+     return dbgsink_mask;
+}
+
+int dbgsink_enable(UINT32 sinks) {
+     int retval = 0;
+     if((sinks & DBGSINK_COM1) && !(dbgsink_mask & DBGSINK_COM1) && com1_init() != 0) {
+        sinks &= ~DBGSINK_COM1;
+        retval = -1;
+     }
+     dbgsink_mask = sinks & DBGSINK_ALL;
+     return retval;
+}
@@ -0,0 +1,26 @@
+#ifndef K_DBGSINK_H
+#define K_DBGSINK_H
+
+#include <Uefi.h>
+#include <sys/types.h>
+
+// where the kernel log is written out, see k_dbgsink.c
+
+#define DBGSINK_DEBUGCON  0x01        // QEMU's debugcon, port 0x402
+#define DBGSINK_COM1      0x02        // 16550 UART at 0x3F8, 115200 8N1
+#define DBGSINK_CONSOLE   0x04        // the framebuffer console
+#define DBGSINK_MEM       0x08        // a ring in memory, read from /dev/kmsg
+#define DBGSINK_ALL       0x0F
+#define DBGSINK_DEFAULT   (DBGSINK_DEBUGCON|DBGSINK_CONSOLE)
+
+void    dbgsink_select(char* names);  // the debug= option, a comma separated list of debugcon, com1, console and mem
+UINT32  dbgsink_enabled();
+int     dbgsink_enable(UINT32 sinks); // swaps the whole set at runtime, -1 if COM1 was asked for and isn't there
+
+// s (NUL terminated at len) to whichever of sinks are enabled, attr is a console text attribute for just this string
+// or 0 for the usual colours - only the kmsg drain calls this
+void    dbgsink_write(UINT32 sinks, char* s, UINTN len, UINTN attr);
+
+ssize_t dbgsink_mem_read(void* buf, size_t count); // whatever /dev/kmsg hasn't read yet, oldest first
+
+#endif
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kmsg.h"
+#include "k_vfs.h"
+#include "k_fdtable.h"
+
+// The table used to be a 512 entry array of vfs_fd_t pointers inside every task_def_t, 4KiB per task whether or not
+// it had anything open and a pointer chase on every read or write. Now the vfs_fd_t itself lives in the slot and the
+// slots are only allocated once a task opens something.
+
+#define FD_TABLE_ALIGN 64
+
+void fd_table_init(fd_table_t* t) {
+     t->size      = 0;
+     t->slots     = NULL;
+     t->slots_mem = NULL;
+}
+
+static int fd_table_grow(fd_table_t* t, UINT32 min_size) {
+     UINT32 size = (t->size == 0) ? FD_TABLE_INITIAL : t->size;
+     void* mem;
+     vfs_fd_t* slots;
+     while(size < min_size) size *= 2;
+     if(size > FD_TABLE_MAX) return -1;
+
+     mem = malloc(size*sizeof(vfs_fd_t) + FD_TABLE_ALIGN-1);
+     if(mem == NULL) {
+        klog("FDTABLE",0,"Out of memory growing fd table to %d slots",size);
+        return -1;
+     }
+     slots = (vfs_fd_t*)(((UINTN)mem + FD_TABLE_ALIGN-1) & ~(UINTN)(FD_TABLE_ALIGN-1));
+     memset(slots,0,size*sizeof(vfs_fd_t));
+     if(t->size > 0) memcpy(slots,t->slots,t->size*sizeof(vfs_fd_t));
+     free(t->slots_mem);
+     t->slots     = slots;
+     t->slots_mem = mem;
+     t->size      = size;
+     return 0;
+}
+
+int fd_table_close(fd_table_t* t, int fd) {
+     vfs_fd_t* f;
+     int retval=0;
+     if(fd < 0) return -1;
+     f = fd_lookup(t,fd);
+     if(f == NULL) return -1;
+     if(f->fs_handler->close != NULL) retval = f->fs_handler->close(f->fs_handler,f->handler_fd);
+     vfs_fs_put(f->fs_handler);
+     f->fs_handler = NULL;
+     f->handler_fd = NULL;
+     return retval;
+}
+
+// vfs_fd is copied into the table and freed, as returned by vfs_fopen()
+int fd_table_set(fd_table_t* t, int fd, vfs_fd_t* vfs_fd) {
+     if(fd < 0 || vfs_fd == NULL) return -1;
+     if((UINT32)fd >= t->size && fd_table_grow(t,fd+1) != 0) return -1;
+     fd_table_close(t,fd);
+     t->slots[fd] = *vfs_fd;
+     free(vfs_fd);
+     return fd;
+}
+
+int fd_table_alloc(fd_table_t* t, vfs_fd_t* vfs_fd) {
+     UINT32 fd;
+     for(fd=0; fd < t->size; fd++) {
+         if(t->slots[fd].fs_handler == NULL) break;
+     }
+     return fd_table_set(t,fd,vfs_fd);
+}
+
+void fd_table_free(fd_table_t* t) {
+     UINT32 fd;
+     for(fd=0; fd < t->size; fd++) fd_table_close(t,fd);
+     free(t->slots_mem);
+     fd_table_init(t);
+}
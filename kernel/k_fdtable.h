@@ -0,0 +1,35 @@
+#ifndef K_FDTABLE_H
+#define K_FDTABLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "k_vfs.h"
+
+#define FD_TABLE_INITIAL 16   // slots allocated on first use, grows by doubling
+#define FD_TABLE_MAX     512
+
+// per-task file descriptor table
+// slots hold the vfs_fd_t inline so resolving an fd is a bounds check and one load, 4 slots per cache line
+typedef struct fd_table_t {
+     UINT32    size;       // number of slots in use, 0 until the first descriptor is installed
+     vfs_fd_t* slots;      // cache line aligned, fs_handler is NULL in free slots
+     void*     slots_mem;  // what was actually allocated, slots is aligned within it
+} fd_table_t;
+
+void fd_table_init(fd_table_t* t);
+void fd_table_free(fd_table_t* t);                  // closes every descriptor
+
+int  fd_table_set(fd_table_t* t, int fd, vfs_fd_t* vfs_fd); // install at a specific fd, closing what was there
+int  fd_table_alloc(fd_table_t* t, vfs_fd_t* vfs_fd);       // install at the lowest free fd, returns it or -1
+int  fd_table_close(fd_table_t* t, int fd);
+
+// the fast path for read/write style syscalls, NULL if fd isn't open
+static inline vfs_fd_t* fd_lookup(fd_table_t* t, unsigned int fd) {
+     vfs_fd_t* retval;
+     if(fd >= t->size) return NULL;
+     retval = &(t->slots[fd]);
+     return (retval->fs_handler != NULL) ? retval : NULL;
+}
+
+#endif
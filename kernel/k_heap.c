@@ -0,0 +1,253 @@
+#include <stdlib.h>
+#include <string.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "kmsg.h"
+#include "k_pmm.h"
+#include "k_heap.h"
+#include "k_smp.h"
+
+// Kernel heap
+//
+// Objects up to KHEAP_SMALL_MAX come from 64KiB slabs of one size class each, found from any object in them by
+// masking since pool blocks are aligned to their size. Bigger requests get pages of their own with a small header
+// in front. The first page of every slab is tagged in the pool's page state, which is how kfree() tells the two apart.
+
+extern EFI_BOOT_SERVICES *BS;
+
+#define KHEAP_SLAB_SIZE   (KHEAP_SLAB_PAGES*PMM_PAGE_SIZE)
+#define KHEAP_CLASSES     14
+#define KHEAP_LARGE_MAGIC 0x4B4C524745484450ULL
+#define KHEAP_ALIGN       16
+
+static const UINT32 kheap_sizes[KHEAP_CLASSES] = {16,32,48,64,96,128,192,256,384,512,768,1024,1536,2048};
+
+typedef struct kheap_free_t kheap_free_t;
+struct kheap_free_t {
+     kheap_free_t* next;
+};
+
+// lives at the start of the slab
+typedef struct kheap_slab_t kheap_slab_t;
+struct kheap_slab_t {
+     UINT32        size_class;
+     UINT32        obj_size;
+     UINT32        used;
+     UINT32        listed;      // on the class's list of slabs with room
+     kheap_free_t* free;
+     UINT8*        bump;        // never handed out from here on
+     UINT8*        end;
+     kheap_slab_t* prev;
+     kheap_slab_t* next;
+};
+
+typedef struct kheap_large_t {
+     UINT64 pages;
+     UINT64 magic;
+} kheap_large_t;
+
+#define KHEAP_SLAB_HEADER ((sizeof(kheap_slab_t) + KHEAP_ALIGN-1) & ~(UINTN)(KHEAP_ALIGN-1))
+
+static kheap_slab_t* kheap_partial[KHEAP_CLASSES];
+static UINT8         kheap_class_of[KHEAP_SMALL_MAX/16 + 1];  // indexed by (size+15)/16
+static int           kheap_ready = 0;
+
+volatile UINT8 kheap_lock = 0;
+
+// TPL is raised for the same reason as in k_pmm.c
+static EFI_TPL acquire_kheap_lock() {
+     return smp_lock(&kheap_lock,TPL_HIGH_LEVEL);
+}
+
+static void release_kheap_lock(EFI_TPL old_tpl) {
+     smp_unlock(&kheap_lock,old_tpl);
+}
+
+// StdLib blocks kfree()d on an AP wait here for the BSP, the firmware's pool can't be touched from anywhere else
+static void* volatile kheap_deferred = NULL;
+
+static void kheap_defer_free(void* ptr) {
+     void* head;
+     do {
+        head = kheap_deferred;
+        *(void**)ptr = head;
+     } while(!__sync_bool_compare_and_swap(&kheap_deferred,head,ptr));
+}
+
+static void kheap_free_deferred() {
+     void* p;
+     void* next;
+     if(kheap_deferred == NULL) return;
+     p = __sync_lock_test_and_set(&kheap_deferred,NULL);
+     while(p != NULL) {
+        next = *(void**)p;
+        free(p);
+        p = next;
+     }
+}
+
+void kheap_init() {
+     UINTN i;
+     UINT32 c=0;
+     for(i=0; i <= KHEAP_SMALL_MAX/16; i++) {
+         while(kheap_sizes[c] < i*16) c++;
+         kheap_class_of[i] = (UINT8)c;
+     }
+     kheap_ready = (pmm_total_pages() > 0);
+}
+
+static void kheap_list_add(kheap_slab_t* s) {
+     s->prev = NULL;
+     s->next = kheap_partial[s->size_class];
+     if(s->next != NULL) s->next->prev = s;
+     kheap_partial[s->size_class] = s;
+     s->listed = 1;
+}
+
+static void kheap_list_remove(kheap_slab_t* s) {
+     if(s->prev != NULL) s->prev->next = s->next; else kheap_partial[s->size_class] = s->next;
+     if(s->next != NULL) s->next->prev = s->prev;
+     s->listed = 0;
+}
+
+static void* kheap_small_alloc(UINTN size) {
+     UINT32 c = kheap_class_of[(size+15)/16];
+     kheap_slab_t* s;
+     void* retval=NULL;
+     EFI_TPL old_tpl;
+
+     old_tpl = acquire_kheap_lock();
+     s = kheap_partial[c];
+     while(s != NULL) {
+        if(s->free != NULL) {
+           retval  = s->free;
+           s->free = s->free->next;
+           break;
+        }
+        if(s->bump + s->obj_size <= s->end) {
+           retval   = s->bump;
+           s->bump += s->obj_size;
+           break;
+        }
+        kheap_list_remove(s); // full, back on the list once something in it is freed
+        s = kheap_partial[c];
+     }
+     if(s == NULL) {
+        s = (kheap_slab_t*)pmm_alloc_pages(KHEAP_SLAB_PAGES,KHEAP_SLAB_PAGES);
+        if(s == NULL) {
+           release_kheap_lock(old_tpl);
+           return NULL;
+        }
+        pmm_set_slab(s,1);
+        s->size_class = c;
+        s->obj_size   = kheap_sizes[c];
+        s->used       = 0;
+        s->free       = NULL;
+        s->end        = (UINT8*)s + KHEAP_SLAB_SIZE;
+        retval        = (UINT8*)s + KHEAP_SLAB_HEADER;
+        s->bump       = (UINT8*)retval + s->obj_size;
+        kheap_list_add(s);
+     }
+     s->used++;
+     release_kheap_lock(old_tpl);
+     return retval;
+}
+
+static void kheap_small_free(kheap_slab_t* s, void* ptr) {
+     kheap_free_t* f = (kheap_free_t*)ptr;
+     EFI_TPL old_tpl;
+     old_tpl = acquire_kheap_lock();
+     f->next = s->free;
+     s->free = f;
+     s->used--;
+     if(s->used == 0) {
+        if(s->listed) kheap_list_remove(s);
+        pmm_set_slab(s,0);
+        release_kheap_lock(old_tpl);
+        pmm_free_pages(s,KHEAP_SLAB_PAGES);
+        return;
+     }
+     if(!s->listed) kheap_list_add(s);
+     release_kheap_lock(old_tpl);
+}
+
+static void* kheap_large_alloc(UINTN size) {
+     UINTN pages = (size + sizeof(kheap_large_t) + PMM_PAGE_SIZE-1)/PMM_PAGE_SIZE;
+     kheap_large_t* l = (kheap_large_t*)pmm_alloc_pages(pages,1);
+     if(l == NULL) return NULL;
+     l->pages = pages;
+     l->magic = KHEAP_LARGE_MAGIC;
+     return (UINT8*)l + sizeof(kheap_large_t);
+}
+
+static kheap_slab_t* kheap_slab_of(void* ptr) {
+     kheap_slab_t* s = (kheap_slab_t*)((UINTN)ptr & ~(UINTN)(KHEAP_SLAB_SIZE-1));
+     return pmm_is_slab(s) ? s : NULL;
+}
+
+static kheap_large_t* kheap_large_of(void* ptr) {
+     return (kheap_large_t*)((UINTN)ptr & ~(UINTN)(PMM_PAGE_SIZE-1));
+}
+
+void* kmalloc(UINTN size) {
+     void* retval=NULL;
+     if(kheap_ready) {
+        if(size <= KHEAP_SMALL_MAX) {
+           retval = kheap_small_alloc(size);
+        } else if(size < ~(UINTN)0 - PMM_PAGE_SIZE) {
+           retval = kheap_large_alloc(size);
+        }
+     }
+     if(retval == NULL && smp_is_bsp()) {
+        kheap_free_deferred();
+        retval = malloc(size);
+     }
+     return retval;
+}
+
+void kfree(void* ptr) {
+     kheap_slab_t* s;
+     kheap_large_t* l;
+     if(ptr == NULL) return;
+     if(!pmm_owns(ptr)) {
+        if(!smp_is_bsp()) {
+           kheap_defer_free(ptr);
+           return;
+        }
+        kheap_free_deferred();
+        free(ptr);
+        return;
+     }
+     s = kheap_slab_of(ptr);
+     if(s != NULL) {
+        kheap_small_free(s,ptr);
+        return;
+     }
+     l = kheap_large_of(ptr);
+     if(l->magic != KHEAP_LARGE_MAGIC) {
+        klog("KHEAP",0,"kfree() of %#llx which kmalloc() never returned",(UINT64)(UINTN)ptr);
+        return;
+     }
+     l->magic = 0;
+     pmm_free_pages(l,l->pages);
+}
+
+void* krealloc(void* ptr, UINTN size) {
+     kheap_slab_t* s;
+     UINTN old_size;
+     void* retval;
+     if(ptr == NULL) return kmalloc(size);
+     if(!pmm_owns(ptr)) return smp_is_bsp() ? realloc(ptr,size) : NULL; // no telling how big it is from an AP
+     s = kheap_slab_of(ptr);
+     if(s != NULL) {
+        old_size = s->obj_size;
+     } else {
+        old_size = kheap_large_of(ptr)->pages*PMM_PAGE_SIZE - sizeof(kheap_large_t);
+     }
+     if(size <= old_size) return ptr;
+     retval = kmalloc(size);
+     if(retval == NULL) return NULL;
+     memcpy(retval,ptr,old_size);
+     kfree(ptr);
+     return retval;
+}
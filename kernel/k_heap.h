@@ -0,0 +1,18 @@
+#ifndef K_HEAP_H
+#define K_HEAP_H
+
+#include <Uefi.h>
+
+// kernel heap on top of the page pool, see k_heap.c
+// anything it can't serve (pool not set up yet or exhausted) comes from StdLib's malloc, kfree() sorts out which is which
+// on an AP there's no falling back to StdLib, kmalloc() returns NULL instead
+
+#define KHEAP_SLAB_PAGES 16        // 64KiB slabs
+#define KHEAP_SMALL_MAX  2048
+
+void  kheap_init();                // called by pmm_init() once the pool exists
+void* kmalloc(UINTN size);
+void  kfree(void* ptr);
+void* krealloc(void* ptr, UINTN size);
+
+#endif
@@ -0,0 +1,137 @@
+#include <Library/UefiBootServicesTableLib.h>
+
+#include <string.h>
+
+#include "kmsg.h"
+#include "k_sync.h"
+#include "k_heap.h"
+#include "k_pmm.h"
+#include "k_imgcache.h"
+
+// Image cache
+//
+// Every spawn used to read the program's file again, through the UEFI filesystem drivers or out of the initrd, just
+// so LoadImage() could copy and relocate it. The file contents are kept here instead, keyed by path and checked
+// against the file's size and modification time, so a repeat spawn goes straight to LoadImage() from memory.
+// LoadImage() makes its own copy, so an image is only referenced while that runs and a changed file can replace it
+// straight away. Two spawns missing on the same file at once both read it, the later copy just ages out.
+
+extern EFI_BOOT_SERVICES *BS;
+
+static imgcache_ent_t* imgcache_head  = NULL;  // most recently used first
+static imgcache_ent_t* imgcache_tail  = NULL;
+static UINT64          imgcache_bytes = 0;
+static kmutex_t        imgcache_lock  = KMUTEX_INIT;
+
+static void* imgcache_alloc(UINT64 size) {
+     UINTN pages = EFI_SIZE_TO_PAGES(size);
+     EFI_PHYSICAL_ADDRESS addr;
+     void* p = pmm_alloc_pages(pages,1);
+     if(p != NULL) return p;
+     if(EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiLoaderData,pages,&addr))) return NULL;
+     return (void*)(UINTN)addr;
+}
+
+static void imgcache_free(imgcache_ent_t* e) {
+     if(e->data != NULL && pmm_owns(e->data)) {
+        pmm_free_pages(e->data,EFI_SIZE_TO_PAGES(e->size));
+     } else if(e->data != NULL) {
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)e->data,EFI_SIZE_TO_PAGES(e->size));
+     }
+     if(e->key != NULL) kfree(e->key);
+     kfree(e);
+}
+
+// the rest of these are called with imgcache_lock held
+static void imgcache_unlink(imgcache_ent_t* e) {
+     if(e->prev) e->prev->next = e->next; else imgcache_head = e->next;
+     if(e->next) e->next->prev = e->prev; else imgcache_tail = e->prev;
+     e->prev   = NULL;
+     e->next   = NULL;
+     e->cached = 0;
+     imgcache_bytes -= e->size;
+}
+
+static void imgcache_push(imgcache_ent_t* e) {
+     e->prev = NULL;
+     e->next = imgcache_head;
+     if(imgcache_head) imgcache_head->prev = e; else imgcache_tail = e;
+     imgcache_head  = e;
+     e->cached      = 1;
+     imgcache_bytes += e->size;
+}
+
+static void imgcache_trim() {
+     imgcache_ent_t* e = imgcache_tail;
+     imgcache_ent_t* prev;
+     while(e != NULL && imgcache_bytes > IMGCACHE_MAX_BYTES) {
+        prev = e->prev;
+        if(e->refs == 0) {
+           imgcache_unlink(e);
+           imgcache_free(e);
+        }
+        e = prev;
+     }
+}
+
+imgcache_ent_t* imgcache_get(void* key, UINTN key_len, UINT64 size, UINT64 mtime, imgcache_read_t read, void* ctx, int* hit) {
+     imgcache_ent_t* e;
+     if(hit != NULL) *hit = 0;
+     if(size == 0) return NULL;
+
+     kmutex_lock(&imgcache_lock);
+     for(e=imgcache_head; e != NULL; e=e->next) {
+         if(e->key_len != key_len || memcmp(e->key,key,key_len) != 0) continue;
+         if(e->size == size && e->mtime == mtime) {
+            e->refs++;
+            imgcache_unlink(e);
+            imgcache_push(e);
+            kmutex_unlock(&imgcache_lock);
+            if(hit != NULL) *hit = 1;
+            return e;
+         }
+         // the file's changed, anyone still loading the old copy frees it when they're done
+         imgcache_unlink(e);
+         if(e->refs == 0) imgcache_free(e);
+         break;
+     }
+     kmutex_unlock(&imgcache_lock);
+
+     e = (imgcache_ent_t*)kmalloc(sizeof(imgcache_ent_t));
+     if(e == NULL) return NULL;
+     BS->SetMem((void*)e,sizeof(imgcache_ent_t),0);
+     e->key  = kmalloc(key_len);
+     e->data = imgcache_alloc(size);
+     e->size = size;
+     if(e->key == NULL || e->data == NULL) {
+        klog("IMGCACHE",0,"No memory for a %lld byte image",size);
+        imgcache_free(e);
+        return NULL;
+     }
+     memcpy(e->key,key,key_len);
+     e->key_len = key_len;
+     e->mtime   = mtime;
+     e->refs    = 1;
+     if(read(ctx,e->data,size) != 0) {
+        imgcache_free(e);
+        return NULL;
+     }
+
+     if(size <= IMGCACHE_MAX_BYTES) {
+        kmutex_lock(&imgcache_lock);
+        imgcache_push(e);
+        imgcache_trim();
+        kmutex_unlock(&imgcache_lock);
+     }
+     return e;
+}
+
+void imgcache_release(imgcache_ent_t* e) {
+     int drop;
+     kmutex_lock(&imgcache_lock);
+     e->refs--;
+     drop = e->refs == 0 && !e->cached;
+     if(!drop) imgcache_trim(); // it may have been what was keeping the cache over its limit
+     kmutex_unlock(&imgcache_lock);
+     if(drop) imgcache_free(e);
+}
@@ -0,0 +1,30 @@
+#ifndef K_IMGCACHE_H
+#define K_IMGCACHE_H
+
+#include <Uefi.h>
+
+// executable images kept in memory between spawns, see k_imgcache.c
+
+#define IMGCACHE_MAX_BYTES (32*1024*1024)   // images nobody is loading go oldest first past this
+
+typedef struct imgcache_ent_t imgcache_ent_t;
+struct imgcache_ent_t {
+     void*           data;
+     UINT64          size;
+     UINT64          mtime;             // along with size, how a changed file is noticed
+     void*           key;
+     UINTN           key_len;
+     UINTN           refs;
+     int             cached;            // on the list, otherwise freed on the last release
+     imgcache_ent_t* prev;
+     imgcache_ent_t* next;
+};
+
+typedef int (*imgcache_read_t)(void* ctx, void* buf, UINT64 size); // 0 once all size bytes are in buf
+
+// the image under key if it's still size bytes from mtime, otherwise read() fills a fresh one - NULL if that fails
+// *hit says which, release the image once LoadImage() has its own copy
+imgcache_ent_t* imgcache_get(void* key, UINTN key_len, UINT64 size, UINT64 mtime, imgcache_read_t read, void* ctx, int* hit);
+void            imgcache_release(imgcache_ent_t* img);
+
+#endif
@@ -7,19 +7,288 @@
 #include <Protocol/BlockIo.h>
 #include <Protocol/DevicePath.h>
 #include <Protocol/EfiShell.h>
+#include <Protocol/SimpleFileSystem.h>
 
 #include "kmsg.h"
+#include "k_vfs.h"
+#include "k_thread.h"
+#include "k_sync.h"
+#include "k_smp.h"
+#include "k_heap.h"
+#include "k_workq.h"
+#include "k_initrd.h"
+#include "k_lz4.h"
+#include "zinitrd.h"
+#include "vfs/tarfs.h"
+#include "k_bootprof.h"
 
 extern EFI_BOOT_SERVICES *BS;
 extern EFI_HANDLE gImageHandle;
 
-void* initrd_buf;
+void*  initrd_buf;
+UINT64 initrd_buf_size=0;   // size of the image file as read from the boot volume
+UINT64 initrd_image_size=0; // size of the filesystem image, after decompression if the file is compressed
+
+// set if the image file is a compressed zinitrd, see zinitrd.h
+zinitrd_header_t* initrd_zhdr=NULL;
+UINT64*           initrd_zoffsets=NULL;
+
+// the image is streamed in by initrd_stream_task() after the first chunk, anything past initrd_loaded is not there yet
+volatile UINT64 initrd_loaded=0;
+volatile int    initrd_stream_failed=0;
+
+// readers waiting in initrd_wait() sleep here, initrd_stream_seq moves every time the stream makes progress or fails
+static kwaitq_t        initrd_stream_waitq = KWAITQ_INIT;
+static volatile UINT64 initrd_stream_seq=0;
+
+EFI_FILE_PROTOCOL  *initrd_file=NULL;
+EFI_SHELL_PROTOCOL *initrd_shell=NULL;
 
 EFI_BLOCK_IO_PROTOCOL    initrd_proto;
 EFI_BLOCK_IO_MEDIA       initrd_media;
 EFI_HANDLE               *initrd_handle=NULL;
 
-#define INITRD_BLOCKSIZE 512
+#define INITRD_BLOCKSIZE  512
+#define INITRD_CHUNK_SIZE (1024*1024) // bytes per read request to the boot volume
+#define INITRD_PROG_STEPS 32          // progress bar updates over the whole image
+
+#define INITRD_ZCACHE_SLOTS  8               // decompressed chunks kept in memory
+#define INITRD_ZCHUNK_MAX    (4*1024*1024)
+
+typedef struct initrd_zslot_t {
+     UINT32 chunk;
+     UINT64 last_used;
+     UINT8* data;
+} initrd_zslot_t;
+
+static initrd_zslot_t initrd_zcache[INITRD_ZCACHE_SLOTS];
+static UINT64         initrd_zcache_clock=0;
+volatile UINT8        initrd_zcache_lock=0;
+
+// InitRDReadBlocks() takes this at TPL_CALLBACK, so holders must be safe from the tick too or it spins on a holder
+// that never gets to run again
+static EFI_TPL acquire_zcache_lock() {
+     return smp_lock(&initrd_zcache_lock,TPL_NOTIFY);
+}
+
+static void release_zcache_lock(EFI_TPL old_tpl) {
+     smp_unlock(&initrd_zcache_lock,old_tpl);
+}
+
+UINT64 initrd_size() {
+     return initrd_image_size;
+}
+
+// called by the stream after initrd_loaded or initrd_stream_failed changes
+static void initrd_stream_signal() {
+     __sync_fetch_and_add(&initrd_stream_seq,1);
+     kwaitq_wake_all(&initrd_stream_waitq);
+}
+
+// block until the first end bytes of the image are in memory, returns 0 if they never will be
+int initrd_wait(UINT64 end) {
+     UINT64 seq;
+     if(end > initrd_buf_size) return 0; // never arriving, and nothing would wake us once the stream was done
+     while(initrd_loaded < end) {
+        seq = initrd_stream_seq;
+        __sync_synchronize(); // sample seq before the state it guards, so a signal in between isn't lost
+        if(initrd_loaded >= end) break;
+        if(initrd_stream_failed) return 0;
+        // can't sleep before the scheduler is up or at raised TPL, fall back to yielding there
+        if(!kwaitq_wait_on(&initrd_stream_waitq,&initrd_stream_seq,seq) && initrd_stream_seq == seq) thread_yield();
+     }
+     return 1;
+}
+
+void* initrd_map(UINT64 offset, UINT64 len) {
+     if(initrd_buf == NULL || initrd_zhdr != NULL) return NULL;
+     if(offset > initrd_buf_size || len > initrd_buf_size - offset) return NULL;
+     if(!initrd_wait(offset+len)) return NULL;
+     return initrd_buf + offset;
+}
+
+static UINT64 initrd_zchunk_len(UINT32 chunk) {
+     UINT64 start = (UINT64)chunk * initrd_zhdr->chunk_size;
+     UINT64 len   = initrd_image_size - start;
+     if(len > initrd_zhdr->chunk_size) len = initrd_zhdr->chunk_size;
+     return len;
+}
+
+// decompress a whole chunk into dst, returns 0 on success - caller must have waited for the chunk to arrive
+static int initrd_zchunk_into(UINT32 chunk, UINT8* dst) {
+     UINT64 start   = initrd_zoffsets[chunk];
+     UINT64 end     = initrd_zoffsets[chunk+1];
+     UINT64 raw_len = initrd_zchunk_len(chunk);
+     if(start > end || end > initrd_buf_size || end-start > raw_len) {
+        klog("INITRD",0,"Corrupt chunk %d in compressed image",chunk);
+        return 1;
+     } else if(end-start == raw_len) {
+        memcpy(dst,initrd_buf+start,raw_len);
+     } else if(lz4_decompress(initrd_buf+start,end-start,dst,raw_len) != raw_len) {
+        klog("INITRD",0,"Corrupt chunk %d in compressed image",chunk);
+        return 1;
+     }
+     return 0;
+}
+
+// returns the decompressed data for a chunk, caller must hold the cache lock and have waited for the chunk to arrive
+static UINT8* initrd_zchunk(UINT32 chunk) {
+     initrd_zslot_t* slot = &initrd_zcache[0];
+     int i;
+     for(i=0; i<INITRD_ZCACHE_SLOTS; i++) {
+         if(initrd_zcache[i].chunk == chunk) {
+            initrd_zcache[i].last_used = ++initrd_zcache_clock;
+            return initrd_zcache[i].data;
+         }
+         if(initrd_zcache[i].last_used < slot->last_used) slot = &initrd_zcache[i];
+     }
+
+     slot->last_used = ++initrd_zcache_clock;
+     if(initrd_zchunk_into(chunk,slot->data) != 0) {
+        slot->chunk = (UINT32)-1;
+        return NULL;
+     }
+     slot->chunk = chunk;
+     return slot->data;
+}
+
+// a whole chunk of a long read, decompressed straight into the reader's buffer by a kernel worker
+typedef struct initrd_zjob_t {
+     kwork_t       work;
+     UINT32        chunk;
+     UINT8*        dst;
+     ksem_t*       done;
+     volatile int* failed;
+} initrd_zjob_t;
+
+static void initrd_zjob_run(void* arg) {
+     initrd_zjob_t* job = (initrd_zjob_t*)arg;
+     if(initrd_zchunk_into(job->chunk,job->dst) != 0) *(job->failed) = 1;
+     ksem_post(job->done);
+}
+
+// copy part of the filesystem image into buf, decompressing as needed - returns 0 on success
+// parallel is 0 for callers that may be at raised TPL, where nothing would get a worker in to finish the job
+static int initrd_read_at(UINT64 offset, void* buf, UINT64 len, int parallel) {
+     if(initrd_buf == NULL) return 1;
+     if(offset > initrd_image_size || len > initrd_image_size - offset) return 1;
+     if(initrd_zhdr == NULL) {
+        void* src = initrd_map(offset,len);
+        if(src == NULL) return 1;
+        memcpy(buf,src,len);
+        return 0;
+     }
+
+     UINT32 chunk;
+     UINT64 in_chunk;
+     UINT64 n;
+     UINT8* data;
+     int    retval = 0;
+     EFI_TPL old_tpl;
+
+     // chunks the read covers completely skip the cache and are decompressed in place, in parallel on the work
+     // queue - the last one is kept back and done here while the workers get on with the rest
+     UINT32         first  = offset / initrd_zhdr->chunk_size;
+     UINT32         last   = (offset+len-1) / initrd_zhdr->chunk_size;
+     initrd_zjob_t* jobs   = parallel && last > first+1 ? (initrd_zjob_t*)kmalloc(sizeof(initrd_zjob_t)*(last-first+1)) : NULL;
+     UINTN          queued = 0;
+     ksem_t         done   = KSEM_INIT(0);
+     volatile int   failed = 0;
+     UINT32         mine   = (UINT32)-1;
+     UINT8*         mine_dst = NULL;
+
+     while(len > 0) {
+        chunk    = offset / initrd_zhdr->chunk_size;
+        in_chunk = offset % initrd_zhdr->chunk_size;
+        n        = initrd_zchunk_len(chunk) - in_chunk;
+        if(n > len) n = len;
+        if(!initrd_wait(initrd_zoffsets[chunk+1])) {
+           retval = 1;
+           break;
+        }
+
+        if(jobs != NULL && in_chunk == 0 && n == initrd_zchunk_len(chunk)) {
+           if(mine != (UINT32)-1) {
+              initrd_zjob_t* job = &jobs[queued++];
+              job->chunk  = mine;
+              job->dst    = mine_dst;
+              job->done   = &done;
+              job->failed = &failed;
+              kwork_init(&job->work,initrd_zjob_run,job);
+              kwork_queue(&job->work);
+           }
+           mine     = chunk;
+           mine_dst = buf;
+        } else {
+           old_tpl = acquire_zcache_lock();
+           data = initrd_zchunk(chunk);
+           if(data != NULL) memcpy(buf,data+in_chunk,n);
+           release_zcache_lock(old_tpl);
+           if(data == NULL) {
+              retval = 1;
+              break;
+           }
+        }
+
+        buf    += n;
+        offset += n;
+        len    -= n;
+     }
+
+     if(mine != (UINT32)-1 && retval == 0 && initrd_zchunk_into(mine,mine_dst) != 0) retval = 1;
+     while(queued > 0) { // the jobs live in our array, so wait for every one of them even if we've failed
+        ksem_wait(&done);
+        queued--;
+     }
+     if(failed) retval = 1;
+     if(jobs != NULL) kfree(jobs);
+     return retval;
+}
+
+int initrd_read(UINT64 offset, void* buf, UINT64 len) {
+     return initrd_read_at(offset,buf,len,1);
+}
+
+// called once the start of the image file is in memory, sets up decompression if the file is a zinitrd
+static int initrd_probe_compressed() {
+     zinitrd_header_t* hdr = (zinitrd_header_t*)initrd_buf;
+     UINT64* offsets;
+     UINT64 table_end;
+     UINT64 i;
+
+     initrd_image_size = initrd_buf_size;
+     if(initrd_buf_size < sizeof(zinitrd_header_t) || memcmp(hdr->magic,ZINITRD_MAGIC,4) != 0) return 0;
+
+     table_end = sizeof(zinitrd_header_t) + ((UINT64)hdr->chunk_count+1)*sizeof(UINT64);
+     if(hdr->chunk_size == 0 || hdr->chunk_size > INITRD_ZCHUNK_MAX ||
+        hdr->chunk_count != (hdr->image_size + hdr->chunk_size-1) / hdr->chunk_size ||
+        table_end > initrd_buf_size) {
+        klog("INITRD",0,"Compressed image has a bad header");
+        return 1;
+     }
+     // readers wait for a chunk's end offset to stream in, so every one has to be somewhere the stream will reach
+     offsets = (UINT64*)(initrd_buf + sizeof(zinitrd_header_t));
+     for(i=0; i<=hdr->chunk_count; i++) {
+         if(offsets[i] < (i == 0 ? table_end : offsets[i-1]) || offsets[i] > initrd_buf_size) {
+            klog("INITRD",0,"Compressed image has a bad chunk table at entry %lld",i);
+            return 1;
+         }
+     }
+     for(i=0; i<INITRD_ZCACHE_SLOTS; i++) {
+         initrd_zcache[i].chunk     = (UINT32)-1;
+         initrd_zcache[i].last_used = 0;
+         initrd_zcache[i].data      = (UINT8*)malloc(hdr->chunk_size);
+         if(initrd_zcache[i].data == NULL) {
+            klog("INITRD",0,"Failed to allocate decompression cache");
+            return 1;
+         }
+     }
+     initrd_zhdr       = hdr;
+     initrd_zoffsets   = offsets;
+     initrd_image_size = hdr->image_size;
+     klog("INITRD",1,"Compressed image, %lld bytes in %d chunks of %d",hdr->image_size,hdr->chunk_count,hdr->chunk_size);
+     return 0;
+}
 
 EFI_STATUS EFIAPI InitRDReadBlocks(
 	IN EFI_BLOCK_IO *This,
@@ -28,7 +297,6 @@ EFI_STATUS EFIAPI InitRDReadBlocks(
 	IN UINTN        BufferSize,
 	OUT VOID        *Buffer)
 {
-	void* block_ptr;
 	EFI_BLOCK_IO_MEDIA *Media = This->Media;
   if(BufferSize % Media->BlockSize != 0)
                 return EFI_BAD_BUFFER_SIZE;
@@ -40,8 +308,8 @@ EFI_STATUS EFIAPI InitRDReadBlocks(
                 return EFI_DEVICE_ERROR;
 
 
-        block_ptr = initrd_buf + MultU64x32(LBA,INITRD_BLOCKSIZE);
-	memcpy(Buffer,block_ptr,BufferSize);
+        if(initrd_read_at(MultU64x32(LBA,INITRD_BLOCKSIZE),Buffer,BufferSize,0) != 0)
+                return EFI_DEVICE_ERROR;
 	return EFI_SUCCESS;
 }
 
@@ -84,45 +352,24 @@ RAM_DISK_DEVICE_PATH initrd_devpath_proto =
 };
 
 
-int mount_initrd(char* path) {
-     klog("INITRD",1,"Opening image in %s",path);
-     FILE* fd = fopen(path,"rb");
-     if(fd==NULL) {
-        klog("INITRD",0,"Failed to open initrd image");
-        return 1;
+// reads the next chunk of the image, returns the number of bytes read or 0 on error
+static UINTN initrd_read_chunk() {
+     UINTN len = INITRD_CHUNK_SIZE;
+     if(len > initrd_buf_size - initrd_loaded) len = initrd_buf_size - initrd_loaded;
+     EFI_STATUS s = initrd_file->Read(initrd_file,&len,initrd_buf + initrd_loaded);
+     if(EFI_ERROR(s) || len == 0) {
+        klog("INITRD",0,"Read error at offset %lld: %d",initrd_loaded,s);
+        return 0;
      }
-     fseek(fd,0,SEEK_END);
-     long size = ftell(fd);
-     klog("INITRD",1,"Image is %d bytes long",size);
-     fseek(fd,0,SEEK_SET);
-     fclose(fd);
-     fd = fopen(path,"rb");
-     
-     initrd_buf = malloc(size+1);
-     if(initrd_buf == NULL) {
-        klog("INITRD",0,"Failed to allocate memory buffer for initrd image");
-        fclose(fd);
-        return 1;
-     }
-
-     klog("INITRD",KLOG_PROG,"Reading image into memory");
-     kmsg_prog_start(size);
-
-     void* cur_buf = initrd_buf; 
-     int i=0;
-     size_t retval=0;
-     size_t read_so_far=0;
-     while(read_so_far < size) {
-         retval = fread(cur_buf,512,8,fd);
-         if(retval != EOF) {
-            cur_buf     += retval*512;
-            read_so_far += retval*512;
-            kmsg_prog_update(retval*512);
-         }
-     }
-    
-     fclose(fd);
+     __sync_synchronize(); // data must land before the watermark moves
+     initrd_loaded += len;
+     return len;
+}
 
+// install the block device and have the UEFI FAT driver bind to it, so images can be loaded from initrd:
+// this has to wait until the whole image is resident - the FAT driver holds a global lock while reading blocks and
+// blocking in there for the stream would deadlock against the stream's own reads from the boot volume
+static int initrd_install_blockio() {
      klog("INITRD",1,"Installing block I/O protocol");
 
      initrd_proto.Revision = EFI_BLOCK_IO_INTERFACE_REVISION;
@@ -135,14 +382,11 @@ int mount_initrd(char* path) {
      initrd_media.RemovableMedia   = FALSE;
      initrd_media.MediaPresent     = TRUE;
      initrd_media.BlockSize        = INITRD_BLOCKSIZE;
-     initrd_media.LastBlock        = size/INITRD_BLOCKSIZE - 1;
+     initrd_media.LastBlock        = initrd_image_size/INITRD_BLOCKSIZE - 1;
      initrd_media.LogicalPartition = TRUE;
      initrd_media.ReadOnly         = TRUE;
      initrd_media.WriteCaching     = FALSE;
 
-
-
-
      EFI_STATUS s=BS->InstallProtocolInterface(&initrd_handle,
                                              &gEfiBlockIoProtocolGuid,
                                              EFI_NATIVE_INTERFACE,
@@ -160,12 +404,62 @@ int mount_initrd(char* path) {
        return 1;
      }
 
-     EFI_SHELL_PROTOCOL *shell_proto;
+     UINTN HandleCount;
+     EFI_HANDLE *HandleBuffer;
+     UINTN HandleIndex;
+     UINTN sweep = bootprof_begin("connect all handles","initrd");
+     s = BOOTPROF_FW("LocateHandleBuffer",BS->LocateHandleBuffer(AllHandles,NULL,NULL,&HandleCount,&HandleBuffer));
+     for(HandleIndex=0; HandleIndex < HandleCount; HandleIndex++) {
+         BOOTPROF_FW("ConnectController",BS->ConnectController(HandleBuffer[HandleIndex],NULL,NULL,TRUE));
+     }
+     BS->FreePool(HandleBuffer);
+     bootprof_end(sweep);
+
+
+      s = BOOTPROF_FW("SetMap",initrd_shell->SetMap(&initrd_devpath_proto,L"initrd:"));
+      if(EFI_ERROR(s)) {
+         klog("INITRD",0,"SetMap failed: %d",s);
+         return 1;
+      }
+      return 0;
+}
+
+void initrd_stream_task(void* _t) {
+     UINT64 prog_step    = initrd_buf_size / INITRD_PROG_STEPS;
+     UINT64 prog_pending = 0;
+     UINTN len;
+     while(initrd_loaded < initrd_buf_size) {
+        len = initrd_read_chunk();
+        if(len == 0) {
+           initrd_stream_failed = 1;
+           initrd_stream_signal();
+           break;
+        }
+        initrd_stream_signal();
+        prog_pending += len;
+        if(prog_pending >= prog_step || initrd_loaded == initrd_buf_size) {
+           kmsg_prog_update(prog_pending);
+           prog_pending = 0;
+        }
+     }
+     initrd_shell->CloseFile((SHELL_FILE_HANDLE)initrd_file);
+     initrd_file = NULL;
+     if(initrd_stream_failed) {
+        klog("INITRD",0,"Failed to read initrd image, %lld of %lld bytes loaded",initrd_loaded,initrd_buf_size);
+        return;
+     }
+     if(!tarfs_probe()) initrd_install_blockio(); // the UEFI FAT driver can't do anything with an archive
+}
+
+// opens the image and takes its buffer from the firmware, the rest is left to mount_initrd()
+// the buffer is one contiguous allocation bigger than the page pool's largest block, so this runs before pmm_init()
+int initrd_open(char* path) {
+     klog("INITRD",1,"Opening image in %s",path);
 
-     s = BS->OpenProtocol(
+     EFI_STATUS s = BS->OpenProtocol(
             gImageHandle,
             &gEfiShellProtocolGuid,
-            &shell_proto,
+            &initrd_shell,
             gImageHandle,
             NULL,
             EFI_OPEN_PROTOCOL_GET_PROTOCOL
@@ -174,25 +468,90 @@ int mount_initrd(char* path) {
         s = gBS->LocateProtocol(
                 &gEfiShellProtocolGuid,
                 NULL,
-                &shell_proto
+                &initrd_shell
                 );
       }
+     if(EFI_ERROR(s)) {
+        klog("INITRD",0,"Could not locate shell protocol");
+        return 1;
+     }
 
+     CHAR16 wpath[PATH_MAX];
+     mbstowcs(wpath,path,PATH_MAX);
+     SHELL_FILE_HANDLE fh;
+     s = initrd_shell->OpenFileByName(wpath,&fh,EFI_FILE_MODE_READ);
+     if(EFI_ERROR(s)) {
+        klog("INITRD",0,"Failed to open initrd image");
+        return 1;
+     }
+     initrd_file = (EFI_FILE_PROTOCOL*)fh; // shell file handles are EFI_FILE_PROTOCOL instances
+
+     UINT64 size=0;
+     initrd_shell->GetFileSize(fh,&size);
+     klog("INITRD",1,"Image is %lld bytes long",size);
+     if(size < INITRD_BLOCKSIZE) {
+        klog("INITRD",0,"Image is too small");
+        initrd_shell->CloseFile(fh);
+        return 1;
+     }
 
-     UINTN HandleCount;
-     EFI_HANDLE *HandleBuffer;
-     UINTN HandleIndex;
-     s = BS->LocateHandleBuffer(AllHandles,NULL,NULL,&HandleCount,&HandleBuffer);
-     for(HandleIndex=0; HandleIndex < HandleCount; HandleIndex++) {
-         BS->ConnectController(HandleBuffer[HandleIndex],NULL,NULL,TRUE);
+     EFI_PHYSICAL_ADDRESS addr;
+     s = BS->AllocatePages(AllocateAnyPages,EfiLoaderData,EFI_SIZE_TO_PAGES(size),&addr);
+     if(EFI_ERROR(s)) {
+        klog("INITRD",0,"Failed to allocate memory buffer for initrd image");
+        initrd_shell->CloseFile(fh);
+        return 1;
      }
-     BS->FreePool(HandleBuffer);
+     initrd_buf      = (void*)(UINTN)addr;
+     initrd_buf_size = size;
+     return 0;
+}
 
+int mount_initrd() {
+     SHELL_FILE_HANDLE fh = (SHELL_FILE_HANDLE)initrd_file;
+     UINT64 size          = initrd_buf_size;
+     if(initrd_buf == NULL) return 1; // initrd_open() said why
 
-      s = shell_proto->SetMap(&initrd_devpath_proto,L"initrd:");
-      if(EFI_ERROR(s)) {
-         klog("INITRD",0,"SetMap failed: %d",s);
-         return 1;
-      }
-      return 0;
+     klog("INITRD",KLOG_PROG,"Reading image into memory");
+     kmsg_prog_start(size);
+
+     // the first chunk holds the filesystem metadata, so read it before anything else gets a chance to look
+     UINTN len = initrd_read_chunk();
+     if(len == 0) {
+        initrd_shell->CloseFile(fh);
+        return 1;
+     }
+     kmsg_prog_update(len);
+
+     // a compressed image needs its whole chunk table up front
+     if(initrd_buf_size >= sizeof(zinitrd_header_t) && memcmp(initrd_buf,ZINITRD_MAGIC,4)==0) {
+        UINT64 table_end = sizeof(zinitrd_header_t) + ((UINT64)((zinitrd_header_t*)initrd_buf)->chunk_count+1)*sizeof(UINT64);
+        while(initrd_loaded < table_end && initrd_loaded < initrd_buf_size) {
+           len = initrd_read_chunk();
+           if(len == 0) {
+              initrd_shell->CloseFile(fh);
+              return 1;
+           }
+           kmsg_prog_update(len);
+        }
+     }
+     if(initrd_probe_compressed() != 0) {
+        initrd_shell->CloseFile(fh);
+        return 1;
+     }
+
+     // the rest streams in behind early mounts and init, readers block on data that hasn't arrived yet
+     int streaming = initrd_loaded < initrd_buf_size;
+     if(streaming) init_kernel_task(&initrd_stream_task,NULL);
+
+     int is_archive = tarfs_probe();
+     vfs_umount(NULL,"/");
+     vfs_simple_mount(is_archive ? "tarfs" : "initrdfs","/dev/uefi/initrd","/");
+
+     if(!streaming) {
+        initrd_shell->CloseFile(fh);
+        initrd_file = NULL;
+        if(!is_archive) return initrd_install_blockio();
+     }
+     return 0;
 }
@@ -1,6 +1,15 @@
 #ifndef K_INITRD_H
 #define K_INITRD_H
 
-int mount_initrd(char* path);
+#include <Uefi.h>
+
+int initrd_open(char* path); // before pmm_init(), takes the image's buffer from the firmware
+int mount_initrd();          // reads the image opened by initrd_open() and mounts it on /
+
+// direct access to the resident initrd image for in-kernel filesystem drivers
+// offsets are into the filesystem image, i.e after decompression if the initrd is compressed
+UINT64 initrd_size();
+int    initrd_read(UINT64 offset, void* buf, UINT64 len); // returns 0 on success
+void*  initrd_map(UINT64 offset, UINT64 len); // returns NULL if the range is outside the image or the image is compressed
 
 #endif
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "k_lz4.h"
+
+// LZ4 block format decoder, see https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// every length and offset is checked against both buffers, a corrupt image can't write outside dst
+
+INTN lz4_decompress(UINT8* src, UINTN src_len, UINT8* dst, UINTN dst_len) {
+     UINT8* ip   = src;
+     UINT8* iend = src + src_len;
+     UINT8* op   = dst;
+     UINT8* oend = dst + dst_len;
+     UINT8* match;
+     UINTN  len;
+     UINTN  offset;
+     UINT8  token;
+     UINT8  b;
+
+     while(ip < iend) {
+        token = *ip++;
+
+        len = token >> 4;
+        if(len == 15) {
+           do {
+              if(ip >= iend) return -1;
+              b    = *ip++;
+              len += b;
+           } while(b == 255);
+        }
+        if(len > (UINTN)(iend-ip) || len > (UINTN)(oend-op)) return -1;
+        memcpy(op,ip,len);
+        op += len;
+        ip += len;
+
+        if(ip == iend) break; // the last sequence is literals only
+
+        if(iend-ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip    += 2;
+        if(offset == 0 || offset > (UINTN)(op-dst)) return -1;
+
+        len = token & 15;
+        if(len == 15) {
+           do {
+              if(ip >= iend) return -1;
+              b    = *ip++;
+              len += b;
+           } while(b == 255);
+        }
+        len += 4;
+        if(len > (UINTN)(oend-op)) return -1;
+
+        match = op - offset;
+        while(len--) *op++ = *match++; // byte by byte, matches may overlap the output
+     }
+     return op - dst;
+}
@@ -0,0 +1,9 @@
+#ifndef K_LZ4_H
+#define K_LZ4_H
+
+#include <Uefi.h>
+
+// decompress a single LZ4 block, returns the decompressed size or -1 if the block is corrupt or too big for dst
+INTN lz4_decompress(UINT8* src, UINTN src_len, UINT8* dst, UINTN dst_len);
+
+#endif
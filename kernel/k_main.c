@@ -26,6 +26,13 @@
 #include "k_utsname.h"
 #include "k_video.h"
 #include "k_syscalls.h"
+#include "k_pmm.h"
+#include "k_stack.h"
+#include "k_smp.h"
+#include "k_workq.h"
+#include "k_dbgsink.h"
+#include "k_bootprof.h"
+#include "k_bench.h"
 
 EFI_SYSTEM_TABLE *ST;
 EFI_BOOT_SERVICES *BS;
@@ -34,9 +41,10 @@ extern EFI_HANDLE gImageHandle;
 
 void idle_task(void* _t) {
      klog("IDLE",1,"Kernel idle task started");
+     thread_set_idle(); // the BSP's, only runs when nothing else can
      for(;;) {
-         __asm__("hlt");
-//         BS->Stall(100000);
+         thread_idle_wait();
+         thread_yield(); // whatever interrupt got us out of hlt may have made something runnable, the tick may be off
      }
 }
 
@@ -44,8 +52,6 @@ void idle_task(void* _t) {
 
 char* argv0; // this needs to be exported for the sake of the VFS module
 
-extern task_def_t* tasks;
-
 void userland_init(void* arg) {
      // this is a bit of a cheat (directly invoking a syscall function) - will need to use inline asm later
      char* argv[]={"/sbin/init",NULL};
@@ -54,30 +60,57 @@ void userland_init(void* arg) {
      sys_execve("initrd:/sbin/init",argv,env);
 }
 
+// listing / has tarfs index the whole archive, which would hold the boot up until the initrd had streamed in
+static void dump_vfs_work(void* arg) {
+     dump_vfs();
+}
+
 int main(int argc, char** argv) {
 
+    bootprof_start();
+
     ST = gST;
     BS = ST->BootServices;
     RT = ST->RuntimeServices;
 
-    init_static_kmsg();
+    smp_init_bsp();
 
     int i;
 
     char* initrd_path = NULL;
     char* vgamode     = NULL;
+    char* bench_list  = NULL;
+
+    // the initrd buffer is bigger than anything the page pool hands out, so it's taken before pmm_init() claims memory
+    bootprof_phase("initrd_open");
+    for(i=1; i<argc; i++) {
+        if(strncmp(argv[i],"initrd=",7)==0) initrd_path = argv[i]+7;
+    }
+    if(initrd_path != NULL) initrd_open(initrd_path);
+
+    bootprof_phase("pmm_init");
+    pmm_init();
+
+    bootprof_phase("cmdline");
 
     argv0 = argv[0];
     if(argc>1) {
        for(i=1; i<argc; i++) {
-           if(strncmp(argv[i],"initrd=",7)==0) {
-              initrd_path = argv[i]+7;
-           } else if(strncmp(argv[i], "vgamode=",8)==0) {
+           if(strncmp(argv[i], "vgamode=",8)==0) {
               vgamode = argv[i]+8;
+           } else if(strncmp(argv[i], "tick=",5)==0) {
+              thread_set_tick(strtoull(argv[i]+5,NULL,10)); // microseconds
+           } else if(strcmp(argv[i], "klog=binary")==0) {
+              kmsg_set_binary();
+           } else if(strncmp(argv[i], "debug=",6)==0) {
+              dbgsink_select(argv[i]+6);
+           } else if(strncmp(argv[i], "bench=",6)==0) {
+              bench_list = argv[i]+6;
            }
        }
     }
 
+    bootprof_phase("init_video");
     init_video(vgamode);
     ST->ConOut->ClearScreen(ST->ConOut);
 
@@ -89,45 +122,67 @@ int main(int argc, char** argv) {
     kprintf("\t\t%s %s %s %s\n",zoidberg_uname.sysname, zoidberg_uname.release, zoidberg_uname.version, zoidberg_uname.machine);
     kprintf("\t\t%s entry point located at %#11x\n\n\n\n", argv0, (UINT64)main);
 
+    bootprof_phase("draw_logo");
     draw_logo();
 
+    bootprof_phase("init_console");
     init_console();
  
-    init_dynamic_kmsg();
-
+    bootprof_phase("cpu_proto_init");
     cpu_proto_init();
 
+    bootprof_phase("kstack_init");
+    kstack_init();
+
+    bootprof_phase("smp_init");
+    smp_init();
+
+    bootprof_phase("vfs_init");
     vfs_init(); 
 
+    bootprof_phase("mount_initrd");
+
     if(initrd_path==NULL) {
        klog("INITRD",0,"No initrd= option specified!");
        klog("INITRD",0,"Can not continue without a valid initrd.img, startup aborted!");
        return;
     } else {
-       if (mount_initrd(initrd_path) != 0) {
+       if (mount_initrd() != 0) {
            klog("INITRD",0,"Startup aborted!");
            return;
        }
     }
 
-    dump_vfs();
+    bootprof_phase("scheduler_start");
 
     klog("UEFI",1,"Disabling watchdog");
     BS->SetWatchdogTimer(0, 0, 0, NULL);
 
     klog("TASKING",1,"Starting multitasking");
     scheduler_start();
+    kmsg_start_drain();
+
+    bootprof_phase("kworkq_init");
+    kworkq_init();
+    kwork_submit(&dump_vfs_work,NULL);
+
+    bootprof_phase("idle_task");
 
     klog("TASKING",1,"Spawning kernel idle task");
     init_kernel_task(&idle_task,NULL);
     BS->Stall(1000);
 
+    bootprof_finish();
     
     klog("INIT",1,"Starting PID 1 /sbin/init");
 
   //  system("fs0:\\EFI\\BOOT\\BOOTX64.efi -nostartup -nomap");
  
-    req_task(&userland_init,NULL);
+    if(bench_list != NULL) {
+       bench_boot(bench_list,&userland_init); // PID 1 waits for the benchmarks
+    } else {
+       req_task(&userland_init,NULL);
+    }
     while(1) {
        init_tasks();
     }
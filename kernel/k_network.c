@@ -14,7 +14,6 @@ EFI_HANDLE netHandle;
 
 EFI_SIMPLE_NETWORK *simple_net = NULL;
 
-extern char *kmsg;
 
 
 void configure_net_dhcp() {
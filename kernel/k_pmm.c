@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "kmsg.h"
+#include "k_pmm.h"
+#include "k_heap.h"
+#include "k_smp.h"
+
+// Physical page allocator
+//
+// At startup the biggest stretches of conventional memory in the UEFI memory map are claimed with AllocatePages() and
+// handed to a buddy allocator, leaving a quarter (and at least PMM_FIRMWARE_MIN pages) to the firmware so StdLib's
+// malloc, LoadImage() and so on keep working. Free blocks are linked through their own first bytes, the only other
+// bookkeeping is a byte of state per page.
+
+extern EFI_BOOT_SERVICES *BS;
+
+typedef struct pmm_free_t pmm_free_t;
+struct pmm_free_t {
+     pmm_free_t* prev;
+     pmm_free_t* next;
+};
+
+static pmm_region_t pmm_regions[PMM_MAX_REGIONS];
+static int          pmm_region_count = 0;
+static pmm_free_t*  pmm_free_lists[PMM_MAX_ORDER+1];
+static UINTN        pmm_pages_total  = 0;
+static UINTN        pmm_pages_free   = 0;
+
+volatile UINT8 pmm_lock = 0;
+
+// the timer is held off while the lock is taken, dmthread frees memory from inside the scheduler and would spin
+// forever on a lock held by the thread it preempted
+static EFI_TPL acquire_pmm_lock() {
+     return smp_lock(&pmm_lock,TPL_HIGH_LEVEL);
+}
+
+static void release_pmm_lock(EFI_TPL old_tpl) {
+     smp_unlock(&pmm_lock,old_tpl);
+}
+
+static pmm_region_t* pmm_region_of(EFI_PHYSICAL_ADDRESS addr) {
+     int i;
+     for(i=0; i < pmm_region_count; i++) {
+         if(addr >= pmm_regions[i].base && addr < pmm_regions[i].base + pmm_regions[i].pages*PMM_PAGE_SIZE) {
+            return &(pmm_regions[i]);
+         }
+     }
+     return NULL;
+}
+
+static pmm_free_t* pmm_page(pmm_region_t* r, UINTN idx) {
+     return (pmm_free_t*)(UINTN)(r->base + idx*PMM_PAGE_SIZE);
+}
+
+static void pmm_list_push(UINTN order, pmm_free_t* b) {
+     b->prev = NULL;
+     b->next = pmm_free_lists[order];
+     if(b->next != NULL) b->next->prev = b;
+     pmm_free_lists[order] = b;
+}
+
+static void pmm_list_remove(UINTN order, pmm_free_t* b) {
+     if(b->prev != NULL) b->prev->next = b->next; else pmm_free_lists[order] = b->next;
+     if(b->next != NULL) b->next->prev = b->prev;
+}
+
+// frees one block, merging it with its buddy for as long as the buddy is free too
+static void pmm_free_block(pmm_region_t* r, UINTN idx, UINTN order) {
+     UINTN buddy;
+     while(order < PMM_MAX_ORDER) {
+        buddy = idx ^ ((UINTN)1 << order);
+        if(buddy + ((UINTN)1 << order) > r->pages) break;
+        if(r->state[buddy] != (PMM_STATE_FREE|order)) break;
+        pmm_list_remove(order,pmm_page(r,buddy));
+        r->state[buddy] = PMM_STATE_TAIL;
+        r->state[idx]   = PMM_STATE_TAIL;
+        idx &= ~((UINTN)1 << order);
+        order++;
+     }
+     r->state[idx] = PMM_STATE_FREE|order;
+     pmm_list_push(order,pmm_page(r,idx));
+}
+
+// frees an arbitrary run of pages as the biggest aligned blocks that fit
+static void pmm_free_range(pmm_region_t* r, UINTN idx, UINTN count) {
+     UINTN order;
+     pmm_pages_free += count;
+     while(count > 0) {
+        order = 0;
+        while(order < PMM_MAX_ORDER && (idx & ((UINTN)1 << order)) == 0 && ((UINTN)2 << order) <= count) order++;
+        pmm_free_block(r,idx,order);
+        idx   += (UINTN)1 << order;
+        count -= (UINTN)1 << order;
+     }
+}
+
+void* pmm_alloc_pages(UINTN pages, UINTN align_pages) {
+     pmm_region_t* r;
+     pmm_free_t* b;
+     UINTN want;
+     UINTN order;
+     UINTN o;
+     UINTN idx;
+     EFI_TPL old_tpl;
+
+     if(pages == 0) return NULL;
+     if(align_pages == 0) align_pages = 1;
+     want  = (pages > align_pages) ? pages : align_pages;
+     order = 0;
+     while(((UINTN)1 << order) < want) order++;
+     if(order > PMM_MAX_ORDER) return NULL;
+
+     old_tpl = acquire_pmm_lock();
+     for(o=order; o <= PMM_MAX_ORDER; o++) {
+         if(pmm_free_lists[o] != NULL) break;
+     }
+     if(o > PMM_MAX_ORDER) {
+        release_pmm_lock(old_tpl);
+        return NULL;
+     }
+     b = pmm_free_lists[o];
+     pmm_list_remove(o,b);
+     r   = pmm_region_of((EFI_PHYSICAL_ADDRESS)(UINTN)b);
+     idx = ((EFI_PHYSICAL_ADDRESS)(UINTN)b - r->base)/PMM_PAGE_SIZE;
+     while(o > order) {
+        o--;
+        r->state[idx + ((UINTN)1 << o)] = PMM_STATE_FREE|o;
+        pmm_list_push(o,pmm_page(r,idx + ((UINTN)1 << o)));
+     }
+     r->state[idx]   = PMM_STATE_USED;
+     pmm_pages_free -= (UINTN)1 << order;
+     // give back what the request didn't need rather than rounding it up to a power of 2
+     if(pages < ((UINTN)1 << order)) pmm_free_range(r,idx+pages,((UINTN)1 << order)-pages);
+     release_pmm_lock(old_tpl);
+     return (void*)pmm_page(r,idx);
+}
+
+// addr..addr+pages has to be exactly what one pmm_alloc_pages() returned: a USED first page, then tail pages up to
+// the next block, anything else would put pages on the free lists twice or free someone else's
+int pmm_free_pages(void* addr, UINTN pages) {
+     EFI_PHYSICAL_ADDRESS a = (EFI_PHYSICAL_ADDRESS)(UINTN)addr;
+     pmm_region_t* r;
+     UINTN idx, i;
+     int ok;
+     EFI_TPL old_tpl;
+     if(addr == NULL || pages == 0) return -1;
+     r = pmm_region_of(a);
+     if(r == NULL || (a & (PMM_PAGE_SIZE-1)) != 0) {
+        klog("PMM",0,"Refusing to free %d pages at %#llx, not from the page pool",pages,a);
+        return -1;
+     }
+     idx = (a - r->base)/PMM_PAGE_SIZE;
+     old_tpl = acquire_pmm_lock();
+     ok = pages <= r->pages - idx && r->state[idx] == PMM_STATE_USED &&
+          (idx + pages == r->pages || r->state[idx + pages] != PMM_STATE_TAIL);
+     for(i=1; ok && i < pages; i++) {
+         if(r->state[idx + i] != PMM_STATE_TAIL) ok = 0;
+     }
+     if(!ok) {
+        release_pmm_lock(old_tpl);
+        klog("PMM",0,"Refusing to free %d pages at %#llx, not an allocated block",pages,a);
+        return -1;
+     }
+     pmm_free_range(r,idx,pages);
+     release_pmm_lock(old_tpl);
+     return 0;
+}
+
+int pmm_owns(void* addr) {
+     return pmm_region_of((EFI_PHYSICAL_ADDRESS)(UINTN)addr) != NULL;
+}
+
+void pmm_set_slab(void* addr, int slab) {
+     pmm_region_t* r = pmm_region_of((EFI_PHYSICAL_ADDRESS)(UINTN)addr);
+     UINTN idx;
+     if(r == NULL) return;
+     idx = ((EFI_PHYSICAL_ADDRESS)(UINTN)addr - r->base)/PMM_PAGE_SIZE;
+     r->state[idx] = slab ? (PMM_STATE_USED|PMM_STATE_SLAB) : PMM_STATE_USED;
+}
+
+int pmm_is_slab(void* addr) {
+     pmm_region_t* r = pmm_region_of((EFI_PHYSICAL_ADDRESS)(UINTN)addr);
+     if(r == NULL) return 0;
+     return (r->state[((EFI_PHYSICAL_ADDRESS)(UINTN)addr - r->base)/PMM_PAGE_SIZE] & PMM_STATE_SLAB) ? 1 : 0;
+}
+
+UINTN pmm_total_pages() {
+     return pmm_pages_total;
+}
+
+UINTN pmm_free_count() {
+     return pmm_pages_free;
+}
+
+// claims base..base+pages from the firmware and frees it into the buddy lists, 0 if it did
+// the range is claimed before the state array is allocated, AllocatePool could otherwise take pages out of it
+static int pmm_add_region(EFI_PHYSICAL_ADDRESS base, UINTN pages) {
+     pmm_region_t* r;
+     EFI_PHYSICAL_ADDRESS addr = base;
+     UINT8* state;
+     if(pmm_region_count >= PMM_MAX_REGIONS) return -1;
+     if(EFI_ERROR(BS->AllocatePages(AllocateAddress,EfiLoaderData,pages,&addr))) return -1;
+     state = (UINT8*)malloc(pages);
+     if(state == NULL) {
+        BS->FreePages(base,pages);
+        return -1;
+     }
+     memset(state,PMM_STATE_TAIL,pages); // pmm_free_range() marks the first page of each block
+     r = &(pmm_regions[pmm_region_count++]);
+     r->base  = base;
+     r->pages = pages;
+     r->state = state;
+     pmm_pages_total += pages;
+     pmm_free_range(r,0,pages);
+     return 0;
+}
+
+void pmm_init() {
+     EFI_MEMORY_DESCRIPTOR* map = NULL;
+     EFI_MEMORY_DESCRIPTOR* d;
+     UINTN map_size  = 0;
+     UINTN map_key;
+     UINTN desc_size;
+     UINT32 desc_ver;
+     UINTN conventional = 0;
+     UINTN budget;
+     UINTN count;
+     UINTN i;
+     UINTN best;
+     UINTN best_pages;
+     EFI_PHYSICAL_ADDRESS start;
+     EFI_PHYSICAL_ADDRESS end;
+     EFI_PHYSICAL_ADDRESS align = ((EFI_PHYSICAL_ADDRESS)PMM_PAGE_SIZE) << PMM_MAX_ORDER;
+     UINT8* taken;
+
+     BS->GetMemoryMap(&map_size,NULL,&map_key,&desc_size,&desc_ver);
+     map_size += 8*desc_size; // room for the entries our own allocations below add
+     map = (EFI_MEMORY_DESCRIPTOR*)malloc(map_size);
+     if(map == NULL || EFI_ERROR(BS->GetMemoryMap(&map_size,map,&map_key,&desc_size,&desc_ver))) {
+        klog("PMM",0,"Could not read the UEFI memory map, kernel heap stays on AllocatePool");
+        free(map);
+        kheap_init();
+        return;
+     }
+     count = map_size/desc_size;
+     taken = (UINT8*)calloc(count,1);
+
+     for(i=0; i < count; i++) {
+         d = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)map + i*desc_size);
+         if(d->Type == EfiConventionalMemory) conventional += d->NumberOfPages;
+     }
+     budget = conventional - conventional/4;
+     if(conventional < PMM_FIRMWARE_MIN) budget = 0;
+     else if(conventional - budget < PMM_FIRMWARE_MIN) budget = conventional - PMM_FIRMWARE_MIN;
+
+     // biggest first, each trimmed to the largest block alignment
+     while(taken != NULL && budget >= PMM_MIN_REGION && pmm_region_count < PMM_MAX_REGIONS) {
+        best       = count;
+        best_pages = 0;
+        for(i=0; i < count; i++) {
+            d = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)map + i*desc_size);
+            if(taken[i] || d->Type != EfiConventionalMemory) continue;
+            start = (d->PhysicalStart + align-1) & ~(align-1);
+            end   = d->PhysicalStart + d->NumberOfPages*PMM_PAGE_SIZE;
+            if(start >= end) continue;
+            if((end-start)/PMM_PAGE_SIZE > best_pages) {
+               best       = i;
+               best_pages = (end-start)/PMM_PAGE_SIZE;
+            }
+        }
+        if(best == count || best_pages < PMM_MIN_REGION) break;
+        taken[best] = 1;
+        d     = (EFI_MEMORY_DESCRIPTOR*)((UINT8*)map + best*desc_size);
+        start = (d->PhysicalStart + align-1) & ~(align-1);
+        if(best_pages > budget) best_pages = budget;
+        if(pmm_add_region(start,best_pages) == 0) budget -= best_pages;
+     }
+     free(taken);
+     free(map);
+     kheap_init();
+     klog("PMM",1,"Page pool has %d MiB in %d regions, %d MiB left to the firmware",
+          (int)(pmm_pages_total/256),pmm_region_count,(int)((conventional-pmm_pages_total)/256));
+}
@@ -0,0 +1,37 @@
+#ifndef K_PMM_H
+#define K_PMM_H
+
+#include <Uefi.h>
+
+#define PMM_PAGE_SIZE      4096
+#define PMM_MAX_ORDER      12         // largest buddy block is 2^12 pages, 16MiB
+#define PMM_MAX_REGIONS    32
+#define PMM_MIN_REGION     256        // pages, smaller stretches of the memory map are left to the firmware
+#define PMM_FIRMWARE_MIN   16384      // pages always left free for AllocatePool and friends, 64MiB
+
+// page state, one byte per page in a region
+#define PMM_STATE_TAIL     0x00       // inside a block, only the first page of a block says what it is
+#define PMM_STATE_FREE     0x80       // first page of a free block, low bits are the order
+#define PMM_STATE_USED     0x40
+#define PMM_STATE_SLAB     0x20       // first page of a kernel heap slab, set alongside USED
+
+// a stretch of conventional memory claimed from the firmware at startup
+typedef struct pmm_region_t {
+     EFI_PHYSICAL_ADDRESS base;     // aligned to the largest block size so blocks are aligned to their own size
+     UINTN                pages;
+     UINT8*               state;
+} pmm_region_t;
+
+void  pmm_init();                                      // claims memory from the UEFI memory map, call early in main()
+
+void* pmm_alloc_pages(UINTN pages, UINTN align_pages); // aligned to align_pages pages, NULL if the pool can't do it
+int   pmm_free_pages(void* addr, UINTN pages);         // exactly what pmm_alloc_pages() gave, -1 and nothing freed otherwise
+int   pmm_owns(void* addr);
+
+void  pmm_set_slab(void* addr, int slab);              // tags the first page of a block for the kernel heap
+int   pmm_is_slab(void* addr);
+
+UINTN pmm_total_pages();
+UINTN pmm_free_count();
+
+#endif
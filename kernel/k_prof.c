@@ -0,0 +1,302 @@
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseLib.h>
+#include <Protocol/LoadedImage.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "kmsg.h"
+#include "dmthread.h"
+#include "k_heap.h"
+#include "k_pmm.h"
+#include "k_smp.h"
+#include "k_sync.h"
+#include "k_prof.h"
+
+// Sampling profiler
+//
+// While it's running every CPU's local APIC timer goes off prof_us apart and each interrupt records the interrupted
+// RIP, the return addresses found by following RBP up the interrupted thread's stack, and the task it was running for,
+// into that CPU's ring. The APs already take their scheduler tick from that timer, so it just runs faster and only
+// every slice'th interrupt preempts; the BSP's tick is the firmware's timer event, which doesn't see the interrupted
+// context, so its samples come from its own local APIC timer if the firmware isn't using that.
+//
+// A frame pointer is only followed while it stays inside the thread's stack, so code built without them gives a
+// short or leaf-only stack rather than a fault. Reading /dev/profile drains the rings into a table of distinct stacks
+// and returns it as folded stacks ("task-3;0x...;0x... 12", outermost frame first) with a header giving where
+// kernel.efi was loaded - tools/profsym turns the addresses into symbols for flamegraph.pl.
+
+extern EFI_BOOT_SERVICES *BS;
+extern EFI_HANDLE gImageHandle;
+
+typedef struct prof_sample_t {
+     UINT64 task;
+     UINT32 depth;
+     UINT32 idle;
+     UINT64 pc[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+typedef struct prof_stack_t {
+     UINT64        count;             // 0 for an empty slot
+     prof_sample_t s;
+} prof_stack_t;
+
+typedef struct prof_cpu_t {
+     prof_sample_t*  ring;
+     volatile UINT64 head;            // only this CPU's timer interrupt adds here
+     volatile UINT64 tail;            // only readers, under prof_lock, take from here
+     volatile UINT64 dropped;
+     UINT64          gen;             // prof_gen the timer was last set up for
+     UINT64          slice;           // interrupts per scheduler tick
+     UINT64          until_tick;
+} prof_cpu_t;
+
+static prof_cpu_t      prof_cpus[SMP_MAX_CPUS];
+static volatile int    prof_running = 0;
+static volatile UINT64 prof_gen     = 0;    // bumped whenever the rate changes, each CPU sets its timer on its next tick
+static UINT64          prof_us      = 0;
+static int             prof_bsp     = 0;    // the BSP's timer is sampling
+static int             prof_hooked  = 0;
+static prof_stack_t*   prof_stacks  = NULL;
+static UINT64          prof_total   = 0;
+static UINT64          prof_other   = 0;    // samples of stacks past PROF_STACKS
+static char*           prof_text    = NULL; // the snapshot being read
+static UINTN           prof_text_len = 0;
+static UINTN           prof_text_pos = 0;
+static kmutex_t        prof_lock    = KMUTEX_INIT;
+
+static void prof_sample(prof_cpu_t* p, EFI_SYSTEM_CONTEXT_X64* ctx) {
+     dmt_cpu_t* cpu = dmt_this_cpu();
+     thread_list* t = cpu->current;
+     prof_sample_t* s;
+     UINT64 lo, hi, fp, next;
+     UINT32 depth = 1;
+     if(p->head - p->tail >= PROF_RING_SAMPLES) {
+        p->dropped++;
+        return;
+     }
+     s        = &p->ring[p->head & (PROF_RING_SAMPLES-1)];
+     s->task  = (t != NULL) ? t->thread.task_id : 0;
+     s->idle  = (t == NULL || t == cpu->idle);
+     s->pc[0] = ctx->Rip;
+     if(t != NULL && t->thread.stack != NULL) {
+        lo = (UINT64)(UINTN)t->thread.stack;
+        hi = lo + STACK_SIZE;
+        fp = ctx->Rbp;
+        while(depth < PROF_MAX_DEPTH && fp >= lo && fp + 16 <= hi && (fp & 7) == 0) {
+           s->pc[depth] = ((UINT64*)(UINTN)fp)[1];
+           next         = ((UINT64*)(UINTN)fp)[0];
+           if(s->pc[depth] == 0) break;
+           depth++;
+           if(next <= fp) break; // stacks grow down, so callers' frames are always higher
+           fp = next;
+        }
+     }
+     s->depth = depth;
+     __asm__ volatile("" ::: "memory"); // the sample's written before a reader can see it
+     p->head++;
+}
+
+// an AP's timer to the rate prof_gen says, the BSP's is started and stopped by prof_start() and prof_stop()
+static void prof_retime(prof_cpu_t* p) {
+     UINT64 tick = thread_get_tick();
+     if(tick == 0) tick = DMT_TICK_DEFAULT_US;
+     p->gen = prof_gen;
+     if(smp_is_bsp()) return;
+     if(prof_running && prof_us < tick) {
+        p->slice = tick / prof_us;
+        smp_timer_period(prof_us,SMP_VEC_TICK);
+     } else {
+        p->slice = 1;
+        smp_timer_period(tick,SMP_VEC_TICK);
+     }
+     p->until_tick = p->slice;
+}
+
+int prof_tick(EFI_SYSTEM_CONTEXT ctx) {
+     prof_cpu_t* p = &prof_cpus[smp_cpu_id()];
+     if(p->gen != prof_gen) prof_retime(p);
+     if(prof_running && p->ring != NULL) prof_sample(p,ctx.SystemContextX64);
+     if(p->slice <= 1) return 1;
+     if(--p->until_tick != 0) return 0;
+     p->until_tick = p->slice;
+     return 1;
+}
+
+static VOID EFIAPI prof_bsp_handler(IN CONST EFI_EXCEPTION_TYPE InterruptType, IN CONST EFI_SYSTEM_CONTEXT SystemContext) {
+     smp_eoi();
+     prof_tick(SystemContext);
+}
+
+static UINT64 prof_hash(prof_sample_t* s) {
+     UINT64 h = 14695981039346656037ULL ^ s->task ^ ((UINT64)s->idle << 63);
+     UINT32 i;
+     for(i=0; i < s->depth; i++) h = (h ^ s->pc[i]) * 1099511628211ULL;
+     return h;
+}
+
+// the rings into prof_stacks, with prof_lock held
+static void prof_drain() {
+     prof_cpu_t* p;
+     prof_sample_t* s;
+     prof_stack_t* e;
+     UINTN cpu, i, n;
+     for(cpu=0; cpu < SMP_MAX_CPUS; cpu++) {
+         p = &prof_cpus[cpu];
+         if(p->ring == NULL) continue;
+         while(p->tail != p->head) {
+            s = &p->ring[p->tail & (PROF_RING_SAMPLES-1)];
+            i = prof_hash(s) & (PROF_STACKS-1);
+            for(n=0; n < PROF_STACKS; n++, i = (i+1) & (PROF_STACKS-1)) {
+                e = &prof_stacks[i];
+                if(e->count == 0) {
+                   memcpy(&e->s,s,sizeof(prof_sample_t));
+                   break;
+                }
+                if(e->s.task == s->task && e->s.idle == s->idle && e->s.depth == s->depth &&
+                   memcmp(e->s.pc,s->pc,s->depth*sizeof(UINT64)) == 0) break;
+            }
+            if(n < PROF_STACKS) e->count++; else prof_other++;
+            prof_total++;
+            __asm__ volatile("" ::: "memory"); // done with the slot before the interrupt can reuse it
+            p->tail++;
+         }
+     }
+}
+
+// prof_stacks as text into prof_text, with prof_lock held
+static int prof_format() {
+     EFI_LOADED_IMAGE_PROTOCOL* image = NULL;
+     UINT64 dropped = 0;
+     UINTN room, len, i;
+     INT32 d;
+     prof_stack_t* e;
+     for(i=0; i < SMP_MAX_CPUS; i++) dropped += prof_cpus[i].dropped;
+     room = 256;
+     for(i=0; i < PROF_STACKS; i++) {
+         if(prof_stacks[i].count != 0) room += 48 + prof_stacks[i].s.depth*20;
+     }
+     prof_text = (char*)kmalloc(room);
+     if(prof_text == NULL) return -1;
+     thread_enter_bsp();
+     BS->HandleProtocol(gImageHandle,&gEfiLoadedImageProtocolGuid,(void**)&image);
+     thread_leave_bsp();
+     len = snprintf(prof_text,room,"# kernel.efi at %#llx size %#llx, %lld samples every %lld us, %lld dropped\n",
+                    image ? (UINT64)(UINTN)image->ImageBase : 0,image ? image->ImageSize : 0,
+                    prof_total,prof_us,dropped);
+     for(i=0; i < PROF_STACKS && len < room; i++) {
+         e = &prof_stacks[i];
+         if(e->count == 0) continue;
+         if(e->s.idle) {
+            len += snprintf(prof_text + len,room - len,"idle");
+         } else {
+            len += snprintf(prof_text + len,room - len,"task-%lld",e->s.task);
+         }
+         for(d=(INT32)e->s.depth-1; d >= 0 && len < room; d--) {
+             len += snprintf(prof_text + len,room - len,";%#llx",e->s.pc[d]);
+         }
+         if(len < room) len += snprintf(prof_text + len,room - len," %lld\n",e->count);
+     }
+     if(prof_other != 0 && len < room) len += snprintf(prof_text + len,room - len,"[other] %lld\n",prof_other);
+     prof_text_len = (len < room) ? len : room-1;
+     prof_text_pos = 0;
+     return 0;
+}
+
+int prof_start(UINTN hz) {
+     EFI_CPU_ARCH_PROTOCOL* cpu_proto;
+     UINTN i, pages;
+     if(hz == 0 || hz > PROF_MAX_HZ) return -1;
+     kmutex_lock(&prof_lock);
+     pages = EFI_SIZE_TO_PAGES(sizeof(prof_sample_t)*PROF_RING_SAMPLES);
+     for(i=0; i < smp_cpu_count(); i++) {
+         if(prof_cpus[i].ring == NULL) prof_cpus[i].ring = (prof_sample_t*)pmm_alloc_pages(pages,1);
+         if(prof_cpus[i].ring == NULL) {
+            kmutex_unlock(&prof_lock);
+            klog("PROF",0,"No memory for CPU %d's samples",i);
+            return -1;
+         }
+     }
+     if(prof_stacks == NULL) prof_stacks = (prof_stack_t*)pmm_alloc_pages(EFI_SIZE_TO_PAGES(sizeof(prof_stack_t)*PROF_STACKS),1);
+     if(prof_stacks == NULL) {
+        kmutex_unlock(&prof_lock);
+        klog("PROF",0,"No memory to count stacks in");
+        return -1;
+     }
+     BS->SetMem((void*)prof_stacks,sizeof(prof_stack_t)*PROF_STACKS,0);
+     for(i=0; i < SMP_MAX_CPUS; i++) {
+         prof_cpus[i].tail    = prof_cpus[i].head;
+         prof_cpus[i].dropped = 0;
+     }
+     prof_total   = 0;
+     prof_other   = 0;
+     prof_us      = 1000000 / hz;
+     prof_running = 1;
+     __sync_fetch_and_add(&prof_gen,1);
+
+     thread_enter_bsp(); // the CPU arch protocol and the BSP's own timer
+     if(!prof_hooked && !EFI_ERROR(BS->LocateProtocol(&gEfiCpuArchProtocolGuid,NULL,(void**)&cpu_proto)) &&
+        !EFI_ERROR(cpu_proto->RegisterInterruptHandler(cpu_proto,SMP_VEC_PROF,prof_bsp_handler))) {
+        prof_hooked = 1;
+     }
+     prof_bsp = prof_hooked && smp_timer_period(prof_us,SMP_VEC_PROF) == 0;
+     thread_leave_bsp();
+     kmutex_unlock(&prof_lock);
+     if(!prof_bsp) klog("PROF",0,"The BSP's local APIC timer isn't free, sampling the APs only");
+     klog("PROF",1,"Sampling every %lld us",prof_us);
+     return 0;
+}
+
+void prof_stop() {
+     kmutex_lock(&prof_lock);
+     prof_running = 0;
+     __sync_fetch_and_add(&prof_gen,1);
+     if(prof_bsp) {
+        thread_enter_bsp();
+        smp_timer_period(0,SMP_VEC_PROF);
+        thread_leave_bsp();
+        prof_bsp = 0;
+     }
+     kmutex_unlock(&prof_lock);
+     klog("PROF",1,"Stopped sampling, %lld samples so far",prof_total);
+}
+
+ssize_t prof_read(void* buf, size_t count) {
+     UINTN n;
+     kmutex_lock(&prof_lock);
+     if(prof_stacks == NULL) {
+        kmutex_unlock(&prof_lock);
+        return 0;
+     }
+     if(prof_text == NULL) {
+        prof_drain();
+        if(prof_format() != 0) {
+           kmutex_unlock(&prof_lock);
+           return -1;
+        }
+     }
+     n = prof_text_len - prof_text_pos;
+     if(n > count) n = count;
+     memcpy(buf,prof_text + prof_text_pos,n);
+     prof_text_pos += n;
+     if(n == 0) { // EOF, the next read takes a fresh snapshot
+        kfree(prof_text);
+        prof_text = NULL;
+     }
+     kmutex_unlock(&prof_lock);
+     return n;
+}
+
+ssize_t prof_write(void* buf, size_t count) {
+     char* c = (char*)buf;
+     UINTN hz = 0;
+     size_t i;
+     for(i=0; i < count && c[i] >= '0' && c[i] <= '9'; i++) hz = hz*10 + (c[i] - '0');
+     if(i == 0) return -1;
+     if(hz == 0) {
+        prof_stop();
+     } else if(prof_start(hz) != 0) {
+        return -1;
+     }
+     return count;
+}
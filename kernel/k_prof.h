@@ -0,0 +1,24 @@
+#ifndef K_PROF_H
+#define K_PROF_H
+
+#include <Uefi.h>
+#include <Protocol/Cpu.h>
+#include <sys/types.h>
+
+// sampling profiler, see k_prof.c
+
+#define PROF_MAX_DEPTH     16         // frames kept per sample, the interrupted RIP first
+#define PROF_RING_SAMPLES  4096       // per CPU between reads of /dev/profile, a power of 2
+#define PROF_STACKS        4096       // distinct stacks counted, samples of any more go in one bucket
+#define PROF_MAX_HZ        100000
+
+int     prof_start(UINTN hz);         // throws away what's been counted so far
+void    prof_stop();
+
+// from the local APIC timer interrupt on any CPU, 1 if this one is also the scheduler's tick
+int     prof_tick(EFI_SYSTEM_CONTEXT ctx);
+
+ssize_t prof_read(void* buf, size_t count);        // /dev/profile: folded stacks, one snapshot per read to EOF
+ssize_t prof_write(void* buf, size_t count);       // /dev/profile: a rate in Hz starts sampling, 0 stops it
+
+#endif
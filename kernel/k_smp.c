@@ -0,0 +1,252 @@
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/BaseLib.h>
+#include <Protocol/Cpu.h>
+#include <Protocol/MpService.h>
+
+#include "kmsg.h"
+#include "dmthread.h"
+#include "k_smp.h"
+#include "k_prof.h"
+
+// Application processors
+//
+// The firmware's MP services start each AP on a procedure of ours that never returns, and from then on the AP belongs
+// to dmthread: its boot stack becomes its idle thread and its local APIC timer gives it a time slice. Boot services
+// only work on the BSP, so an AP must never call them - no TPL, no firmware allocations, no console or file protocols.
+// Threads therefore stay on the BSP unless they're made DMT_CPU_ANY, and those hop over to the BSP with
+// thread_enter_bsp() for anything that needs the firmware. The BSP keeps the firmware's timer event for its tick.
+//
+// Each CPU's dmt_cpu_t is found through the GS base, which nothing else in the kernel or the firmware uses.
+
+extern EFI_BOOT_SERVICES *BS;
+
+#define MSR_APIC_BASE        0x1B
+#define MSR_GS_BASE          0xC0000101
+#define APIC_BASE_X2APIC     (1 << 10)
+#define X2APIC_MSR(reg)      (0x800 + ((reg) >> 4))
+
+#define LAPIC_TPR            0x080
+#define LAPIC_EOI            0x0B0
+#define LAPIC_SVR            0x0F0
+#define LAPIC_ICR_LO         0x300
+#define LAPIC_ICR_HI         0x310
+#define LAPIC_LVT_TIMER      0x320
+#define LAPIC_TIMER_INIT     0x380
+#define LAPIC_TIMER_CUR      0x390
+#define LAPIC_TIMER_DIV      0x3E0
+
+#define LAPIC_SVR_ENABLE     (1 << 8)
+#define LAPIC_ICR_PENDING    (1 << 12)
+#define LAPIC_LVT_MASKED     (1 << 16)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_DIV_16         0x3
+
+// what smp_lock() hands back on an AP, just whether IF was set
+#define SMP_AP_IRQS_ON       0x100
+#define SMP_AP_IRQS_OFF      0x101
+
+static volatile UINTN  smp_online = 1;
+static UINT32          smp_apic_ids[SMP_MAX_CPUS];
+static volatile UINT8* lapic_mmio = NULL;
+static int             lapic_x2   = 0;
+static UINT32          lapic_ticks_per_us = 0;  // at divide by 16, measured by the first AP up
+static int             lapic_bsp_timer    = 0;  // the BSP's timer is ours, the firmware had it masked
+
+static UINT32 lapic_read(UINT32 reg) {
+     if(lapic_x2) return (UINT32)AsmReadMsr64(X2APIC_MSR(reg));
+     return *(volatile UINT32*)(lapic_mmio + reg);
+}
+
+static void lapic_write(UINT32 reg, UINT32 val) {
+     if(lapic_x2) {
+        AsmWriteMsr64(X2APIC_MSR(reg),val);
+        return;
+     }
+     *(volatile UINT32*)(lapic_mmio + reg) = val;
+}
+
+UINTN smp_cpu_id() {
+     UINTN id;
+     __asm__ volatile("mov %%gs:%c1, %0" : "=r"(id) : "i"(OFFSET_OF(dmt_cpu_t,id)));
+     return id;
+}
+
+int smp_is_bsp() {
+     return smp_cpu_id() == 0;
+}
+
+UINTN smp_cpu_count() {
+     return smp_online;
+}
+
+// whether we're on the BSP can't change under us: threads only move between the BSP and the APs when they give up
+// the CPU themselves, never from being preempted
+EFI_TPL smp_lock(volatile UINT8* lock, EFI_TPL tpl) {
+     EFI_TPL old;
+     if(smp_is_bsp()) {
+        old = BS->RaiseTPL(tpl);
+     } else {
+        old = GetInterruptState() ? SMP_AP_IRQS_ON : SMP_AP_IRQS_OFF;
+        DisableInterrupts();
+     }
+     while(__sync_lock_test_and_set(lock, 1)) {
+        CpuPause();
+     }
+     return old;
+}
+
+void smp_unlock(volatile UINT8* lock, EFI_TPL old) {
+     __sync_synchronize();
+     *lock = 0;
+     if(old == SMP_AP_IRQS_ON) {
+        EnableInterrupts();
+     } else if(old != SMP_AP_IRQS_OFF) {
+        BS->RestoreTPL(old);
+     }
+}
+
+// only ever called with the scheduler lock held, so nothing else on this CPU is halfway through writing the ICR
+void smp_kick(UINTN cpu) {
+     if(smp_online == 1 || cpu >= SMP_MAX_CPUS || cpu == smp_cpu_id()) return;
+     if(lapic_x2) {
+        AsmWriteMsr64(X2APIC_MSR(LAPIC_ICR_LO),((UINT64)smp_apic_ids[cpu] << 32) | SMP_VEC_KICK);
+        return;
+     }
+     while(lapic_read(LAPIC_ICR_LO) & LAPIC_ICR_PENDING) {
+        CpuPause();
+     }
+     lapic_write(LAPIC_ICR_HI,smp_apic_ids[cpu] << 24);
+     lapic_write(LAPIC_ICR_LO,SMP_VEC_KICK);
+}
+
+void smp_eoi() {
+     lapic_write(LAPIC_EOI,0);
+}
+
+static VOID EFIAPI smp_tick_handler(IN CONST EFI_EXCEPTION_TYPE InterruptType, IN CONST EFI_SYSTEM_CONTEXT SystemContext) {
+     lapic_write(LAPIC_EOI,0);   // before we switch away, we might not be back for a while
+     if(prof_tick(SystemContext)) thread_preempt(); // while profiling the timer's faster than the time slice
+}
+
+static VOID EFIAPI smp_kick_handler(IN CONST EFI_EXCEPTION_TYPE InterruptType, IN CONST EFI_SYSTEM_CONTEXT SystemContext) {
+     lapic_write(LAPIC_EOI,0);   // getting out of hlt was the point, the idle loop takes it from there
+}
+
+// timed against the TSC since there's no Stall() on an AP
+static void lapic_timer_set(UINT64 us, UINT8 vector) {
+     UINT64 ticks;
+     UINT64 start;
+     UINT32 n;
+     lapic_write(LAPIC_TIMER_DIV,LAPIC_DIV_16);
+     if(lapic_ticks_per_us == 0) {
+        lapic_write(LAPIC_LVT_TIMER,LAPIC_LVT_MASKED | vector);
+        lapic_write(LAPIC_TIMER_INIT,0xFFFFFFFF);
+        start = thread_now_us();
+        while(thread_now_us() - start < 1000) {
+           CpuPause();
+        }
+        n = (0xFFFFFFFF - lapic_read(LAPIC_TIMER_CUR)) / 1000;
+        lapic_ticks_per_us = n ? n : 1;
+     }
+     if(us == 0) {
+        lapic_write(LAPIC_LVT_TIMER,LAPIC_LVT_MASKED | vector);
+        lapic_write(LAPIC_TIMER_INIT,0);
+        return;
+     }
+     ticks = us * lapic_ticks_per_us;
+     lapic_write(LAPIC_LVT_TIMER,LAPIC_TIMER_PERIODIC | vector);
+     lapic_write(LAPIC_TIMER_INIT,(ticks > 0xFFFFFFFF) ? 0xFFFFFFFF : (UINT32)ticks);
+}
+
+// periodic at the scheduler's time slice
+static void lapic_timer_start() {
+     UINT64 us = thread_get_tick();
+     if(us == 0) us = DMT_TICK_DEFAULT_US;
+     lapic_timer_set(us,SMP_VEC_TICK);
+}
+
+int smp_timer_period(UINT64 us, UINT8 vector) {
+     if(lapic_mmio == NULL && !lapic_x2) return -1;
+     if(smp_is_bsp() && !lapic_bsp_timer) {
+        if(!(lapic_read(LAPIC_LVT_TIMER) & LAPIC_LVT_MASKED)) return -1;
+        lapic_bsp_timer = 1;
+     }
+     lapic_timer_set(us,vector);
+     return 0;
+}
+
+static VOID EFIAPI smp_ap_entry(VOID* arg) {
+     dmt_cpu_t* cpu = (dmt_cpu_t*)arg;
+     AsmWriteMsr64(MSR_GS_BASE,(UINT64)(UINTN)cpu);
+     lapic_write(LAPIC_TPR,0);
+     lapic_write(LAPIC_SVR,lapic_read(LAPIC_SVR) | LAPIC_SVR_ENABLE);
+     lapic_timer_start();
+     __sync_fetch_and_add(&smp_online,1);
+     thread_ap_main();
+}
+
+void smp_init_bsp() {
+     dmt_cpus[0].self = &dmt_cpus[0];
+     dmt_cpus[0].id   = 0;
+     dmt_cpus[0].online = 1;
+     AsmWriteMsr64(MSR_GS_BASE,(UINT64)(UINTN)&dmt_cpus[0]);
+}
+
+void smp_init() {
+     EFI_MP_SERVICES_PROTOCOL* mp;
+     EFI_CPU_ARCH_PROTOCOL* cpu_proto;
+     EFI_PROCESSOR_INFORMATION info;
+     EFI_EVENT done;
+     UINTN count, enabled, bsp, i;
+     UINTN started = 1;
+     UINT64 apic_base;
+     dmt_cpu_t* cpu;
+
+     // the local APIC is identity mapped like everything else, the APs are in x2APIC mode if the BSP is
+     apic_base  = AsmReadMsr64(MSR_APIC_BASE);
+     lapic_x2   = (apic_base & APIC_BASE_X2APIC) != 0;
+     lapic_mmio = (volatile UINT8*)(UINTN)(apic_base & ~0xFFFULL);
+
+     if(EFI_ERROR(BS->LocateProtocol(&gEfiMpServiceProtocolGuid,NULL,(void**)&mp))) {
+        klog("SMP",1,"No MP services, running on the BSP only");
+        return;
+     }
+     if(EFI_ERROR(mp->GetNumberOfProcessors(mp,&count,&enabled)) || EFI_ERROR(mp->WhoAmI(mp,&bsp))) {
+        klog("SMP",0,"Could not count CPUs, running on the BSP only");
+        return;
+     }
+     if(enabled < 2) {
+        klog("SMP",1,"Only the one CPU");
+        return;
+     }
+     if(EFI_ERROR(BS->LocateProtocol(&gEfiCpuArchProtocolGuid,NULL,(void**)&cpu_proto)) ||
+        EFI_ERROR(cpu_proto->RegisterInterruptHandler(cpu_proto,SMP_VEC_TICK,smp_tick_handler)) ||
+        EFI_ERROR(cpu_proto->RegisterInterruptHandler(cpu_proto,SMP_VEC_KICK,smp_kick_handler))) {
+        klog("SMP",0,"Could not hook the AP interrupt vectors, running on the BSP only");
+        return;
+     }
+
+     if(!EFI_ERROR(mp->GetProcessorInfo(mp,bsp,&info))) smp_apic_ids[0] = (UINT32)info.ProcessorId;
+
+     for(i=0; i < count && started < SMP_MAX_CPUS; i++) {
+         if(i == bsp) continue;
+         if(EFI_ERROR(mp->GetProcessorInfo(mp,i,&info)) || !(info.StatusFlag & PROCESSOR_ENABLED_BIT)) continue;
+         cpu = &dmt_cpus[started];
+         cpu->self = cpu;
+         cpu->id   = started;
+         smp_apic_ids[started] = (UINT32)info.ProcessorId;
+         if(thread_cpu_init(cpu) != 0) break;
+         // non-blocking, which is the only way to start something that never finishes - done never gets signalled
+         if(EFI_ERROR(BS->CreateEvent(0,0,NULL,NULL,&done)) ||
+            EFI_ERROR(mp->StartupThisAP(mp,smp_ap_entry,i,done,0,cpu,NULL))) {
+            klog("SMP",0,"Could not start CPU %d",i);
+            continue;
+         }
+         started++;
+     }
+
+     for(i=0; i < 1000 && smp_online < started; i++) {
+         BS->Stall(1000);
+     }
+     klog("SMP",1,"%d of %d CPUs running threads",smp_online,count);
+}
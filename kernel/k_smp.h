@@ -0,0 +1,30 @@
+#ifndef K_SMP_H
+#define K_SMP_H
+
+#include <Uefi.h>
+
+// application processors and locking that works on all of them, see k_smp.c
+
+#define SMP_MAX_CPUS   32
+#define SMP_VEC_TICK   0xF0           // AP time slice, from each AP's local APIC timer
+#define SMP_VEC_KICK   0xF1           // gets a CPU out of hlt to look at its run queue
+#define SMP_VEC_PROF   0xF2           // the BSP's local APIC timer while the profiler has it, see k_prof.c
+
+void  smp_init_bsp();                 // per-CPU pointer for the BSP, before anything takes a lock
+void  smp_init();                     // starts the APs, needs the CPU arch protocol
+UINTN smp_cpu_count();                // CPUs running threads, 1 until smp_init()
+UINTN smp_cpu_id();                   // 0 is the BSP
+int   smp_is_bsp();
+void  smp_kick(UINTN cpu);            // IPI, a no-op for the CPU we're on
+
+// this CPU's local APIC timer periodic every us on vector, 0 stops it - on the BSP only if the firmware isn't using
+// it (-1 if it is), APs always own theirs
+int   smp_timer_period(UINT64 us, UINT8 vector);
+void  smp_eoi();                      // end of a local APIC interrupt on this CPU
+
+// a spinlock that also holds off preemption - TPL is raised on the BSP as before, APs can't call boot services so
+// they clear IF instead. Nothing that can only run on the BSP may be called with one held on an AP.
+EFI_TPL smp_lock(volatile UINT8* lock, EFI_TPL tpl);
+void    smp_unlock(volatile UINT8* lock, EFI_TPL old);
+
+#endif
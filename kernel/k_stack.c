@@ -0,0 +1,122 @@
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/Cpu.h>
+
+#include "kmsg.h"
+#include "k_pmm.h"
+#include "k_stack.h"
+#include "k_smp.h"
+
+// Thread stack pool
+//
+// Stacks are whole pages from the page pool, rounded up to a power of 2 so a handful of free lists covers every size.
+// The page below each stack is made read-protected through the CPU arch protocol when the firmware's page tables
+// allow it, so running off the end faults instead of scribbling over a neighbour. Freed stacks keep their guard and
+// sit on their class's list for the next thread, which makes spawning after the first few threads allocation free.
+//
+// Guards are set through the firmware, so a stack an AP has to take from the page pool goes without one, and one an AP
+// frees stays on its list however long that gets. The firmware only flushes the BSP's TLB when it changes a guard.
+//
+// There's no committing pages on first touch - the firmware's identity map already has every page present and we
+// don't own the page fault handler - so recycling is what stands in for it.
+
+extern EFI_BOOT_SERVICES *BS;
+
+typedef struct kstack_free_t kstack_free_t;
+struct kstack_free_t {
+     kstack_free_t* next;
+};
+
+static kstack_free_t*         kstack_lists[KSTACK_CLASSES];
+static UINTN                  kstack_counts[KSTACK_CLASSES];
+static EFI_CPU_ARCH_PROTOCOL* kstack_cpu    = NULL;
+static int                    kstack_guards = 0;
+
+volatile UINT8 kstack_lock = 0;
+
+// dmthread hands stacks back from inside the scheduler, same as the heap
+static EFI_TPL acquire_kstack_lock() {
+     return smp_lock(&kstack_lock,TPL_HIGH_LEVEL);
+}
+
+static void release_kstack_lock(EFI_TPL old_tpl) {
+     smp_unlock(&kstack_lock,old_tpl);
+}
+
+void kstack_init() {
+     EFI_PHYSICAL_ADDRESS probe;
+     if(EFI_ERROR(BS->LocateProtocol(&gEfiCpuArchProtocolGuid,NULL,(void**)&kstack_cpu))) {
+        klog("KSTACK",0,"No CPU arch protocol, thread stacks have no guard pages");
+        return;
+     }
+     // not every firmware will change page attributes, find out with a page of our own
+     probe = (EFI_PHYSICAL_ADDRESS)(UINTN)pmm_alloc_pages(1,1);
+     if(probe == 0) return;
+     if(!EFI_ERROR(kstack_cpu->SetMemoryAttributes(kstack_cpu,probe,PMM_PAGE_SIZE,EFI_MEMORY_RP))) {
+        kstack_cpu->SetMemoryAttributes(kstack_cpu,probe,PMM_PAGE_SIZE,EFI_MEMORY_WB);
+        kstack_guards = 1;
+        klog("KSTACK",1,"Thread stacks get guard pages");
+     } else {
+        klog("KSTACK",0,"Firmware won't unmap pages, thread stacks have no guard pages");
+     }
+     pmm_free_pages((void*)(UINTN)probe,1);
+}
+
+static int kstack_class(UINTN size) {
+     UINTN pages = (size + PMM_PAGE_SIZE-1)/PMM_PAGE_SIZE;
+     int c = 0;
+     while(c < KSTACK_CLASSES && ((UINTN)KSTACK_MIN_PAGES << c) < pages) c++;
+     return c;
+}
+
+void* kstack_alloc(UINTN size) {
+     int c = kstack_class(size);
+     UINTN pages;
+     UINT8* base;
+     EFI_PHYSICAL_ADDRESS addr;
+     kstack_free_t* s;
+     EFI_TPL old_tpl;
+
+     if(c == KSTACK_CLASSES) return NULL;
+     old_tpl = acquire_kstack_lock();
+     s = kstack_lists[c];
+     if(s != NULL) {
+        kstack_lists[c] = s->next;
+        kstack_counts[c]--;
+     }
+     release_kstack_lock(old_tpl);
+     if(s != NULL) return (void*)s;
+
+     pages = ((UINTN)KSTACK_MIN_PAGES << c) + 1;
+     base  = (UINT8*)pmm_alloc_pages(pages,1);
+     if(base == NULL) {
+        if(!smp_is_bsp() || EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiBootServicesData,pages,&addr))) return NULL;
+        base = (UINT8*)(UINTN)addr;
+     }
+     if(kstack_guards && smp_is_bsp()) kstack_cpu->SetMemoryAttributes(kstack_cpu,(EFI_PHYSICAL_ADDRESS)(UINTN)base,PMM_PAGE_SIZE,EFI_MEMORY_RP);
+     return base + PMM_PAGE_SIZE;
+}
+
+void kstack_free(void* stack, UINTN size) {
+     int c = kstack_class(size);
+     kstack_free_t* s = (kstack_free_t*)stack;
+     UINT8* base;
+     EFI_TPL old_tpl;
+
+     if(stack == NULL || c == KSTACK_CLASSES) return;
+     old_tpl = acquire_kstack_lock();
+     if(kstack_counts[c] < KSTACK_KEEP || !smp_is_bsp()) {
+        s->next = kstack_lists[c];
+        kstack_lists[c] = s;
+        kstack_counts[c]++;
+        release_kstack_lock(old_tpl);
+        return;
+     }
+     release_kstack_lock(old_tpl);
+     base = (UINT8*)stack - PMM_PAGE_SIZE;
+     if(kstack_guards) kstack_cpu->SetMemoryAttributes(kstack_cpu,(EFI_PHYSICAL_ADDRESS)(UINTN)base,PMM_PAGE_SIZE,EFI_MEMORY_WB);
+     if(pmm_owns(base)) {
+        pmm_free_pages(base,((UINTN)KSTACK_MIN_PAGES << c) + 1);
+     } else {
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)base,((UINTN)KSTACK_MIN_PAGES << c) + 1);
+     }
+}
@@ -0,0 +1,16 @@
+#ifndef K_STACK_H
+#define K_STACK_H
+
+#include <Uefi.h>
+
+// thread stack pool, see k_stack.c
+
+#define KSTACK_MIN_PAGES   4          // smallest class, 16KiB
+#define KSTACK_CLASSES     7          // powers of 2 up to 1MiB
+#define KSTACK_KEEP        64         // free stacks kept per class, past that they go back to the page pool
+
+void  kstack_init();                  // looks up the CPU arch protocol for guard pages, call once it's there
+void* kstack_alloc(UINTN size);       // lowest usable address, size bytes above it are the stack
+void  kstack_free(void* stack, UINTN size);
+
+#endif
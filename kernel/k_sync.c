@@ -0,0 +1,258 @@
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "dmthread.h"
+#include "k_sync.h"
+#include "k_smp.h"
+
+// Kernel wait queues
+//
+// A waiting thread puts a node on its own stack into the queue and blocks itself in dmthread, whoever wakes it takes
+// the node off and makes it runnable. Both sides hold the queue's lock while they do that, so a wakeup can't slip in
+// between a thread deciding to sleep and actually sleeping. The lock raises TPL to TPL_NOTIFY, which means wakers can
+// be EFI event notify functions - nothing in here may be called from above TPL_NOTIFY. On an AP it clears IF instead.
+//
+// Anything that can't sleep (notify functions, the scheduler tick, early boot before there are threads) spins instead,
+// which is all the old spinlocks ever did.
+
+extern EFI_BOOT_SERVICES *BS;
+
+static EFI_TPL acquire_waitq_lock(kwaitq_t* q) {
+     return smp_lock(&q->lock,TPL_NOTIFY);
+}
+
+static void release_waitq_lock(kwaitq_t* q, EFI_TPL old_tpl) {
+     smp_unlock(&q->lock,old_tpl);
+}
+
+static int ksync_can_block() {
+     EFI_TPL tpl;
+     if(thread_self() == NULL) return 0;
+     if(!smp_is_bsp()) return GetInterruptState(); // an AP has no TPL, only our tick handler runs with IF off
+     tpl = BS->RaiseTPL(TPL_HIGH_LEVEL);
+     BS->RestoreTPL(tpl);
+     return tpl == TPL_APPLICATION;
+}
+
+static void cpu_relax() {
+     __asm__ volatile("pause");
+}
+
+static void waitq_push(kwaitq_t* q, kwait_node_t* n) {
+     n->next = NULL;
+     n->prev = q->tail;
+     if(q->tail != NULL) q->tail->next = n; else q->head = n;
+     q->tail = n;
+}
+
+static void waitq_unlink(kwaitq_t* q, kwait_node_t* n) {
+     if(n->prev != NULL) n->prev->next = n->next; else q->head = n->next;
+     if(n->next != NULL) n->next->prev = n->prev; else q->tail = n->prev;
+}
+
+// thread_kill() of a waiting thread, the node goes away with its stack
+static void waitq_cancel(thread_list* t) {
+     kwaitq_t* q = (kwaitq_t*)t->block_obj;
+     kwait_node_t* n;
+     EFI_TPL old_tpl;
+     if(q == NULL) return;
+     old_tpl = acquire_waitq_lock(q);
+     for(n=q->head; n != NULL; n=n->next) {
+         if(n->thread != t) continue;
+         waitq_unlink(q,n);
+         n->thread = NULL;
+         break;
+     }
+     t->cancel_block = NULL;
+     t->block_obj    = NULL;
+     release_waitq_lock(q,old_tpl);
+}
+
+// longest waiter, to be passed to thread_wake() before the queue is unlocked
+static thread_list* waitq_pop(kwaitq_t* q) {
+     kwait_node_t* n = q->head;
+     thread_list* t;
+     if(n == NULL) return NULL;
+     waitq_unlink(q,n);
+     t = n->thread;
+     n->thread = NULL; // tells the sleeper it was this queue that woke it
+     t->cancel_block = NULL;
+     t->block_obj    = NULL;
+     return t;
+}
+
+// called with q locked, returns unlocked once a waker has taken us off the queue
+// drop is unlocked after we're queued but before we sleep, for condition variables
+static void waitq_sleep(kwaitq_t* q, EFI_TPL old_tpl, kmutex_t* drop) {
+     kwait_node_t n;
+     n.thread = thread_self();
+     waitq_push(q,&n);
+     thread_self()->block_obj    = q;
+     thread_self()->cancel_block = waitq_cancel;
+     thread_block_prepare();
+     release_waitq_lock(q,old_tpl);
+     if(drop != NULL) kmutex_unlock(drop);
+     for(;;) {
+        thread_block_finish();
+        old_tpl = acquire_waitq_lock(q);
+        if(n.thread == NULL) break;
+        thread_block_prepare(); // someone else called thread_wake() on us, still queued so go back to sleep
+        release_waitq_lock(q,old_tpl);
+     }
+     release_waitq_lock(q,old_tpl);
+}
+
+void kwaitq_init(kwaitq_t* q) {
+     q->lock = 0;
+     q->head = NULL;
+     q->tail = NULL;
+}
+
+int kwaitq_wait_on(kwaitq_t* q, volatile UINT64* word, UINT64 val) {
+     EFI_TPL old_tpl;
+     if(!ksync_can_block()) return 0;
+     old_tpl = acquire_waitq_lock(q);
+     if(*word != val) {
+        release_waitq_lock(q,old_tpl);
+        return 0;
+     }
+     waitq_sleep(q,old_tpl,NULL);
+     return 1;
+}
+
+int kwaitq_wake_one(kwaitq_t* q) {
+     thread_list* t;
+     EFI_TPL old_tpl = acquire_waitq_lock(q);
+     t = waitq_pop(q);
+     if(t != NULL) thread_wake(t);
+     release_waitq_lock(q,old_tpl);
+     return t != NULL;
+}
+
+int kwaitq_wake_all(kwaitq_t* q) {
+     thread_list* t;
+     int retval=0;
+     EFI_TPL old_tpl = acquire_waitq_lock(q);
+     while((t = waitq_pop(q)) != NULL) {
+        thread_wake(t);
+        retval++;
+     }
+     release_waitq_lock(q,old_tpl);
+     return retval;
+}
+
+void kmutex_init(kmutex_t* m) {
+     m->locked = 0;
+     m->owner  = NULL;
+     kwaitq_init(&(m->waitq));
+}
+
+int kmutex_trylock(kmutex_t* m) {
+     if(!__sync_bool_compare_and_swap(&m->locked,0,1)) return 0;
+     m->owner = thread_self();
+     return 1;
+}
+
+void kmutex_lock(kmutex_t* m) {
+     EFI_TPL old_tpl;
+     if(kmutex_trylock(m)) return;
+     if(!ksync_can_block()) {
+        while(!kmutex_trylock(m)) cpu_relax();
+        return;
+     }
+     old_tpl = acquire_waitq_lock(&(m->waitq));
+     if(kmutex_trylock(m)) { // let go while we were taking the queue lock
+        release_waitq_lock(&(m->waitq),old_tpl);
+        return;
+     }
+     waitq_sleep(&(m->waitq),old_tpl,NULL);
+     // kmutex_unlock() made us the owner before waking us
+}
+
+void kmutex_unlock(kmutex_t* m) {
+     thread_list* next;
+     EFI_TPL old_tpl = acquire_waitq_lock(&(m->waitq));
+     next = waitq_pop(&(m->waitq));
+     if(next != NULL) {
+        m->owner = next; // stays locked, it's theirs now
+        thread_wake(next);
+     } else {
+        m->owner = NULL;
+        __sync_synchronize();
+        m->locked = 0;
+     }
+     release_waitq_lock(&(m->waitq),old_tpl);
+}
+
+void ksem_init(ksem_t* s, UINT64 count) {
+     s->count = count;
+     kwaitq_init(&(s->waitq));
+}
+
+int ksem_trywait(ksem_t* s) {
+     int retval=0;
+     EFI_TPL old_tpl = acquire_waitq_lock(&(s->waitq));
+     if(s->count > 0) {
+        s->count--;
+        retval = 1;
+     }
+     release_waitq_lock(&(s->waitq),old_tpl);
+     return retval;
+}
+
+void ksem_wait(ksem_t* s) {
+     EFI_TPL old_tpl;
+     if(!ksync_can_block()) {
+        while(!ksem_trywait(s)) cpu_relax();
+        return;
+     }
+     old_tpl = acquire_waitq_lock(&(s->waitq));
+     if(s->count > 0) {
+        s->count--;
+        release_waitq_lock(&(s->waitq),old_tpl);
+        return;
+     }
+     waitq_sleep(&(s->waitq),old_tpl,NULL);
+     // ksem_post() handed its count straight to us
+}
+
+void ksem_post(ksem_t* s) {
+     thread_list* t;
+     EFI_TPL old_tpl = acquire_waitq_lock(&(s->waitq));
+     t = waitq_pop(&(s->waitq));
+     if(t != NULL) {
+        thread_wake(t);
+     } else {
+        s->count++;
+     }
+     release_waitq_lock(&(s->waitq),old_tpl);
+}
+
+VOID EFIAPI ksem_notify(EFI_EVENT e, VOID* s) {
+     ksem_post((ksem_t*)s);
+}
+
+void kcond_init(kcond_t* c) {
+     kwaitq_init(&(c->waitq));
+}
+
+void kcond_wait(kcond_t* c, kmutex_t* m) {
+     EFI_TPL old_tpl;
+     if(!ksync_can_block()) { // a spurious wakeup, callers recheck their condition anyway
+        kmutex_unlock(m);
+        cpu_relax();
+        kmutex_lock(m);
+        return;
+     }
+     // queued before m is dropped, so a signal sent the moment we let go of it still finds us
+     old_tpl = acquire_waitq_lock(&(c->waitq));
+     waitq_sleep(&(c->waitq),old_tpl,m);
+     kmutex_lock(m);
+}
+
+void kcond_signal(kcond_t* c) {
+     kwaitq_wake_one(&(c->waitq));
+}
+
+void kcond_broadcast(kcond_t* c) {
+     kwaitq_wake_all(&(c->waitq));
+}
@@ -0,0 +1,65 @@
+#ifndef K_SYNC_H
+#define K_SYNC_H
+
+#include <Uefi.h>
+#include "dmthread.h"
+
+// kernel wait queues and the blocking primitives built on them, see k_sync.c
+// waiting threads are off the run queue entirely until someone wakes them
+
+// one per waiting thread, lives on that thread's stack
+typedef struct kwait_node_t {
+     thread_list*         thread;
+     struct kwait_node_t* next;
+     struct kwait_node_t* prev;
+} kwait_node_t;
+
+typedef struct kwaitq_t {
+     volatile UINT8 lock;
+     kwait_node_t*  head;
+     kwait_node_t*  tail;
+} kwaitq_t;
+
+typedef struct kmutex_t {
+     volatile UINT8 locked;
+     thread_list*   owner;
+     kwaitq_t       waitq;
+} kmutex_t;
+
+typedef struct ksem_t {
+     volatile UINT64 count;
+     kwaitq_t        waitq;
+} ksem_t;
+
+typedef struct kcond_t {
+     kwaitq_t waitq;
+} kcond_t;
+
+#define KWAITQ_INIT  {0,NULL,NULL}
+#define KMUTEX_INIT  {0,NULL,KWAITQ_INIT}
+#define KSEM_INIT(n) {(n),KWAITQ_INIT}
+#define KCOND_INIT   {KWAITQ_INIT}
+
+void kwaitq_init(kwaitq_t* q);
+int  kwaitq_wait_on(kwaitq_t* q, volatile UINT64* word, UINT64 val); // sleeps only if *word is still val, 1 if it slept
+int  kwaitq_wake_one(kwaitq_t* q);                 // returns how many threads were woken
+int  kwaitq_wake_all(kwaitq_t* q);                 // change the word first, then wake
+
+// unlock hands the mutex straight to the longest waiter, so a thread that unlocks and relocks can't starve it
+void kmutex_init(kmutex_t* m);
+void kmutex_lock(kmutex_t* m);
+int  kmutex_trylock(kmutex_t* m);                  // 1 if we got it
+void kmutex_unlock(kmutex_t* m);
+
+void ksem_init(ksem_t* s, UINT64 count);
+void ksem_wait(ksem_t* s);
+int  ksem_trywait(ksem_t* s);                      // 1 if a count was taken
+void ksem_post(ksem_t* s);
+VOID EFIAPI ksem_notify(EFI_EVENT e, VOID* s);     // pass to CreateEvent() with the semaphore as context, posts on signal
+
+void kcond_init(kcond_t* c);
+void kcond_wait(kcond_t* c, kmutex_t* m);          // m must be held, it's held again on return
+void kcond_signal(kcond_t* c);
+void kcond_broadcast(kcond_t* c);
+
+#endif
@@ -8,6 +8,10 @@
 #include "dmthread.h"
 #include "k_utsname.h"
 #include "k_vfs.h"
+#include "k_pmm.h"
+#include "k_heap.h"
+#include "k_imgcache.h"
+#include "k_sync.h"
 
 #include <sys/EfiSysCall.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -35,8 +39,6 @@
 extern EFI_BOOT_SERVICES *BS;
 extern EFI_HANDLE gImageHandle;
 
-extern task_def_t* tasks;
-
 void sys_exit() {
 //     kill_task(ctx->task_id);
 }
@@ -80,25 +82,116 @@ EFI_STATUS OpenShellProtocol( EFI_SHELL_PROTOCOL            **gEfiShellProtocol
   return Status;
 }
 
-void uefi_run(void* _t) {
-     char* _filename = (char*)_t;
-     EFI_STATUS rstat = 0;
-     EFI_SHELL_PROTOCOL            *shell;
-     EFI_DEVICE_PATH_PROTOCOL *path;
-     EFI_STATUS s = OpenShellProtocol(&shell);
+// LoadImage() from memory and start it, the cache only has to hold on to the image until LoadImage() returns
+static EFI_STATUS run_image(char* name, EFI_DEVICE_PATH_PROTOCOL* path, void* image, UINT64 size, imgcache_ent_t* img, int hit, UINT64 start) {
      EFI_HANDLE child_h;
-     path = shell->GetDevicePathFromFilePath(_filename);
-
-     s = BS->LoadImage(0,gImageHandle,path,NULL,NULL,&child_h);
+     EFI_STATUS s = BS->LoadImage(FALSE,gImageHandle,path,image,size,&child_h);
+     if(img != NULL) imgcache_release(img);
      if(EFI_ERROR(s)) {
         klog("UEFI",0,"Could not load image! Error: %d",s);
-     } else {
-        s = BS->StartImage(child_h,NULL,NULL);
-        BS->UnloadImage(child_h);
+        return s;
+     }
+     klog("UEFI",1,"Loaded %s in %lld us%s",name,thread_now_us()-start,hit ? " from the image cache" : "");
+     s = BS->StartImage(child_h,NULL,NULL);
+     BS->UnloadImage(child_h);
+     return s;
+}
+
+typedef struct shell_image_t {
+     EFI_SHELL_PROTOCOL* shell;
+     SHELL_FILE_HANDLE   fh;
+} shell_image_t;
+
+static int shell_read_image(void* ctx, void* buf, UINT64 size) {
+     shell_image_t* src = (shell_image_t*)ctx;
+     UINTN len = size;
+     EFI_STATUS s = src->shell->ReadFile(src->fh,&len,buf);
+     return (EFI_ERROR(s) || len != size) ? 1 : 0;
+}
+
+static int vfs_read_image(void* ctx, void* buf, UINT64 size) {
+     vfs_fd_t* fd = (vfs_fd_t*)ctx;
+     vfs_lseek(fd,0,SEEK_SET);
+     return (vfs_fread(fd,buf,size) == size) ? 0 : 1;
+}
+
+// only has to change when the file does
+static UINT64 efi_time_stamp(EFI_TIME* t) {
+     UINT64 secs = (((((UINT64)t->Year*12 + t->Month)*31 + t->Day)*24 + t->Hour)*60 + t->Minute)*60 + t->Second;
+     return secs*1000 + t->Nanosecond/1000000;
+}
+
+void uefi_run(char* filename, CHAR16* wfname) {
+     EFI_SHELL_PROTOCOL *shell;
+     EFI_DEVICE_PATH_PROTOCOL *path;
+     EFI_FILE_INFO* info;
+     imgcache_ent_t* img;
+     shell_image_t src;
+     int hit;
+     UINT64 start = thread_now_us();
+     EFI_STATUS s = OpenShellProtocol(&shell);
+     if(EFI_ERROR(s)) {
+        klog("UEFI",0,"Could not locate shell protocol");
+        return;
+     }
+     path = shell->GetDevicePathFromFilePath(wfname);
+     s = shell->OpenFileByName(wfname,&src.fh,EFI_FILE_MODE_READ);
+     if(EFI_ERROR(s)) {
+        klog("UEFI",0,"Could not open image %s",filename);
+        return;
+     }
+     src.shell = shell;
+     info = shell->GetFileInfo(src.fh);
+     if(info == NULL) {
+        shell->CloseFile(src.fh);
+        return;
+     }
+     img = imgcache_get(wfname,StrSize(wfname),info->FileSize,efi_time_stamp(&info->ModificationTime),shell_read_image,&src,&hit);
+     BS->FreePool(info);
+     shell->CloseFile(src.fh);
+     if(img == NULL) {
+        klog("UEFI",0,"Could not read image %s",filename);
+        return;
+     }
+     run_image(filename,path,img->data,img->size,img,hit,start);
+}
+
+// load an image straight out of the VFS rather than through the UEFI filesystem drivers
+// used for initrd: so init and friends can start while the initrd is still streaming in
+int vfs_run(char* path) {
+     UINT64 start = thread_now_us();
+     imgcache_ent_t* img = NULL;
+     int hit = 0;
+     vfs_fd_t* fd = vfs_fopen(path,"r");
+     if(fd == NULL) {
+        klog("UEFI",0,"Could not open image %s",path);
+        return 1;
+     }
+     struct stat st;
+     if(vfs_fstat(fd,&st) != 0) {
+        vfs_fclose(fd);
+        return 1;
+     }
+
+     size_t len = st.st_size;
+     void* image = vfs_fmap(fd,0,&len);
+     if(image == NULL || len < st.st_size) { // not contiguous in memory, read it in or find it already read
+        img = imgcache_get(path,strlen(path)+1,st.st_size,st.st_mtime,vfs_read_image,fd,&hit);
+        if(img == NULL) {
+           klog("UEFI",0,"Could not read image %s",path);
+           vfs_fclose(fd);
+           return 1;
+        }
+        image = img->data;
      }
+
+     EFI_STATUS s = run_image(path,NULL,image,st.st_size,img,hit,start);
+     vfs_fclose(fd);
+     return EFI_ERROR(s) ? 1 : 0;
 }
 
 typedef struct spawn_req_t {
+    char* path;
     char* wfname;
     char** argv;
     char** envp;
@@ -107,11 +200,14 @@ typedef struct spawn_req_t {
 void spawn_req(void* arg) {
      task_def_t* t = (task_def_t*)arg;
      spawn_req_t *req = (spawn_req_t*)t->arg;
-     char* spawn_filename = calloc(1024,1);
-     wcstombs(spawn_filename,req->wfname,1024);
-     klog("SPAWN",1,"Trying to spawn %s",spawn_filename);
-     free(spawn_filename);
-     uefi_run((void*)req->wfname);
+     klog("SPAWN",1,"Trying to spawn %s",req->path);
+     sys_init();
+     if(strncmp(req->path,"initrd:",7)==0) {
+        vfs_run(req->path+7);
+     } else {
+        uefi_run(req->path,req->wfname);
+     }
+     free(req->path);
      free(req);
 }
 
@@ -122,6 +218,8 @@ pid_t sys_spawn(char* path, char** argv, char** envp) {
      mbstowcs((wchar_t *)wfname, path, strlen(path) + 1);
      conv_backslashes(wfname);
      spawn_req_t* req = calloc(sizeof(spawn_req_t),1);
+     req->path   = malloc(strlen(path)+1);
+     strcpy(req->path,path);
      req->wfname = wfname;
      req->argv   = argv;
      req->envp   = envp;
@@ -132,23 +230,25 @@ pid_t sys_spawn(char* path, char** argv, char** envp) {
 
 // used to setup a userspace process
 void sys_init() { 
-     int cur_pid = get_cur_task();
-     tasks[cur_pid].fds[0] = vfs_fopen("/dev/console","r");
-     tasks[cur_pid].fds[1] = vfs_fopen("/dev/console","w");
-     tasks[cur_pid].fds[2] = vfs_fopen("/dev/console","w");
+     task_def_t* t = get_task(get_cur_task());
+     if(t == NULL) return;
+     fd_table_set(&(t->fds),0,vfs_fopen("/dev/console","r"));
+     fd_table_set(&(t->fds),1,vfs_fopen("/dev/console","w"));
+     fd_table_set(&(t->fds),2,vfs_fopen("/dev/console","w"));
 }
 
 void sys_getcwd(char* buf, size_t size) {
      int cur_pid = get_cur_task();
-     if(tasks[cur_pid].cwd == NULL) return NULL;
+     task_def_t* t = get_task(cur_pid);
+     if(t == NULL || t->cwd == NULL) return NULL;
 
-     strncpy(buf,tasks[cur_pid].cwd,size);
+     strncpy(buf,t->cwd,size);
      klog("GETCWD",1,"Task %d is in %s",cur_pid,buf);
 }
 
 void* sys_getenvp() {
-      int cur_pid = get_cur_task();
-      return tasks[cur_pid].environ;
+      task_def_t* t = get_task(get_cur_task());
+      return (t != NULL) ? t->environ : NULL;
 }
 
 // ripped from newlib
@@ -173,23 +273,25 @@ char* unix_dirname(char *path)
 
 int sys_chdir(char* path) {
      int cur_pid = get_cur_task();
+     task_def_t* t = get_task(cur_pid);
      klog("CHDIR",1,"Trying to chdir for task %d to %s",cur_pid,path);
-     if(tasks[cur_pid].cwd == NULL) tasks[cur_pid].cwd = calloc(PATH_MAX,1);
+     if(t == NULL) return -1;
+     if(t->cwd == NULL) t->cwd = calloc(PATH_MAX,1);
      if(path[strlen(path)]=='/') path[strlen(path)]==0; // eliminate trailing /
      if(path[0]=='/') {  // absolute path
-        strncpy(tasks[cur_pid].cwd,path,PATH_MAX);
+        strncpy(t->cwd,path,PATH_MAX);
      } else {
         char tmp_buf[PATH_MAX];
-        if(strlen(tasks[cur_pid].cwd)>1) {
+        if(strlen(t->cwd)>1) {
            if(strncmp(path,"..",strlen(path))==0) { 
-              snprintf(tmp_buf,PATH_MAX,"%s",unix_dirname(tasks[cur_pid].cwd));
+              snprintf(tmp_buf,PATH_MAX,"%s",unix_dirname(t->cwd));
            } else {
-              snprintf(tmp_buf,PATH_MAX,"%s/%s",tasks[cur_pid].cwd,path);
+              snprintf(tmp_buf,PATH_MAX,"%s/%s",t->cwd,path);
            }
         }else {
            snprintf(tmp_buf,PATH_MAX,"/%s",path);
         }
-        strncpy(tasks[cur_pid].cwd,tmp_buf,PATH_MAX);
+        strncpy(t->cwd,tmp_buf,PATH_MAX);
      }
      // TODO - check with VFS layer if the requested path exists
      return 0;
@@ -201,26 +303,131 @@ pid_t sys_getpid() {
 
 // ssize_t read(unsigned int fd, char* buf, size_t count)
 ssize_t sys_read(unsigned int fd, void* buf, size_t count) {
-      return read(fd,buf,count);
+      task_def_t* t = get_task(get_cur_task());
+      vfs_fd_t* f = (t != NULL) ? fd_lookup(&(t->fds),fd) : NULL;
+      if(f == NULL || f->fs_handler->read == NULL) return -1;
+      return f->fs_handler->read(f->fs_handler,f->handler_fd,buf,count);
 }
 
 // ssize_t write(int fd, void* buf, uint32 count)
 ssize_t sys_write(unsigned int fd, void* buf, size_t count) {
       // TODO implement multiple terminals etc, different stdin/stdout for different processes
-      // TODO map the fd for the calling process
-      return write(fd,buf,count);
+      task_def_t* t = get_task(get_cur_task());
+      vfs_fd_t* f = (t != NULL) ? fd_lookup(&(t->fds),fd) : NULL;
+      if(f == NULL || f->fs_handler->write == NULL) return -1;
+      return f->fs_handler->write(f->fs_handler,f->handler_fd,buf,count);
 }
 
 void* sys_malloc(size_t size) {
-      return malloc(size);
+      return kmalloc(size);
 }
 
 void sys_free(void* ptr) {
-     free(ptr);
+     kfree(ptr);
 }
 
 void* sys_realloc(void* ptr, size_t size) {
-      return realloc(ptr,size);
+      return krealloc(ptr,size);
+}
+
+// ranges sys_pagealloc() gave a task, so sys_pagefree() only takes back what was handed out and whatever the task
+// still holds goes back when it exits
+struct task_pages_t {
+     void*          addr;
+     UINTN          pages;
+     int            firmware;      // from BS->AllocatePages, the page pool couldn't do it
+     task_pages_t*  next;
+};
+
+static kmutex_t task_pages_lock = KMUTEX_INIT;
+
+static void task_pages_release(task_pages_t* p) {
+     if(p->firmware) {
+        thread_enter_bsp();
+        BS->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)p->addr,p->pages);
+        thread_leave_bsp();
+     } else {
+        pmm_free_pages(p->addr,p->pages);
+     }
+     kfree(p);
+}
+
+void pagealloc_task_exit(task_def_t* t) {
+     task_pages_t* p;
+     kmutex_lock(&task_pages_lock);
+     p = t->pages;
+     t->pages = NULL;
+     kmutex_unlock(&task_pages_lock);
+     while(p != NULL) {
+        task_pages_t* next = p->next;
+        task_pages_release(p);
+        p = next;
+     }
+}
+
+// void* pagealloc(size_t pages, size_t align_pages) - align_pages is a power of 2, the region starts on a multiple of
+// align_pages pages - used by userland malloc to get memory in big chunks instead of trapping for every allocation
+void* sys_pagealloc(size_t pages, size_t align_pages) {
+      task_def_t* t = get_task(get_cur_task());
+      task_pages_t* p;
+      EFI_PHYSICAL_ADDRESS addr;
+      UINT64 align;
+      UINT64 aligned;
+      UINT64 head;
+      UINT64 extra;
+      if(t == NULL || pages == 0) return NULL;
+      if(align_pages == 0) align_pages = 1;
+      if((align_pages & (align_pages-1)) != 0) return NULL;
+      p = (task_pages_t*)kmalloc(sizeof(task_pages_t));
+      if(p == NULL) return NULL;
+      p->pages    = pages;
+      p->firmware = 0;
+      p->addr     = pmm_alloc_pages(pages,align_pages);
+
+      if(p->addr == NULL) {
+         // the page pool couldn't do it, ask the firmware
+         extra = align_pages-1;
+         if(EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiLoaderData,pages+extra,&addr))) {
+            kfree(p);
+            return NULL;
+         }
+         align   = align_pages*EFI_PAGE_SIZE;
+         aligned = (addr + align-1) & ~(align-1);
+         head    = (aligned-addr)/EFI_PAGE_SIZE;
+         if(head > 0)         BS->FreePages(addr,head);
+         if(extra-head > 0)   BS->FreePages(aligned + pages*EFI_PAGE_SIZE,extra-head);
+         p->addr     = (void*)(UINTN)aligned;
+         p->firmware = 1;
+      }
+
+      kmutex_lock(&task_pages_lock);
+      p->next  = t->pages;
+      t->pages = p;
+      kmutex_unlock(&task_pages_lock);
+      return p->addr;
+}
+
+// int pagefree(void* ptr, size_t pages) - exactly a range pagealloc() returned to this task
+int sys_pagefree(void* ptr, size_t pages) {
+      task_def_t* t = get_task(get_cur_task());
+      task_pages_t** link;
+      task_pages_t* p = NULL;
+      if(t == NULL || ptr == NULL || pages == 0) return -1;
+      kmutex_lock(&task_pages_lock);
+      for(link=&(t->pages); *link != NULL; link=&((*link)->next)) {
+          if((*link)->addr == ptr && (*link)->pages == pages) {
+             p     = *link;
+             *link = p->next;
+             break;
+          }
+      }
+      kmutex_unlock(&task_pages_lock);
+      if(p == NULL) {
+         klog("PAGEFREE",0,"Task %d tried to free %d pages at %#llx it wasn't given",t->task_id,pages,ptr);
+         return -1;
+      }
+      task_pages_release(p);
+      return 0;
 }
 
 int sys_uname (struct utsname *buf) {
@@ -233,26 +440,98 @@ pid_t sys_wait(int* status) {
 
 
 int sys_execve(char *filename, char **argv, char** envp) {
+    if(strncmp(filename,"initrd:",7)==0) return vfs_run(filename+7);
     CHAR16 *wfname = (CHAR16 *)malloc((strlen(filename) + 1) * sizeof(CHAR16));
     mbstowcs((wchar_t *)wfname, filename, strlen(filename) + 1);
     conv_backslashes(wfname);
-    uefi_run((void*)wfname);
+    uefi_run(filename,wfname);
 
     return 0;
 }
 
+#define ZSYSCALL_SELFTEST  666 // int 0x80 only, returns 42
+#define ZSYSCALL_FASTPROBE 667 // int 0x80 only, returns 1 if userland may use SYSCALL
+
+#define MSR_EFER      0xC0000080
+#define MSR_STAR      0xC0000081
+#define MSR_LSTAR     0xC0000082
+#define MSR_FMASK     0xC0000084
+#define EFER_SCE      1
+#define SYSCALL_FMASK 0x700      // TF, IF and DF, the same state the int 0x80 interrupt gate gives the handler
+
+UINT16 z_syscall_ss;        // firmware's stack selector, SYSCALL loads STAR CS+8 which needn't be a data segment
+int    z_fast_syscalls = 0;
+
+UINT64 EFIAPI syscall_dispatch(UINT64 a, UINT64 b, UINT64 c, UINT64 num) {
+     if(num >= sizeof(syscalls)/sizeof(syscalls[0])) return (UINT64)-1;
+     UINT64 (*teh_syscall)(UINT64 a, UINT64 b, UINT64 c) = syscalls[num];
+     return teh_syscall(a,b,c);
+}
+
+// SYSCALL entry point
+// everything runs in ring 0, where SYSRET can't be used as it always returns to ring 3 - instead the caller's rflags
+// (saved by the CPU in r11) are restored with popfq and the return address (saved in rcx) is popped by ret
+// userland moves the first argument to r10 as rcx is lost, the rest are where the MS ABI puts them
+void z_syscall_entry();
+__asm__(
+     ".text\n"
+     ".globl z_syscall_entry\n"
+     "z_syscall_entry:\n"
+     "   movw z_syscall_ss(%rip), %ss\n"
+     "   pushq %rcx\n"
+     "   pushq %r11\n"
+     "   pushq %rbp\n"
+     "   movq %rsp, %rbp\n"
+     "   andq $-16, %rsp\n"
+     "   subq $32, %rsp\n"             // shadow space for syscall_dispatch
+     "   movq %r10, %rcx\n"
+     "   movq %rax, %r9\n"
+     "   call syscall_dispatch\n"
+     "   movq %rbp, %rsp\n"
+     "   popq %rbp\n"
+     "   popfq\n"
+     "   ret\n"
+);
+
 void EFIAPI syscall_inter_handler(IN CONST EFI_EXCEPTION_TYPE InterruptType, IN CONST EFI_SYSTEM_CONTEXT SystemContext) {
-     if(SystemContext.SystemContextX64->Rax == 666) {
+     if(SystemContext.SystemContextX64->Rax == ZSYSCALL_SELFTEST) {
         SystemContext.SystemContextX64->Rax = 42;
         return;
      }
-     UINT64 retval;
-     UINT64 (*teh_syscall)(UINT64 a, UINT64 b, UINT64 c) = syscalls[SystemContext.SystemContextX64->Rax];
+     if(SystemContext.SystemContextX64->Rax == ZSYSCALL_FASTPROBE) {
+        SystemContext.SystemContextX64->Rax = z_fast_syscalls;
+        return;
+     }
      // this is a crazy hack due to ABI differences
-     retval = teh_syscall(             SystemContext.SystemContextX64->Rcx,
-             SystemContext.SystemContextX64->Rdx,
-             SystemContext.SystemContextX64->R8);
-     SystemContext.SystemContextX64->Rax = retval;
+     SystemContext.SystemContextX64->Rax = syscall_dispatch(SystemContext.SystemContextX64->Rcx,
+                                                            SystemContext.SystemContextX64->Rdx,
+                                                            SystemContext.SystemContextX64->R8,
+                                                            SystemContext.SystemContextX64->Rax);
+}
+
+static void fast_syscall_init() {
+     UINT32 edx;
+     UINT16 cs;
+     UINT64 a;
+
+     AsmCpuid(0x80000001,NULL,NULL,NULL,&edx);
+     if(!(edx & (1 << 11))) {
+        klog("CPU",0,"SYSCALL not supported, using int 0x80 only");
+        return;
+     }
+     __asm__ volatile("mov %%cs, %0" : "=r"(cs));
+     __asm__ volatile("mov %%ss, %0" : "=r"(z_syscall_ss));
+     AsmWriteMsr64(MSR_STAR,  (UINT64)cs << 32);
+     AsmWriteMsr64(MSR_LSTAR, (UINT64)(UINTN)&z_syscall_entry);
+     AsmWriteMsr64(MSR_FMASK, SYSCALL_FMASK);
+     AsmWriteMsr64(MSR_EFER,  AsmReadMsr64(MSR_EFER) | EFER_SCE);
+
+     __asm__ volatile("syscall"
+                      : "=a"(a)
+                      : "a"((UINT64)ZSYSCALL_GETPID)
+                      : "rcx","rdx","r8","r9","r10","r11","xmm0","xmm1","xmm2","xmm3","xmm4","xmm5","memory","cc");
+     klog("CPU",1,"SYSCALL fast path enabled, getpid returned %d",a);
+     z_fast_syscalls = 1;
 }
 
 void cpu_proto_init() {
@@ -265,6 +544,7 @@ void cpu_proto_init() {
         klog("CPU",1,"Opened arch protocol!");
      }
 
+     // int 0x80 stays as the fallback for CPUs without SYSCALL, and it's how userland finds out which to use
      s = cpu_proto->RegisterInterruptHandler(cpu_proto,0x80,syscall_inter_handler);
      if(EFI_ERROR(s)) {
         klog("CPU",0,"Could not register 0x80 handler: %d",s);
@@ -277,6 +557,6 @@ void cpu_proto_init() {
              "int $0x80;"
              :"=a"(a)::);
      klog("CPU",1,"Got back %d from syscall",a);
-}
-
 
+     fast_syscall_init();
+}
@@ -15,4 +15,12 @@
 
 void cpu_proto_init();
 
+extern int z_fast_syscalls;                // SYSCALL can be used as well as int 0x80
+
+typedef struct task_pages_t task_pages_t;
+void pagealloc_task_exit(task_def_t* t);   // gives back everything sys_pagealloc() handed the task
+
+// runs syscall num, shared by the SYSCALL and int 0x80 entry points and the zring
+UINT64 EFIAPI syscall_dispatch(UINT64 a, UINT64 b, UINT64 c, UINT64 num);
+
 #endif
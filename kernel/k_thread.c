@@ -11,134 +11,288 @@
 #include "kmsg.h"
 #include "k_thread.h"
 #include "dmthread.h"
+#include "k_sync.h"
+#include "k_heap.h"
+#include "k_zring.h"
+#include "k_syscalls.h"
 
 extern EFI_BOOT_SERVICES *BS;
 
-task_def_t tasks[4096];
+// PID table
+//
+// A 3 level radix tree of 32-way nodes keyed by PID. Nodes only exist for the parts of the PID space that have been
+// used and are never freed, so get_task() walks it without taking a lock. PIDs come from a cursor that wraps at
+// TASK_PID_MAX and skips anything still in the table, so a PID isn't handed out again until the rest of the space
+// has been gone through. Task structs come from the kernel heap, fd tables are allocated on first use.
 
-task_def_t *pending_tasks       = NULL;
-task_def_t *pending_tasks_last  = NULL;
+#define PIDTAB_BITS   5
+#define PIDTAB_FANOUT (1 << PIDTAB_BITS)
+#define PIDTAB_LEVELS 3
 
-volatile UINT8 req_tasks_lock=0; // crappy crappy mutex
+typedef struct pidtab_node_t {
+     void* slots[PIDTAB_FANOUT];
+} pidtab_node_t;
 
-UINT64    last_task_id    = 0;
-UINT64    max_task_id     = 0;
-UINT64    cur_task_id     = 0;
+static pidtab_node_t pidtab_root;
+static kmutex_t      pidtab_lock  = KMUTEX_INIT;
+static UINT64        pidtab_nodes = 0;
+static UINT64        next_pid     = 1;
+static UINT64        task_count   = 0;
+static task_def_t    kernel_task;          // PID 0, what the main thread and kernel tasks see as their own
+static task_def_t*   dead_tasks   = NULL;  // exited while still running on their own stack, freed by the next caller
 
-void acquire_tasks_lock() {   // warning - this motherfucker blocks FOREVER, FOR ALL ETERNITY if already locked
-     while(__sync_lock_test_and_set(&req_tasks_lock, 1)) {
-     }
+// task requests - any thread can push, only main pops (Vyukov's intrusive MPSC queue)
+// a push is one atomic exchange, a producer preempted between the exchange and linking its node in leaves main
+// unable to see past it for a moment, so main yields until the link shows up
+static task_def_t  req_stub;
+static task_def_t* volatile req_head = &req_stub;  // producers swap themselves in here
+static task_def_t* req_tail = &req_stub;           // only main touches this
+static ksem_t      req_count = KSEM_INIT(0);       // one per request pushed, main sleeps on it
+
+static void req_push(task_def_t* t) {
+     task_def_t* prev;
+     t->next = NULL;
+     prev = __sync_lock_test_and_set(&req_head,t); // xchg, a full barrier on x86
+     prev->next = t;
 }
 
-void release_tasks_lock() {
-     __sync_synchronize();
-     req_tasks_lock=0;
+static task_def_t* req_pop() {
+     task_def_t* tail = req_tail;
+     task_def_t* next = tail->next;
+     if(tail == &req_stub) {
+        if(next == NULL) return NULL;
+        req_tail = next;
+        tail     = next;
+        next     = next->next;
+     }
+     if(next != NULL) {
+        req_tail = next;
+        return tail;
+     }
+     if(tail != req_head) return NULL; // a push is halfway through
+     req_push(&req_stub);
+     next = tail->next;
+     if(next != NULL) {
+        req_tail = next;
+        return tail;
+     }
+     return NULL;
 }
 
 void init_tasks() {
-     acquire_tasks_lock();
-     task_def_t* t = pending_tasks;
-     while(t != NULL) {
-       klog("TASKING",1,"Found a task_req");
-       if(t != NULL) {
-          UINT64 new_task_id = init_task(t->task_proc, t->arg, t->task_id);
-          klog("TASKING",1,"task_req %d honoured",new_task_id);
-       }
-       if(t-> next != NULL) {
-          t = t->next;
-          free(t->prev);
-          t->prev = NULL;
-       } else {
-          free(t);
-          t = NULL;
-       }
-     }
-     pending_tasks      = NULL;
-     pending_tasks_last = NULL;
-     release_tasks_lock();
+     task_def_t* t;
+     ksem_wait(&req_count);
+     do {
+        while((t = req_pop()) == NULL) { // counted but not linked in yet
+           thread_yield();
+           __sync_synchronize();
+        }
+        klog("TASKING",1,"Found a task_req");
+        UINT64 new_task_id = init_task(t->task_proc, t->arg, t->task_id);
+        klog("TASKING",1,"task_req %d honoured",new_task_id);
+        kfree(t);
+     } while(ksem_trywait(&req_count));
 }
 
 UINT64 get_cur_task() {
-     return sys.current->thread.task_id;
+     return thread_self()->thread.task_id;
 }
 
 void req_task(void (*task_proc)(void* ctx), void* arg) {
-     acquire_tasks_lock();
-     if(pending_tasks == NULL) {  // need to setup the list
-        pending_tasks = (task_def_t*)malloc(sizeof(task_def_t));
-        BS->SetMem((void*)pending_tasks,sizeof(task_def_t),0);
-        pending_tasks->arg       = arg;
-        pending_tasks->task_proc = task_proc;
-        pending_tasks_last = pending_tasks;
+     task_def_t* new_task = (task_def_t*)kmalloc(sizeof(task_def_t));
+     if(new_task == NULL) {
+        klog("TASKING",0,"Out of memory queueing task at %#llx",task_proc);
+        return;
+     }
+     BS->SetMem((void*)new_task,sizeof(task_def_t),0);
+     new_task->task_proc = task_proc;
+     new_task->arg       = arg;
+     req_push(new_task);
+     ksem_post(&req_count);
+}
+
+static void** pidtab_slot(UINT64 pid, int create) {
+     pidtab_node_t* n = &pidtab_root;
+     pidtab_node_t* child;
+     UINTN idx;
+     int level;
+     if(pid >= TASK_PID_MAX) return NULL;
+     for(level=PIDTAB_LEVELS-1; level > 0; level--) {
+         idx   = (pid >> (level*PIDTAB_BITS)) & (PIDTAB_FANOUT-1);
+         child = (pidtab_node_t*)n->slots[idx];
+         if(child == NULL) {
+            if(!create) return NULL;
+            child = (pidtab_node_t*)kmalloc(sizeof(pidtab_node_t));
+            if(child == NULL) return NULL;
+            BS->SetMem((void*)child,sizeof(pidtab_node_t),0);
+            pidtab_nodes++;
+            __sync_synchronize(); // zeroed before a lockless reader can get to it
+            n->slots[idx] = child;
+         }
+         n = child;
+     }
+     return &(n->slots[pid & (PIDTAB_FANOUT-1)]);
+}
+
+// call with pidtab_lock held, 0 if the table is full
+static UINT64 alloc_pid() {
+     UINT64 tries;
+     void** slot;
+     for(tries=0; tries < TASK_PID_MAX; tries++) {
+         if(next_pid >= TASK_PID_MAX) next_pid = 1;
+         slot = pidtab_slot(next_pid,1);
+         if(slot == NULL) return 0;
+         if(*slot == NULL) return next_pid++;
+         next_pid++;
+     }
+     return 0;
+}
+
+static void free_task(task_def_t* t) {
+     zring_task_exit(t);
+     pagealloc_task_exit(t);
+     fd_table_free(&(t->fds));
+     free(t->cwd);
+     kfree(t);
+}
+
+// tasks that died on their own stack can go once some other thread gets here
+static void free_dead_tasks() {
+     task_def_t* t;
+     task_def_t* keep = NULL;
+     while(dead_tasks != NULL) {
+        t = dead_tasks;
+        dead_tasks = t->next;
+        if(t->ctx == NULL || t->ctx == thread_self()) {
+           t->next = keep;
+           keep = t;
+        } else {
+           free_task(t);
+        }
+     }
+     dead_tasks = keep;
+}
+
+// takes t out of the table, call with pidtab_lock held
+static void remove_task(task_def_t* t) {
+     void** slot = pidtab_slot(t->task_id,0);
+     if(slot != NULL && *slot == t) {
+        *slot = NULL;
+        task_count--;
+     }
+     // a task with no thread yet can't be known to be off its stack, so it's never freed here
+     if(t->ctx == NULL || t->ctx == thread_self()) {
+        t->next = dead_tasks;
+        dead_tasks = t;
      } else {
-        task_def_t* new_task = (task_def_t*)malloc(sizeof(task_def_t));
-        BS->SetMem((void*)new_task,sizeof(task_def_t),0);
-        new_task->prev = pending_tasks_last;
-        pending_tasks_last->next = new_task;
+        free_task(t);
      }
-     release_tasks_lock();
+}
+
+// every task starts here so its PID goes back in the pool when task_proc returns
+static void task_entry(void* arg) {
+     task_def_t* t = (task_def_t*)arg;
+     thread_self()->thread.task_id = t->task_id;
+     ((void (*)(void*))t->task_proc)(t);
+     kmutex_lock(&pidtab_lock);
+     remove_task(t);
+     kmutex_unlock(&pidtab_lock);
 }
 
 UINT64 init_task(void (*task_proc)(void* ctx), void* arg, UINT64 desired_id) {
      UINT64 new_task_id;
+     void** slot;
+     task_def_t* new_task = (task_def_t*)kmalloc(sizeof(task_def_t));
+     if(new_task == NULL) return 0;
+     BS->SetMem((void*)new_task,sizeof(task_def_t),0);
+
+     kmutex_lock(&pidtab_lock);
+     free_dead_tasks();
      if(desired_id <= 0) {
-        new_task_id = last_task_id+1;
-        if(tasks[new_task_id].task_id > 0) return;
-        max_task_id++;
+        new_task_id = alloc_pid();
      } else {
-       new_task_id = desired_id;
+        slot = pidtab_slot(desired_id,1);
+        new_task_id = (slot != NULL && *slot == NULL) ? desired_id : 0;
+     }
+     if(new_task_id == 0) {
+        kmutex_unlock(&pidtab_lock);
+        kfree(new_task);
+        klog("TASKING",0,"No free task ID for task at %#llx",task_proc);
+        return 0;
      }
      klog("TASKING",1,"Starting task ID %d at %#llx",new_task_id,task_proc);
 
-     task_def_t new_task;
+     new_task->task_id   = new_task_id;
+     new_task->task_proc = task_proc;
+     new_task->arg       = arg;
+     fd_table_init(&(new_task->fds));
 
-     new_task.task_id       = new_task_id;
-     new_task.task_proc     = task_proc;
-     new_task.arg           = arg;
-     new_task.cwd           = NULL;
-     tasks[new_task_id]  = new_task;
-     tasks[new_task_id].ctx = create_thread((thread_func_t)task_proc,&(tasks[new_task_id]));
-     tasks[new_task_id].ctx->thread.task_id = new_task_id;
-     last_task_id = new_task_id; 
-     return new_task.task_id;
+     // the thread can run, and even finish, before create_thread() returns - holding the lock until ctx is filled in
+     // keeps its remove_task() (and anyone's kill_task()) waiting, and the table only shows it once it's complete
+     new_task->ctx = create_thread((thread_func_t)task_entry,new_task);
+     if(new_task->ctx == NULL) {
+        kmutex_unlock(&pidtab_lock);
+        fd_table_free(&(new_task->fds));
+        kfree(new_task);
+        klog("TASKING",0,"No thread for task at %#llx",task_proc);
+        return 0;
+     }
+     new_task->ctx->thread.task_id = new_task_id;
+     *pidtab_slot(new_task_id,1) = new_task;
+     task_count++;
+     kmutex_unlock(&pidtab_lock);
+     return new_task_id;
 }
 
 void init_kernel_task(void (*task_proc)(void* ctx), void* arg) {
      klog("TASKING",1,"init_kernel task at %#llx",task_proc);
-     task_def_t *new_task = (task_def_t*)malloc(sizeof(task_def_t));
+     task_def_t *new_task = (task_def_t*)kmalloc(sizeof(task_def_t));
+     BS->SetMem((void*)new_task,sizeof(task_def_t),0);
      new_task->task_id   = -1;
      new_task->task_proc = task_proc;
      new_task->arg       = arg;
-     new_task->ctx = create_thread((thread_func_t)task_proc,&new_task);
+     new_task->ctx = create_thread((thread_func_t)task_proc,new_task);
      new_task->ctx->thread.task_id = 0;
 
 }
 
 task_def_t *get_task(UINT64 task_id) {
-     task_def_t* retval = NULL;
-     retval = &(tasks[task_id]);
-     return retval;
+     void** slot = pidtab_slot(task_id,0);
+     return (slot != NULL) ? (task_def_t*)*slot : NULL;
+}
+
+UINT64 get_task_count() {
+     return task_count;
+}
+
+UINT64 get_task_table_bytes() {
+     return task_count*sizeof(task_def_t) + pidtab_nodes*sizeof(pidtab_node_t);
 }
 
 void kill_task(UINT64 task_id) {
-     task_def_t* t = get_task(task_id);
-     dmthread_t *dmthread_ctx = (dmthread_t*)t->ctx;
-     dmthread_ctx->status = STATUS_DEAD;
+     task_def_t* t;
+     if(task_id == 0) return;
+     kmutex_lock(&pidtab_lock);
+     free_dead_tasks();
+     t = get_task(task_id);
+     if(t != NULL) {
+        if(t->ctx != NULL) thread_kill(t->ctx);
+        remove_task(t);
+     }
+     kmutex_unlock(&pidtab_lock);
 }
 
 void scheduler_start() {
      klog("TASKING",1,"Configuring task table");
-     BS->SetMem((void*)tasks,sizeof(task_def_t)*4096,0);
-
+     BS->SetMem((void*)&kernel_task,sizeof(task_def_t),0);
+     fd_table_init(&(kernel_task.fds));
+     *pidtab_slot(0,1) = &kernel_task;
 }
 
 
 void yield_until(EFI_EVENT e) {
      // TODO - implement a timeout of some sort
-     for(;;) {
-         EFI_STATUS s = BS->CheckEvent(e);
-         if(s==EFI_SUCCESS) return;
-         thread_yield();
-     }
+     if(BS->CheckEvent(e)==EFI_SUCCESS) return;
+     thread_wait_event(e); // off the run queue until the scheduler sees e signalled
 }
 
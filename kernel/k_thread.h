@@ -8,6 +8,9 @@
 #include <Library/PcdLib.h>
 #include <Library/UefiLib.h>
 #include "k_vfs.h"
+#include "k_fdtable.h"
+
+#define TASK_PID_MAX 32768   // PIDs are 1 to TASK_PID_MAX-1, 0 is the kernel
 
 typedef struct task_def_t {
    int task_id;
@@ -15,9 +18,11 @@ typedef struct task_def_t {
    thread_list* ctx;
    void* arg;
 
-   vfs_fd_t* fds[512]; // file descriptor table
+   fd_table_t fds; // file descriptor table
    char** environ;
    char* cwd;
+   void* zring;    // zring_ctx_t, if the task registered a syscall ring
+   struct task_pages_t* pages; // what sys_pagealloc() has given the task
 
    struct task_def_t *next;
    struct task_def_t *prev;
@@ -28,9 +33,11 @@ UINT64 get_cur_task();
 // TODO - make req_task return the task ID
 void req_task(void (*task_proc)(void* ctx), void* arg);    // request a task init
 UINT64 init_task(void (*task_proc)(void* ctx), void* arg, UINT64 desired_id); // actually init the task (from main thread only)
-void init_tasks();                                         // do pending req_task
+void init_tasks();                                         // do pending req_task, sleeps until there is one
 void init_kernel_task(void (*task_proc)(void* ctx), void* arg); // init a kernel task, can NOT be killed - use with care
-struct task_def_t *get_task(UINT64 task_id);
+struct task_def_t *get_task(UINT64 task_id);               // NULL if there's no such task
+UINT64 get_task_count();
+UINT64 get_task_table_bytes();                             // task structs and PID table nodes, not what their fds hold
 void kill_task(UINT64 task_id);
 void scheduler_start();
 
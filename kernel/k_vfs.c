@@ -3,11 +3,14 @@
 #include <stdlib.h>
 #include "kmsg.h"
 #include "k_vfs.h"
+#include "k_vfs_trie.h"
 #include <stdio.h>
 
 #include "vfs/devuefi.h"
 #include "vfs/uefi.h"
 #include "vfs/devfs.h"
+#include "vfs/initrdfs.h"
+#include "vfs/tarfs.h"
 
 #include <Library/UefiLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -32,50 +35,123 @@ vfs_fs_type_t* vfs_fs_type_list_last  = NULL;
 
 char boot_path[PATH_MAX];
 
-vfs_prefix_entry_t* locate_prefix(char* path) { // scan the prefix table for a file
-   vfs_prefix_entry_t* p = vfs_prefix_list_first;
-   int max_len=0;
-   vfs_prefix_entry_t* retval = NULL;
-   while(p != NULL) {
-       if(strncmp(path,p->prefix_str,strlen(p->prefix_str))==0) {
-          if(strlen(p->prefix_str) > max_len) {
-             retval  = p;
-             max_len = strlen(p->prefix_str);
-          }
-       }
-       p = p->next;
-   } 
-   return retval;
+vfs_prefix_entry_t *vfs_prefix_retired = NULL; // unmounted entries, kept around as lockless readers may still hold them
+
+volatile UINT8 vfs_mount_lock=0;
+
+void acquire_mount_lock() {
+     while(__sync_lock_test_and_set(&vfs_mount_lock, 1)) {
+     }
+}
+
+void release_mount_lock() {
+     __sync_synchronize();
+     vfs_mount_lock=0;
+}
+
+vfs_prefix_entry_t* locate_prefix(char* path) { // find the longest mountpoint matching a path
+   return vfs_trie_lookup(path);
+}
+
+// a lockless reader may still find a retired entry, so a handler is only used with a reference taken - once the
+// count's been to 0 the filesystem is shut down and nothing gets a new one
+static int vfs_fs_get(vfs_fs_handler_t* fs_handler) {
+   UINT64 refs;
+   do {
+      refs = fs_handler->refs;
+      if(refs == 0) return 0;
+   } while(!__sync_bool_compare_and_swap(&fs_handler->refs,refs,refs+1));
+   return 1;
+}
+
+void vfs_fs_put(vfs_fs_handler_t* fs_handler) {
+   if(__sync_sub_and_fetch(&fs_handler->refs,1) != 0) return;
+   klog("VFS",1,"Shutting down %s",fs_handler->fs_type);
+   if(fs_handler->shutdown != NULL) fs_handler->shutdown(fs_handler);
 }
 
 vfs_fd_t* vfs_fopen(char* path, char* mode) {
    vfs_prefix_entry_t* p = locate_prefix(path);
-   if(p==NULL) return NULL;
-   if(p->fs_handler->file_exists(p->fs_handler,path)==0) return NULL;
-   vfs_fd_t* retval = malloc(sizeof(vfs_fd_t));
+   if(p==NULL || !vfs_fs_get(p->fs_handler)) return NULL;
+   path += p->prefix_len; // handlers get paths relative to their mountpoint, same as opendir()
+   int exists = p->fs_handler->file_exists(p->fs_handler,path);
+   vfs_fd_t* retval = (exists==0) ? NULL : malloc(sizeof(vfs_fd_t));
+   if(retval == NULL) {
+      vfs_fs_put(p->fs_handler);
+      return NULL;
+   }
    retval->fs_handler = p->fs_handler;
    retval->handler_fd = p->fs_handler->open(p->fs_handler,path, mode);
+   if(retval->handler_fd == NULL) {
+      free(retval);
+      vfs_fs_put(p->fs_handler);
+      return NULL;
+   }
+   return retval; // the fd keeps the reference until vfs_fclose()
+}
+
+int vfs_fclose(vfs_fd_t* fd) {
+   int retval = 0;
+   if(fd == NULL) return -1;
+   if(fd->fs_handler->close != NULL) retval = fd->fs_handler->close(fd->fs_handler,fd->handler_fd);
+   vfs_fs_put(fd->fs_handler);
+   free(fd);
+   return retval;
+}
+
+ssize_t vfs_fread(vfs_fd_t* fd, void* buf, size_t count) {
+   if(fd == NULL || fd->fs_handler->read == NULL) return -1;
+   return fd->fs_handler->read(fd->fs_handler,fd->handler_fd,buf,count);
+}
+
+ssize_t vfs_fwrite(vfs_fd_t* fd, void* buf, size_t count) {
+   if(fd == NULL || fd->fs_handler->write == NULL) return -1;
+   return fd->fs_handler->write(fd->fs_handler,fd->handler_fd,buf,count);
+}
+
+off_t vfs_lseek(vfs_fd_t* fd, off_t offset, int whence) {
+   if(fd == NULL || fd->fs_handler->lseek == NULL) return -1;
+   return fd->fs_handler->lseek(fd->fs_handler,fd->handler_fd,offset,whence);
+}
+
+int vfs_stat(char* path, struct stat *buf) {
+   vfs_prefix_entry_t* p = locate_prefix(path);
+   int retval;
+   if(p==NULL || p->fs_handler->stat == NULL || !vfs_fs_get(p->fs_handler)) return -1;
+   retval = p->fs_handler->stat(p->fs_handler,path+p->prefix_len,buf);
+   vfs_fs_put(p->fs_handler);
    return retval;
 }
 
+int vfs_fstat(vfs_fd_t* fd, struct stat *buf) {
+   if(fd == NULL || fd->fs_handler->fstat == NULL) return -1;
+   return fd->fs_handler->fstat(fd->fs_handler,fd->handler_fd,buf);
+}
+
+void* vfs_fmap(vfs_fd_t* fd, off_t offset, size_t* len) {
+   if(fd == NULL || fd->fs_handler->map == NULL) return NULL;
+   return fd->fs_handler->map(fd->fs_handler,fd->handler_fd,offset,len);
+}
+
 vfs_dir_fd_t* vfs_opendir(char* path) {
    vfs_dir_fd_t* retval = calloc(sizeof(vfs_dir_fd_t),1);
    retval->is_root    = 0;
    vfs_prefix_entry_t* p = locate_prefix(path);
-   if(p==NULL) {
+   if(p==NULL || !vfs_fs_get(p->fs_handler)) {
       free(retval);
       return NULL;
    }
    retval->fs_handler = p->fs_handler;
-   klog("VFS",1,"Will open %s",path+strlen(p->prefix_str));
+   klog("VFS",1,"Will open %s",path+p->prefix_len);
    if(!strcmp(path,p->prefix_str)) {
       retval->is_root = 1;
       retval->last_out = -1;
       // TODO make list_root_dir return vfs_dir_fd_t array and set d_type
       retval->prefix_dirs = p->fs_handler->list_root_dir(p->fs_handler);
    } else {
-      retval->handler_fd = p->fs_handler->opendir(p->fs_handler,path+strlen(p->prefix_str));
+      retval->handler_fd = p->fs_handler->opendir(p->fs_handler,path+p->prefix_len);
    }
+   vfs_fs_put(p->fs_handler); // there's no closedir, so readdir takes its own each time
    return retval;
 }
 
@@ -92,7 +168,9 @@ vfs_dirent_t* vfs_readdir(vfs_dir_fd_t* fd) {
      return retval;
    } else {
      free(retval);
+     if(!vfs_fs_get(fd->fs_handler)) return NULL;
      retval = fd->fs_handler->readdir(fd->fs_handler,fd->handler_fd);
+     vfs_fs_put(fd->fs_handler);
    }
    return retval;
 }
@@ -109,6 +187,12 @@ void vfs_init_types() {
      
      vfs_init_devfs_fs_type();
      vfs_add_type(devfs_fs_type);
+
+     vfs_init_initrdfs_fs_type();
+     vfs_add_type(initrdfs_fs_type);
+
+     vfs_init_tarfs_fs_type();
+     vfs_add_type(tarfs_fs_type);
 }
 
 void vfs_add_type(vfs_fs_type_t *fs_type) {
@@ -176,11 +260,13 @@ void vfs_mount(vfs_fs_handler_t* fs_handler, char* dev_name, char* mountpoint) {
      BS->SetMem((void*)new_entry,sizeof(vfs_prefix_entry_t),0);
 
      new_entry->prefix_str = mountpoint;
+     new_entry->prefix_len = strlen(mountpoint);
      new_entry->dev_name   = dev_name;
      new_entry->fs_handler = fs_handler;
      new_entry->next       = NULL;
+     fs_handler->refs      = 1; // the mount's, vfs_umount() drops it
 
-     // TODO - add lock here and anywhere else we fiddle with the prefix list
+     acquire_mount_lock();
      if(vfs_prefix_list_first==NULL) {
         new_entry->prev       = NULL;
         vfs_prefix_list_first = new_entry;
@@ -190,6 +276,47 @@ void vfs_mount(vfs_fs_handler_t* fs_handler, char* dev_name, char* mountpoint) {
         new_entry->prev            = vfs_prefix_list_last;
         vfs_prefix_list_last = new_entry;
      }
+     vfs_trie_insert(new_entry);
+     release_mount_lock();
+}
+
+void vfs_umount(char* dev_name, char* mountpoint) {
+     if(dev_name == NULL && mountpoint == NULL) return;
+
+     acquire_mount_lock();
+     vfs_prefix_entry_t* p = vfs_prefix_list_last;
+     while(p != NULL) {
+       if((dev_name == NULL || strcmp(p->dev_name,dev_name)==0) &&
+          (mountpoint == NULL || strcmp(p->prefix_str,mountpoint)==0)) break;
+       p = p->prev;
+     }
+     if(p == NULL) {
+        release_mount_lock();
+        klog("VFS",0,"Can not umount %s %s, not mounted",dev_name ? dev_name : "", mountpoint ? mountpoint : "");
+        return;
+     }
+
+     // if something else is mounted on the same prefix, it takes over the trie node
+     vfs_prefix_entry_t* replacement = vfs_prefix_list_first;
+     while(replacement != NULL) {
+       if(replacement != p && strcmp(replacement->prefix_str,p->prefix_str)==0) break;
+       replacement = replacement->next;
+     }
+     vfs_trie_remove(p,replacement);
+
+     if(p->prev != NULL) p->prev->next = p->next; else vfs_prefix_list_first = p->next;
+     if(p->next != NULL) p->next->prev = p->prev; else vfs_prefix_list_last  = p->prev;
+     p->next = vfs_prefix_retired;
+     p->prev = NULL;
+     vfs_prefix_retired = p;
+     release_mount_lock();
+
+     klog("VFS",1,"Unmounted %s from %s",p->dev_name,p->prefix_str);
+     vfs_fs_put(p->fs_handler);
+}
+
+void vfs_boot_file(char* buf, size_t len, char* name) {
+     snprintf(buf,len,"%s:/%s",boot_path + strlen("/dev/uefi/"),name);
 }
 
 void dump_vfs() {
@@ -38,6 +38,7 @@ typedef struct vfs_fs_handler_t {
 
      // needed by the VFS layer
      int      (*file_exists)(vfs_fs_handler_t* this, char* path);   // simple boolean check
+     volatile UINT64 refs; // the mount's own, one per open fd and one per call in flight - shutdown() runs at 0
      char**   (*list_root_dir)(vfs_fs_handler_t* this);             // returns an array of strings, caller must free()
 
      // standard I/O operations
@@ -48,6 +49,10 @@ typedef struct vfs_fs_handler_t {
      ssize_t              (*read)(vfs_fs_handler_t* this, void* fd, void* buf, size_t count);
      ssize_t              (*write)(vfs_fs_handler_t* this, void* fd, void* buf, size_t count);
      off_t                (*lseek)(vfs_fs_handler_t* this, void* fd, off_t offset, int whence);
+
+     // optional, for filesystems backed by memory - returns a pointer to the file data at offset and sets *len to
+     // the number of contiguous bytes available there (at most *len on entry), or NULL if it can't be done
+     void*                (*map)(vfs_fs_handler_t* this, void* fd, off_t offset, size_t* len);
      int                  (*stat)(vfs_fs_handler_t* this, char* path, struct stat *buf);
      int                  (*fstat)(vfs_fs_handler_t* this, void* fd, struct stat *buf);
 } vfs_fs_handler_t;
@@ -56,7 +61,9 @@ typedef struct vfs_prefix_entry_t vfs_prefix_entry_t;
 
 struct vfs_prefix_entry_t {
      char* prefix_str;
+     size_t prefix_len; // cached strlen(prefix_str)
      char* dev_name;
+     void* trie_node;   // node in the mount trie this entry is attached to, see k_vfs_trie.c
      vfs_fs_handler_t *fs_handler;
      vfs_prefix_entry_t* next;
      vfs_prefix_entry_t* prev;
@@ -97,8 +104,16 @@ void vfs_mount(vfs_fs_handler_t* fs_handler, char* dev_name, char* mountpoint);
 // dump the mount table etc to system console
 void dump_vfs();
 
+// name at the root of the volume we booted from (/boot), as a UEFI path StdLib's fopen() takes - UEFI writes don't
+// go through the VFS yet
+void vfs_boot_file(char* buf, size_t len, char* name);
+
+// drop a reference taken on fs_handler for an open fd, for fd tables that close the handler fd themselves
+void vfs_fs_put(vfs_fs_handler_t* fs_handler);
+
 // either param can be NULL, but one must be non-null
 //  whichever is the most recent matching prefix entry will be removed
+//  the filesystem is only shut down once the last fd open on it is closed
 void vfs_umount(char* dev_name, char* mountpoint);
 
 vfs_fd_t*            vfs_fopen(char* path, char* mode);
@@ -108,6 +123,7 @@ int                  vfs_fclose(vfs_fd_t* fd);
 ssize_t              vfs_fread(vfs_fd_t* fd, void* buf, size_t count);
 ssize_t              vfs_fwrite(vfs_fd_t* fd, void* buf, size_t count);
 off_t                vfs_lseek(vfs_fd_t* fd, off_t offset, int whence);
+void*                vfs_fmap(vfs_fd_t* fd, off_t offset, size_t* len); // zero-copy access where the filesystem supports it
 int                  vfs_stat(char* path, struct stat *buf);
 int                  vfs_fstat(vfs_fd_t* fs, struct stat *buf);
 
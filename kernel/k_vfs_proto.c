@@ -6,6 +6,7 @@
 #include <stdio.h>
 
 #include "k_vfs_proto.h"
+#include "k_bootprof.h"
 
 #include <Library/UefiLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -23,7 +24,6 @@ extern EFI_HANDLE gImageHandle;
 
 // TODO - setup private context struct for the EFI_FILE_PROTOCOL struct
 // TODO - import ext3 driver
-// TODO - implement a tar driver so initrd can be a tarball
 // TODO - abstraction layer for getting an EFI_FILE_PROTOCOL directly from /dev/uefi/whatever
 // TODO - perhaps a gzip layer over block devices?
 
@@ -264,13 +264,15 @@ void init_vfs_proto() {
      UINTN HandleCount;
      EFI_HANDLE *HandleBuffer;
      UINTN HandleIndex;
-     s = BS->LocateHandleBuffer(AllHandles,NULL,NULL,&HandleCount,&HandleBuffer);
+     UINTN sweep = bootprof_begin("connect all handles","vfs");
+     s = BOOTPROF_FW("LocateHandleBuffer",BS->LocateHandleBuffer(AllHandles,NULL,NULL,&HandleCount,&HandleBuffer));
      for(HandleIndex=0; HandleIndex < HandleCount; HandleIndex++) {
-         BS->ConnectController(HandleBuffer[HandleIndex],NULL,NULL,TRUE);
+         BOOTPROF_FW("ConnectController",BS->ConnectController(HandleBuffer[HandleIndex],NULL,NULL,TRUE));
      }
      BS->FreePool(HandleBuffer);
+     bootprof_end(sweep);
 
-     s = shell_proto->SetMap(&vfs_devpath_proto,L"zoidberg:");
+     s = BOOTPROF_FW("SetMap",shell_proto->SetMap(&vfs_devpath_proto,L"zoidberg:"));
       if(EFI_ERROR(s)) {
          klog("VFS",0,"SetMap failed: %d",s);
       }
@@ -0,0 +1,147 @@
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kmsg.h"
+#include "k_vfs.h"
+#include "k_vfs_trie.h"
+
+// Component-wise radix trie over the mountpoints in the prefix table
+//
+// Lookups cost O(path depth) no matter how many filesystems are mounted: every component of the path is hashed once
+// and compared against the children of the current node, and the deepest node with a mount attached wins.
+//
+// Readers take no locks: a new node is fully initialised before a single pointer store publishes it, and nodes are
+// never freed once published. Mounting and unmounting only ever swap the entry pointer on a node.
+
+static vfs_trie_node_t vfs_trie_root = {0};
+
+static UINT32 vfs_trie_hash(char* s, size_t len) { // FNV-1a
+     UINT32 h = 2166136261u;
+     size_t i;
+     for(i=0; i<len; i++) {
+         h ^= (UINT8)s[i];
+         h *= 16777619u;
+     }
+     return h;
+}
+
+static vfs_trie_node_t* vfs_trie_find_child(vfs_trie_node_t* node, char* component, size_t len, UINT32 hash) {
+     vfs_trie_node_t* child = node->children[hash & (VFS_TRIE_BUCKETS-1)];
+     while(child != NULL) {
+        if(child->hash == hash && child->component_len == len && memcmp(child->component,component,len)==0) return child;
+        child = child->next;
+     }
+     return NULL;
+}
+
+vfs_prefix_entry_t* vfs_trie_lookup_in(vfs_trie_node_t* root, char* path) {
+     if(path == NULL || path[0] != '/') return NULL;
+
+     vfs_trie_node_t*    node   = root;
+     vfs_prefix_entry_t* retval = node->entry;
+     char* p = path+1;
+     char* end;
+     size_t len;
+
+     // only components followed by a / can be a mountpoint, so the final component of the path is never looked up
+     while((end = strchr(p,'/')) != NULL) {
+        len = end-p;
+        if(len == 0) break;
+        node = vfs_trie_find_child(node,p,len,vfs_trie_hash(p,len));
+        if(node == NULL) break;
+        if(node->entry != NULL) retval = node->entry;
+        p = end+1;
+     }
+     return retval;
+}
+
+vfs_prefix_entry_t* vfs_trie_lookup(char* path) {
+     return vfs_trie_lookup_in(&vfs_trie_root,path);
+}
+
+static vfs_trie_node_t* vfs_trie_walk_create(vfs_trie_node_t* root, char* mountpoint) {
+     vfs_trie_node_t* node = root;
+     vfs_trie_node_t* child;
+     char* p = mountpoint;
+     char* end;
+     size_t len;
+     UINT32 hash;
+     UINT32 bucket;
+
+     while(*p == '/') p++;
+     while(*p != 0) {
+        end = strchr(p,'/');
+        len = (end == NULL) ? strlen(p) : (size_t)(end-p);
+        hash  = vfs_trie_hash(p,len);
+        child = vfs_trie_find_child(node,p,len,hash);
+        if(child == NULL) {
+           child = (vfs_trie_node_t*)calloc(1,sizeof(vfs_trie_node_t));
+           if(child == NULL) {
+              klog("VFS",0,"Out of memory building mount trie for %s",mountpoint);
+              return NULL;
+           }
+           child->component = (char*)malloc(len+1);
+           if(child->component == NULL) {
+              free(child);
+              klog("VFS",0,"Out of memory building mount trie for %s",mountpoint);
+              return NULL;
+           }
+           memcpy(child->component,p,len);
+           child->component[len] = 0;
+           child->component_len  = len;
+           child->hash           = hash;
+
+           bucket = hash & (VFS_TRIE_BUCKETS-1);
+           child->next = node->children[bucket];
+           __sync_synchronize(); // node must be complete before readers can reach it
+           node->children[bucket] = child;
+        }
+        node = child;
+        if(end == NULL) break;
+        p = end;
+        while(*p == '/') p++;
+     }
+     return node;
+}
+
+void vfs_trie_insert_in(vfs_trie_node_t* root, vfs_prefix_entry_t* entry) {
+     vfs_trie_node_t* node = vfs_trie_walk_create(root,entry->prefix_str);
+     if(node == NULL) return;
+     entry->trie_node = node;
+     if(node->entry == NULL) {
+        __sync_synchronize();
+        node->entry = entry;
+     }
+}
+
+void vfs_trie_insert(vfs_prefix_entry_t* entry) {
+     vfs_trie_insert_in(&vfs_trie_root,entry);
+}
+
+void vfs_trie_remove(vfs_prefix_entry_t* entry, vfs_prefix_entry_t* replacement) {
+     vfs_trie_node_t* node = (vfs_trie_node_t*)entry->trie_node;
+     if(node == NULL) return;
+     if(node->entry == entry) {
+        if(replacement != NULL) replacement->trie_node = node;
+        __sync_synchronize();
+        node->entry = replacement;
+     }
+     entry->trie_node = NULL;
+}
+
+vfs_trie_node_t* vfs_trie_new() {
+     return (vfs_trie_node_t*)calloc(1,sizeof(vfs_trie_node_t));
+}
+
+void vfs_trie_free(vfs_trie_node_t* root) {
+     vfs_trie_node_t* child;
+     int i;
+     for(i=0; i<VFS_TRIE_BUCKETS; i++) {
+         while((child = root->children[i]) != NULL) {
+            root->children[i] = child->next;
+            vfs_trie_free(child);
+         }
+     }
+     free(root->component);
+     free(root);
+}
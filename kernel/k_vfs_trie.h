@@ -0,0 +1,40 @@
+#ifndef K_VFS_TRIE_H
+#define K_VFS_TRIE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "k_vfs.h"
+
+#define VFS_TRIE_BUCKETS 16 // must be a power of 2
+
+// one node per path component of a mountpoint, the root node represents "/"
+typedef struct vfs_trie_node_t vfs_trie_node_t;
+struct vfs_trie_node_t {
+     char*                        component;
+     size_t                       component_len;
+     UINT32                       hash;
+     vfs_prefix_entry_t* volatile entry;        // mount attached at this node, NULL if none
+     vfs_trie_node_t*    volatile next;         // next node in the same bucket of the parent
+     vfs_trie_node_t*    volatile children[VFS_TRIE_BUCKETS];
+};
+
+// readers never lock and may run concurrently with a writer
+// writers (vfs_mount/vfs_umount) must hold the mount lock in k_vfs.c
+// nodes are never freed, so a reader can never see a dangling node
+vfs_prefix_entry_t* vfs_trie_lookup(char* path);
+
+// attach a prefix entry to the trie, creating nodes as needed - if the mountpoint already has an entry attached
+// the existing one is kept, same as the old linear scan where the first registered entry won
+void vfs_trie_insert(vfs_prefix_entry_t* entry);
+
+// detach a prefix entry, replacement is attached in its place and may be NULL
+void vfs_trie_remove(vfs_prefix_entry_t* entry, vfs_prefix_entry_t* replacement);
+
+// a private trie apart from the mount table, e.g for benchmarking lookups - vfs_trie_remove() works on these too
+vfs_trie_node_t*    vfs_trie_new();
+void                vfs_trie_insert_in(vfs_trie_node_t* root, vfs_prefix_entry_t* entry);
+vfs_prefix_entry_t* vfs_trie_lookup_in(vfs_trie_node_t* root, char* path);
+void                vfs_trie_free(vfs_trie_node_t* root);   // nothing may be reading it any more
+
+#endif
@@ -18,6 +18,7 @@
 
 
 #include "kmsg.h"
+#include "k_bootprof.h"
 
 extern EFI_BOOT_SERVICES *BS;
 
@@ -293,12 +294,12 @@ void init_video(char* vgamode) {
 
      UINTN handleCount;
      EFI_HANDLE *handleBuffer;
-     BS->LocateHandleBuffer(
+     BOOTPROF_FW("LocateHandleBuffer",BS->LocateHandleBuffer(
                     ByProtocol,
                     &gEfiGraphicsOutputProtocolGuid,
                     NULL,
                     &handleCount,
-                    &handleBuffer);
+                    &handleBuffer));
      EFI_STATUS s = BS->HandleProtocol (handleBuffer[0], &gEfiGraphicsOutputProtocolGuid, (VOID **) &GraphicsOutput);
      if(EFI_ERROR(s)) {
         klog("VIDEO",0,"No graphics output support: %d",s); 
@@ -338,6 +339,6 @@ void init_video(char* vgamode) {
      if(matching_mode==-1) {
         klog("VIDEO",0,"Failed to set desired mode!");
      } else {
-        GraphicsOutput->SetMode(GraphicsOutput,matching_mode);
+        BOOTPROF_FW("SetMode",GraphicsOutput->SetMode(GraphicsOutput,matching_mode));
      }
 }
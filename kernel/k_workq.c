@@ -0,0 +1,245 @@
+#include <Library/UefiBootServicesTableLib.h>
+
+#include "kmsg.h"
+#include "dmthread.h"
+#include "k_sync.h"
+#include "k_heap.h"
+#include "k_smp.h"
+#include "k_workq.h"
+
+// Kernel work queue
+//
+// A fixed pool of DMT_CPU_ANY worker threads, one per CPU, each with a Chase-Lev deque: the worker pushes and pops
+// at the bottom without a lock, idle workers steal from the top with a CAS. Work submitted from outside the pool goes
+// on a worker's inbox, a lock-free stack the worker moves onto its deque in submission order, so everything queued
+// is stealable. Work submitted by a worker goes straight on its own deque.
+//
+// Items can run on any CPU and in any order. Anything that needs boot services goes through thread_enter_bsp() and
+// anything that blocks for long holds up a worker, so keep items small. A worker with nothing to do or steal sleeps
+// on its semaphore; whoever makes work visible wakes one sleeper, and the sleeping flag is swapped back to 0 by
+// exactly one waker so posts never pile up.
+
+typedef struct kworker_t {
+     volatile INT64    top;           // thieves take from here
+     volatile INT64    bottom;        // the owner pushes and pops here
+     kwork_t*          deque[KWORKQ_DEQUE_SIZE];
+     kwork_t* volatile inbox;         // newest first
+     volatile UINT32   sleeping;
+     ksem_t            wake;
+     thread_list*      thread;
+     UINTN             id;
+} kworker_t;
+
+static kworker_t kworkers[KWORKQ_MAX_WORKERS];
+static UINTN     kworker_count = 0;
+static UINTN     kworkq_rr     = 0;
+
+static int deque_push(kworker_t* k, kwork_t* w) {
+     INT64 b = k->bottom;
+     if(b - k->top >= KWORKQ_DEQUE_SIZE) return -1;
+     k->deque[b & (KWORKQ_DEQUE_SIZE-1)] = w;
+     __asm__ volatile("" ::: "memory"); // x86 keeps stores in order, the slot is written before a thief can see it
+     k->bottom = b+1;
+     return 0;
+}
+
+static kwork_t* deque_pop(kworker_t* k) {
+     INT64 b = k->bottom - 1;
+     INT64 t;
+     kwork_t* w;
+     k->bottom = b;
+     __sync_synchronize(); // thieves have to see the smaller bottom before we read top
+     t = k->top;
+     if(t > b) {
+        k->bottom = b+1;
+        return NULL;
+     }
+     w = k->deque[b & (KWORKQ_DEQUE_SIZE-1)];
+     if(t == b) {
+        // the last one, a thief may be going for it too
+        if(!__sync_bool_compare_and_swap(&k->top,t,t+1)) w = NULL;
+        k->bottom = b+1;
+     }
+     return w;
+}
+
+static kwork_t* deque_steal(kworker_t* k) {
+     INT64 t = k->top;
+     INT64 b;
+     kwork_t* w;
+     __asm__ volatile("" ::: "memory"); // loads aren't reordered on x86 either
+     b = k->bottom;
+     if(t >= b) return NULL;
+     w = k->deque[t & (KWORKQ_DEQUE_SIZE-1)];
+     if(!__sync_bool_compare_and_swap(&k->top,t,t+1)) return NULL;
+     return w;
+}
+
+static void kwork_run(kwork_t* w) {
+     kwork_func_t func = w->func;
+     void* arg = w->arg;
+     if(w->owned) kfree(w);
+     func(arg);
+}
+
+static void kworkq_wake(kworker_t* k) {
+     if(__sync_lock_test_and_set(&k->sleeping,0)) ksem_post(&k->wake);
+}
+
+// something just became stealable, get one idle worker onto it
+static void kworkq_wake_idle() {
+     UINTN i;
+     __sync_synchronize(); // the push before the look at sleeping, a worker going to sleep does the reverse
+     for(i=0; i < kworker_count; i++) {
+         if(kworkers[i].sleeping && __sync_lock_test_and_set(&kworkers[i].sleeping,0)) {
+            ksem_post(&kworkers[i].wake);
+            return;
+         }
+     }
+}
+
+static kworker_t* kworker_self() {
+     thread_list* self = thread_self();
+     UINTN i;
+     for(i=0; i < kworker_count; i++) {
+         if(kworkers[i].thread == self) return &kworkers[i];
+     }
+     return NULL;
+}
+
+static void kworker_drain_inbox(kworker_t* k) {
+     kwork_t* list;
+     kwork_t* fifo = NULL;
+     kwork_t* w;
+     int moved = 0;
+     if(k->inbox == NULL) return;
+     list = __sync_lock_test_and_set(&k->inbox,NULL);
+     while(list != NULL) {
+        w        = list;
+        list     = w->next;
+        w->next  = fifo;
+        fifo     = w;
+     }
+     while(fifo != NULL) {
+        w    = fifo;
+        fifo = w->next;
+        if(deque_push(k,w) == 0) {
+           moved++;
+        } else {
+           kwork_run(w); // deque's full, we'd be getting to it anyway
+        }
+     }
+     if(moved > 1) kworkq_wake_idle();
+}
+
+static kwork_t* kworker_steal(kworker_t* k) {
+     kworker_t* victim;
+     kwork_t* w;
+     UINTN i;
+     for(i=1; i < kworker_count; i++) {
+         victim = &kworkers[(k->id + i) % kworker_count];
+         w = deque_steal(victim);
+         if(w != NULL) {
+            if(victim->top < victim->bottom) kworkq_wake_idle(); // more where that came from
+            return w;
+         }
+     }
+     return NULL;
+}
+
+static int kworkq_pending(kworker_t* k) {
+     UINTN i;
+     if(k->inbox != NULL) return 1;
+     for(i=0; i < kworker_count; i++) {
+         if(kworkers[i].top < kworkers[i].bottom) return 1;
+     }
+     return 0;
+}
+
+static void kworker_main(void* arg) {
+     kworker_t* k = (kworker_t*)arg;
+     kwork_t* w;
+     for(;;) {
+        kworker_drain_inbox(k);
+        w = deque_pop(k);
+        if(w == NULL) w = kworker_steal(k);
+        if(w != NULL) {
+           kwork_run(w);
+           continue;
+        }
+        __sync_lock_test_and_set(&k->sleeping,1); // xchg, so it's visible before we look again
+        if(kworkq_pending(k)) {
+           if(__sync_lock_test_and_set(&k->sleeping,0) == 0) ksem_wait(&k->wake); // a waker beat us to it
+           continue;
+        }
+        ksem_wait(&k->wake);
+     }
+}
+
+void kworkq_init() {
+     UINTN n = smp_cpu_count();
+     UINTN i;
+     kworker_t* k;
+     if(n < 2) n = 2; // so one item that blocks doesn't hold everything else up
+     if(n > KWORKQ_MAX_WORKERS) n = KWORKQ_MAX_WORKERS;
+     for(i=0; i < n; i++) {
+         k = &kworkers[i];
+         k->id = i;
+         ksem_init(&k->wake,0);
+     }
+     // workers look at kworker_count when stealing, so they're all set up before any of them runs
+     kworker_count = n;
+     for(i=0; i < n; i++) {
+         kworkers[i].thread = create_thread((thread_func_t)kworker_main,&kworkers[i]);
+         thread_set_affinity(kworkers[i].thread,DMT_CPU_ANY);
+     }
+     klog("WORKQ",1,"Started %d kernel workers",n);
+}
+
+void kwork_init(kwork_t* w, kwork_func_t func, void* arg) {
+     w->func  = func;
+     w->arg   = arg;
+     w->next  = NULL;
+     w->owned = 0;
+}
+
+void kwork_queue(kwork_t* w) {
+     kworker_t* k;
+     kwork_t* head;
+     UINTN start, i;
+     if(kworker_count == 0) { // too early for workers, just do it
+        kwork_run(w);
+        return;
+     }
+     k = kworker_self();
+     if(k != NULL && deque_push(k,w) == 0) {
+        kworkq_wake_idle();
+        return;
+     }
+     // an idle worker if there is one, otherwise round robin
+     start = __sync_fetch_and_add(&kworkq_rr,1);
+     k = &kworkers[start % kworker_count];
+     for(i=0; i < kworker_count; i++) {
+         if(kworkers[(start + i) % kworker_count].sleeping) {
+            k = &kworkers[(start + i) % kworker_count];
+            break;
+         }
+     }
+     do {
+        head    = k->inbox;
+        w->next = head;
+     } while(!__sync_bool_compare_and_swap(&k->inbox,head,w));
+     kworkq_wake(k);
+}
+
+int kwork_submit(kwork_func_t func, void* arg) {
+     kwork_t* w = (kwork_t*)kmalloc(sizeof(kwork_t));
+     if(w == NULL) {
+        klog("WORKQ",0,"Out of memory queueing work at %#llx",func);
+        return -1;
+     }
+     kwork_init(w,func,arg);
+     w->owned = 1;
+     kwork_queue(w);
+     return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef K_WORKQ_H
+#define K_WORKQ_H
+
+#include <Uefi.h>
+
+// deferred kernel work, run by a fixed pool of worker threads - see k_workq.c
+
+#define KWORKQ_MAX_WORKERS 32
+#define KWORKQ_DEQUE_SIZE  256        // per worker, a power of 2
+
+typedef void (*kwork_func_t)(void* arg);
+
+typedef struct kwork_t {
+     kwork_func_t    func;
+     void*           arg;
+     struct kwork_t* next;            // on a worker's inbox
+     int             owned;           // from kwork_submit(), freed before func runs
+} kwork_t;
+
+void kworkq_init();                                    // after smp_init(), one worker per CPU (at least 2)
+int  kwork_submit(kwork_func_t func, void* arg);       // 0 once queued, -1 if there's no memory for it
+void kwork_init(kwork_t* w, kwork_func_t func, void* arg);
+void kwork_queue(kwork_t* w);                          // w is free to reuse once func has been called
+
+#endif
@@ -0,0 +1,276 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kmsg.h"
+#include "dmthread.h"
+#include "k_thread.h"
+#include "k_syscalls.h"
+#include "k_sync.h"
+#include "k_zring.h"
+
+// Kernel side of the shared syscall ring, see zring.h for the layout
+//
+// Entries are run through the same dispatcher as SYSCALL and int 0x80, from sys_zring_enter() in the calling task or
+// from the SQPOLL thread. The SQPOLL thread borrows the owning task's ID while it runs entries so fd lookups and the
+// like resolve against the right task. Once every polled ring has gone idle and has ZRING_NEED_WAKEUP set, the
+// SQPOLL thread sleeps until sys_zring_enter() clears the flag on one of them or a new polled ring is registered.
+//
+// There's one SQPOLL thread for every ring, so it never runs an entry that can block: it stops in front of one and
+// sets ZRING_NEED_WAKEUP, and the task's next sys_zring_enter() runs it on the task's own thread. An unregistered
+// polled ring is left for the SQPOLL thread to unlink and free, since it's the one walking the list.
+
+#define ZRING_IDLE_PASSES 1024 // empty polls before the SQPOLL thread stops watching a ring
+
+// only the poll thread takes contexts off the list, so it can walk it without locking
+static zring_ctx_t* volatile zring_poll_list = NULL;
+volatile UINT8               zring_poll_lock = 0;
+static int                   zring_poll_started = 0;
+static volatile UINT32       zring_poll_sleeping = 0;
+static ksem_t                zring_poll_wake = KSEM_INIT(0);
+
+static void acquire_poll_lock() {
+     while(__sync_lock_test_and_set(&zring_poll_lock, 1)) {
+     }
+}
+
+static void release_poll_lock() {
+     __sync_synchronize();
+     zring_poll_lock=0;
+}
+
+// entries that make no sense without a trap of their own, or would recurse
+static int zring_allowed(UINT32 opcode) {
+     switch(opcode) {
+        case ZSYSCALL_EXIT:
+        case ZSYSCALL_EXECVE:
+        case ZSYSCALL_ZRING_SETUP:
+        case ZSYSCALL_ZRING_ENTER:
+          return 0;
+     }
+     return 1;
+}
+
+// entries that may sleep - on the console, another task or the firmware
+static int zring_blocks(UINT32 opcode) {
+     switch(opcode) {
+        case ZSYSCALL_READ:
+        case ZSYSCALL_SPAWN:
+        case ZSYSCALL_WAIT:
+        case ZSYSCALL_TRACEDUMP:
+          return 1;
+     }
+     return 0;
+}
+
+// runs everything pending in r, with ctx->lock held, returns the number of entries completed
+// from_poll stops in front of an entry that may block and sets *punted, the task has to run that one itself
+static int zring_drain(zring_t* r, int from_poll, int* punted) {
+     zring_sqe_t  sqe;
+     zring_cqe_t* cqe;
+     UINT32 mask    = r->entries-1;
+     UINT32 head    = r->sq_head;
+     UINT32 cq_tail = r->cq_tail;
+     int done=0;
+
+     while(head != r->sq_tail && cq_tail - r->cq_head < r->entries) {
+        __sync_synchronize(); // see the entry as written before the tail moved
+        sqe = ZRING_SQES(r)[head & mask];
+        if(from_poll && zring_blocks(sqe.opcode)) {
+           *punted = 1;
+           break;
+        }
+        cqe = &(ZRING_CQES(r)[cq_tail & mask]);
+        cqe->user_data = sqe.user_data;
+        if(sqe.opcode < sizeof(syscalls)/sizeof(syscalls[0]) && zring_allowed(sqe.opcode)) {
+           cqe->result = syscall_dispatch(sqe.args[0],sqe.args[1],sqe.args[2],sqe.opcode);
+        } else {
+           cqe->result = -1;
+        }
+        head++;
+        cq_tail++;
+        done++;
+        __sync_synchronize(); // completion must be visible before the task can see it
+        r->cq_tail = cq_tail;
+        r->sq_head = head;
+     }
+     return done;
+}
+
+static void zring_unlock(zring_ctx_t* ctx) {
+     __sync_synchronize();
+     ctx->lock = 0;
+}
+
+static void zring_poll_kick() {
+     if(__sync_lock_test_and_set(&zring_poll_sleeping,0)) ksem_post(&zring_poll_wake);
+}
+
+// one look at a polled ring, 1 if the poll thread is still watching it
+// ctx->ring is only read with ctx->lock held, zring_unregister() takes the lock to clear it
+static int zring_poll_ring(zring_ctx_t* ctx) {
+     zring_t* r;
+     UINT64 own_id;
+     int watching;
+     int punted = 0;
+     if(__sync_lock_test_and_set(&ctx->lock, 1)) return 1; // the task is draining it itself
+     r = ctx->ring;
+     if(r == NULL || (r->kernel_flags & ZRING_NEED_WAKEUP)) {
+        zring_unlock(ctx);
+        return 0;
+     }
+     own_id = thread_self()->thread.task_id;
+     thread_self()->thread.task_id = ctx->task_id;
+     if(zring_drain(r,1,&punted) > 0 && !punted) {
+        ctx->idle_passes = 0;
+     } else if(punted) {
+        __sync_fetch_and_or(&r->kernel_flags,ZRING_NEED_WAKEUP); // over to the task, it traps once it sees this
+        ctx->idle_passes = 0;
+     } else if(++ctx->idle_passes >= ZRING_IDLE_PASSES) {
+        __sync_fetch_and_or(&r->kernel_flags,ZRING_NEED_WAKEUP);
+        __sync_synchronize();
+        // anything submitted while the flag was going up would be missed, so look once more
+        if(r->sq_head != r->sq_tail) {
+           __sync_fetch_and_and(&r->kernel_flags,~ZRING_NEED_WAKEUP);
+           ctx->idle_passes = 0;
+        }
+     }
+     thread_self()->thread.task_id = own_id;
+     watching = (r->kernel_flags & ZRING_NEED_WAKEUP) ? 0 : 1;
+     zring_unlock(ctx); // r can go as soon as this is dropped
+     return watching;
+}
+
+// 1 if the ring is registered and the poll thread is meant to be watching it
+static int zring_poll_watching(zring_ctx_t* ctx) {
+     int watching;
+     if(__sync_lock_test_and_set(&ctx->lock, 1)) return 1;
+     watching = ctx->ring != NULL && !(ctx->ring->kernel_flags & ZRING_NEED_WAKEUP);
+     zring_unlock(ctx);
+     return watching;
+}
+
+// unlinks and frees the contexts zring_unregister() has let go of
+static void zring_poll_reap() {
+     zring_ctx_t* volatile* pp;
+     zring_ctx_t* ctx;
+     zring_ctx_t* dead = NULL;
+     acquire_poll_lock();
+     pp = &zring_poll_list;
+     while((ctx = *pp) != NULL) {
+        if(ctx->dead) {
+           *pp = ctx->next;
+           ctx->next = dead;
+           dead = ctx;
+        } else {
+           pp = &ctx->next;
+        }
+     }
+     release_poll_lock();
+     while((ctx = dead) != NULL) {
+        dead = ctx->next;
+        free(ctx);
+     }
+}
+
+// sleeps whenever every ring has gone idle, sys_zring_setup(), sys_zring_enter() and unregistering kick it awake
+static void zring_poll_task(void* _t) {
+     zring_ctx_t* ctx;
+     int watching;
+     for(;;) {
+        zring_poll_reap();
+        watching = 0;
+        for(ctx = zring_poll_list; ctx != NULL; ctx = ctx->next) watching |= zring_poll_ring(ctx);
+        if(watching) {
+           thread_yield();
+           continue;
+        }
+        __sync_lock_test_and_set(&zring_poll_sleeping,1); // xchg, so it's visible before we look again
+        for(ctx = zring_poll_list; ctx != NULL && !watching; ctx = ctx->next) watching = zring_poll_watching(ctx);
+        if(watching) {
+           if(__sync_lock_test_and_set(&zring_poll_sleeping,0) == 0) ksem_wait(&zring_poll_wake); // a kick beat us to it
+           continue;
+        }
+        ksem_wait(&zring_poll_wake);
+     }
+}
+
+static void zring_unregister(task_def_t* t) {
+     zring_ctx_t* ctx = (zring_ctx_t*)t->zring;
+     if(ctx == NULL) return;
+     while(__sync_lock_test_and_set(&ctx->lock, 1)) thread_yield(); // the poll thread may be partway through it
+     ctx->ring = NULL;
+     zring_unlock(ctx);
+     t->zring = NULL;
+     if(!ctx->polled) {
+        free(ctx);
+        return;
+     }
+     __sync_synchronize();
+     ctx->dead = 1; // the poll thread's from here, it may free it straight away
+     zring_poll_kick();
+}
+
+void zring_task_exit(task_def_t* t) {
+     zring_unregister(t);
+}
+
+// int zring_setup(void* ring, unsigned int entries, unsigned int flags) - a NULL ring unregisters
+int sys_zring_setup(void* ring, unsigned int entries, unsigned int flags) {
+     task_def_t* t = get_task(get_cur_task());
+     zring_t* r = (zring_t*)ring;
+     zring_ctx_t* ctx;
+
+     if(t == NULL) return -1;
+     zring_unregister(t);
+     if(r == NULL) return 0;
+     if(entries == 0 || entries > ZRING_ENTRIES_MAX || (entries & (entries-1)) != 0) return -1;
+
+     ctx = (zring_ctx_t*)calloc(1,sizeof(zring_ctx_t));
+     if(ctx == NULL) return -1;
+     memset(r,0,sizeof(zring_t));
+     r->entries     = entries;
+     r->setup_flags = flags;
+     ctx->ring      = r;
+     ctx->task_id   = t->task_id;
+     ctx->polled    = (flags & ZRING_SQPOLL) ? 1 : 0;
+     t->zring       = ctx;
+
+     if(ctx->polled) {
+        acquire_poll_lock();
+        ctx->next = zring_poll_list;
+        __sync_synchronize();
+        zring_poll_list = ctx;
+        if(!zring_poll_started) {
+           zring_poll_started = 1;
+           init_kernel_task(&zring_poll_task,NULL);
+        }
+        release_poll_lock();
+        zring_poll_kick();
+     }
+     klog("ZRING",1,"Task %d registered a %d entry ring%s",t->task_id,entries,ctx->polled ? " with SQPOLL" : "");
+     return 0;
+}
+
+// int zring_enter() - runs everything pending in the calling task's ring, returns the number of entries completed
+int sys_zring_enter() {
+     task_def_t* t = get_task(get_cur_task());
+     zring_ctx_t* ctx = (t != NULL) ? (zring_ctx_t*)t->zring : NULL;
+     zring_t* r;
+     int woke = 0;
+     int done;
+     if(ctx == NULL) return -1;
+     while(__sync_lock_test_and_set(&ctx->lock, 1)) thread_yield(); // the poll thread may be partway through it
+     r = ctx->ring;
+     if(r == NULL) {
+        zring_unlock(ctx);
+        return -1;
+     }
+     if(r->kernel_flags & ZRING_NEED_WAKEUP) {
+        ctx->idle_passes = 0;
+        __sync_fetch_and_and(&r->kernel_flags,~ZRING_NEED_WAKEUP);
+        woke = ctx->polled;
+     }
+     done = zring_drain(r,0,NULL);
+     zring_unlock(ctx);
+     if(woke) zring_poll_kick();
+     return done;
+}
@@ -0,0 +1,22 @@
+#ifndef K_ZRING_H
+#define K_ZRING_H
+
+#include <Uefi.h>
+#include "zring.h"
+
+// kernel's view of a registered ring, task_def_t.zring points at one of these
+typedef struct zring_ctx_t zring_ctx_t;
+struct zring_ctx_t {
+     zring_t*       ring;        // NULL once unregistered
+     int            task_id;
+     int            polled;      // on the SQPOLL list
+     UINT32         idle_passes;
+     volatile UINT8 lock;        // held while draining
+     volatile int   dead;        // unregistered, the poll thread unlinks and frees it
+     zring_ctx_t*   next;
+};
+
+struct task_def_t;
+void zring_task_exit(struct task_def_t* t);   // drops the task's ring when it goes away
+
+#endif
@@ -2,141 +2,683 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 
 #include <sys/EfiSysCall.h>
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
+#include <Library/BaseLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Protocol/LoadedImage.h>
 
 
-#define IN_KMSG
 #include "kmsg.h"
 #include "k_console.h"
+#include "k_sync.h"
+#include "k_smp.h"
+#include "dmthread.h"
+#include "k_pmm.h"
+#include "ktrace.h"
+#include "k_dbgsink.h"
+#include "k_vfs.h"
 
-char *kmsg=NULL;
+// Kernel log
+//
+// Every CPU has a ring of log records. A writer formats its line on its own stack, reserves room in the ring of the
+// CPU it's on with a CAS on the head, copies the line in and marks the record written - no locks, and nothing that
+// waits on the console. One drain thread on the BSP takes records off the rings oldest first by TSC and writes them
+// to the debug sinks (k_dbgsink.c), so klog() costs a format and a copy wherever it's called from.
+//
+// Records are 8 byte aligned and never wrap: one that won't fit before the end of the ring leaves a pad record there
+// and starts again at the front. The drain zeroes what it's consumed before moving the tail past it, so a record
+// whose header isn't marked written yet is still being filled in, and the drain leaves that ring alone until it is.
+// A full ring drops the line and counts it, the drain reports how many went.
+//
+// Until kmsg_start_drain() there's no thread to hand off to, so whoever logs on the BSP drains on the spot.
+//
+// With klog=binary, klog() doesn't format at all: the first call with a format string gives it an ID and works out
+// what its arguments are, after that a call only copies the ID and its raw arguments into the ring (strings copied,
+// since they may not live that long). The drain formats the record when it writes it out and keeps its binary form,
+// so the last KTRACE_KEEP_SIZE bytes of log can be written to the boot volume with sys_tracedump() and turned back
+// into text by tools/ktracedump - see ktrace.h for that format. Only format strings inside the kernel image get IDs,
+// one from a buffer could say something else next time, and anything ktrace.h can't encode is just formatted.
 
-static char static_kmsg[4096];
-static int is_static=1;
-static int buf_len=4096;
+extern EFI_BOOT_SERVICES *BS;
 
-volatile UINT8 kmsg_lock=0;
-volatile UINT8 klog_lock=0;
+#define KMSG_RING_SIZE   65536            // per CPU, a power of 2
+#define KMSG_LINE_MAX    1024             // longer lines are cut short
+#define KMSG_COMP_MAX    16
 
-void acquire_kmsg_lock() {
-     while(__sync_lock_test_and_set(&kmsg_lock, 1)) {
+#define KMSG_WRITTEN     0x80000000       // in kmsg_rec_t.size
+#define KMSG_PAD         0x40000000       // nothing here, skip to the front of the ring
+#define KMSG_SIZE_MASK   0x0FFFFFFF
+
+#define KMSG_RAW         0xFF             // level of a kprintf() record, written out as it is
+
+#define KMSG_BIN         0x01             // in kmsg_rec_t.flags, text is a format ID and the arguments
+
+#define KMSG_PREFIX_MAX  16               // "[COMP]" padded, before the text
+
+typedef struct kmsg_rec_t {
+     volatile UINT32 size;                // whole record, flags on top
+     UINT16          len;                 // of text
+     UINT8           level;               // KLOG_ERR, KLOG_OK, KLOG_PROG or KMSG_RAW
+     UINT8           flags;
+     UINT64          tsc;
+     char            comp[KMSG_COMP_MAX];
+     char            text[];
+} kmsg_rec_t;
+
+typedef struct kmsg_ring_t {
+     volatile UINT64 head;                // writers reserve from here
+     volatile UINT64 tail;                // only the drain moves this
+     volatile UINT64 dropped;
+     UINT64          dropped_seen;
+     UINT8           buf[KMSG_RING_SIZE];
+} kmsg_ring_t;
+
+static kmsg_ring_t     kmsg_rings[SMP_MAX_CPUS];
+static volatile UINT8  kmsg_draining = 0;
+static volatile UINT32 kmsg_idle     = 0;   // drain thread asleep, the first writer to swap it back posts
+static thread_list*    kmsg_drainer  = NULL;
+static ksem_t          kmsg_wake     = KSEM_INIT(0);
+
+#define KTRACE_FMT_MAX    1024                  // formats with IDs, later ones are just formatted
+#define KTRACE_HASH_SIZE  2048                  // a power of 2
+#define KTRACE_NO_ID      0xFFFFFFFF            // in ktrace_hash_id, this format is always just formatted
+#define KTRACE_KEEP_SIZE  (4*1024*1024)         // binary log kept for sys_tracedump(), a power of 2
+#define KTRACE_KEEP_PAD   0x80000000            // in ktrace_rec_t.size, skip to the front
+#define KTRACE_DUMP_NAME  "klog.trc"
+
+typedef struct ktrace_fmt_t {
+     const char* fmt;
+     UINTN       nargs;
+     UINT8       sig[KTRACE_MAX_ARGS];          // KTRACE_ARG_* of each argument in order, '*' included
+} ktrace_fmt_t;
+
+static int                  kmsg_binary       = 0;
+static UINTN                ktrace_image_base = 0;
+static UINTN                ktrace_image_end  = 0;
+static ktrace_fmt_t         ktrace_fmts[KTRACE_FMT_MAX];
+static volatile UINT32      ktrace_fmt_count  = 0;
+static const char* volatile ktrace_hash_key[KTRACE_HASH_SIZE];
+static volatile UINT32      ktrace_hash_id[KTRACE_HASH_SIZE];   // ID+1 once ktrace_fmts[ID] is filled in
+static UINT8*               ktrace_keep       = NULL;           // the rest of these are only touched by the drain
+static UINT64               ktrace_keep_head  = 0;
+static UINT64               ktrace_keep_tail  = 0;
+
+static kmsg_rec_t* kmsg_reserve(kmsg_ring_t* r, UINT32 size) {
+     UINT64 pos, off, need;
+     kmsg_rec_t* pad;
+     do {
+        pos  = r->head;
+        off  = pos & (KMSG_RING_SIZE-1);
+        need = size;
+        if(off + size > KMSG_RING_SIZE) need += KMSG_RING_SIZE - off;
+        if(pos + need - r->tail > KMSG_RING_SIZE) {
+           __sync_fetch_and_add(&r->dropped,1);
+           return NULL;
+        }
+     } while(!__sync_bool_compare_and_swap(&r->head,pos,pos+need));
+     if(need != size) {
+        pad = (kmsg_rec_t*)(r->buf + off);
+        pad->size = (UINT32)(KMSG_RING_SIZE - off) | KMSG_PAD | KMSG_WRITTEN;
+        off = 0;
      }
+     return (kmsg_rec_t*)(r->buf + off);
 }
 
-void acquire_klog_lock() {
-     while(__sync_lock_test_and_set(&klog_lock, 1)) {
+// the next record the drain can have, NULL if the ring's empty or its oldest record is still being written
+static kmsg_rec_t* kmsg_peek(kmsg_ring_t* r) {
+     kmsg_rec_t* rec;
+     UINT32 size;
+     while(r->tail != r->head) {
+        rec  = (kmsg_rec_t*)(r->buf + (r->tail & (KMSG_RING_SIZE-1)));
+        size = rec->size;
+        if(!(size & KMSG_WRITTEN)) return NULL;
+        if(!(size & KMSG_PAD)) return rec;
+        memset((void*)rec,0,size & KMSG_SIZE_MASK);
+        __sync_synchronize();
+        r->tail += size & KMSG_SIZE_MASK;
      }
+     return NULL;
 }
 
-void release_kmsg_lock() {
-     __sync_synchronize();
-     kmsg_lock=0;
+static void kmsg_consume(kmsg_ring_t* r, kmsg_rec_t* rec) {
+     UINT32 size = rec->size & KMSG_SIZE_MASK;
+     memset((void*)rec,0,size);
+     __sync_synchronize(); // zeroed before a writer can reserve it again
+     r->tail += size;
 }
 
-void release_klog_lock() {
-     __sync_synchronize();
-     klog_lock=0;
+// the prefix and the line go to the serial sinks as one string, the console gets the prefix in colour
+static void kmsg_emit(kmsg_rec_t* rec) {
+     static char out[KMSG_PREFIX_MAX+KMSG_LINE_MAX+1]; // only the drain gets here
+     char* line = out + KMSG_PREFIX_MAX;
+     char comp[KMSG_COMP_MAX+2];
+     UINT32 id;
+     UINTN plen, len;
+     if(rec->flags & KMSG_BIN) {
+        memcpy(&id,rec->text,4);
+        len = ktrace_format(line,KMSG_LINE_MAX,ktrace_fmts[id].fmt,(UINT8*)rec->text+4,rec->len-4);
+     } else {
+        len = rec->len;
+        memcpy(line,rec->text,len);
+        line[len] = 0;
+     }
+     if(rec->level == KMSG_RAW) {
+        dbgsink_write(DBGSINK_ALL,line,len,0);
+        return;
+     }
+     snprintf(comp,sizeof(comp),"[%s]",rec->comp);
+     plen = snprintf(out,15,"%-10s ",comp);
+     dbgsink_write(DBGSINK_CONSOLE,out,plen,
+                   (rec->level != KLOG_ERR) ? EFI_TEXT_ATTR(EFI_GREEN|0x8,EFI_BACKGROUND_BLACK)
+                                            : EFI_TEXT_ATTR(EFI_RED|0x8,EFI_BACKGROUND_BLACK));
+     dbgsink_write(DBGSINK_CONSOLE,line,len,0);
+     if(rec->level != KLOG_PROG) dbgsink_write(DBGSINK_CONSOLE,"\n",1,0);
+     memmove(out + plen,line,len);
+     out[plen+len]   = '\n';
+     out[plen+len+1] = 0;
+     dbgsink_write(DBGSINK_ALL & ~DBGSINK_CONSOLE,out,plen+len+1,0);
+}
+
+// the record as ktrace.h has it on the end of the kept log, making room by losing the oldest
+static void ktrace_keep_rec(kmsg_rec_t* rec, UINT8 cpu) {
+     ktrace_rec_t* k;
+     UINT8* args = (UINT8*)rec->text;
+     UINT32 len  = rec->len;
+     UINT32 fmt  = KTRACE_FMT_TEXT;
+     UINT32 size;
+     UINT64 off, gap;
+     if(rec->flags & KMSG_BIN) {
+        memcpy(&fmt,rec->text,4);
+        args += 4;
+        len  -= 4;
+     }
+     size = (sizeof(ktrace_rec_t) + len + 7) & ~7;
+     off  = ktrace_keep_head & (KTRACE_KEEP_SIZE-1);
+     gap  = (off + size > KTRACE_KEEP_SIZE) ? KTRACE_KEEP_SIZE - off : 0;
+     while(ktrace_keep_head + gap + size - ktrace_keep_tail > KTRACE_KEEP_SIZE) {
+        k = (ktrace_rec_t*)(ktrace_keep + (ktrace_keep_tail & (KTRACE_KEEP_SIZE-1)));
+        ktrace_keep_tail += k->size & ~KTRACE_KEEP_PAD;
+     }
+     if(gap != 0) {
+        ((ktrace_rec_t*)(ktrace_keep + off))->size = (UINT32)gap | KTRACE_KEEP_PAD;
+        ktrace_keep_head += gap;
+        off = 0;
+     }
+     k = (ktrace_rec_t*)(ktrace_keep + off);
+     k->size     = size;
+     k->len      = (UINT16)len;
+     k->level    = rec->level;
+     k->cpu      = cpu;
+     k->tsc      = rec->tsc;
+     memcpy(k->comp,rec->comp,KMSG_COMP_MAX);
+     k->fmt      = fmt;
+     k->reserved = 0;
+     memcpy((UINT8*)(k+1),args,len);
+     ktrace_keep_head += size;
+}
+
+// something the drain could take now - a record still being written gets the drain posted once it's done
+int kmsg_pending() {
+     kmsg_ring_t* r;
+     UINTN i;
+     for(i=0; i < SMP_MAX_CPUS; i++) {
+         r = &kmsg_rings[i];
+         if(r->tail != r->head && (((kmsg_rec_t*)(r->buf + (r->tail & (KMSG_RING_SIZE-1))))->size & KMSG_WRITTEN)) return 1;
+     }
+     return 0;
+}
+
+UINT64 kmsg_dropped() {
+     UINT64 retval = 0;
+     UINTN i;
+     for(i=0; i < SMP_MAX_CPUS; i++) retval += kmsg_rings[i].dropped;
+     return retval;
+}
+
+void kmsg_flush() {
+     kmsg_ring_t* best_ring;
+     kmsg_rec_t* best;
+     kmsg_rec_t* rec;
+     UINT64 lost;
+     char note[64];
+     UINTN i, best_cpu = 0;
+     if(!smp_is_bsp() || __sync_lock_test_and_set(&kmsg_draining,1)) return;
+     for(;;) {
+        best = NULL;
+        best_ring = NULL;
+        for(i=0; i < SMP_MAX_CPUS; i++) {
+            if(kmsg_rings[i].tail == kmsg_rings[i].head) continue;
+            rec = kmsg_peek(&kmsg_rings[i]);
+            if(rec != NULL && (best == NULL || rec->tsc < best->tsc)) {
+               best      = rec;
+               best_ring = &kmsg_rings[i];
+               best_cpu  = i;
+            }
+        }
+        if(best == NULL) break;
+        kmsg_emit(best);
+        if(ktrace_keep != NULL) ktrace_keep_rec(best,(UINT8)best_cpu);
+        kmsg_consume(best_ring,best);
+     }
+     for(i=0; i < SMP_MAX_CPUS; i++) {
+         lost = kmsg_rings[i].dropped - kmsg_rings[i].dropped_seen;
+         if(lost == 0) continue;
+         kmsg_rings[i].dropped_seen += lost;
+         snprintf(note,sizeof(note),"[KMSG] %lld lines dropped on CPU %d\n",lost,i);
+         dbgsink_write(DBGSINK_ALL,note,strlen(note),0);
+     }
+     __sync_lock_release(&kmsg_draining);
+}
+
+static void kmsg_drain_task(void* _t) {
+     for(;;) {
+        kmsg_flush();
+        __sync_lock_test_and_set(&kmsg_idle,1); // xchg, visible before we look again
+        if(kmsg_pending()) {
+           if(__sync_lock_test_and_set(&kmsg_idle,0) == 0) ksem_wait(&kmsg_wake); // a writer's post is on its way
+           continue;
+        }
+        ksem_wait(&kmsg_wake);
+     }
+}
+
+void kmsg_start_drain() {
+     kmsg_drainer = create_thread((thread_func_t)kmsg_drain_task,NULL);
+}
+
+// a record of len bytes on this CPU's ring, then the drain told about it
+static void kmsg_put(char* component, UINT8 level, UINT8 flags, void* data, UINT32 len) {
+     kmsg_rec_t* rec;
+     UINT32 size = (sizeof(kmsg_rec_t) + len + 7) & ~7;
+     rec = kmsg_reserve(&kmsg_rings[smp_cpu_id()],size);
+     if(rec != NULL) {
+        rec->len   = (UINT16)len;
+        rec->level = level;
+        rec->flags = flags;
+        rec->tsc   = AsmReadTsc();
+        strncpy(rec->comp,component,KMSG_COMP_MAX-1);
+        memcpy(rec->text,data,len);
+        // xchg, so the drain can't see us as not written yet while we see it as not idle yet
+        __sync_lock_test_and_set(&rec->size,size | KMSG_WRITTEN);
+     }
+
+     if(kmsg_drainer == NULL) {
+        kmsg_flush();
+     } else if(kmsg_idle && __sync_lock_test_and_set(&kmsg_idle,0)) {
+        ksem_post(&kmsg_wake);
+     }
 }
 
-extern EFI_SYSTEM_TABLE *ST;
+// kmsg_out() appends one character if there's room, keeping the last byte for the NUL
+static inline void kmsg_out(char* out, size_t room, size_t* used, char c) {
+     if(*used + 1 < room) out[(*used)++] = c;
+}
+
+static void kmsg_out_pad(char* out, size_t room, size_t* used, char c, int n) {
+     while(n-- > 0) kmsg_out(out,room,used,c);
+}
+
+// vsnprintf() for the conversions the kernel logs with - StdLib's may allocate, which only the BSP can do, and klog()
+// has to be callable from any CPU without waiting on it. Floating point comes out as the bare conversion.
+static int kmsg_vformat(char* out, size_t room, const char* fmt, va_list ap) {
+     const char* spec;
+     const char* s;
+     char digits[24];
+     char sign;
+     char* prefix;
+     unsigned long long v;
+     long long sv;
+     size_t used = 0;
+     int left, plus, space, alt, zero, width, prec, wide, is_signed, base, upper;
+     int ndigits, nzeros, slen, pad;
+     if(room == 0) return 0;
+     for(; *fmt != 0; fmt++) {
+         if(*fmt != '%') {
+            kmsg_out(out,room,&used,*fmt);
+            continue;
+         }
+         spec = fmt++;
+         left = plus = space = alt = zero = 0;
+         for(;; fmt++) {
+             if(*fmt == '-')       left  = 1;
+             else if(*fmt == '+')  plus  = 1;
+             else if(*fmt == ' ')  space = 1;
+             else if(*fmt == '#')  alt   = 1;
+             else if(*fmt == '0')  zero  = 1;
+             else if(*fmt != '\'') break;
+         }
+         width = 0;
+         if(*fmt == '*') {
+            width = va_arg(ap,int);
+            if(width < 0) {
+               left  = 1;
+               width = -width;
+            }
+            fmt++;
+         } else {
+            while(*fmt >= '0' && *fmt <= '9') width = width*10 + (*fmt++ - '0');
+         }
+         prec = -1;
+         if(*fmt == '.') {
+            fmt++;
+            prec = 0;
+            if(*fmt == '*') {
+               prec = va_arg(ap,int);
+               fmt++;
+            } else {
+               while(*fmt >= '0' && *fmt <= '9') prec = prec*10 + (*fmt++ - '0');
+            }
+         }
+         wide = 0;
+         while(*fmt == 'h' || *fmt == 'l' || *fmt == 'L' || *fmt == 'q' || *fmt == 'j' || *fmt == 'z' || *fmt == 't') {
+            if(*fmt != 'h') wide = 1;
+            fmt++;
+         }
+
+         is_signed = 0;
+         base      = 10;
+         upper     = 0;
+         switch(*fmt) {
+            case '%':
+               kmsg_out(out,room,&used,'%');
+               continue;
+            case 'c':
+               kmsg_out_pad(out,room,&used,' ',left ? 0 : width-1);
+               kmsg_out(out,room,&used,(char)va_arg(ap,int));
+               kmsg_out_pad(out,room,&used,' ',left ? width-1 : 0);
+               continue;
+            case 's':
+               s = va_arg(ap,const char*);
+               if(s == NULL) s = "(null)";
+               for(slen=0; s[slen] != 0 && (prec < 0 || slen < prec); slen++);
+               kmsg_out_pad(out,room,&used,' ',left ? 0 : width-slen);
+               for(pad=0; pad < slen; pad++) kmsg_out(out,room,&used,s[pad]);
+               kmsg_out_pad(out,room,&used,' ',left ? width-slen : 0);
+               continue;
+            case 'd': case 'i':
+               is_signed = 1;
+            break;
+            case 'u':
+            break;
+            case 'o':
+               base = 8;
+            break;
+            case 'X':
+               upper = 1;
+            case 'x':
+               base = 16;
+            break;
+            case 'p':
+               base = 16;
+               alt  = 1;
+               wide = 1;
+            break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+               if(fmt[-1] == 'L') (void)va_arg(ap,long double); else (void)va_arg(ap,double);
+            default:
+               // not something we can do, show it as it was written
+               if(*fmt == 0) fmt--;
+               for(s=spec; s <= fmt; s++) kmsg_out(out,room,&used,*s);
+               continue;
+         }
+
+         sign = 0;
+         if(is_signed) {
+            sv = wide ? va_arg(ap,long long) : va_arg(ap,int);
+            if(sv < 0) {
+               sign = '-';
+               v = 0ULL - (unsigned long long)sv;
+            } else {
+               v = (unsigned long long)sv;
+               if(plus) sign = '+'; else if(space) sign = ' ';
+            }
+         } else if(*fmt == 'p') {
+            v = (unsigned long long)(UINTN)va_arg(ap,void*);
+         } else {
+            v = wide ? va_arg(ap,unsigned long long) : va_arg(ap,unsigned int);
+         }
+
+         ndigits = 0;
+         while(v != 0) {
+            digits[ndigits++] = (upper ? "0123456789ABCDEF" : "0123456789abcdef")[v % base];
+            v /= base;
+         }
+         prefix = "";
+         if(alt && base == 16 && ndigits > 0) prefix = upper ? "0X" : "0x";
+         nzeros = 0;
+         if(prec < 0) {
+            if(ndigits == 0) nzeros = 1;
+         } else if(prec > ndigits) {
+            nzeros = prec - ndigits;
+         }
+         if(alt && base == 8 && nzeros == 0 && (ndigits == 0 || digits[ndigits-1] != '0')) nzeros = 1;
+         pad = width - ndigits - nzeros - (sign ? 1 : 0) - (int)strlen(prefix);
+         if(zero && !left && prec < 0 && pad > 0) {
+            nzeros += pad;
+            pad = 0;
+         }
+         kmsg_out_pad(out,room,&used,' ',left ? 0 : pad);
+         if(sign) kmsg_out(out,room,&used,sign);
+         while(*prefix != 0) kmsg_out(out,room,&used,*prefix++);
+         kmsg_out_pad(out,room,&used,'0',nzeros);
+         while(ndigits > 0) kmsg_out(out,room,&used,digits[--ndigits]);
+         kmsg_out_pad(out,room,&used,' ',left ? pad : 0);
+     }
+     out[used] = 0;
+     return (int)used;
+}
+
+static int kmsg_write(char* component, UINT8 level, const char *fmt, va_list ap) {
+     char line[KMSG_LINE_MAX];
+     UINT32 len;
+     int retval;
+     retval = kmsg_vformat(line,KMSG_LINE_MAX,fmt,ap);
+     if(retval < 0) return retval;
+     len = (retval < KMSG_LINE_MAX) ? retval : KMSG_LINE_MAX-1;
+     kmsg_put(component,level,0,line,len);
+     return retval;
+}
+
+// fmt's entry in ktrace_fmts, NULL if it has to be formatted now
+static ktrace_fmt_t* ktrace_intern(const char* fmt) {
+     const char* p = fmt;
+     ktrace_spec_t spec;
+     ktrace_fmt_t* f;
+     UINTN h, n;
+     UINT32 id;
+     if((UINTN)fmt < ktrace_image_base || (UINTN)fmt >= ktrace_image_end) return NULL;
+     h = ((UINTN)fmt >> 3) * 0x9E3779B97F4A7C15ULL >> 53;
+     for(n=0; n < KTRACE_HASH_SIZE; n++, h++) {
+         h &= KTRACE_HASH_SIZE-1;
+         if(ktrace_hash_key[h] == NULL && __sync_bool_compare_and_swap(&ktrace_hash_key[h],NULL,fmt)) break;
+         if(ktrace_hash_key[h] != fmt) continue;
+         id = ktrace_hash_id[h];
+         return (id == 0 || id == KTRACE_NO_ID) ? NULL : &ktrace_fmts[id-1]; // 0 is someone else still on it
+     }
+     if(n == KTRACE_HASH_SIZE) return NULL;
 
-void init_static_kmsg() {
-     memset((void*)static_kmsg,0,4096);
+     // it's ours to fill in
+     id = __sync_fetch_and_add(&ktrace_fmt_count,1);
+     if(id >= KTRACE_FMT_MAX) {
+        ktrace_hash_id[h] = KTRACE_NO_ID;
+        return NULL;
+     }
+     f = &ktrace_fmts[id];
+     f->nargs = 0;
+     while(ktrace_next_spec(&p,&spec)) {
+        if(spec.type == KTRACE_ARG_NONE) continue;
+        if(spec.type == KTRACE_ARG_BAD || f->nargs + spec.stars >= KTRACE_MAX_ARGS) {
+           f->nargs = KTRACE_MAX_ARGS+1;
+           break;
+        }
+        while(spec.stars-- > 0) f->sig[f->nargs++] = KTRACE_ARG_INT;
+        f->sig[f->nargs++] = (UINT8)spec.type;
+     }
+     f->fmt = (f->nargs > KTRACE_MAX_ARGS) ? NULL : fmt; // the ID's left unused, dumps write it as empty
+     __sync_synchronize();
+     ktrace_hash_id[h] = (f->fmt != NULL) ? id+1 : KTRACE_NO_ID;
+     return (f->fmt != NULL) ? f : NULL;
 }
 
-int kprintf(const char *fmt, ...);
-void init_dynamic_kmsg() {
-	kmsg = realloc((void*)kmsg, 4096);
-	memset((void*)kmsg, 0, 4096);
-	strcat(kmsg,static_kmsg);
-	is_static = 0;
+// the ID and then the arguments in out as ktrace.h has them, -1 if that's more than room
+static int ktrace_encode(ktrace_fmt_t* f, UINT8* out, UINTN room, va_list ap) {
+     UINT8* p = out;
+     UINT8* end = out + room;
+     UINT32 id = (UINT32)(f - ktrace_fmts);
+     INT64 v;
+     double d;
+     char* s;
+     UINT16 slen;
+     UINTN i;
+     memcpy(p,&id,4);
+     p += 4;
+     for(i=0; i < f->nargs; i++) {
+         if(end - p < 8) return -1;
+         switch(f->sig[i]) {
+            case KTRACE_ARG_INT:
+               v = va_arg(ap,int);
+               memcpy(p,&v,8);
+               p += 8;
+            break;
+            case KTRACE_ARG_INT64:
+               v = va_arg(ap,INT64);
+               memcpy(p,&v,8);
+               p += 8;
+            break;
+            case KTRACE_ARG_DOUBLE:
+               d = va_arg(ap,double);
+               memcpy(p,&d,8);
+               p += 8;
+            break;
+            case KTRACE_ARG_LDOUBLE:
+               d = (double)va_arg(ap,long double);
+               memcpy(p,&d,8);
+               p += 8;
+            break;
+            case KTRACE_ARG_STR:
+               s = va_arg(ap,char*);
+               if(s == NULL) s = "(null)";
+               for(slen=0; slen < KTRACE_STR_MAX && s[slen] != 0; slen++);
+               if(end - p < 2 + slen) return -1;
+               memcpy(p,&slen,2);
+               memcpy(p+2,s,slen);
+               p += 2 + slen;
+            break;
+         }
+     }
+     return (int)(p - out);
 }
 
 int kprintf(const char *fmt, ...)
 {
-	acquire_kmsg_lock();
-	char temp_buf[4096];
-	memset((void*)temp_buf, 0, 4096);
 	va_list ap;
 	va_start(ap, fmt);
-	int retval = vsprintf(temp_buf,fmt,ap);
+	int retval = kmsg_write("",KMSG_RAW,fmt,ap);
 	va_end(ap);
-	if(is_static==0) {
-		if((strlen(temp_buf)+strlen(kmsg))>buf_len) {
-			kmsg = realloc((void*)kmsg, strlen(kmsg)+strlen(temp_buf)+8192); // always tag on a few kb so we don't need to reallocate every time
-			buf_len = strlen(kmsg)+strlen(temp_buf)+8192;
-		}
-		strcat(kmsg,temp_buf);
-	} else {
-		strcat(static_kmsg,temp_buf);
-	}
-	console_write_chars(temp_buf,strlen(temp_buf));
-//	printf(temp_buf);
-	release_kmsg_lock();
         return retval;
 }
 
-int kvprintf(const char *fmt, va_list ap)
-{
-	acquire_kmsg_lock();
-	char temp_buf[4096];
-	memset((void*)temp_buf, 0, 4096);
-	int retval = vsprintf(temp_buf,fmt,ap);
-	if(is_static==0) {
-		if((strlen(temp_buf)+strlen(kmsg))>buf_len) {
-			kmsg = realloc((void*)kmsg, strlen(kmsg)+strlen(temp_buf)+8192); // always tag on a few kb so we don't need to reallocate every time
-			buf_len = strlen(kmsg)+strlen(temp_buf)+8192;
-		}
-		strcat(kmsg,temp_buf);
-	} else {
-		strcat(static_kmsg,temp_buf);
-	}
-	
-	int i=0;
-	UINT16 port = 0x402;
-	UINT8  c=0;
-	for(i=0; i < strlen(temp_buf); i++) {
-	    c = temp_buf[i];
-	    __asm__ volatile("outb %0, %1" : : "a"(c), "Nd"(port));
-	}
-	c = '\n';
-        __asm__ volatile("outb %0, %1" : : "a"(c), "Nd"(port));
-	console_write_chars(temp_buf,strlen(temp_buf));
-	//printf(temp_buf);
-	release_kmsg_lock();
-        return retval;
+// -1 if the arguments don't fit a record, nothing's been logged and ap hasn't been touched
+static int kmsg_write_bin(char* component, UINT8 level, ktrace_fmt_t* f, va_list ap) {
+     UINT8 rec[KMSG_LINE_MAX];
+     va_list args;
+     int len;
+     va_copy(args,ap);
+     len = ktrace_encode(f,rec,sizeof(rec),args);
+     va_end(args);
+     if(len < 0) return -1;
+     kmsg_put(component,level,KMSG_BIN,rec,len);
+     return 0; // nothing's been formatted to count
 }
 
-
 int klog(char* component, int is_good, const char *fmt, ...) {
-    acquire_klog_lock();
-    if(is_good != KLOG_ERR) {
-       ST->ConOut->SetAttribute(ST->ConOut,EFI_TEXT_ATTR(EFI_GREEN|0x8,EFI_BACKGROUND_BLACK));
-    } else {
-       ST->ConOut->SetAttribute(ST->ConOut,EFI_TEXT_ATTR(EFI_RED|0x8,EFI_BACKGROUND_BLACK));
-    }
-    char temp_buf[15];
-    char comp_buf[15];
-    snprintf(comp_buf,15,"[%s]",component);
-    snprintf(temp_buf,15,"%-10s ",comp_buf);
-    int i;
-    CHAR16 str[] = {0,0};
-    for(i=0; i<strlen(temp_buf); i++) {
-       str[0] = (CHAR16)(temp_buf[i]);
-       ST->ConOut->OutputString(ST->ConOut,str);
-    }
-    ST->ConOut->SetAttribute(ST->ConOut,EFI_TEXT_ATTR(EFI_LIGHTGRAY,EFI_BACKGROUND_BLACK));
     va_list ap;
+    ktrace_fmt_t* f;
+    int retval;
     va_start(ap, fmt);
-    int retval = kvprintf(fmt,ap);
-    va_end(ap);
-    if(is_good != KLOG_PROG) {
-       kprintf("\n");
+    if(kmsg_binary && (f = ktrace_intern(fmt)) != NULL && kmsg_write_bin(component,(UINT8)is_good,f,ap) == 0) {
+       retval = 0;
+    } else {
+       retval = kmsg_write(component,(UINT8)is_good,fmt,ap);
     }
-    release_klog_lock();
+    va_end(ap);
+    return retval;
+}
+
+void kmsg_set_binary() {
+     EFI_LOADED_IMAGE_PROTOCOL* image;
+     EFI_PHYSICAL_ADDRESS addr;
+     if(EFI_ERROR(BS->HandleProtocol(gImageHandle,&gEfiLoadedImageProtocolGuid,(void**)&image))) {
+        klog("KMSG",0,"Can't find the kernel image, not logging in binary");
+        return;
+     }
+     ktrace_keep = pmm_alloc_pages(EFI_SIZE_TO_PAGES(KTRACE_KEEP_SIZE),1);
+     if(ktrace_keep == NULL) {
+        if(EFI_ERROR(BS->AllocatePages(AllocateAnyPages,EfiLoaderData,EFI_SIZE_TO_PAGES(KTRACE_KEEP_SIZE),&addr))) {
+           klog("KMSG",0,"No memory to keep a binary log in");
+           return;
+        }
+        ktrace_keep = (UINT8*)(UINTN)addr;
+     }
+     ktrace_image_base = (UINTN)image->ImageBase;
+     ktrace_image_end  = ktrace_image_base + image->ImageSize;
+     kmsg_binary       = 1;
+     klog("KMSG",1,"Logging in binary, keeping the last %d KiB",KTRACE_KEEP_SIZE/1024);
+}
+
+int ktrace_dump(char* path) {
+     char def_path[PATH_MAX];
+     ktrace_header_t hdr;
+     ktrace_rec_t* k;
+     UINT64 pos, bytes = 0;
+     UINT32 i, len;
+     FILE* fp;
+     if(ktrace_keep == NULL) return -1;
+     if(path == NULL) {
+        vfs_boot_file(def_path,PATH_MAX,KTRACE_DUMP_NAME);
+        path = def_path;
+     }
+     thread_enter_bsp(); // StdLib
+     kmsg_flush();
+     while(__sync_lock_test_and_set(&kmsg_draining,1)) thread_yield(); // the kept log holds still while we write it
+     fp = fopen(path,"wb");
+     if(fp == NULL) {
+        __sync_lock_release(&kmsg_draining);
+        thread_leave_bsp();
+        klog("KMSG",0,"Could not open %s to write the binary log to",path);
+        return -1;
+     }
+     for(pos=ktrace_keep_tail; pos != ktrace_keep_head; pos += k->size & ~KTRACE_KEEP_PAD) {
+         k = (ktrace_rec_t*)(ktrace_keep + (pos & (KTRACE_KEEP_SIZE-1)));
+         if(!(k->size & KTRACE_KEEP_PAD)) bytes += k->size;
+     }
+     memcpy(hdr.magic,KTRACE_MAGIC,4);
+     hdr.fmt_count  = (ktrace_fmt_count < KTRACE_FMT_MAX) ? ktrace_fmt_count : KTRACE_FMT_MAX;
+     hdr.tsc_per_us = thread_tsc_per_us();
+     hdr.rec_bytes  = bytes;
+     fwrite(&hdr,sizeof(hdr),1,fp);
+     for(i=0; i < hdr.fmt_count; i++) {
+         len = (ktrace_fmts[i].fmt != NULL) ? strlen(ktrace_fmts[i].fmt) : 0;
+         fwrite(&len,4,1,fp);
+         if(len != 0) fwrite(ktrace_fmts[i].fmt,len,1,fp);
+     }
+     for(pos=ktrace_keep_tail; pos != ktrace_keep_head; pos += k->size & ~KTRACE_KEEP_PAD) {
+         k = (ktrace_rec_t*)(ktrace_keep + (pos & (KTRACE_KEEP_SIZE-1)));
+         if(!(k->size & KTRACE_KEEP_PAD)) fwrite(k,k->size,1,fp);
+     }
+     fclose(fp);
+     __sync_lock_release(&kmsg_draining);
+     thread_leave_bsp();
+     klog("KMSG",1,"Wrote %lld bytes of binary log to %s",bytes,path);
+     return 0;
+}
+
+int sys_tracedump(char* path) {
+     return ktrace_dump(path);
 }
 
 static UINT64 prog_start_cur   = 0;
@@ -146,7 +688,9 @@ static char prog_amounts[256];
 static char spin_char[] = "/-|\\-";
 static int prog_spin=0;
 
+// the bar is drawn straight to the console, so anything logged before it goes out first
 void kmsg_prog_start(UINT64 total) {
+     kmsg_flush();
      prog_start_cur = prog_start_total = 0;
      prog_start_total = total;
      snprintf(prog_chars,32,"%0*d",30,0);
@@ -155,6 +699,7 @@ void kmsg_prog_start(UINT64 total) {
 }
 
 void kmsg_prog_update(UINT64 n) {
+     kmsg_flush();
      prog_start_cur += n;
      if(prog_spin>=4) prog_spin=-1;
      prog_spin++;
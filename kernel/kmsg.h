@@ -5,13 +5,17 @@
 #define KLOG_OK   1  // this log entry is just a status update, it's all good
 #define KLOG_PROG 2  // this log entry is something that needs a progress bar
 
-#ifndef IN_KMSG
-extern char *kmsg;
-#endif
+// lines go into a per-CPU ring and a thread on the BSP writes them out, see kmsg.c
+
+void kmsg_start_drain(); // once threads can be created, until then the BSP writes lines out as they're logged
+
+void kmsg_flush();       // write out everything logged so far, only does anything on the BSP
+int  kmsg_pending();     // 1 while something logged hasn't been written out yet
+UINT64 kmsg_dropped();   // lines that found their CPU's ring full, since boot
 
-void init_static_kmsg();
+void kmsg_set_binary();  // klog=binary, klog() keeps its arguments and formats later - see ktrace.h
 
-void init_dynamic_kmsg();
+int ktrace_dump(char* path); // the kept binary log to a UEFI path, NULL for klog.trc on the boot volume
 
 int kprintf(const char *fmt, ...);
 
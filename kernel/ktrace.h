@@ -0,0 +1,207 @@
+#ifndef KTRACE_H
+#define KTRACE_H
+
+// Binary kernel log, shared between the kernel and tools/ktracedump
+//
+// With klog=binary a klog() call keeps its format string's ID and its arguments as they were passed instead of the
+// formatted line, and the text is only made when it's written out. The kernel keeps the last few MiB of records and
+// sys_tracedump() writes them out as:
+//
+//   ktrace_header_t
+//   fmt_count x { uint32_t len; char fmt[len]; }   format strings in ID order, not NUL terminated
+//   ktrace_rec_t records, oldest first, each followed by len bytes of arguments and padded to size
+//
+// Each argument is encoded in the order of the format's conversions: an 8 byte integer or double (a '*' width or
+// precision is an integer before its conversion), or for %s a uint16_t length and that many bytes.
+// ktrace_format() turns them back into text the way snprintf() would have.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define KTRACE_MAGIC      "KTR1"
+#define KTRACE_FMT_TEXT   0xFFFFFFFF   // not deferred, the arguments are the finished text
+#define KTRACE_MAX_ARGS   16
+#define KTRACE_STR_MAX    256          // %s arguments are cut short past this
+
+// argument types
+#define KTRACE_ARG_NONE    0           // %%
+#define KTRACE_ARG_INT     1           // int or narrower, stored sign extended
+#define KTRACE_ARG_INT64   2
+#define KTRACE_ARG_DOUBLE  3
+#define KTRACE_ARG_LDOUBLE 4           // stored as a double
+#define KTRACE_ARG_STR     5
+#define KTRACE_ARG_BAD     6           // can't be deferred (%n, %ls, anything unknown)
+
+typedef struct __attribute__((__packed__)) ktrace_header_t {
+     char     magic[4];
+     uint32_t fmt_count;
+     uint64_t tsc_per_us;              // 0 if the kernel hadn't measured it
+     uint64_t rec_bytes;               // of records after the format table
+} ktrace_header_t;
+
+typedef struct __attribute__((__packed__)) ktrace_rec_t {
+     uint32_t size;                    // header, arguments and padding to 8 bytes
+     uint16_t len;                     // of arguments
+     uint8_t  level;                   // KLOG_ERR, KLOG_OK or KLOG_PROG, 0xFF for kprintf()
+     uint8_t  cpu;
+     uint64_t tsc;
+     char     comp[16];
+     uint32_t fmt;                     // format string ID, or KTRACE_FMT_TEXT
+     uint32_t reserved;
+} ktrace_rec_t;
+
+typedef struct ktrace_spec_t {
+     const char* start;                // the '%'
+     const char* end;                  // just past the conversion character
+     int         type;
+     int         stars;                // int arguments it takes before its own, for '*'
+} ktrace_spec_t;
+
+// the next conversion in *fmt, 0 once there are no more
+static inline int ktrace_next_spec(const char** fmt, ktrace_spec_t* spec) {
+     const char* p = *fmt;
+     int wide = 0;
+     int ldbl = 0;
+     char conv;
+     while(*p != 0 && *p != '%') p++;
+     if(*p == 0) return 0;
+     spec->start = p++;
+     spec->stars = 0;
+     while(*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'') p++;
+     if(*p == '*') {
+        spec->stars++;
+        p++;
+     }
+     while(*p >= '0' && *p <= '9') p++;
+     if(*p == '.') {
+        p++;
+        if(*p == '*') {
+           spec->stars++;
+           p++;
+        }
+        while(*p >= '0' && *p <= '9') p++;
+     }
+     while(*p == 'h' || *p == 'l' || *p == 'L' || *p == 'q' || *p == 'j' || *p == 'z' || *p == 't') {
+        if(*p == 'L') ldbl = 1; else if(*p != 'h') wide = 1;
+        p++;
+     }
+     conv = *p;
+     if(conv != 0) p++;
+     switch(conv) {
+        case '%':
+           spec->type = KTRACE_ARG_NONE;
+        break;
+        case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+           spec->type = wide ? KTRACE_ARG_INT64 : KTRACE_ARG_INT;
+        break;
+        case 'p':
+           spec->type = KTRACE_ARG_INT64;
+        break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+           spec->type = ldbl ? KTRACE_ARG_LDOUBLE : KTRACE_ARG_DOUBLE;
+        break;
+        case 's':
+           spec->type = wide ? KTRACE_ARG_BAD : KTRACE_ARG_STR;
+        break;
+        default:
+           spec->type = KTRACE_ARG_BAD;
+        break;
+     }
+     spec->end = p;
+     *fmt = p;
+     return 1;
+}
+
+static inline int ktrace_get64(const uint8_t** args, const uint8_t* end, uint64_t* v) {
+     if(end - *args < 8) return 0;
+     memcpy(v,*args,8);
+     *args += 8;
+     return 1;
+}
+
+// appends to out at *used, never past room-1, and keeps it NUL terminated
+static inline void ktrace_append(char* out, size_t room, size_t* used, const char* s, size_t len) {
+     if(*used + len > room-1) len = room-1 - *used;
+     memcpy(out + *used,s,len);
+     *used += len;
+     out[*used] = 0;
+}
+
+// fmt applied to a record's arguments, like snprintf(), returns the length written
+static inline size_t ktrace_format(char* out, size_t room, const char* fmt, const uint8_t* args, size_t args_len) {
+     const uint8_t* end = args + args_len;
+     const char* p = fmt;
+     const char* lit = fmt;
+     ktrace_spec_t spec;
+     char piece[64];
+     char str[KTRACE_STR_MAX+1];
+     uint64_t v, star[2];
+     uint16_t slen;
+     double d;
+     size_t used = 0;
+     size_t plen;
+     int n, i, s;
+     if(room == 0) return 0;
+     out[0] = 0;
+     while(ktrace_next_spec(&p,&spec)) {
+        ktrace_append(out,room,&used,lit,spec.start - lit);
+        lit = spec.end;
+        if(spec.type == KTRACE_ARG_NONE) {
+           ktrace_append(out,room,&used,"%",1);
+           continue;
+        }
+        for(s=0; s < spec.stars; s++) {
+            if(!ktrace_get64(&args,end,&star[s])) return used;
+        }
+        // the conversion on its own, with any '*' filled in
+        plen = 0;
+        s    = 0;
+        for(i=0; spec.start + i < spec.end && plen < sizeof(piece)-24; i++) {
+            if(spec.start[i] == '*') {
+               plen += snprintf(piece + plen,sizeof(piece) - plen,"%d",(int)star[s++]);
+            } else {
+               piece[plen++] = spec.start[i];
+            }
+        }
+        piece[plen] = 0;
+        n = 0;
+        switch(spec.type) {
+           case KTRACE_ARG_INT:
+              if(!ktrace_get64(&args,end,&v)) return used;
+              n = snprintf(out + used,room - used,piece,(int)v);
+           break;
+           case KTRACE_ARG_INT64:
+              if(!ktrace_get64(&args,end,&v)) return used;
+              n = snprintf(out + used,room - used,piece,(long long)v);
+           break;
+           case KTRACE_ARG_DOUBLE:
+              if(!ktrace_get64(&args,end,&v)) return used;
+              memcpy(&d,&v,8);
+              n = snprintf(out + used,room - used,piece,d);
+           break;
+           case KTRACE_ARG_LDOUBLE:
+              if(!ktrace_get64(&args,end,&v)) return used;
+              memcpy(&d,&v,8);
+              n = snprintf(out + used,room - used,piece,(long double)d);
+           break;
+           case KTRACE_ARG_STR:
+              if(end - args < 2) return used;
+              memcpy(&slen,args,2);
+              args += 2;
+              if(slen > KTRACE_STR_MAX || end - args < slen) return used;
+              memcpy(str,args,slen);
+              str[slen] = 0;
+              args += slen;
+              n = snprintf(out + used,room - used,piece,str);
+           break;
+           default:
+              return used;
+        }
+        if(n > 0) used += ((size_t)n < room - used) ? (size_t)n : room-1 - used;
+     }
+     ktrace_append(out,room,&used,lit,strlen(lit));
+     return used;
+}
+
+#endif
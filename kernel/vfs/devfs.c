@@ -1,10 +1,16 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
 
 #include "../k_vfs.h"
+#include "../k_dbgsink.h"
+#include "../k_prof.h"
+#include "../k_bench.h"
 extern EFI_BOOT_SERVICES *BS;
 extern EFI_HANDLE gImageHandle;
 
@@ -14,44 +20,108 @@ extern EFI_HANDLE gImageHandle;
 vfs_fs_type_t *devfs_fs_type = NULL;
 char* devfs_fs_type_s = "devfs";
 
-char** root_list = {
-    "console",
-    NULL
+// every device is a fixed entry in this table, an open file descriptor is just a pointer to the entry
+typedef struct devfs_dev_t {
+     char*   name;
+     ssize_t (*read)(void* buf, size_t count);
+     ssize_t (*write)(void* buf, size_t count);
+} devfs_dev_t;
+
+static ssize_t devfs_console_read(void* buf, size_t count) {
+     return read(0,buf,count);
+}
+
+static ssize_t devfs_console_write(void* buf, size_t count) {
+     return write(1,buf,count);
+}
+
+static ssize_t devfs_null_read(void* buf, size_t count) {
+     return 0;
+}
+
+static ssize_t devfs_zero_read(void* buf, size_t count) {
+     memset(buf,0,count);
+     return count;
+}
+
+static ssize_t devfs_discard_write(void* buf, size_t count) {
+     return count;
+}
+
+static devfs_dev_t devfs_devs[] = {
+     {"console", &devfs_console_read, &devfs_console_write},
+     {"null",    &devfs_null_read,    &devfs_discard_write},
+     {"zero",    &devfs_zero_read,    &devfs_discard_write},
+     {"kmsg",    &dbgsink_mem_read,   &devfs_discard_write}, // with debug=...,mem
+     {"profile", &prof_read,          &prof_write},          // write a rate in Hz to start sampling, 0 to stop
+     {"bench",   &bench_read,         &bench_write},         // write a benchmark name to run it, read the results
+     {NULL,      NULL,                NULL}
 };
 
+static devfs_dev_t* devfs_find(char* path) {
+     int i;
+     while(*path == '/') path++;
+     for(i=0; devfs_devs[i].name != NULL; i++) {
+         if(strcmp(devfs_devs[i].name,path)==0) return &(devfs_devs[i]);
+     }
+     return NULL;
+}
+
 void vfs_devfs_shutdown(vfs_fs_handler_t* this) {
 }
 
 int vfs_devfs_file_exists(vfs_fs_handler_t* this, char* path) {
+     return devfs_find(path) != NULL;
 }
 
 char** vfs_devfs_list_root_dir(vfs_fs_handler_t* this) {
-       return root_list;
+     int i;
+     char** retval = (char**)calloc(sizeof(char*),sizeof(devfs_devs)/sizeof(devfs_dev_t));
+     if(retval == NULL) return NULL;
+     for(i=0; devfs_devs[i].name != NULL; i++) {
+         retval[i] = (char*)calloc(1,strlen(devfs_devs[i].name)+1);
+         strcpy(retval[i],devfs_devs[i].name);
+     }
+     return retval;
 }
 
 void* vfs_devfs_open(vfs_fs_handler_t* this, char* path, int flags) {
+     return devfs_find(path);
 }
 
 int vfs_devfs_close(vfs_fs_handler_t* this, void* fd) {
+     return 0;
 }
 
 ssize_t vfs_devfs_read(vfs_fs_handler_t* this, void* fd, void* buf, size_t count) {
+     return ((devfs_dev_t*)fd)->read(buf,count);
 }
 
 ssize_t vfs_devfs_write(vfs_fs_handler_t* this, void* fd, void* buf, size_t count) {
+     return ((devfs_dev_t*)fd)->write(buf,count);
 }
 
 off_t vfs_devfs_lseek(vfs_fs_handler_t* this, void* fd, off_t offset, int whence) {
+     return 0; // none of the devices are seekable, same as /dev/null on unix seeking is just ignored
+}
+
+static void devfs_stat(struct stat *buf) {
+     memset(buf,0,sizeof(struct stat));
+     buf->st_mode  = S_IFCHR | 0666;
+     buf->st_nlink = 1;
 }
 
 int vfs_devfs_stat(vfs_fs_handler_t* this, char* path, struct stat *buf) {
+     if(devfs_find(path) == NULL) return -1;
+     devfs_stat(buf);
+     return 0;
 }
 
 int vfs_devfs_fstat(vfs_fs_handler_t* this, void* fd, struct stat *buf) {
+     devfs_stat(buf);
+     return 0;
 }
 
-
-
 void vfs_devfs_setup(vfs_fs_handler_t* this, char* dev_name, char* mountpoint) {
      this->list_root_dir = &vfs_devfs_list_root_dir;
      this->shutdown      = &vfs_devfs_shutdown;
@@ -0,0 +1,500 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "../k_vfs.h"
+#include "../k_initrd.h"
+#include "../kmsg.h"
+extern EFI_BOOT_SERVICES *BS;
+extern EFI_HANDLE gImageHandle;
+
+#define IN_INITRDFS
+#include "initrdfs.h"
+
+// Read-only FAT12/16/32 driver that works directly on the resident initrd image
+//
+// Going through the UEFI FAT driver means every read is copied out of the image by InitRDReadBlocks() and then
+// copied again out of the FAT driver's own caches. Here file data is copied exactly once, straight from the image
+// into the caller's buffer, and map() hands out pointers into the image itself for callers that can use them.
+// Compressed images can't be mapped, reads are then copied out of the decompressed chunk cache in k_initrd.c.
+
+vfs_fs_type_t *initrdfs_fs_type = NULL;
+char* initrdfs_fs_type_s = "initrdfs";
+
+#define FAT_EOC        0xFFFFFFFF
+#define FAT_DIRENT_LEN 32
+#define FAT_ATTR_DIR   0x10
+#define FAT_ATTR_VOL   0x08
+#define FAT_ATTR_LFN   0x0F
+
+typedef struct initrdfs_vol_t {
+     UINT32 cluster_size;
+     UINT32 fat_type;      // 12, 16 or 32
+     UINT64 fat_offset;
+     UINT64 root_offset;   // FAT12/16 only, the root directory is a fixed region
+     UINT32 root_entries;
+     UINT32 root_cluster;  // FAT32 only
+     UINT64 data_offset;
+     UINT32 cluster_count;
+} initrdfs_vol_t;
+
+typedef struct initrdfs_node_t {
+     UINT32 first_cluster; // 0 means the fixed root directory on FAT12/16
+     UINT32 size;
+     int    is_dir;
+} initrdfs_node_t;
+
+typedef struct initrdfs_dir_iter_t {
+     UINT32 cluster;
+     UINT32 index;         // entry index within the current cluster, or within the fixed root directory
+     UINT8  entry[FAT_DIRENT_LEN];
+} initrdfs_dir_iter_t;
+
+typedef struct initrdfs_fd_t {
+     initrdfs_node_t     node;
+     UINT64              pos;
+     UINT32              cur_cluster;     // cluster holding byte cur_cluster_idx*cluster_size of the file
+     UINT32              cur_cluster_idx;
+     initrdfs_dir_iter_t dir_iter;        // only used for directories
+} initrdfs_fd_t;
+
+static UINT32 rd16(UINT64 offset) {
+     UINT8 p[2];
+     if(initrd_read(offset,p,2) != 0) return 0;
+     return p[0] | (p[1] << 8);
+}
+
+static UINT32 rd32(UINT64 offset) {
+     UINT8 p[4];
+     if(initrd_read(offset,p,4) != 0) return 0;
+     return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT32 fat_next(initrdfs_vol_t* vol, UINT32 cluster) {
+     UINT32 v;
+     if(cluster < 2 || cluster >= vol->cluster_count+2) return FAT_EOC;
+     switch(vol->fat_type) {
+        case 12:
+          v = rd16(vol->fat_offset + cluster + cluster/2);
+          v = (cluster & 1) ? (v >> 4) : (v & 0xFFF);
+          if(v >= 0xFF7) return FAT_EOC;
+        break;
+        case 16:
+          v = rd16(vol->fat_offset + cluster*2);
+          if(v >= 0xFFF7) return FAT_EOC;
+        break;
+        default:
+          v = rd32(vol->fat_offset + cluster*4) & 0x0FFFFFFF;
+          if(v >= 0x0FFFFFF7) return FAT_EOC;
+        break;
+     }
+     if(v < 2) return FAT_EOC;
+     return v;
+}
+
+static UINT64 cluster_offset(initrdfs_vol_t* vol, UINT32 cluster) {
+     return vol->data_offset + (UINT64)(cluster-2) * vol->cluster_size;
+}
+
+// returns the next raw 32 byte directory entry, copied into the iterator, or NULL at the end of the directory
+static UINT8* dir_next_raw(initrdfs_vol_t* vol, initrdfs_dir_iter_t* iter) {
+     UINT64 offset;
+     if(iter->cluster == 0) {
+        if(iter->index >= vol->root_entries) return NULL;
+        offset = vol->root_offset + (UINT64)iter->index*FAT_DIRENT_LEN;
+     } else {
+        if(iter->cluster == FAT_EOC) return NULL;
+        if(iter->index >= vol->cluster_size/FAT_DIRENT_LEN) {
+           iter->cluster = fat_next(vol,iter->cluster);
+           iter->index   = 0;
+           if(iter->cluster == FAT_EOC) return NULL;
+        }
+        offset = cluster_offset(vol,iter->cluster) + (UINT64)iter->index*FAT_DIRENT_LEN;
+     }
+     if(initrd_read(offset,iter->entry,FAT_DIRENT_LEN) != 0 || iter->entry[0] == 0) return NULL;
+     iter->index++;
+     return iter->entry;
+}
+
+static void short_name(UINT8* entry, char* name) {
+     int i;
+     int len=0;
+     for(i=0; i<8 && entry[i] != ' '; i++) {
+         name[len++] = (entry[12] & 0x08) ? tolower(entry[i]) : entry[i];
+     }
+     if(len > 0 && name[0] == 0x05) name[0] = 0xE5;
+     if(entry[8] != ' ') {
+        name[len++] = '.';
+        for(i=8; i<11 && entry[i] != ' '; i++) {
+            name[len++] = (entry[12] & 0x10) ? tolower(entry[i]) : entry[i];
+        }
+     }
+     name[len] = 0;
+}
+
+// returns the next directory entry that isn't part of a long name or a volume label, with the name in name
+static UINT8* dir_next(initrdfs_vol_t* vol, initrdfs_dir_iter_t* iter, char* name) {
+     static const int lfn_offsets[13] = {1,3,5,7,9,14,16,18,20,22,24,28,30};
+     UINT8* entry;
+     int have_lfn=0;
+     int i;
+     int seq;
+     UINT32 c;
+
+     while((entry = dir_next_raw(vol,iter)) != NULL) {
+        if(entry[0] == 0xE5) {
+           have_lfn = 0;
+           continue;
+        }
+        if(entry[11] == FAT_ATTR_LFN) {
+           seq = (entry[0] & 0x1F) - 1;
+           if(seq < 0 || seq >= 19) continue;
+           if(entry[0] & 0x40) {
+              memset(name,0,256);
+              have_lfn = 1;
+           }
+           for(i=0; i<13 && (seq*13+i) < 255; i++) {
+               c = entry[lfn_offsets[i]] | (entry[lfn_offsets[i]+1] << 8);
+               if(c == 0 || c == 0xFFFF) break;
+               name[seq*13+i] = (c < 0x80) ? (char)c : '?';
+           }
+           continue;
+        }
+        if(entry[11] & FAT_ATTR_VOL) {
+           have_lfn = 0;
+           continue;
+        }
+        if(!have_lfn || name[0] == 0) short_name(entry,name);
+        return entry;
+     }
+     return NULL;
+}
+
+static void node_from_entry(initrdfs_vol_t* vol, UINT8* entry, initrdfs_node_t* node) {
+     node->first_cluster = entry[26] | (entry[27] << 8) | (entry[20] << 16) | ((UINT32)entry[21] << 24);
+     node->size          = entry[28] | (entry[29] << 8) | (entry[30] << 16) | ((UINT32)entry[31] << 24);
+     node->is_dir        = (entry[11] & FAT_ATTR_DIR) ? 1 : 0;
+     if(node->is_dir && node->first_cluster == 0 && vol->fat_type == 32) node->first_cluster = vol->root_cluster;
+}
+
+static void root_node(initrdfs_vol_t* vol, initrdfs_node_t* node) {
+     node->first_cluster = (vol->fat_type == 32) ? vol->root_cluster : 0;
+     node->size          = 0;
+     node->is_dir        = 1;
+}
+
+static int name_eq(char* a, char* b, size_t b_len) { // FAT names are case insensitive
+     size_t i;
+     for(i=0; i<b_len; i++) {
+         if(a[i] == 0 || tolower(a[i]) != tolower(b[i])) return 0;
+     }
+     return a[b_len] == 0;
+}
+
+static int lookup(initrdfs_vol_t* vol, char* path, initrdfs_node_t* node) {
+     initrdfs_dir_iter_t iter;
+     char name[256];
+     UINT8* entry;
+     char* end;
+     size_t len;
+
+     root_node(vol,node);
+     while(*path != 0) {
+        while(*path == '/') path++;
+        if(*path == 0) break;
+        if(!node->is_dir) return 0;
+        end = strchr(path,'/');
+        len = (end == NULL) ? strlen(path) : (size_t)(end-path);
+
+        iter.cluster = node->first_cluster;
+        iter.index   = 0;
+        while((entry = dir_next(vol,&iter,name)) != NULL) {
+           if(name_eq(name,path,len)) break;
+        }
+        if(entry == NULL) return 0;
+        node_from_entry(vol,entry,node);
+        if(node->is_dir && node->first_cluster == 0) root_node(vol,node); // .. from a subdirectory of the root
+        path += len;
+     }
+     return 1;
+}
+
+// returns the image offset of the current position of fd, and sets *len to the number of contiguous bytes there,
+// never more than *len on entry and never past the end of the file - *len is 0 at the end of the file or on error
+static UINT64 file_run(initrdfs_vol_t* vol, initrdfs_fd_t* fd, size_t* len) {
+     UINT64 idx;
+     UINT64 in_cluster;
+     UINT64 avail;
+     UINT32 c;
+     UINT32 next;
+
+     if(fd->pos >= fd->node.size || fd->node.first_cluster < 2) {
+        *len = 0;
+        return 0;
+     }
+     if(*len > fd->node.size - fd->pos) *len = fd->node.size - fd->pos;
+
+     idx = fd->pos / vol->cluster_size;
+     if(fd->cur_cluster < 2 || idx < fd->cur_cluster_idx) {
+        fd->cur_cluster     = fd->node.first_cluster;
+        fd->cur_cluster_idx = 0;
+     }
+     while(fd->cur_cluster_idx < idx) {
+        fd->cur_cluster = fat_next(vol,fd->cur_cluster);
+        if(fd->cur_cluster == FAT_EOC) {
+           *len = 0;
+           return 0;
+        }
+        fd->cur_cluster_idx++;
+     }
+
+     // extend the run over any physically consecutive clusters
+     in_cluster = fd->pos % vol->cluster_size;
+     avail      = vol->cluster_size - in_cluster;
+     c          = fd->cur_cluster;
+     while(avail < *len && (next = fat_next(vol,c)) == c+1) {
+        avail += vol->cluster_size;
+        c      = next;
+     }
+     if(avail < *len) *len = avail;
+     return cluster_offset(vol,fd->cur_cluster) + in_cluster;
+}
+
+void vfs_initrdfs_shutdown(vfs_fs_handler_t* this) {
+     free(this->fs_data);
+     this->fs_data = NULL;
+}
+
+int vfs_initrdfs_file_exists(vfs_fs_handler_t* this, char* path) {
+     initrdfs_node_t node;
+     if(this->fs_data == NULL) return 0;
+     return lookup((initrdfs_vol_t*)this->fs_data,path,&node);
+}
+
+char** vfs_initrdfs_list_root_dir(vfs_fs_handler_t* this) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_dir_iter_t iter;
+     initrdfs_node_t root;
+     char name[256];
+     int i=0;
+     int max=64;
+     char** retval = (char**)calloc(sizeof(char*),max+1);
+
+     if(vol == NULL || retval == NULL) return retval;
+     root_node(vol,&root);
+     iter.cluster = root.first_cluster;
+     iter.index   = 0;
+     while(dir_next(vol,&iter,name) != NULL) {
+        if(i == max) {
+           max *= 2;
+           retval = (char**)realloc(retval,sizeof(char*)*(max+1));
+        }
+        retval[i] = (char*)calloc(1,strlen(name)+1);
+        strcpy(retval[i],name);
+        i++;
+     }
+     retval[i] = NULL;
+     return retval;
+}
+
+void* vfs_initrdfs_open(vfs_fs_handler_t* this, char* path, int flags) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_fd_t* fd;
+     if(vol == NULL) return NULL;
+     fd = (initrdfs_fd_t*)calloc(1,sizeof(initrdfs_fd_t));
+     if(fd == NULL) return NULL;
+     if(!lookup(vol,path,&(fd->node))) {
+        free(fd);
+        return NULL;
+     }
+     fd->dir_iter.cluster = fd->node.first_cluster;
+     return fd;
+}
+
+void* vfs_initrdfs_opendir(vfs_fs_handler_t* this, char* path) {
+     initrdfs_fd_t* fd = (initrdfs_fd_t*)vfs_initrdfs_open(this,path,O_RDONLY);
+     if(fd == NULL) return NULL;
+     if(!fd->node.is_dir) {
+        free(fd);
+        return NULL;
+     }
+     return fd;
+}
+
+struct vfs_dirent_t* vfs_initrdfs_readdir(vfs_fs_handler_t* this, void* _fd) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_fd_t*  fd  = (initrdfs_fd_t*)_fd;
+     vfs_dirent_t* retval;
+     UINT8* entry;
+     if(vol == NULL || fd == NULL) return NULL;
+     retval = (vfs_dirent_t*)calloc(1,sizeof(vfs_dirent_t));
+     entry  = dir_next(vol,&(fd->dir_iter),retval->d_name);
+     if(entry == NULL) {
+        free(retval);
+        return NULL;
+     }
+     retval->d_type = (entry[11] & FAT_ATTR_DIR) ? DT_DIR : DT_REG;
+     return retval;
+}
+
+int vfs_initrdfs_close(vfs_fs_handler_t* this, void* fd) {
+     free(fd);
+     return 0;
+}
+
+ssize_t vfs_initrdfs_read(vfs_fs_handler_t* this, void* _fd, void* buf, size_t count) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_fd_t*  fd  = (initrdfs_fd_t*)_fd;
+     ssize_t retval=0;
+     size_t len;
+     UINT64 offset;
+     void* src;
+     if(vol == NULL || fd == NULL || fd->node.is_dir) return -1;
+     while(count > 0) {
+        len    = count;
+        offset = file_run(vol,fd,&len);
+        if(len == 0) break;
+        src = initrd_map(offset,len);
+        if(src != NULL) {
+           memcpy(buf,src,len);
+        } else if(initrd_read(offset,buf,len) != 0) {
+           break;
+        }
+        buf      += len;
+        count    -= len;
+        fd->pos  += len;
+        retval   += len;
+     }
+     return retval;
+}
+
+ssize_t vfs_initrdfs_write(vfs_fs_handler_t* this, void* fd, void* buf, size_t count) {
+     return -1; // read only
+}
+
+off_t vfs_initrdfs_lseek(vfs_fs_handler_t* this, void* _fd, off_t offset, int whence) {
+     initrdfs_fd_t* fd = (initrdfs_fd_t*)_fd;
+     off_t new_pos;
+     if(fd == NULL) return -1;
+     switch(whence) {
+        case SEEK_SET: new_pos = offset;                  break;
+        case SEEK_CUR: new_pos = fd->pos + offset;        break;
+        case SEEK_END: new_pos = fd->node.size + offset;  break;
+        default: return -1;
+     }
+     if(new_pos < 0) return -1;
+     fd->pos = new_pos;
+     return new_pos;
+}
+
+void* vfs_initrdfs_map(vfs_fs_handler_t* this, void* _fd, off_t offset, size_t* len) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_fd_t*  fd  = (initrdfs_fd_t*)_fd;
+     UINT64 img_offset;
+     if(vol == NULL || fd == NULL || offset < 0 || fd->node.is_dir) return NULL;
+     fd->pos    = offset;
+     img_offset = file_run(vol,fd,len);
+     if(*len == 0) return NULL;
+     return initrd_map(img_offset,*len);
+}
+
+static void node_stat(initrdfs_vol_t* vol, initrdfs_node_t* node, struct stat *buf) {
+     memset(buf,0,sizeof(struct stat));
+     buf->st_mode    = node->is_dir ? (S_IFDIR | 0555) : (S_IFREG | 0444);
+     buf->st_size    = node->size;
+     buf->st_blksize = vol->cluster_size;
+     buf->st_nlink   = 1;
+}
+
+int vfs_initrdfs_stat(vfs_fs_handler_t* this, char* path, struct stat *buf) {
+     initrdfs_vol_t* vol = (initrdfs_vol_t*)this->fs_data;
+     initrdfs_node_t node;
+     if(vol == NULL || !lookup(vol,path,&node)) return -1;
+     node_stat(vol,&node,buf);
+     return 0;
+}
+
+int vfs_initrdfs_fstat(vfs_fs_handler_t* this, void* fd, struct stat *buf) {
+     if(this->fs_data == NULL || fd == NULL) return -1;
+     node_stat((initrdfs_vol_t*)this->fs_data,&(((initrdfs_fd_t*)fd)->node),buf);
+     return 0;
+}
+
+static initrdfs_vol_t* parse_bpb() {
+     UINT8 bpb[512];
+     initrdfs_vol_t* vol;
+     UINT32 bytes_per_sector;
+     UINT32 sectors_per_cluster;
+     UINT32 reserved_sectors;
+     UINT32 num_fats;
+     UINT32 fat_sectors;
+     UINT32 total_sectors;
+     UINT32 root_sectors;
+
+     if(initrd_read(0,bpb,512) != 0 || bpb[510] != 0x55 || bpb[511] != 0xAA) return NULL;
+     bytes_per_sector    = rd16(11);
+     sectors_per_cluster = bpb[13];
+     reserved_sectors    = rd16(14);
+     num_fats            = bpb[16];
+     total_sectors       = rd16(19) ? rd16(19) : rd32(32);
+     fat_sectors         = rd16(22) ? rd16(22) : rd32(36);
+     if(bytes_per_sector < 512 || sectors_per_cluster == 0 || num_fats == 0 || fat_sectors == 0) return NULL;
+
+     vol = (initrdfs_vol_t*)calloc(1,sizeof(initrdfs_vol_t));
+     if(vol == NULL) return NULL;
+     vol->root_entries = rd16(17);
+     root_sectors      = (vol->root_entries*FAT_DIRENT_LEN + bytes_per_sector-1) / bytes_per_sector;
+     vol->cluster_size = bytes_per_sector * sectors_per_cluster;
+     vol->fat_offset   = (UINT64)reserved_sectors * bytes_per_sector;
+     vol->root_offset  = vol->fat_offset + (UINT64)num_fats * fat_sectors * bytes_per_sector;
+     vol->data_offset  = vol->root_offset + (UINT64)root_sectors * bytes_per_sector;
+     vol->cluster_count = (total_sectors - (reserved_sectors + num_fats*fat_sectors + root_sectors)) / sectors_per_cluster;
+
+     if(vol->cluster_count < 4085) {
+        vol->fat_type = 12;
+     } else if(vol->cluster_count < 65525) {
+        vol->fat_type = 16;
+     } else {
+        vol->fat_type     = 32;
+        vol->root_cluster = rd32(44);
+     }
+     return vol;
+}
+
+void vfs_initrdfs_setup(vfs_fs_handler_t* this, char* dev_name, char* mountpoint) {
+     this->fs_data = parse_bpb();
+     if(this->fs_data == NULL) {
+        klog("VFS",0,"initrdfs: no FAT filesystem found in initrd image");
+     } else {
+        klog("VFS",1,"initrdfs: FAT%d, %d byte clusters",((initrdfs_vol_t*)this->fs_data)->fat_type,
+                                                        ((initrdfs_vol_t*)this->fs_data)->cluster_size);
+     }
+
+     this->list_root_dir = &vfs_initrdfs_list_root_dir;
+     this->shutdown      = &vfs_initrdfs_shutdown;
+     this->file_exists   = &vfs_initrdfs_file_exists;
+
+     this->open          = &vfs_initrdfs_open;
+     this->opendir       = &vfs_initrdfs_opendir;
+     this->readdir       = &vfs_initrdfs_readdir;
+     this->close         = &vfs_initrdfs_close;
+     this->read          = &vfs_initrdfs_read;
+     this->write         = &vfs_initrdfs_write;
+     this->lseek         = &vfs_initrdfs_lseek;
+     this->map           = &vfs_initrdfs_map;
+     this->stat          = &vfs_initrdfs_stat;
+     this->fstat         = &vfs_initrdfs_fstat;
+}
+
+void vfs_init_initrdfs_fs_type() {
+     initrdfs_fs_type          = (vfs_fs_type_t*)calloc(sizeof(vfs_fs_type_t),1);
+     initrdfs_fs_type->fs_type = initrdfs_fs_type_s;
+     initrdfs_fs_type->setup   = &vfs_initrdfs_setup;
+     klog("VFS",1,"initrdfs filesystem driver setup");
+}
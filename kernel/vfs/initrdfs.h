@@ -0,0 +1,20 @@
+#ifndef VFS_INITRDFS_H
+#define VFS_INITRDFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "../k_vfs.h"
+
+extern EFI_BOOT_SERVICES *BS;
+extern EFI_HANDLE gImageHandle;
+
+#ifndef IN_INITRDFS
+extern vfs_fs_type_t *initrdfs_fs_type;
+#endif
+
+void vfs_init_initrdfs_fs_type();
+
+#endif
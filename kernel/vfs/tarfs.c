@@ -0,0 +1,764 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "../k_vfs.h"
+#include "../k_initrd.h"
+#include "../kmsg.h"
+#include "../k_sync.h"
+extern EFI_BOOT_SERVICES *BS;
+extern EFI_HANDLE gImageHandle;
+
+#define IN_TARFS
+#include "tarfs.h"
+
+// Read-only driver for an initrd image that is a ustar/pax tar or a newc cpio archive
+//
+// Every entry goes into a hash table keyed on its full normalised path, so a lookup is one hash and one compare no
+// matter how deep the file is or how many files share a directory. The archive is indexed a header at a time as
+// lookups miss and readdir runs off the end of a directory, not at mount time - the initrd streams in behind the
+// mount, and finding /sbin/init shouldn't have to wait for the headers at the far end of the image.
+// Directories are linked to their children for readdir, parents that have no entry of their own in the archive are
+// created implicitly. File data in both formats is stored contiguously, reads come straight out of the image.
+//
+// Symlinks are followed when they are the last component of a path, which covers the usual busybox style initrd.
+
+vfs_fs_type_t *tarfs_fs_type = NULL;
+char* tarfs_fs_type_s = "tarfs";
+
+#define TAR_BLOCK          512
+#define CPIO_HDR_LEN       110
+#define TARFS_BUCKETS      256 // initial size of the hash table, must be a power of 2
+#define TARFS_PATH_BUF     256 // lookups of paths longer than this allocate a buffer
+#define TARFS_SYMLOOP_MAX  8
+
+// file type bits as stored in cpio archives, which are not necessarily the same as the ones in sys/stat.h
+#define CPIO_S_IFMT  0170000
+#define CPIO_S_IFDIR 0040000
+#define CPIO_S_IFREG 0100000
+#define CPIO_S_IFLNK 0120000
+
+typedef struct tarfs_node_t tarfs_node_t;
+struct tarfs_node_t {
+     char*         path;       // relative to the root of the archive, no leading or trailing /, "" for the root
+     size_t        path_len;
+     char*         name;       // last component of path
+     UINT32        hash;
+     int           type;       // DT_REG, DT_DIR or DT_LNK
+     mode_t        perm;
+     time_t        mtime;
+     UINT64        offset;     // image offset of the file data
+     UINT64        size;
+     char*         link;       // symlink target
+     tarfs_node_t* hash_next;
+     tarfs_node_t* parent;
+     tarfs_node_t* children;
+     tarfs_node_t* last_child;
+     tarfs_node_t* sibling;
+};
+
+typedef struct tarfs_vol_t {
+     tarfs_node_t*  root;
+     tarfs_node_t** buckets;
+     UINT32         bucket_count;
+     UINT32         node_count;
+     kmutex_t       lock;       // over the index, indexing more of the archive can sleep on the initrd stream
+     UINT64         next;       // image offset of the first header not indexed yet
+     int            cpio;
+     int            done;       // reached the end of the archive, or damage
+} tarfs_vol_t;
+
+typedef struct tarfs_fd_t {
+     tarfs_node_t* node;
+     UINT64        pos;
+     tarfs_node_t* last_child; // only used for directories, NULL before the first readdir
+} tarfs_fd_t;
+
+static UINT32 tarfs_hash(char* s, size_t len) { // FNV-1a
+     UINT32 h = 2166136261u;
+     size_t i;
+     for(i=0; i<len; i++) {
+         h ^= (UINT8)s[i];
+         h *= 16777619u;
+     }
+     return h;
+}
+
+// collapse a path into a/b/c form, resolving . and .. without looking at the archive
+// out must hold len+1 bytes, returns the length of the result
+static size_t normalize(char* in, size_t len, char* out) {
+     size_t i=0;
+     size_t o=0;
+     size_t start;
+     size_t clen;
+     while(i < len) {
+        while(i < len && in[i] == '/') i++;
+        start = i;
+        while(i < len && in[i] != '/') i++;
+        clen = i-start;
+        if(clen == 0 || (clen == 1 && in[start] == '.')) continue;
+        if(clen == 2 && in[start] == '.' && in[start+1] == '.') {
+           while(o > 0 && out[o-1] != '/') o--;
+           if(o > 0) o--;
+           continue;
+        }
+        if(o > 0) out[o++] = '/';
+        memcpy(out+o,in+start,clen);
+        o += clen;
+     }
+     out[o] = 0;
+     return o;
+}
+
+static tarfs_node_t* tarfs_find(tarfs_vol_t* vol, char* path, size_t len) {
+     UINT32 hash = tarfs_hash(path,len);
+     tarfs_node_t* node = vol->buckets[hash & (vol->bucket_count-1)];
+     while(node != NULL) {
+        if(node->hash == hash && node->path_len == len && memcmp(node->path,path,len)==0) return node;
+        node = node->hash_next;
+     }
+     return NULL;
+}
+
+static void tarfs_grow(tarfs_vol_t* vol) {
+     UINT32 count = vol->bucket_count*2;
+     tarfs_node_t** buckets = (tarfs_node_t**)calloc(count,sizeof(tarfs_node_t*));
+     tarfs_node_t* node;
+     tarfs_node_t* next;
+     UINT32 i;
+     if(buckets == NULL) return; // keep the old table, lookups just get slower
+     for(i=0; i<vol->bucket_count; i++) {
+         for(node = vol->buckets[i]; node != NULL; node = next) {
+             next = node->hash_next;
+             node->hash_next = buckets[node->hash & (count-1)];
+             buckets[node->hash & (count-1)] = node;
+         }
+     }
+     free(vol->buckets);
+     vol->buckets      = buckets;
+     vol->bucket_count = count;
+}
+
+// returns the node for a normalised path, creating it and any missing parent directories if needed
+static tarfs_node_t* tarfs_add(tarfs_vol_t* vol, char* path, size_t len) {
+     tarfs_node_t* node = tarfs_find(vol,path,len);
+     tarfs_node_t* parent = NULL;
+     size_t parent_len = len;
+     UINT32 bucket;
+
+     if(node != NULL) return node;
+     if(len > 0) {
+        while(parent_len > 0 && path[parent_len-1] != '/') parent_len--;
+        if(parent_len > 0) parent_len--;
+        parent = tarfs_add(vol,path,parent_len);
+        if(parent == NULL) return NULL;
+        parent->type = DT_DIR;
+     }
+
+     node = (tarfs_node_t*)calloc(1,sizeof(tarfs_node_t)+len+1);
+     if(node == NULL) return NULL;
+     node->path     = (char*)(node+1);
+     node->path_len = len;
+     memcpy(node->path,path,len);
+     node->path[len] = 0;
+     node->name     = (parent_len > 0) ? node->path+parent_len+1 : node->path;
+     node->hash     = tarfs_hash(path,len);
+     node->type     = DT_DIR;
+     node->perm     = 0555;
+     node->parent   = parent;
+     if(parent != NULL) {
+        if(parent->last_child == NULL) {
+           parent->children = node;
+        } else {
+           parent->last_child->sibling = node;
+        }
+        parent->last_child = node;
+     }
+
+     bucket = node->hash & (vol->bucket_count-1);
+     node->hash_next      = vol->buckets[bucket];
+     vol->buckets[bucket] = node;
+     vol->node_count++;
+     if(vol->node_count > vol->bucket_count) tarfs_grow(vol);
+     return node;
+}
+
+// add an entry from the archive, name doesn't need to be normalised
+static tarfs_node_t* tarfs_add_entry(tarfs_vol_t* vol, char* name, int type, mode_t perm, time_t mtime,
+                                     UINT64 offset, UINT64 size) {
+     size_t len = strlen(name);
+     char* path = (char*)malloc(len+1);
+     tarfs_node_t* node;
+     if(path == NULL) return NULL;
+     len  = normalize(name,len,path);
+     node = tarfs_add(vol,path,len);
+     free(path);
+     if(node == NULL) return NULL;
+     node->type   = type;
+     node->perm   = perm & 07777;
+     node->mtime  = mtime;
+     node->offset = offset;
+     node->size   = (type == DT_DIR) ? 0 : size;
+     return node;
+}
+
+// length of a string in a fixed size header field, which is only NUL terminated if it's shorter than the field
+static size_t field_len(UINT8* p, size_t max) {
+     size_t len=0;
+     while(len < max && p[len] != 0) len++;
+     return len;
+}
+
+static char* copy_string(char* s, size_t len) {
+     char* retval = (char*)malloc(len+1);
+     if(retval == NULL) return NULL;
+     memcpy(retval,s,len);
+     retval[len] = 0;
+     return retval;
+}
+
+// returns a NUL terminated copy of part of the image, caller must free()
+static char* read_string(UINT64 offset, UINT64 len) {
+     char* s = (char*)malloc(len+1);
+     if(s == NULL) return NULL;
+     if(initrd_read(offset,s,len) != 0) {
+        free(s);
+        return NULL;
+     }
+     s[len] = 0;
+     return s;
+}
+
+static UINT64 tar_num(UINT8* p, int len) {
+     UINT64 v=0;
+     int i=0;
+     if(p[0] & 0x80) { // GNU base-256 for values that don't fit in octal
+        v = p[0] & 0x7F;
+        for(i=1; i<len; i++) v = (v << 8) | p[i];
+        return v;
+     }
+     while(i < len && (p[i] == ' ' || p[i] == 0)) i++;
+     while(i < len && p[i] >= '0' && p[i] <= '7') v = (v << 3) | (p[i++] - '0');
+     return v;
+}
+
+static int tar_checksum_ok(UINT8* hdr) {
+     UINT64 sum=0;
+     int i;
+     for(i=0; i<TAR_BLOCK; i++) sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+     return sum == tar_num(hdr+148,8);
+}
+
+// picks path and linkpath out of a pax extended header, replacing whatever is in *name and *link
+static void tar_pax(UINT64 offset, UINT64 size, char** name, char** link) {
+     char* data = read_string(offset,size);
+     char* p = data;
+     char* end;
+     char* key;
+     char* value;
+     UINT64 rec_len;
+     if(data == NULL) return;
+     while(p < data+size) {
+        rec_len = strtoul(p,&key,10);
+        if(rec_len == 0 || key == p || *key != ' ' || rec_len > (UINT64)(data+size-p)) break;
+        end = p+rec_len-1; // the newline ending this record
+        *end = 0;
+        key++;
+        value = strchr(key,'=');
+        if(value != NULL) {
+           *value++ = 0;
+           if(strcmp(key,"path")==0) {
+              free(*name);
+              *name = copy_string(value,strlen(value));
+           } else if(strcmp(key,"linkpath")==0) {
+              free(*link);
+              *link = copy_string(value,strlen(value));
+           }
+        }
+        p = end+1;
+     }
+     free(data);
+}
+
+// indexes the next entry along with any long name or pax headers in front of it
+// 1 if it did, 0 at the end of the archive, -1 if the archive is damaged
+static int tar_next(tarfs_vol_t* vol) {
+     UINT8  hdr[TAR_BLOCK];
+     char   name[155+1+100+1]; // prefix + / + name + NUL
+     UINT64 image_size = initrd_size();
+     UINT64 offset=vol->next;
+     UINT64 data;
+     UINT64 size;
+     char*  long_name=NULL;  // from a GNU L entry or a pax header, applies to the next entry only
+     char*  long_link=NULL;
+     char*  entry_name;
+     char*  entry_link;
+     tarfs_node_t* node;
+     tarfs_node_t* target;
+     char*  target_path;
+     size_t len;
+     int    retval=0;
+
+     while(offset + TAR_BLOCK <= image_size) {
+        if(initrd_read(offset,hdr,TAR_BLOCK) != 0) {
+           retval = -1;
+           break;
+        }
+        if(hdr[0] == 0) break; // end of archive
+        if(!tar_checksum_ok(hdr)) {
+           klog("VFS",0,"tarfs: bad header checksum at offset %lld",offset);
+           retval = -1;
+           break;
+        }
+        size = tar_num(hdr+124,12);
+        data = offset + TAR_BLOCK;
+        if(size > image_size - data) {
+           klog("VFS",0,"tarfs: archive is truncated");
+           retval = -1;
+           break;
+        }
+        offset = data + ((size + TAR_BLOCK-1) & ~(UINT64)(TAR_BLOCK-1));
+
+        switch(hdr[156]) {
+           case 'L':
+             free(long_name);
+             long_name = read_string(data,size);
+           continue;
+           case 'K':
+             free(long_link);
+             long_link = read_string(data,size);
+           continue;
+           case 'x':
+             tar_pax(data,size,&long_name,&long_link);
+           continue;
+           case 'g':
+           continue;
+        }
+
+        entry_name = long_name;
+        if(entry_name == NULL) {
+           len = 0;
+           if(memcmp(hdr+257,"ustar",5)==0 && hdr[345] != 0) {
+              len = field_len(hdr+345,155);
+              memcpy(name,hdr+345,len);
+              name[len++] = '/';
+           }
+           memcpy(name+len,hdr,field_len(hdr,100));
+           name[len+field_len(hdr,100)] = 0;
+           entry_name = name;
+        }
+        entry_link = long_link;
+        if(entry_link == NULL) entry_link = copy_string((char*)hdr+157,field_len(hdr+157,100));
+
+        node = NULL;
+        switch(hdr[156]) {
+           case '0':
+           case '7':
+           case 0:
+             node = tarfs_add_entry(vol,entry_name,DT_REG,tar_num(hdr+100,8),tar_num(hdr+136,12),data,size);
+           break;
+           case '5':
+             node = tarfs_add_entry(vol,entry_name,DT_DIR,tar_num(hdr+100,8),tar_num(hdr+136,12),0,0);
+           break;
+           case '2':
+             node = tarfs_add_entry(vol,entry_name,DT_LNK,0777,tar_num(hdr+136,12),0,0);
+             if(node != NULL && entry_link != NULL) {
+                free(node->link);
+                node->link = entry_link;
+                node->size = strlen(entry_link);
+                entry_link = NULL;
+             }
+           break;
+           case '1': // hard link, shares the data of an earlier entry
+             if(entry_link == NULL) break;
+             len         = strlen(entry_link);
+             target      = NULL;
+             target_path = (char*)malloc(len+1);
+             if(target_path != NULL) {
+                target = tarfs_find(vol,target_path,normalize(entry_link,len,target_path));
+                free(target_path);
+             }
+             if(target != NULL && target->type == DT_REG) {
+                node = tarfs_add_entry(vol,entry_name,DT_REG,target->perm,target->mtime,target->offset,target->size);
+             } else {
+                klog("VFS",0,"tarfs: hard link to missing file %s",entry_link);
+             }
+           break;
+           default: // devices, fifos etc don't mean anything here
+           break;
+        }
+        free(entry_link);
+        if(entry_name != name) free(entry_name);
+        vol->next = offset;
+        return 1;
+     }
+     free(long_name);
+     free(long_link);
+     return retval;
+}
+
+static UINT32 cpio_hex(char* p) {
+     UINT32 v=0;
+     int i;
+     for(i=0; i<8; i++) {
+         v <<= 4;
+         if(p[i] >= '0' && p[i] <= '9') {
+            v |= p[i]-'0';
+         } else if(p[i] >= 'a' && p[i] <= 'f') {
+            v |= p[i]-'a'+10;
+         } else if(p[i] >= 'A' && p[i] <= 'F') {
+            v |= p[i]-'A'+10;
+         }
+     }
+     return v;
+}
+
+// like tar_next()
+static int cpio_next(tarfs_vol_t* vol) {
+     char   hdr[CPIO_HDR_LEN];
+     UINT64 image_size = initrd_size();
+     UINT64 offset=vol->next;
+     UINT64 data;
+     UINT32 mode;
+     UINT32 mtime;
+     UINT32 size;
+     UINT32 name_size;
+     char*  name;
+     tarfs_node_t* node;
+
+     if(offset + CPIO_HDR_LEN <= image_size) {
+        if(initrd_read(offset,hdr,CPIO_HDR_LEN) != 0) return -1;
+        if(memcmp(hdr,"07070",5) != 0 || (hdr[5] != '1' && hdr[5] != '2')) {
+           klog("VFS",0,"tarfs: bad cpio header at offset %lld",offset);
+           return -1;
+        }
+        mode      = cpio_hex(hdr+14);
+        mtime     = cpio_hex(hdr+46);
+        size      = cpio_hex(hdr+54);
+        name_size = cpio_hex(hdr+94);
+        data      = (offset + CPIO_HDR_LEN + name_size + 3) & ~(UINT64)3;
+        if(name_size == 0 || data > image_size || size > image_size - data) {
+           klog("VFS",0,"tarfs: archive is truncated");
+           return -1;
+        }
+        name = read_string(offset+CPIO_HDR_LEN,name_size-1);
+        if(name == NULL) return -1;
+        vol->next = (data + size + 3) & ~(UINT64)3;
+
+        if(strcmp(name,"TRAILER!!!")==0) {
+           free(name);
+           return 0;
+        }
+        switch(mode & CPIO_S_IFMT) {
+           case CPIO_S_IFREG:
+             tarfs_add_entry(vol,name,DT_REG,mode,mtime,data,size);
+           break;
+           case CPIO_S_IFDIR:
+             tarfs_add_entry(vol,name,DT_DIR,mode,mtime,0,0);
+           break;
+           case CPIO_S_IFLNK:
+             node = tarfs_add_entry(vol,name,DT_LNK,mode,mtime,0,0);
+             if(node != NULL) {
+                free(node->link);
+                node->link = read_string(data,size);
+                node->size = size;
+             }
+           break;
+        }
+        free(name);
+        return 1;
+     }
+     return 0;
+}
+
+// indexes one more entry, 0 once the whole archive has been, vol->lock must be held
+static int tarfs_index_next(tarfs_vol_t* vol) {
+     int r;
+     if(vol->done) return 0;
+     r = vol->cpio ? cpio_next(vol) : tar_next(vol);
+     if(r == 1) return 1;
+     vol->done = 1;
+     // a damaged archive stays mounted with whatever was indexed before the damage
+     if(r < 0) klog("VFS",0,"tarfs: archive is damaged, some files will be missing");
+     klog("VFS",1,"tarfs: indexed %d entries",vol->node_count-1);
+     return 0;
+}
+
+int tarfs_probe() {
+     UINT8 hdr[TAR_BLOCK];
+     if(initrd_read(0,hdr,TAR_BLOCK) != 0) return 0;
+     if(memcmp(hdr,"07070",5)==0 && (hdr[5] == '1' || hdr[5] == '2')) return 1;
+     return memcmp(hdr+257,"ustar",5)==0 && tar_checksum_ok(hdr);
+}
+
+// vol->lock must be held, misses index more of the archive until the path turns up or there's nothing left
+static tarfs_node_t* lookup_nofollow(tarfs_vol_t* vol, char* path) {
+     char buf[TARFS_PATH_BUF];
+     char* norm = buf;
+     size_t len = strlen(path);
+     tarfs_node_t* node;
+     if(len >= TARFS_PATH_BUF) {
+        norm = (char*)malloc(len+1);
+        if(norm == NULL) return NULL;
+     }
+     len  = normalize(path,len,norm);
+     while((node = tarfs_find(vol,norm,len)) == NULL && tarfs_index_next(vol));
+     if(norm != buf) free(norm);
+     return node;
+}
+
+static tarfs_node_t* lookup(tarfs_vol_t* vol, char* path) {
+     tarfs_node_t* node = lookup_nofollow(vol,path);
+     char* target = NULL;
+     char* next;
+     int depth;
+     for(depth=0; node != NULL && node->type == DT_LNK && node->link != NULL && depth < TARFS_SYMLOOP_MAX; depth++) {
+        next = (char*)malloc(node->parent->path_len + strlen(node->link) + 2);
+        if(next == NULL) break;
+        if(node->link[0] == '/') {
+           strcpy(next,node->link);
+        } else {
+           memcpy(next,node->parent->path,node->parent->path_len);
+           next[node->parent->path_len] = '/';
+           strcpy(next+node->parent->path_len+1,node->link);
+        }
+        free(target);
+        target = next;
+        node   = lookup_nofollow(vol,target);
+     }
+     free(target);
+     if(node != NULL && node->type == DT_LNK) return NULL; // dangling or looping
+     return node;
+}
+
+void vfs_tarfs_shutdown(vfs_fs_handler_t* this) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     tarfs_node_t* node;
+     tarfs_node_t* next;
+     UINT32 i;
+     if(vol == NULL) return;
+     for(i=0; i<vol->bucket_count; i++) {
+         for(node = vol->buckets[i]; node != NULL; node = next) {
+             next = node->hash_next;
+             free(node->link);
+             free(node);
+         }
+     }
+     free(vol->buckets);
+     free(vol);
+     this->fs_data = NULL;
+}
+
+int vfs_tarfs_file_exists(vfs_fs_handler_t* this, char* path) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     int retval;
+     if(vol == NULL) return 0;
+     kmutex_lock(&(vol->lock));
+     retval = lookup(vol,path) != NULL;
+     kmutex_unlock(&(vol->lock));
+     return retval;
+}
+
+char** vfs_tarfs_list_root_dir(vfs_fs_handler_t* this) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     tarfs_node_t* node;
+     int i=0;
+     char** retval;
+
+     if(vol == NULL) return (char**)calloc(sizeof(char*),1);
+     kmutex_lock(&(vol->lock));
+     while(tarfs_index_next(vol));
+     kmutex_unlock(&(vol->lock));
+     for(node = vol->root->children; node != NULL; node = node->sibling) i++;
+     retval = (char**)calloc(sizeof(char*),i+1);
+     if(retval == NULL) return NULL;
+     i = 0;
+     for(node = vol->root->children; node != NULL; node = node->sibling) {
+         retval[i] = (char*)calloc(1,strlen(node->name)+1);
+         strcpy(retval[i],node->name);
+         i++;
+     }
+     retval[i] = NULL;
+     return retval;
+}
+
+void* vfs_tarfs_open(vfs_fs_handler_t* this, char* path, int flags) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     tarfs_node_t* node;
+     tarfs_fd_t* fd;
+     if(vol == NULL) return NULL;
+     kmutex_lock(&(vol->lock));
+     node = lookup(vol,path);
+     kmutex_unlock(&(vol->lock));
+     if(node == NULL) return NULL;
+     fd = (tarfs_fd_t*)calloc(1,sizeof(tarfs_fd_t));
+     if(fd == NULL) return NULL;
+     fd->node = node;
+     return fd;
+}
+
+void* vfs_tarfs_opendir(vfs_fs_handler_t* this, char* path) {
+     tarfs_fd_t* fd = (tarfs_fd_t*)vfs_tarfs_open(this,path,O_RDONLY);
+     if(fd == NULL) return NULL;
+     if(fd->node->type != DT_DIR) {
+        free(fd);
+        return NULL;
+     }
+     return fd;
+}
+
+// children are only ever added at the end of a directory's list, so past the last one there's more to index
+struct vfs_dirent_t* vfs_tarfs_readdir(vfs_fs_handler_t* this, void* _fd) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     tarfs_fd_t* fd = (tarfs_fd_t*)_fd;
+     tarfs_node_t* next;
+     vfs_dirent_t* retval;
+     if(fd == NULL || vol == NULL) return NULL;
+     kmutex_lock(&(vol->lock));
+     do {
+        next = (fd->last_child != NULL) ? fd->last_child->sibling : fd->node->children;
+     } while(next == NULL && tarfs_index_next(vol));
+     kmutex_unlock(&(vol->lock));
+     if(next == NULL) return NULL;
+     retval = (vfs_dirent_t*)calloc(1,sizeof(vfs_dirent_t));
+     if(retval == NULL) return NULL;
+     strncpy(retval->d_name,next->name,sizeof(retval->d_name)-1);
+     retval->d_type = next->type;
+     fd->last_child = next;
+     return retval;
+}
+
+int vfs_tarfs_close(vfs_fs_handler_t* this, void* fd) {
+     free(fd);
+     return 0;
+}
+
+ssize_t vfs_tarfs_read(vfs_fs_handler_t* this, void* _fd, void* buf, size_t count) {
+     tarfs_fd_t* fd = (tarfs_fd_t*)_fd;
+     void* src;
+     if(fd == NULL || fd->node->type != DT_REG) return -1;
+     if(fd->pos >= fd->node->size) return 0;
+     if(count > fd->node->size - fd->pos) count = fd->node->size - fd->pos;
+     src = initrd_map(fd->node->offset + fd->pos,count);
+     if(src != NULL) {
+        memcpy(buf,src,count);
+     } else if(initrd_read(fd->node->offset + fd->pos,buf,count) != 0) {
+        return -1;
+     }
+     fd->pos += count;
+     return count;
+}
+
+ssize_t vfs_tarfs_write(vfs_fs_handler_t* this, void* fd, void* buf, size_t count) {
+     return -1; // read only
+}
+
+off_t vfs_tarfs_lseek(vfs_fs_handler_t* this, void* _fd, off_t offset, int whence) {
+     tarfs_fd_t* fd = (tarfs_fd_t*)_fd;
+     off_t new_pos;
+     if(fd == NULL) return -1;
+     switch(whence) {
+        case SEEK_SET: new_pos = offset;                   break;
+        case SEEK_CUR: new_pos = fd->pos + offset;         break;
+        case SEEK_END: new_pos = fd->node->size + offset;  break;
+        default: return -1;
+     }
+     if(new_pos < 0) return -1;
+     fd->pos = new_pos;
+     return new_pos;
+}
+
+void* vfs_tarfs_map(vfs_fs_handler_t* this, void* _fd, off_t offset, size_t* len) {
+     tarfs_fd_t* fd = (tarfs_fd_t*)_fd;
+     if(fd == NULL || offset < 0 || fd->node->type != DT_REG || (UINT64)offset >= fd->node->size) return NULL;
+     if(*len > fd->node->size - offset) *len = fd->node->size - offset;
+     fd->pos = offset;
+     return initrd_map(fd->node->offset + offset,*len);
+}
+
+static void node_stat(tarfs_node_t* node, struct stat *buf) {
+     memset(buf,0,sizeof(struct stat));
+     switch(node->type) {
+        case DT_DIR: buf->st_mode = S_IFDIR; break;
+        case DT_LNK: buf->st_mode = S_IFLNK; break;
+        default:     buf->st_mode = S_IFREG; break;
+     }
+     buf->st_mode   |= node->perm;
+     buf->st_size    = node->size;
+     buf->st_mtime   = node->mtime;
+     buf->st_blksize = TAR_BLOCK;
+     buf->st_nlink   = 1;
+}
+
+int vfs_tarfs_stat(vfs_fs_handler_t* this, char* path, struct stat *buf) {
+     tarfs_vol_t* vol = (tarfs_vol_t*)this->fs_data;
+     tarfs_node_t* node;
+     if(vol == NULL) return -1;
+     kmutex_lock(&(vol->lock));
+     node = lookup(vol,path);
+     kmutex_unlock(&(vol->lock));
+     if(node == NULL) return -1;
+     node_stat(node,buf);
+     return 0;
+}
+
+int vfs_tarfs_fstat(vfs_fs_handler_t* this, void* fd, struct stat *buf) {
+     if(fd == NULL) return -1;
+     node_stat(((tarfs_fd_t*)fd)->node,buf);
+     return 0;
+}
+
+// just the root, everything else is indexed as it's needed
+static tarfs_vol_t* tarfs_index() {
+     UINT8 magic[6];
+     tarfs_vol_t* vol = (tarfs_vol_t*)calloc(1,sizeof(tarfs_vol_t));
+     if(vol == NULL) return NULL;
+     kmutex_init(&(vol->lock));
+     vol->bucket_count = TARFS_BUCKETS;
+     vol->buckets      = (tarfs_node_t**)calloc(vol->bucket_count,sizeof(tarfs_node_t*));
+     if(vol->buckets == NULL) {
+        free(vol);
+        return NULL;
+     }
+     vol->root = tarfs_add(vol,"",0);
+     if(vol->root == NULL || initrd_read(0,magic,6) != 0) {
+        free(vol->root);
+        free(vol->buckets);
+        free(vol);
+        return NULL;
+     }
+     vol->cpio = memcmp(magic,"07070",5)==0;
+     return vol;
+}
+
+void vfs_tarfs_setup(vfs_fs_handler_t* this, char* dev_name, char* mountpoint) {
+     this->fs_data = tarfs_index();
+     if(this->fs_data == NULL) klog("VFS",0,"tarfs: could not index initrd image");
+
+     this->list_root_dir = &vfs_tarfs_list_root_dir;
+     this->shutdown      = &vfs_tarfs_shutdown;
+     this->file_exists   = &vfs_tarfs_file_exists;
+
+     this->open          = &vfs_tarfs_open;
+     this->opendir       = &vfs_tarfs_opendir;
+     this->readdir       = &vfs_tarfs_readdir;
+     this->close         = &vfs_tarfs_close;
+     this->read          = &vfs_tarfs_read;
+     this->write         = &vfs_tarfs_write;
+     this->lseek         = &vfs_tarfs_lseek;
+     this->map           = &vfs_tarfs_map;
+     this->stat          = &vfs_tarfs_stat;
+     this->fstat         = &vfs_tarfs_fstat;
+}
+
+void vfs_init_tarfs_fs_type() {
+     tarfs_fs_type          = (vfs_fs_type_t*)calloc(sizeof(vfs_fs_type_t),1);
+     tarfs_fs_type->fs_type = tarfs_fs_type_s;
+     tarfs_fs_type->setup   = &vfs_tarfs_setup;
+     klog("VFS",1,"tarfs filesystem driver setup");
+}
@@ -0,0 +1,23 @@
+#ifndef VFS_TARFS_H
+#define VFS_TARFS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "../k_vfs.h"
+
+extern EFI_BOOT_SERVICES *BS;
+extern EFI_HANDLE gImageHandle;
+
+#ifndef IN_TARFS
+extern vfs_fs_type_t *tarfs_fs_type;
+#endif
+
+void vfs_init_tarfs_fs_type();
+
+// returns 1 if the initrd image is a tar or newc cpio archive that tarfs can mount
+int tarfs_probe();
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef ZINITRD_H
+#define ZINITRD_H
+
+// On-disk format of a compressed initrd image, shared between the kernel and tools/mkzinitrd
+//
+// The uncompressed image is split into fixed size chunks and each chunk is compressed on its own as an LZ4 block,
+// so any chunk can be decompressed without touching the ones before it. A chunk whose compressed size equals its
+// uncompressed size is stored as-is.
+//
+//   zinitrd_header_t
+//   UINT64 offsets[chunk_count+1]   file offset of each chunk, the last entry is the end of the file
+//   chunk data
+
+#include <stdint.h>
+
+#define ZINITRD_MAGIC "ZRD1"
+
+typedef struct __attribute__((__packed__)) zinitrd_header_t {
+     char     magic[4];
+     uint32_t chunk_size;
+     uint64_t image_size;  // uncompressed
+     uint32_t chunk_count;
+     uint32_t reserved;
+} zinitrd_header_t;
+
+#endif
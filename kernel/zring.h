@@ -0,0 +1,67 @@
+#ifndef ZRING_H
+#define ZRING_H
+
+// Shared submission/completion ring for batching syscalls, used by both the kernel and newlib's zoidberg port
+//
+// A task fills in submission entries and moves sq_tail, then either calls sys_zring_enter() to have everything
+// pending run in one trap, or with ZRING_SQPOLL leaves it to a kernel thread that watches the ring. Each entry
+// becomes exactly one completion entry carrying the syscall's return value, in submission order.
+//
+// The ring is one block of memory allocated by the task, laid out as
+//
+//   zring_t
+//   zring_sqe_t sqes[entries]
+//   zring_cqe_t cqes[entries]
+//
+// sq_tail and cq_head are only written by the task, sq_head and cq_tail only by the kernel. Indices run freely and
+// are masked with entries-1 when used, so entries must be a power of 2.
+
+#include <stdint.h>
+
+#define ZRING_ENTRIES_MAX 4096
+
+// setup flags
+#define ZRING_SQPOLL      1    // a kernel thread drains the ring, no trap needed to submit
+
+// flags set by the kernel
+#define ZRING_NEED_WAKEUP 1    // SQPOLL thread stopped watching this ring after it went idle, call sys_zring_enter()
+
+typedef struct zring_sqe_t {
+     uint32_t opcode;          // a ZSYSCALL_ number
+     uint32_t reserved;
+     uint64_t args[3];
+     uint64_t user_data;       // passed through to the completion untouched
+} zring_sqe_t;
+
+typedef struct zring_cqe_t {
+     uint64_t user_data;
+     int64_t  result;
+} zring_cqe_t;
+
+typedef struct zring_t {
+     uint32_t          entries;
+     uint32_t          setup_flags;
+     volatile uint32_t kernel_flags;
+     uint32_t          pad0[13];
+     volatile uint32_t sq_head;      // own cache line each, the task and the kernel write opposite ends
+     uint32_t          pad1[15];
+     volatile uint32_t sq_tail;
+     uint32_t          sq_queued;    // task private, entries handed out by zring_get_sqe() but not yet submitted
+     uint32_t          pad2[14];
+     volatile uint32_t cq_head;
+     uint32_t          pad3[15];
+     volatile uint32_t cq_tail;
+     uint32_t          pad4[15];
+} zring_t;
+
+#define ZRING_SQES(r) ((zring_sqe_t*)((uint8_t*)(r) + sizeof(zring_t)))
+#define ZRING_CQES(r) ((zring_cqe_t*)((uint8_t*)ZRING_SQES(r) + (r)->entries*sizeof(zring_sqe_t)))
+#define ZRING_SIZE(n) (sizeof(zring_t) + (n)*(sizeof(zring_sqe_t) + sizeof(zring_cqe_t)))
+
+// userland helpers, implemented in newlib's zoidberg port
+zring_t*     zring_init(uint32_t entries, uint32_t flags);  // allocate and register the calling task's ring
+zring_sqe_t* zring_get_sqe(zring_t* ring);                  // next free submission entry, NULL if the ring is full
+int          zring_submit(zring_t* ring);                   // publish queued entries, traps only if it has to
+int          zring_wait_cqe(zring_t* ring, zring_cqe_t* cqe); // copy out the next completion, waiting if needed
+
+#endif
@@ -4,5 +4,5 @@ export OVMFPATH=/home/gareth/edk2/Build/OvmfX64/DEBUG_GCC46/FV
 export ROMPATH=/usr/lib/ipxe/qemu/efi-e1000.rom
 
 
-qemu-system-x86_64 -bios ${OVMFPATH}/OVMF.fd -usb -usbdevice disk::boot.img -netdev user,id=mynet0,net=192.168.76.0/24,dhcpstart=192.168.76.9 -device e1000,netdev=mynet0,mac=DE:AD:BE:EF:FC:E6  -m 4G -net dump,file=./dump.pcap  -serial stdio -debugcon file:debug.log -global isa-debugcon.iobase=0x402 -vga std 
+qemu-system-x86_64 -bios ${OVMFPATH}/OVMF.fd -usb -usbdevice disk::boot.img -netdev user,id=mynet0,net=192.168.76.0/24,dhcpstart=192.168.76.9 -device e1000,netdev=mynet0,mac=DE:AD:BE:EF:FC:E6  -m 4G -smp 4 -net dump,file=./dump.pcap  -serial stdio -debugcon file:debug.log -global isa-debugcon.iobase=0x402 -vga std 
 
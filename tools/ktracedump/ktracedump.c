@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../../kernel/ktrace.h"
+
+// Turns a binary kernel log written by sys_tracedump() (klog.trc on the boot volume by default) back into text
+//
+// Each line gets the time since the first record in the dump, the CPU it was logged on and the component, the same
+// prefix the console has. kprintf() output is written out as it is.
+
+#define LINE_MAX_LEN 4096
+
+static void usage(char* argv0) {
+     fprintf(stderr,"Usage: %s [-t] input\n",argv0);
+     fprintf(stderr,"  -t  raw TSC values instead of microseconds\n");
+     exit(1);
+}
+
+int main(int argc, char** argv) {
+     int    raw_tsc = 0;
+     char*  in_path = NULL;
+     char   line[LINE_MAX_LEN];
+     char   comp[20];
+     int i;
+
+     for(i=1; i<argc; i++) {
+         if(strcmp(argv[i],"-t")==0) {
+            raw_tsc = 1;
+         } else if(in_path == NULL) {
+            in_path = argv[i];
+         } else {
+            usage(argv[0]);
+         }
+     }
+     if(in_path == NULL) usage(argv[0]);
+
+     FILE* in = fopen(in_path,"rb");
+     if(in == NULL) {
+        fprintf(stderr,"Could not open %s: %s\n",in_path,strerror(errno));
+        return 1;
+     }
+     fseek(in,0,SEEK_END);
+     size_t file_size = ftell(in);
+     fseek(in,0,SEEK_SET);
+     uint8_t* file = (uint8_t*)malloc(file_size ? file_size : 1);
+     if(fread(file,1,file_size,in) != file_size) {
+        fprintf(stderr,"Could not read %s\n",in_path);
+        return 1;
+     }
+     fclose(in);
+
+     ktrace_header_t hdr;
+     if(file_size < sizeof(hdr) || memcmp(file,KTRACE_MAGIC,4) != 0) {
+        fprintf(stderr,"%s is not a kernel binary log\n",in_path);
+        return 1;
+     }
+     memcpy(&hdr,file,sizeof(hdr));
+
+     // the format table, each string copied out so it can be NUL terminated
+     char** fmts = (char**)calloc(hdr.fmt_count ? hdr.fmt_count : 1,sizeof(char*));
+     size_t pos = sizeof(hdr);
+     uint32_t len;
+     for(i=0; i < (int)hdr.fmt_count; i++) {
+         if(file_size - pos < 4) break;
+         memcpy(&len,file + pos,4);
+         pos += 4;
+         if(file_size - pos < len) break;
+         fmts[i] = (char*)malloc(len+1);
+         memcpy(fmts[i],file + pos,len);
+         fmts[i][len] = 0;
+         pos += len;
+     }
+     if(i != (int)hdr.fmt_count) {
+        fprintf(stderr,"%s is cut short in its format table\n",in_path);
+        return 1;
+     }
+
+     ktrace_rec_t rec;
+     uint64_t first_tsc = 0;
+     uint64_t t;
+     size_t end = pos + hdr.rec_bytes;
+     if(end > file_size) end = file_size;
+     while(end - pos >= sizeof(rec)) {
+        memcpy(&rec,file + pos,sizeof(rec));
+        if(rec.size < sizeof(rec) || rec.size > end - pos || sizeof(rec) + rec.len > rec.size) {
+           fprintf(stderr,"Bad record at offset %zu\n",pos);
+           return 1;
+        }
+        const uint8_t* args = file + pos + sizeof(rec);
+        pos += rec.size;
+
+        if(rec.fmt == KTRACE_FMT_TEXT) {
+           len = rec.len < LINE_MAX_LEN ? rec.len : LINE_MAX_LEN-1;
+           memcpy(line,args,len);
+           line[len] = 0;
+        } else if(rec.fmt < hdr.fmt_count && fmts[rec.fmt][0] != 0) {
+           ktrace_format(line,sizeof(line),fmts[rec.fmt],args,rec.len);
+        } else {
+           snprintf(line,sizeof(line),"<unknown format %u>",rec.fmt);
+        }
+        if(rec.level == 0xFF) { // kprintf()
+           fputs(line,stdout);
+           continue;
+        }
+
+        if(first_tsc == 0) first_tsc = rec.tsc;
+        t = rec.tsc - first_tsc;
+        rec.comp[15] = 0;
+        snprintf(comp,sizeof(comp),"[%s]",rec.comp);
+        if(raw_tsc || hdr.tsc_per_us == 0) {
+           printf("%20llu ",(unsigned long long)rec.tsc);
+        } else {
+           printf("[%6llu.%06llu] ",(unsigned long long)(t / hdr.tsc_per_us / 1000000),(unsigned long long)(t / hdr.tsc_per_us % 1000000));
+        }
+        printf("cpu%-2u %-10s %s%s",rec.cpu,comp,line,rec.level == 2 ? "" : "\n");
+     }
+     return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "../../kernel/zinitrd.h"
+
+// Packs an initrd image into the chunked LZ4 format described in kernel/zinitrd.h
+//
+// The compressor is a plain hash chain matcher, -l sets how many candidates are tried per position (1<<(level-1)).
+// Boot time is dominated by reading the image, so the default is the strongest level.
+
+#define MINMATCH    4
+#define MFLIMIT     12 // no match may start within the last 12 bytes of a block
+#define LASTLITERALS 5 // the last 5 bytes of a block are always literals
+#define MAX_OFFSET  65535
+#define HASH_LOG    16
+
+static uint32_t read32(const uint8_t* p) {
+     return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t hash4(const uint8_t* p) {
+     return (read32(p) * 2654435761u) >> (32-HASH_LOG);
+}
+
+static uint8_t* write_len(uint8_t* op, size_t len) {
+     while(len >= 255) {
+        *op++ = 255;
+        len  -= 255;
+     }
+     *op++ = (uint8_t)len;
+     return op;
+}
+
+static uint8_t* write_sequence(uint8_t* op, const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len) {
+     uint8_t* token = op++;
+     *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+     if(lit_len >= 15) op = write_len(op,lit_len-15);
+     memcpy(op,lit,lit_len);
+     op += lit_len;
+     if(match_len == 0) return op; // last literals
+     *op++ = offset & 0xFF;
+     *op++ = offset >> 8;
+     match_len -= MINMATCH;
+     *token |= (match_len >= 15 ? 15 : match_len);
+     if(match_len >= 15) op = write_len(op,match_len-15);
+     return op;
+}
+
+// compress one block, returns the compressed size - dst must hold at least lz4_bound(len) bytes
+static size_t lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, int level) {
+     static int32_t head[1<<HASH_LOG];
+     int32_t* chain = (int32_t*)malloc(len*sizeof(int32_t));
+     const uint8_t* anchor = src;
+     uint8_t* op = dst;
+     size_t pos = 0;
+     size_t match_limit = len > MFLIMIT ? len - MFLIMIT : 0;
+     size_t match_end   = len > LASTLITERALS ? len - LASTLITERALS : 0;
+     int attempts = 1 << (level-1);
+
+     memset(head,0xFF,sizeof(head));
+     while(pos < match_limit) {
+        uint32_t h = hash4(src+pos);
+        int32_t cand = head[h];
+        size_t best_len = 0;
+        size_t best_off = 0;
+        int n = attempts;
+        while(cand >= 0 && pos-cand <= MAX_OFFSET && n-- > 0) {
+           size_t l = 0;
+           while(pos+l < match_end && src[cand+l] == src[pos+l]) l++;
+           if(l > best_len) {
+              best_len = l;
+              best_off = pos-cand;
+           }
+           cand = chain[cand];
+        }
+        chain[pos] = head[h];
+        head[h]    = pos;
+
+        if(best_len < MINMATCH) {
+           pos++;
+           continue;
+        }
+        op = write_sequence(op,anchor,src+pos-anchor,best_off,best_len);
+        // index the positions inside the match so later matches can refer to them
+        size_t end = pos+best_len;
+        for(pos++; pos < end; pos++) {
+            if(pos >= match_limit) continue;
+            h = hash4(src+pos);
+            chain[pos] = head[h];
+            head[h]    = pos;
+        }
+        anchor = src+pos;
+     }
+     op = write_sequence(op,anchor,src+len-anchor,0,0);
+     free(chain);
+     return op-dst;
+}
+
+static void usage(char* argv0) {
+     fprintf(stderr,"Usage: %s [-l level] [-c chunk_kb] input output\n",argv0);
+     fprintf(stderr,"  -l level     compression level 1-9, default 9\n");
+     fprintf(stderr,"  -c chunk_kb  uncompressed chunk size in KiB, default 256\n");
+     exit(1);
+}
+
+int main(int argc, char** argv) {
+     int    level      = 9;
+     size_t chunk_size = 256*1024;
+     char*  in_path    = NULL;
+     char*  out_path   = NULL;
+     int i;
+
+     for(i=1; i<argc; i++) {
+         if(strcmp(argv[i],"-l")==0 && i+1 < argc) {
+            level = atoi(argv[++i]);
+         } else if(strcmp(argv[i],"-c")==0 && i+1 < argc) {
+            chunk_size = (size_t)atoi(argv[++i])*1024;
+         } else if(in_path == NULL) {
+            in_path = argv[i];
+         } else if(out_path == NULL) {
+            out_path = argv[i];
+         } else {
+            usage(argv[0]);
+         }
+     }
+     if(in_path == NULL || out_path == NULL || level < 1 || level > 9) usage(argv[0]);
+     if(chunk_size == 0 || chunk_size > 4*1024*1024) {
+        fprintf(stderr,"Chunk size must be between 1KiB and 4MiB\n");
+        return 1;
+     }
+
+     FILE* in = fopen(in_path,"rb");
+     if(in == NULL) {
+        fprintf(stderr,"Could not open %s: %s\n",in_path,strerror(errno));
+        return 1;
+     }
+     fseek(in,0,SEEK_END);
+     size_t image_size = ftell(in);
+     fseek(in,0,SEEK_SET);
+     uint8_t* image = (uint8_t*)malloc(image_size ? image_size : 1);
+     if(fread(image,1,image_size,in) != image_size) {
+        fprintf(stderr,"Could not read %s\n",in_path);
+        return 1;
+     }
+     fclose(in);
+
+     zinitrd_header_t hdr;
+     memcpy(hdr.magic,ZINITRD_MAGIC,4);
+     hdr.chunk_size  = chunk_size;
+     hdr.image_size  = image_size;
+     hdr.chunk_count = (image_size + chunk_size-1) / chunk_size;
+     hdr.reserved    = 0;
+
+     uint64_t* offsets = (uint64_t*)calloc(hdr.chunk_count+1,sizeof(uint64_t));
+     uint8_t*  packed  = (uint8_t*)malloc(chunk_size + chunk_size/255 + 16);
+     FILE* out = fopen(out_path,"wb");
+     if(out == NULL) {
+        fprintf(stderr,"Could not open %s: %s\n",out_path,strerror(errno));
+        return 1;
+     }
+
+     // the chunk table is written twice, once as a placeholder and again once the offsets are known
+     uint64_t pos = sizeof(hdr) + (uint64_t)(hdr.chunk_count+1)*sizeof(uint64_t);
+     fwrite(&hdr,sizeof(hdr),1,out);
+     fwrite(offsets,sizeof(uint64_t),hdr.chunk_count+1,out);
+     for(i=0; i<(int)hdr.chunk_count; i++) {
+         size_t raw_len = image_size - (size_t)i*chunk_size;
+         if(raw_len > chunk_size) raw_len = chunk_size;
+         uint8_t* raw = image + (size_t)i*chunk_size;
+         size_t len = lz4_compress(raw,raw_len,packed,level);
+         offsets[i] = pos;
+         if(len >= raw_len) { // incompressible, store it as-is
+            fwrite(raw,1,raw_len,out);
+            pos += raw_len;
+         } else {
+            fwrite(packed,1,len,out);
+            pos += len;
+         }
+     }
+     offsets[hdr.chunk_count] = pos;
+     fseek(out,sizeof(hdr),SEEK_SET);
+     fwrite(offsets,sizeof(uint64_t),hdr.chunk_count+1,out);
+     fclose(out);
+
+     printf("%s: %zu -> %llu bytes (%.1f%%), %u chunks of %zu\n",out_path,image_size,(unsigned long long)pos,
+            image_size ? 100.0*pos/image_size : 100.0,hdr.chunk_count,chunk_size);
+     return 0;
+}
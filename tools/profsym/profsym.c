@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+// Turns the addresses in a /dev/profile dump into kernel function names, for flamegraph.pl
+//
+// The symbols come from nm on the kernel's ELF build output (kernel.debug under the EDK2 build directory), whose
+// addresses are kernel.efi's RVAs, so an address in the dump is looked up at its offset from where the header says
+// kernel.efi was loaded. Addresses outside the image (firmware, user programs) stay as they are. Stacks that come out
+// the same once symbolized are added together.
+
+#define LINE_MAX_LEN 8192
+
+typedef struct sym_t {
+     uint64_t addr;
+     char*    name;
+} sym_t;
+
+typedef struct folded_t {
+     char*    frames;
+     uint64_t count;
+} folded_t;
+
+static sym_t*   syms     = NULL;
+static size_t   sym_count = 0;
+static folded_t* stacks   = NULL;
+static size_t   stack_count = 0;
+static size_t   stack_room  = 0;
+
+static void usage(char* argv0) {
+     fprintf(stderr,"Usage: %s kernel.debug [profile]\n",argv0);
+     fprintf(stderr,"  reads the profile from stdin if it isn't given, writes folded stacks to stdout\n");
+     exit(1);
+}
+
+static int sym_cmp(const void* a, const void* b) {
+     uint64_t x = ((const sym_t*)a)->addr;
+     uint64_t y = ((const sym_t*)b)->addr;
+     return (x > y) - (x < y);
+}
+
+static int folded_cmp(const void* a, const void* b) {
+     return strcmp(((const folded_t*)a)->frames,((const folded_t*)b)->frames);
+}
+
+static int load_syms(char* elf) {
+     char cmd[LINE_MAX_LEN];
+     char line[LINE_MAX_LEN];
+     char name[LINE_MAX_LEN];
+     unsigned long long addr;
+     char type;
+     size_t room = 0;
+     snprintf(cmd,sizeof(cmd),"nm -n '%s'",elf);
+     FILE* nm = popen(cmd,"r");
+     if(nm == NULL) return -1;
+     while(fgets(line,sizeof(line),nm) != NULL) {
+        if(sscanf(line,"%llx %c %s",&addr,&type,name) != 3) continue;
+        if(type != 't' && type != 'T' && type != 'w' && type != 'W') continue;
+        if(sym_count == room) {
+           room = room ? room*2 : 1024;
+           syms = (sym_t*)realloc(syms,room*sizeof(sym_t));
+        }
+        syms[sym_count].addr = addr;
+        syms[sym_count].name = strdup(name);
+        sym_count++;
+     }
+     if(pclose(nm) != 0 || sym_count == 0) return -1;
+     qsort(syms,sym_count,sizeof(sym_t),sym_cmp);
+     return 0;
+}
+
+static char* lookup(uint64_t rva) {
+     size_t lo = 0, hi = sym_count;
+     if(sym_count == 0 || rva < syms[0].addr) return NULL;
+     while(hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if(syms[mid].addr <= rva) lo = mid; else hi = mid;
+     }
+     return syms[lo].name;
+}
+
+static void add_stack(char* frames, uint64_t count) {
+     if(stack_count == stack_room) {
+        stack_room = stack_room ? stack_room*2 : 1024;
+        stacks = (folded_t*)realloc(stacks,stack_room*sizeof(folded_t));
+     }
+     stacks[stack_count].frames = strdup(frames);
+     stacks[stack_count].count  = count;
+     stack_count++;
+}
+
+int main(int argc, char** argv) {
+     char line[LINE_MAX_LEN];
+     char out[LINE_MAX_LEN*2];
+     unsigned long long base = 0, size = 0;
+     size_t i, n;
+
+     if(argc < 2 || argc > 3) usage(argv[0]);
+     if(load_syms(argv[1]) != 0) {
+        fprintf(stderr,"Could not read symbols from %s with nm\n",argv[1]);
+        return 1;
+     }
+     FILE* in = stdin;
+     if(argc == 3) {
+        in = fopen(argv[2],"r");
+        if(in == NULL) {
+           fprintf(stderr,"Could not open %s: %s\n",argv[2],strerror(errno));
+           return 1;
+        }
+     }
+
+     while(fgets(line,sizeof(line),in) != NULL) {
+        line[strcspn(line,"\n")] = 0;
+        if(line[0] == '#') {
+           sscanf(line,"# kernel.efi at %llx size %llx",&base,&size);
+           continue;
+        }
+        char* space = strrchr(line,' ');
+        if(space == NULL) continue;
+        *space = 0;
+        uint64_t count = strtoull(space+1,NULL,10);
+
+        out[0] = 0;
+        n = 0;
+        for(char* f = strtok(line,";"); f != NULL; f = strtok(NULL,";")) {
+            char* name = f;
+            if(strncmp(f,"0x",2) == 0 && size != 0) {
+               uint64_t addr = strtoull(f,NULL,16);
+               if(addr >= base && addr < base + size) {
+                  char* s = lookup(addr - base);
+                  if(s != NULL) name = s;
+               }
+            }
+            n += snprintf(out + n,sizeof(out) - n,"%s%s",n ? ";" : "",name);
+            if(n >= sizeof(out)) break;
+        }
+        add_stack(out,count);
+     }
+     if(base == 0) fprintf(stderr,"No kernel.efi load address in the profile, addresses left as they are\n");
+
+     qsort(stacks,stack_count,sizeof(folded_t),folded_cmp);
+     for(i=0; i < stack_count; i++) {
+         uint64_t count = stacks[i].count;
+         while(i+1 < stack_count && strcmp(stacks[i].frames,stacks[i+1].frames) == 0) count += stacks[++i].count;
+         printf("%s %llu\n",stacks[i].frames,(unsigned long long)count);
+     }
+     return 0;
+}
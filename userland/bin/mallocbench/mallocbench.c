@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Allocation-heavy benchmark: builds shell-style command lines a word at a time with realloc() and splits each one
+// back into a malloc()ed argv array, the way a shell would. It runs once on the userland heap (zmalloc.c) and once
+// on the kernel heap through sys_malloc() and friends, which is what every malloc() used to trap into.
+//
+// Prints TSC cycles per line, userland has no calibration to turn them into time.
+
+#define LINES 20000
+#define WORDS 24
+
+void* sys_malloc(size_t size);
+void  sys_free(void* ptr);
+void* sys_realloc(void* ptr, size_t size);
+
+typedef struct heap_t {
+    char*  name;
+    void*  (*alloc)(size_t size);
+    void   (*release)(void* ptr);
+    void*  (*grow)(void* ptr, size_t size);
+} heap_t;
+
+static char* words[] = {"ls","-l","/bin","echo","$HOME","grep","-v","initrd","cat","/dev/kmsg","|","sort",
+                        "uname","-a",">","/tmp/out.txt","cd","..","export","PATH=/bin:/sbin","&&","true","wc","-c"};
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t run(heap_t* h) {
+    uint64_t start = rdtsc();
+    char*  line;
+    char** argv;
+    size_t len, n;
+    int i, w, argc;
+    char*  p;
+    char*  end;
+    for(i=0; i < LINES; i++) {
+        line = NULL;
+        len  = 0;
+        for(w=0; w < WORDS; w++) {
+            p    = words[(i*7 + w*3) % (sizeof(words)/sizeof(words[0]))];
+            n    = strlen(p);
+            line = h->grow(line,len+n+2);
+            memcpy(line+len,p,n);
+            len += n;
+            line[len++] = ' ';
+            line[len]   = 0;
+        }
+        argv = h->alloc(sizeof(char*)*(WORDS+1));
+        argc = 0;
+        for(p=line; *p != 0; p=end+1) {
+            end = strchr(p,' ');
+            argv[argc] = h->alloc(end-p+1);
+            memcpy(argv[argc],p,end-p);
+            argv[argc++][end-p] = 0;
+        }
+        argv[argc] = NULL;
+        for(w=0; w < argc; w++) h->release(argv[w]);
+        h->release(argv);
+        h->release(line);
+    }
+    return rdtsc() - start;
+}
+
+int main() {
+    heap_t user   = {"userland heap", &malloc,     &free,     &realloc};
+    heap_t kernel = {"kernel heap",   &sys_malloc, &sys_free, &sys_realloc};
+    uint64_t c;
+    c = run(&user);
+    printf("mallocbench %s: %llu cycles/line, %d lines of %d words\n",user.name,c/LINES,LINES,WORDS);
+    c = run(&kernel);
+    printf("mallocbench %s: %llu cycles/line, %d lines of %d words\n",kernel.name,c/LINES,LINES,WORDS);
+    return 0;
+}
@@ -21,6 +21,7 @@ efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
      BS = ST->BootServices;
      RT = ST->RuntimeServices;
      gImageHandle = ImageHandle;
+     z_fast_syscalls = (z_syscall_probe() == 1);
      environ = sys_getenvp();
 
        int i;
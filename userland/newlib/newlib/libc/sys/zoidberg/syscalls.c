@@ -57,22 +57,11 @@ int read(int file, char *ptr, int len) {
     return sys_read(file, ptr, len);
 }
 
-void* malloc(size_t size) {
-      return sys_malloc(size);
-}
-
+// malloc, free and friends live in zmalloc.c, this one is the kernel heap
 void* z_malloc(size_t size) {
       return sys_malloc(size);
 }
 
-void* realloc(void* ptr, size_t size) {
-      return sys_realloc(ptr, size);
-}
-
-void free(void* ptr) {
-     sys_free(ptr);
-}
-
 void* sbrk_ptr=NULL;
 void* sbrk_base=NULL;
 uint64_t sbrk_offs=0;
@@ -101,3 +90,43 @@ int wait(int *status) { }
 int write(int file, char *ptr, int len) { 
     return sys_write(file, ptr, len);
 }
+
+zring_t* zring_init(uint32_t entries, uint32_t flags) {
+    zring_t* ring = malloc(ZRING_SIZE(entries));
+    if(ring == NULL) return NULL;
+    if(sys_zring_setup(ring, entries, flags) != 0) {
+       free(ring);
+       errno = EINVAL;
+       return NULL;
+    }
+    return ring;
+}
+
+zring_sqe_t* zring_get_sqe(zring_t* ring) {
+    if(ring->sq_queued - ring->sq_head >= ring->entries) return NULL;
+    return &(ZRING_SQES(ring)[ring->sq_queued++ & (ring->entries-1)]);
+}
+
+int zring_submit(zring_t* ring) {
+    int count = ring->sq_queued - ring->sq_tail;
+    __sync_synchronize(); // entries must be complete before the kernel can see them
+    ring->sq_tail = ring->sq_queued;
+    __sync_synchronize();
+    if(!(ring->setup_flags & ZRING_SQPOLL) || (ring->kernel_flags & ZRING_NEED_WAKEUP)) sys_zring_enter();
+    return count;
+}
+
+int zring_wait_cqe(zring_t* ring, zring_cqe_t* cqe) {
+    while(ring->cq_head == ring->cq_tail) {
+       if(ring->sq_head == ring->sq_tail) { // nothing in flight
+          errno = EAGAIN;
+          return -1;
+       }
+       if(!(ring->setup_flags & ZRING_SQPOLL) || (ring->kernel_flags & ZRING_NEED_WAKEUP)) sys_zring_enter();
+    }
+    __sync_synchronize();
+    *cqe = ZRING_CQES(ring)[ring->cq_head & (ring->entries-1)];
+    __sync_synchronize();
+    ring->cq_head++;
+    return 0;
+}
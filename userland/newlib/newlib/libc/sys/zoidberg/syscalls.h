@@ -13,6 +13,7 @@
 #include <sys/errno.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <sys/zring.h>
 
 #define _UTSNAME_LENGTH 65
 #define _UTSNAME_SYSNAME_LENGTH _UTSNAME_LENGTH
@@ -32,4 +33,8 @@ struct utsname {
 
 #include "syscalls.inc"
 
+// set by crt0 once the kernel has said SYSCALL can be used, the stubs in u_syscalls.asm use int 0x80 until then
+extern char z_fast_syscalls;
+long z_syscall_probe();
+
 #endif
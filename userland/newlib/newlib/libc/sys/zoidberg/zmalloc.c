@@ -0,0 +1,361 @@
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <reent.h>
+
+#include "syscalls.h"
+
+// Userland heap for zoidberg, replaces routing every malloc/free/realloc through a kernel trap
+//
+// Memory comes from the kernel in 1MiB segments via sys_pagealloc(), aligned to their own size so the segment any
+// pointer belongs to is found by masking. Each segment is cut into 16 spans of 64KiB, a span either holds objects of
+// one size class or is part of a run of spans given to a single large allocation. Anything too big for a run gets a
+// segment of its own sized to fit and goes straight back to the kernel when freed.
+//
+// Small allocations are popped off the per-class list of spans with room and the span's free list, so the common
+// case never leaves userland. Processes are single threaded, so the heap below is the whole per-thread cache.
+
+#define ZM_PAGE_SIZE     4096
+#define ZM_SEGMENT_SHIFT 20
+#define ZM_SEGMENT_SIZE  ((size_t)1 << ZM_SEGMENT_SHIFT)
+#define ZM_SPAN_SHIFT    16
+#define ZM_SPAN_SIZE     ((size_t)1 << ZM_SPAN_SHIFT)
+#define ZM_SPANS         (ZM_SEGMENT_SIZE/ZM_SPAN_SIZE)
+#define ZM_ALIGN         16
+
+// 16 byte steps up to 128, then 4 classes per power of 2 up to 32KiB
+#define ZM_CLASSES       40
+#define ZM_SMALL_MAX     32768
+
+#define ZM_SPAN_FREE     0xFFFF  // size_class of a span nobody is using
+#define ZM_SPAN_LARGE    0xFFFE  // first span of a large allocation's run
+#define ZM_SPAN_TAIL     0xFFFD  // rest of the run
+
+typedef struct zm_free_t {
+     struct zm_free_t* next;
+} zm_free_t;
+
+typedef struct zm_span_t {
+     uint16_t          size_class;
+     uint16_t          span_count;  // large runs only
+     uint32_t          used;        // objects handed out
+     size_t            obj_size;
+     zm_free_t*        free;        // objects given back
+     uint8_t*          bump;        // objects never handed out start here
+     uint8_t*          end;
+     struct zm_span_t* prev;        // on the class's list of spans with room
+     struct zm_span_t* next;
+     int               listed;
+     int               interior;    // memalign() handed out a pointer past the start of an object here
+} zm_span_t;
+
+typedef struct zm_segment_t {
+     size_t               huge_pages;  // non-zero if this segment is one huge allocation
+     size_t               huge_size;
+     uint32_t             free_spans;
+     struct zm_segment_t* prev;
+     struct zm_segment_t* next;
+     zm_span_t            spans[ZM_SPANS];
+} zm_segment_t;
+
+// huge allocations start after the segment header, rounded up to keep the pointer aligned
+#define ZM_HEADER_SIZE   ((sizeof(zm_segment_t) + ZM_ALIGN-1) & ~(size_t)(ZM_ALIGN-1))
+
+typedef struct zm_heap_t {
+     zm_span_t*    partial[ZM_CLASSES];
+     zm_segment_t* segments;
+     zm_segment_t* spare;      // one empty segment kept back so a malloc/free loop doesn't trap each time
+} zm_heap_t;
+
+static zm_heap_t zm_heap;
+
+static size_t zm_class_size(unsigned int c) {
+     unsigned int e;
+     size_t p;
+     if(c < 8) return (c+1)*16;
+     e = (c-8)/4;
+     p = (size_t)128 << e;
+     return p + (p/4)*((c-8)%4 + 1);
+}
+
+static unsigned int zm_size_class(size_t size) {
+     unsigned int e;
+     if(size <= 128) return (size == 0) ? 0 : (unsigned int)((size+15)/16 - 1);
+     e = 63 - __builtin_clzl(size-1);
+     return 8 + (e-7)*4 + (unsigned int)(((size-1) >> (e-2)) & 3);
+}
+
+static zm_segment_t* zm_segment_of(void* ptr) {
+     return (zm_segment_t*)((uintptr_t)ptr & ~(uintptr_t)(ZM_SEGMENT_SIZE-1));
+}
+
+static uint8_t* zm_span_base(zm_segment_t* seg, unsigned int i) {
+     return (uint8_t*)seg + i*ZM_SPAN_SIZE;
+}
+
+static zm_span_t* zm_span_of(zm_segment_t* seg, void* ptr) {
+     return &(seg->spans[((uintptr_t)ptr - (uintptr_t)seg) >> ZM_SPAN_SHIFT]);
+}
+
+// start of the small object ptr points into
+static uint8_t* zm_object_of(zm_segment_t* seg, zm_span_t* s, void* ptr) {
+     uint8_t* base = zm_span_base(seg,(unsigned int)(s - seg->spans));
+     if(s == seg->spans) base += ZM_HEADER_SIZE;
+     return base + (((uint8_t*)ptr - base)/s->obj_size)*s->obj_size;
+}
+
+static void zm_list_add(zm_span_t** head, zm_span_t* s) {
+     s->prev   = NULL;
+     s->next   = *head;
+     if(*head != NULL) (*head)->prev = s;
+     *head     = s;
+     s->listed = 1;
+}
+
+static void zm_list_remove(zm_span_t** head, zm_span_t* s) {
+     if(s->prev != NULL) s->prev->next = s->next; else *head = s->next;
+     if(s->next != NULL) s->next->prev = s->prev;
+     s->prev   = NULL;
+     s->next   = NULL;
+     s->listed = 0;
+}
+
+static zm_segment_t* zm_segment_new() {
+     zm_segment_t* seg;
+     unsigned int i;
+     if(zm_heap.spare != NULL) {
+        seg = zm_heap.spare;
+        zm_heap.spare = NULL;
+     } else {
+        seg = (zm_segment_t*)sys_pagealloc(ZM_SEGMENT_SIZE/ZM_PAGE_SIZE,ZM_SEGMENT_SIZE/ZM_PAGE_SIZE);
+        if(seg == NULL) return NULL;
+     }
+     memset(seg,0,sizeof(zm_segment_t));
+     for(i=0; i < ZM_SPANS; i++) seg->spans[i].size_class = ZM_SPAN_FREE;
+     seg->free_spans = ZM_SPANS;
+     seg->next = zm_heap.segments;
+     if(seg->next != NULL) seg->next->prev = seg;
+     zm_heap.segments = seg;
+     return seg;
+}
+
+static void zm_segment_release(zm_segment_t* seg) {
+     if(seg->prev != NULL) seg->prev->next = seg->next; else zm_heap.segments = seg->next;
+     if(seg->next != NULL) seg->next->prev = seg->prev;
+     if(zm_heap.spare == NULL) {
+        zm_heap.spare = seg;
+     } else {
+        sys_pagefree(seg,ZM_SEGMENT_SIZE/ZM_PAGE_SIZE);
+     }
+}
+
+// finds count free spans in a row, span 0 holds the segment header so only small objects ever go there
+static zm_span_t* zm_span_alloc(unsigned int count, int small) {
+     zm_segment_t* seg;
+     unsigned int i;
+     unsigned int run;
+     for(seg = zm_heap.segments; ; seg = seg->next) {
+         if(seg == NULL) {
+            seg = zm_segment_new();
+            if(seg == NULL) return NULL;
+         }
+         if(seg->free_spans < count) continue;
+         run = 0;
+         for(i = small ? 0 : 1; i < ZM_SPANS; i++) {
+             run = (seg->spans[i].size_class == ZM_SPAN_FREE) ? run+1 : 0;
+             if(run == count) {
+                i = i+1-count;
+                seg->free_spans -= count;
+                return &(seg->spans[i]);
+             }
+         }
+     }
+}
+
+static void zm_span_free(zm_segment_t* seg, zm_span_t* s, unsigned int count) {
+     unsigned int i;
+     for(i=0; i < count; i++) s[i].size_class = ZM_SPAN_FREE;
+     seg->free_spans += count;
+     if(seg->free_spans == ZM_SPANS) zm_segment_release(seg);
+}
+
+static void* zm_huge_alloc(size_t size) {
+     size_t pages;
+     zm_segment_t* seg;
+     if(size > SIZE_MAX/2) return NULL;
+     pages = (ZM_HEADER_SIZE + size + ZM_PAGE_SIZE-1)/ZM_PAGE_SIZE;
+     seg = (zm_segment_t*)sys_pagealloc(pages,ZM_SEGMENT_SIZE/ZM_PAGE_SIZE);
+     if(seg == NULL) return NULL;
+     seg->huge_pages = pages;
+     seg->huge_size  = pages*ZM_PAGE_SIZE - ZM_HEADER_SIZE;
+     return (uint8_t*)seg + ZM_HEADER_SIZE;
+}
+
+static void* zm_large_alloc(size_t size) {
+     zm_segment_t* seg;
+     zm_span_t* s;
+     unsigned int i;
+     unsigned int count;
+     if(size > (ZM_SPANS-1)*ZM_SPAN_SIZE) return zm_huge_alloc(size);
+     count = (unsigned int)((size + ZM_SPAN_SIZE-1)/ZM_SPAN_SIZE);
+     s = zm_span_alloc(count,0);
+     if(s == NULL) return NULL;
+     s->size_class = ZM_SPAN_LARGE;
+     s->span_count = count;
+     for(i=1; i < count; i++) s[i].size_class = ZM_SPAN_TAIL;
+     seg = zm_segment_of(s);
+     return zm_span_base(seg,(unsigned int)(s - seg->spans));
+}
+
+static void* zm_small_alloc(size_t size) {
+     unsigned int c = zm_size_class(size);
+     zm_span_t* s = zm_heap.partial[c];
+     zm_segment_t* seg;
+     unsigned int i;
+     uint8_t* base;
+     void* retval;
+
+     while(s != NULL) {
+        if(s->free != NULL) {
+           retval  = s->free;
+           s->free = s->free->next;
+           s->used++;
+           return retval;
+        }
+        if(s->bump + s->obj_size <= s->end) {
+           retval   = s->bump;
+           s->bump += s->obj_size;
+           s->used++;
+           return retval;
+        }
+        zm_list_remove(&(zm_heap.partial[c]),s); // full, comes back when something in it is freed
+        s = zm_heap.partial[c];
+     }
+
+     s = zm_span_alloc(1,1);
+     if(s == NULL) return NULL;
+     seg  = zm_segment_of(s);
+     i    = (unsigned int)(s - seg->spans);
+     base = zm_span_base(seg,i);
+     if(i == 0) base += ZM_HEADER_SIZE;
+     s->size_class = (uint16_t)c;
+     s->obj_size   = zm_class_size(c);
+     s->used       = 1;
+     s->free       = NULL;
+     s->interior   = 0;
+     s->bump       = base + s->obj_size;
+     s->end        = zm_span_base(seg,i) + ZM_SPAN_SIZE;
+     zm_list_add(&(zm_heap.partial[c]),s);
+     return base;
+}
+
+static size_t zm_usable_size(void* ptr) {
+     zm_segment_t* seg = zm_segment_of(ptr);
+     zm_span_t* s;
+     if(seg->huge_pages) return (uint8_t*)seg + ZM_HEADER_SIZE + seg->huge_size - (uint8_t*)ptr;
+     s = zm_span_of(seg,ptr);
+     if(s->size_class == ZM_SPAN_LARGE) return s->span_count*ZM_SPAN_SIZE;
+     if(s->interior) return zm_object_of(seg,s,ptr) + s->obj_size - (uint8_t*)ptr;
+     return s->obj_size;
+}
+
+void* malloc(size_t size) {
+     void* retval;
+     if(size <= ZM_SMALL_MAX) {
+        retval = zm_small_alloc(size);
+     } else {
+        retval = zm_large_alloc(size);
+     }
+     if(retval == NULL) errno = ENOMEM;
+     return retval;
+}
+
+void free(void* ptr) {
+     zm_segment_t* seg;
+     zm_span_t* s;
+     zm_free_t* f;
+     if(ptr == NULL) return;
+     seg = zm_segment_of(ptr);
+     if(seg->huge_pages) {
+        sys_pagefree(seg,seg->huge_pages);
+        return;
+     }
+     s = zm_span_of(seg,ptr);
+     if(s->size_class == ZM_SPAN_LARGE) {
+        zm_span_free(seg,s,s->span_count);
+        return;
+     }
+     f = (zm_free_t*)(s->interior ? zm_object_of(seg,s,ptr) : (uint8_t*)ptr);
+     f->next = s->free;
+     s->free = f;
+     s->used--;
+     if(s->used == 0) {
+        if(s->listed) zm_list_remove(&(zm_heap.partial[s->size_class]),s);
+        zm_span_free(seg,s,1);
+     } else if(!s->listed) {
+        zm_list_add(&(zm_heap.partial[s->size_class]),s);
+     }
+}
+
+void* realloc(void* ptr, size_t size) {
+     size_t old_size;
+     void* retval;
+     if(ptr == NULL) return malloc(size);
+     if(size == 0) {
+        free(ptr);
+        return NULL;
+     }
+     old_size = zm_usable_size(ptr);
+     if(size <= old_size) return ptr;
+     retval = malloc(size);
+     if(retval == NULL) return NULL;
+     memcpy(retval,ptr,old_size);
+     free(ptr);
+     return retval;
+}
+
+void* calloc(size_t n, size_t size) {
+     void* retval;
+     if(size != 0 && n > SIZE_MAX/size) {
+        errno = ENOMEM;
+        return NULL;
+     }
+     retval = malloc(n*size);
+     if(retval != NULL) memset(retval,0,n*size);
+     return retval;
+}
+
+// objects are 16 byte aligned and large runs 64KiB aligned, anything in between over-allocates a small object and
+// hands out a pointer into it
+void* memalign(size_t align, size_t size) {
+     uint8_t* raw;
+     zm_segment_t* seg;
+     if(align <= ZM_ALIGN) return malloc(size);
+     if(align > ZM_SPAN_SIZE || (align & (align-1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+     }
+     if(size > SIZE_MAX/2) {
+        errno = ENOMEM;
+        return NULL;
+     }
+     if(size < ZM_ALIGN) size = ZM_ALIGN; // the aligned pointer must stay inside the object even for 0 bytes
+     raw = (uint8_t*)malloc(size + align - ZM_ALIGN);
+     if(raw == NULL || ((uintptr_t)raw & (align-1)) == 0) return raw;
+     seg = zm_segment_of(raw);
+     if(!seg->huge_pages) zm_span_of(seg,raw)->interior = 1;
+     return (void*)(((uintptr_t)raw + align-1) & ~(uintptr_t)(align-1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+     return (ptr == NULL) ? 0 : zm_usable_size(ptr);
+}
+
+// newlib calls these internally, MALLOC_PROVIDED leaves them to the port
+void* _malloc_r(struct _reent* r, size_t size)              { return malloc(size); }
+void  _free_r(struct _reent* r, void* ptr)                  { free(ptr); }
+void* _realloc_r(struct _reent* r, void* ptr, size_t size)  { return realloc(ptr,size); }
+void* _calloc_r(struct _reent* r, size_t n, size_t size)    { return calloc(n,size); }
+void* _memalign_r(struct _reent* r, size_t align, size_t size) { return memalign(align,size); }
+size_t _malloc_usable_size_r(struct _reent* r, void* ptr)   { return malloc_usable_size(ptr); }